@@ -26,7 +26,7 @@
 
 #include "llvm/Bitcode/NaCl/NaClBitcodeParser.h"
 #include <map>
-#include <set>
+#include <vector>
 
 namespace llvm {
 
@@ -97,8 +97,9 @@ public:
   // abbreviations that may apply to the given record.
   const AbbrevTrieNode *MatchRecord(const NaClBitcodeRecordData &Record) const;
 
-  // Returns the abbreviations associated with the node.
-  const std::set<AbbrevIndexPair> &GetAbbreviations() const {
+  // Returns the abbreviations associated with the node, sorted by
+  // abbreviation index.
+  const std::vector<AbbrevIndexPair> &GetAbbreviations() const {
     return Abbreviations;
   }
 
@@ -117,8 +118,11 @@ private:
   SuccessorMap Successors;
 
   // The set of abbreviations that apply if one can't match a pnacl
-  // bitcode record against any of the successors.
-  std::set<AbbrevIndexPair> Abbreviations;
+  // bitcode record against any of the successors. Kept as a sorted
+  // vector, rather than a std::set, since it is only modified while
+  // building the trie, and is then walked once for every record that
+  // is looked up.
+  std::vector<AbbrevIndexPair> Abbreviations;
 };
 
 // A map from record sizes, to the corresponding trie one should use
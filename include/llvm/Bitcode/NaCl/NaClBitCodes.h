@@ -23,6 +23,7 @@
 #include "llvm/Support/ErrorHandling.h"
 #include "llvm/Support/MathExtras.h"
 #include <cassert>
+#include <atomic>
 
 namespace llvm {
 class raw_ostream;
@@ -261,7 +262,9 @@ static inline bool operator>(const NaClBitCodeAbbrevOp &Op1,
 /// specialized format instead of the fully-general, fully-vbr, format.
 class NaClBitCodeAbbrev {
   SmallVector<NaClBitCodeAbbrevOp, 8> OperandList;
-  unsigned char RefCount; // Number of things using this.
+  // Number of things using this. Cursors on different threads share the
+  // abbreviations of the BlockInfo block.
+  std::atomic<unsigned> RefCount;
   ~NaClBitCodeAbbrev() {}
 public:
   NaClBitCodeAbbrev() : RefCount(1) {}
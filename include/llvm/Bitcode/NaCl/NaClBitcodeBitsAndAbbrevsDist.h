@@ -46,6 +46,8 @@ public:
 
   virtual void AddRecord(const NaClBitcodeRecord &Record);
 
+  virtual void Merge(const NaClBitcodeDistElement &Other);
+
   // Note: No AddBlock method override because abbrevations only
   // apply to records.
 
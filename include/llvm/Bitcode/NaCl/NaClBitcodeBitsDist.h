@@ -47,6 +47,8 @@ public:
 
   virtual void AddRecord(const NaClBitcodeRecord &Record);
 
+  virtual void Merge(const NaClBitcodeDistElement &Other);
+
   virtual void AddBlock(const NaClBitcodeBlock &Block);
 
   // Returns the total number of bits used to represent all instances
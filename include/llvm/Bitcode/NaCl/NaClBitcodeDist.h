@@ -309,6 +309,11 @@ public:
   /// Note: Requires that GetStorageKind() == BlockStorage.
   virtual void AddBlock(const NaClBitcodeBlock &Block);
 
+  /// Adds the contents of distribution map Other to this distribution
+  /// map. Other must have been built from the same kind of elements.
+  /// Used to combine distribution maps collected on separate threads.
+  void Merge(const NaClBitcodeDist &Other);
+
   /// Builds the distribution associated with the distribution map.
   /// Warning: The distribution is cached, and hence, only valid while
   /// it's contents is not changed.
@@ -419,6 +424,11 @@ public:
   // Adds an instance of the given block to this element.
   virtual void AddBlock(const NaClBitcodeBlock &Block);
 
+  // Adds the instances of element Other, which must be of the same
+  // kind, to this element. By default, merges the instance counts and
+  // any nested distributions.
+  virtual void Merge(const NaClBitcodeDistElement &Other);
+
   // Returns the number of instances associated with this element.
   unsigned GetNumInstances() const {
     return NumInstances;
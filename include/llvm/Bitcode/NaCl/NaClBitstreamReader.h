@@ -19,7 +19,9 @@
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/Bitcode/NaCl/NaClLLVMBitCodes.h"
 #include "llvm/Support/Endian.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/StreamableMemoryObject.h"
+#include <algorithm>
 #include <climits>
 #include <vector>
 
@@ -43,6 +45,12 @@ public:
 private:
   std::unique_ptr<StreamableMemoryObject> BitcodeBytes;
 
+  /// DirectBytes - The bitcode, if it is all in memory (e.g. an mmap'ed
+  /// file), or null if it is streamed. Cursors load in-memory bitcode
+  /// directly, 64 bits at a time, rather than through BitcodeBytes.
+  const unsigned char *DirectBytes;
+  size_t DirectSize;
+
   std::vector<BlockInfo> BlockInfoRecords;
 
   /// \brief Holds the offset of the first byte after the header.
@@ -51,7 +59,8 @@ private:
   NaClBitstreamReader(const NaClBitstreamReader&) LLVM_DELETED_FUNCTION;
   void operator=(const NaClBitstreamReader&) LLVM_DELETED_FUNCTION;
 public:
-  NaClBitstreamReader() : InitialAddress(0) {}
+  NaClBitstreamReader()
+      : DirectBytes(0), DirectSize(0), InitialAddress(0) {}
 
   NaClBitstreamReader(const unsigned char *Start, const unsigned char *End) {
     InitialAddress = 0;
@@ -60,7 +69,7 @@ public:
 
   NaClBitstreamReader(StreamableMemoryObject *Bytes,
                       size_t MyInitialAddress=0)
-      : InitialAddress(MyInitialAddress)
+      : DirectBytes(0), DirectSize(0), InitialAddress(MyInitialAddress)
   {
     BitcodeBytes.reset(Bytes);
   }
@@ -68,10 +77,17 @@ public:
   void init(const unsigned char *Start, const unsigned char *End) {
     assert(((End-Start) & 3) == 0 &&"Bitcode stream not a multiple of 4 bytes");
     BitcodeBytes.reset(getNonStreamedMemoryObject(Start, End));
+    DirectBytes = Start;
+    DirectSize = End - Start;
   }
 
   StreamableMemoryObject &getBitcodeBytes() { return *BitcodeBytes; }
 
+  /// getDirectBytes - Return the bitcode if it is all in memory, or null if
+  /// it must be read through getBitcodeBytes().
+  const unsigned char *getDirectBytes() const { return DirectBytes; }
+  size_t getDirectSize() const { return DirectSize; }
+
   ~NaClBitstreamReader() {
     // Free the BlockInfoRecords.
     while (!BlockInfoRecords.empty()) {
@@ -213,17 +229,21 @@ class NaClBitstreamCursor {
   size_t NextChar;
 
   /// CurWord/word_t - This is the current data we have pulled from the stream
-  /// but have not returned to the client.  This is specifically and
-  /// intentionally defined to follow the word size of the host machine for
-  /// efficiency.  We use word_t in places that are aware of this to make it
-  /// perfectly explicit what is going on.
-  typedef uint32_t word_t;
+  /// but have not returned to the client.  Bitcode that is all in memory is
+  /// loaded 64 bits at a time with unaligned loads; streamed bitcode is read
+  /// 32 bits at a time.  The unread bits are always the low bits of CurWord,
+  /// and the bits above them are zero.
+  typedef uint64_t word_t;
   word_t CurWord;
 
   /// BitsInCurWord - This is the number of bits in CurWord that are valid. This
-  /// is always from [0...31/63] inclusive (depending on word size).
+  /// is always from [0...64] inclusive.
   unsigned BitsInCurWord;
 
+  /// VBRContinuationBits - For each chunk width, the continuation bits of the
+  /// chunks of a VBR that starts at bit 0 of CurWord.
+  static const word_t VBRContinuationBits[33];
+
   // CurCodeSize - This is the declared size of code values used for the current
   // block, in bits.
   NaClBitcodeSelectorAbbrev CurCodeSize;
@@ -274,11 +294,15 @@ public:
   void freeState();
   
   bool isEndPos(size_t pos) {
+    if (BitStream->getDirectBytes())
+      return pos >= BitStream->getDirectSize();
     return BitStream->getBitcodeBytes().isObjectEnd(static_cast<uint64_t>(pos));
   }
 
   bool canSkipToPos(size_t pos) const {
     // pos can be skipped to if it is a valid address or one byte past the end.
+    if (BitStream->getDirectBytes())
+      return pos <= BitStream->getDirectSize();
     return pos == 0 || BitStream->getBitcodeBytes().isValidAddress(
         static_cast<uint64_t>(pos - 1));
   }
@@ -358,24 +382,85 @@ public:
 
   /// JumpToBit - Reset the stream to the specified bit number.
   void JumpToBit(uint64_t BitNo) {
-    uintptr_t ByteNo = uintptr_t(BitNo/8) & ~(sizeof(word_t)-1);
-    unsigned WordBitNo = unsigned(BitNo & (sizeof(word_t)*8-1));
+    uintptr_t ByteNo = uintptr_t(BitNo/8) & ~uintptr_t(3);
+    unsigned WordBitNo = unsigned(BitNo & 31);
     assert(canSkipToPos(ByteNo) && "Invalid location");
 
-    // Move the cursor to the right word.
+    // Move the cursor to the right 32-bit word.
     NextChar = ByteNo;
     BitsInCurWord = 0;
     CurWord = 0;
 
     // Skip over any bits that are already consumed.
-    if (WordBitNo) {
-      if (sizeof(word_t) > 4)
-        Read64(WordBitNo);
-      else
-        Read(WordBitNo);
+    if (WordBitNo)
+      Read(WordBitNo);
+  }
+
+private:
+  /// fillCurWord - Load the next word of the stream into CurWord, which must
+  /// have no bits left. Returns false at the end of the stream.
+  bool fillCurWord() {
+    if (const unsigned char *Bytes = BitStream->getDirectBytes()) {
+      size_t Size = BitStream->getDirectSize();
+      if (NextChar + sizeof(word_t) <= Size) {
+        CurWord = support::endian::read<word_t, support::little,
+                                        support::unaligned>(Bytes + NextChar);
+        NextChar += sizeof(word_t);
+        BitsInCurWord = 64;
+        return true;
+      }
+      if (NextChar >= Size)
+        return false;
+      // Less than 64 bits are left. The stream is a multiple of 4 bytes, so
+      // read the rest 32 bits at a time.
+      uint8_t Array[4] = {0};
+      memcpy(Array, Bytes + NextChar, std::min<size_t>(4, Size - NextChar));
+      CurWord = support::endian::read<uint32_t, support::little,
+                                      support::unaligned>(Array);
+    } else {
+      if (isEndPos(NextChar))
+        return false;
+      uint8_t Array[4] = {0};
+      BitStream->getBitcodeBytes().readBytes(NextChar, sizeof(Array), Array);
+      // Handle big-endian byte-swapping if necessary.
+      CurWord = support::endian::read<uint32_t, support::little,
+                                      support::unaligned>(Array);
+    }
+    NextChar += 4;
+    BitsInCurWord = 32;
+    return true;
+  }
+
+  /// readVBRFromCurWord - If all the chunks of a VBR with NumBits-bit chunks
+  /// are in CurWord, read it into Result and return true. The chunk that ends
+  /// the VBR is found with a single bit scan for the first clear continuation
+  /// bit, rather than by reading a chunk at a time.
+  bool readVBRFromCurWord(unsigned NumBits, uint64_t &Result) {
+    // Leave malformed chunk widths to Read(), which asserts.
+    if (NumBits > 32)
+      return false;
+    word_t Ends = ~CurWord & VBRContinuationBits[NumBits];
+    if (BitsInCurWord < 64)
+      Ends &= (word_t(1) << BitsInCurWord) - 1;
+    if (Ends == 0)
+      return false;
+
+    unsigned Bits = countTrailingZeros(Ends) + 1;
+    word_t Chunks = CurWord;
+    CurWord = Bits == 64 ? 0 : CurWord >> Bits;
+    BitsInCurWord -= Bits;
+
+    word_t PayloadMask = (word_t(1) << (NumBits-1)) - 1;
+    Result = Chunks & PayloadMask;
+    for (unsigned Shift = NumBits-1; Bits > NumBits; Bits -= NumBits) {
+      Chunks >>= NumBits;
+      Result |= (Chunks & PayloadMask) << Shift;
+      Shift += NumBits-1;
     }
+    return true;
   }
 
+public:
   uint32_t Read(unsigned NumBits) {
     assert(NumBits && NumBits <= 32 &&
            "Cannot return zero or more than 32 bits!");
@@ -388,54 +473,44 @@ public:
       return R;
     }
 
+    uint32_t R = uint32_t(CurWord);
+    unsigned BitsInPrevWord = BitsInCurWord;
+
     // If we run out of data, stop at the end of the stream.
-    if (isEndPos(NextChar)) {
+    if (!fillCurWord()) {
       CurWord = 0;
       BitsInCurWord = 0;
       return 0;
     }
 
-    uint32_t R = uint32_t(CurWord);
-
-    // Read the next word from the stream.
-    uint8_t Array[sizeof(word_t)] = {0};
-    
-    BitStream->getBitcodeBytes().readBytes(NextChar, sizeof(Array), Array);
-    
-    // Handle big-endian byte-swapping if necessary.
-    support::detail::packed_endian_specific_integral
-      <word_t, support::little, support::unaligned> EndianValue;
-    memcpy(&EndianValue, Array, sizeof(Array));
-    
-    CurWord = EndianValue;
-
-    NextChar += sizeof(word_t);
-
-    // Extract NumBits-BitsInCurWord from what we just read.
-    unsigned BitsLeft = NumBits-BitsInCurWord;
-
-    // Be careful here, BitsLeft is in the range [1..32]/[1..64] inclusive.
-    R |= uint32_t((CurWord & (word_t(~0ULL) >> (sizeof(word_t)*8-BitsLeft)))
-                    << BitsInCurWord);
-
-    // BitsLeft bits have just been used up from CurWord.  BitsLeft is in the
-    // range [1..32]/[1..64] so be careful how we shift.
-    if (BitsLeft != sizeof(word_t)*8)
-      CurWord >>= BitsLeft;
-    else
-      CurWord = 0;
-    BitsInCurWord = sizeof(word_t)*8-BitsLeft;
+    // Extract the remaining bits from what we just read. BitsLeft is in the
+    // range [1..32], and CurWord has at least 32 bits.
+    unsigned BitsLeft = NumBits-BitsInPrevWord;
+    R |= uint32_t((CurWord & (~0ULL >> (64-BitsLeft))) << BitsInPrevWord);
+    CurWord >>= BitsLeft;
+    BitsInCurWord -= BitsLeft;
     return R;
   }
 
   uint64_t Read64(unsigned NumBits) {
     if (NumBits <= 32) return Read(NumBits);
 
+    if (BitsInCurWord >= NumBits) {
+      uint64_t R = CurWord & (~0ULL >> (64-NumBits));
+      CurWord = NumBits == 64 ? 0 : CurWord >> NumBits;
+      BitsInCurWord -= NumBits;
+      return R;
+    }
+
     uint64_t V = Read(32);
     return V | (uint64_t)Read(NumBits-32) << 32;
   }
 
   uint32_t ReadVBR(unsigned NumBits) {
+    uint64_t Value;
+    if (readVBRFromCurWord(NumBits, Value))
+      return uint32_t(Value);
+
     uint32_t Piece = Read(NumBits);
     if ((Piece & (1U << (NumBits-1))) == 0)
       return Piece;
@@ -456,6 +531,10 @@ public:
   // ReadVBR64 - Read a VBR that may have a value up to 64-bits in size.  The
   // chunk size of the VBR must still be <= 32 bits though.
   uint64_t ReadVBR64(unsigned NumBits) {
+    uint64_t Value;
+    if (readVBRFromCurWord(NumBits, Value))
+      return Value;
+
     uint32_t Piece = Read(NumBits);
     if ((Piece & (1U << (NumBits-1))) == 0)
       return uint64_t(Piece);
@@ -475,17 +554,11 @@ public:
 
 private:
   void SkipToFourByteBoundary() {
-    // If word_t is 64-bits and if we've read less than 32 bits, just dump
-    // the bits we have up to the next 32-bit boundary.
-    if (sizeof(word_t) > 4 &&
-        BitsInCurWord >= 32) {
-      CurWord >>= BitsInCurWord-32;
-      BitsInCurWord = 32;
-      return;
-    }
-    
-    BitsInCurWord = 0;
-    CurWord = 0;
+    // NextChar is always on a 32-bit boundary, so dump the bits we have up to
+    // the last 32-bit boundary before it.
+    unsigned Extra = BitsInCurWord % 32;
+    CurWord >>= Extra;
+    BitsInCurWord -= Extra;
   }
 public:
 
@@ -19,6 +19,7 @@
 #include "llvm/Support/CommandLine.h"
 
 #include <string>
+#include <vector>
 
 namespace llvm {
   class MemoryBuffer;
@@ -39,6 +40,11 @@ namespace llvm {
   /// files.
   extern cl::opt<bool> PNaClAllowLocalSymbolTables;
 
+  /// The number of threads that decode function blocks while a module read
+  /// from memory is materialized. If 0, function blocks are decoded as they
+  /// are parsed.
+  extern cl::opt<unsigned> PNaClReaderThreads;
+
   /// \brief Defines the integer bit size used to model pointers in PNaCl.
   static const unsigned PNaClIntPtrTypeBitSize = 32;
 
@@ -74,6 +80,12 @@ namespace llvm {
                                        std::string *ErrMsg = 0,
                                        bool AcceptSupportedOnly = true);
 
+  /// getNaClLazyFunctionBodySizes - For a module from getNaClLazyBitcodeModule
+  /// or getNaClStreamedBitcodeModule, sets Sizes to the size in bits of each
+  /// function body that is still to be read, in module order, without reading
+  /// them. Returns true on error.
+  bool getNaClLazyFunctionBodySizes(Module *M, std::vector<uint64_t> &Sizes);
+
   /// NaClParseBitcodeFile - Read the specified bitcode file,
   /// returning the module.  If an error occurs, this returns null and
   /// fills in *ErrMsg if it is non-null.  This method *never* takes
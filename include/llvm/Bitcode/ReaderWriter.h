@@ -16,6 +16,7 @@
 
 #include "llvm/Support/ErrorOr.h"
 #include <string>
+#include <vector>
 
 namespace llvm {
   class BitstreamWriter;
@@ -42,6 +43,12 @@ namespace llvm {
                                    LLVMContext &Context,
                                    std::string *ErrMsg = nullptr);
 
+  /// For a module from getLazyBitcodeModule or getStreamedBitcodeModule,
+  /// sets Sizes to the size in bits of each function body that is still to
+  /// be read, in module order, without reading them.
+  std::error_code getLazyFunctionBodySizes(Module *M,
+                                           std::vector<uint64_t> &Sizes);
+
   /// Read the header of the specified bitcode buffer and extract just the
   /// triple information. If successful, this returns a string and *does not*
   /// take ownership of 'buffer'. On error, this returns "".
@@ -0,0 +1,139 @@
+//==- ThreadedStreamingCache.h - Cache for StreamingMemoryObject -*- C++ -*-==//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_SUPPORT_THREADEDSTREAMINGCACHE_H
+#define LLVM_SUPPORT_THREADEDSTREAMINGCACHE_H
+
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Mutex.h"
+#include "llvm/Support/StreamableMemoryObject.h"
+#include <atomic>
+
+namespace llvm {
+
+// The bytes fetched so far from a StreamingMemoryObject that is read by
+// several threads, each through its own ThreadedStreamingCache. Fetched bytes
+// are kept in chunks that do not move once allocated, and the number of bytes
+// fetched is published atomically, so reading bytes that are already present
+// takes no lock. Only fetching more bytes from the streamer is serialized.
+class SharedStreamingCache {
+ public:
+  explicit SharedStreamingCache(StreamingMemoryObject *S);
+  ~SharedStreamingCache();
+
+  // Bytes are fetched a cache line at a time, and a read may not cross a
+  // cache line.
+  const static uint64_t kCacheSize = 4 * 4096;
+  const static uint64_t kCacheSizeMask = ~(kCacheSize - 1);
+
+  // The number of bytes that can be read without fetching.
+  uint64_t getFetchedSize() const {
+    return FetchedSize.load(std::memory_order_acquire);
+  }
+
+  // The size of the object, or 0 if not known yet.
+  uint64_t getObjectSize() const {
+    return ObjectSize.load(std::memory_order_acquire);
+  }
+
+  // Returns the fetched byte at address, which must be less than
+  // getFetchedSize(). The rest of its cache line follows it in memory.
+  const uint8_t *getFetchedBytes(uint64_t address) const {
+    unsigned Chunk = getChunkIndex(address);
+    return Chunks[Chunk] + (address - getChunkBase(Chunk));
+  }
+
+  // Fetches the bytes up to and including address. Returns false if address
+  // is past the end of the object.
+  bool fetchTo(uint64_t address);
+
+  bool isObjectEnd(uint64_t address);
+  // Drops the first s bytes of the object. This happens once for all the
+  // readers; repeating it with the same s does nothing.
+  bool dropLeadingBytes(size_t s);
+  void setKnownObjectSize(size_t size);
+
+ private:
+  // Chunk 0 holds the first two cache lines and chunk i > 0 holds cache lines
+  // [2^i, 2^(i+1)), so that a handful of chunks covers any object, no chunk
+  // boundary falls inside a cache line, and the chunk of an address is found
+  // without a lock.
+  const static unsigned kMaxChunks = 64;
+
+  static unsigned getChunkIndex(uint64_t address) {
+    uint64_t Line = address / kCacheSize;
+    return Line < 2 ? 0 : Log2_64(Line);
+  }
+  static uint64_t getChunkBase(unsigned Chunk) {
+    return Chunk == 0 ? 0 : (uint64_t(1) << Chunk) * kCacheSize;
+  }
+  static uint64_t getChunkSize(unsigned Chunk) {
+    return Chunk == 0 ? 2 * kCacheSize : getChunkBase(Chunk);
+  }
+
+  StreamingMemoryObject *Streamer;
+  sys::SmartMutex<false> StreamerLock;
+  // The number of leading bytes dropped from Streamer, under StreamerLock.
+  size_t BytesDropped;
+  // Written under StreamerLock before FetchedSize covers them.
+  uint8_t *Chunks[kMaxChunks];
+  std::atomic<uint64_t> FetchedSize;
+  std::atomic<uint64_t> ObjectSize;
+
+  SharedStreamingCache(const SharedStreamingCache&) LLVM_DELETED_FUNCTION;
+  void operator=(const SharedStreamingCache&) LLVM_DELETED_FUNCTION;
+};
+
+// An implementation of StreamingMemoryObject for use in multithreaded
+// translation. Each thread has one of these objects, each of which has a
+// pointer to a SharedStreamingCache. Bitcode is read one word at a time, and
+// reads of bytes that some thread has already fetched do not contend.
+
+class ThreadedStreamingCache : public llvm::StreamingMemoryObject {
+ public:
+  explicit ThreadedStreamingCache(SharedStreamingCache *S) : Shared(S) {}
+  uint64_t getBase() const override { return 0; }
+  uint64_t getExtent() const override;
+  int readByte(uint64_t address, uint8_t* ptr) const override;
+  int readBytes(uint64_t address, uint64_t size,
+                uint8_t *buf) const override;
+  const uint8_t *getPointer(uint64_t address,
+                            uint64_t size) const override {
+    // This could be fixed by ensuring the bytes are fetched and returning a
+    // pointer into the shared chunks, but it's not currently necessary. Users
+    // that need the pointer don't stream.
+    llvm_unreachable("getPointer in streaming memory objects not allowed");
+    return NULL;
+  }
+  bool isValidAddress(uint64_t address) const override;
+  bool isObjectEnd(uint64_t address) const override;
+
+  /// Drop s bytes from the front of the stream, pushing the positions of the
+  /// remaining bytes down by s. This is used to skip past the bitcode header,
+  /// since we don't know a priori if it's present, and we can't put bytes
+  /// back into the stream once we've read them. This must happen before
+  /// other threads start reading.
+  bool dropLeadingBytes(size_t s) override;
+
+  /// If the data object size is known in advance, many of the operations can
+  /// be made more efficient, so this method should be called before reading
+  /// starts (although it can be called anytime).
+  void setKnownObjectSize(size_t size) override;
+ private:
+  SharedStreamingCache *Shared;
+
+  ThreadedStreamingCache(
+      const ThreadedStreamingCache&) LLVM_DELETED_FUNCTION;
+  void operator=(const ThreadedStreamingCache&) LLVM_DELETED_FUNCTION;
+};
+
+} // namespace llvm
+
+#endif // LLVM_SUPPORT_THREADEDSTREAMINGCACHE_H
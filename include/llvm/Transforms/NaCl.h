@@ -17,10 +17,12 @@
 namespace llvm {
 
 class BasicBlockPass;
+class DataLayout;
 class Function;
 class FunctionPass;
 class FunctionType;
 class Instruction;
+class Module;
 class ModulePass;
 class Use;
 class Value;
@@ -70,6 +72,45 @@ ModulePass *createLowerEmAsyncifyPass(); // XXX EMSCRIPTEN
 void PNaClABISimplifyAddPreOptPasses(PassManagerBase &PM);
 void PNaClABISimplifyAddPostOptPasses(PassManagerBase &PM);
 
+// The instruction-local rewrite done by one of the ABI simplification
+// passes, in a form that can be fused with the rewrites of other passes
+// (see createFusedRewritesPass).
+class PNaClRewrite {
+public:
+  virtual ~PNaClRewrite() {}
+
+  // Called once per module, before any function is rewritten.
+  virtual void initialize(Module &M, const DataLayout &DL) {}
+
+  // Returns true if rewriteFunction() may change Func because of Func
+  // itself rather than one of its instructions.
+  virtual bool mayRewriteFunction(const Function &Func) const {
+    return false;
+  }
+
+  // Returns true if rewriteFunction() may change Inst. A function with no
+  // such instruction must be left unchanged by rewriteFunction(). This
+  // must only read the IR, since it is called on several functions at
+  // once.
+  virtual bool mayRewrite(const Instruction &Inst) const = 0;
+
+  // Rewrites the instructions of Func. Returns true if Func was changed.
+  virtual bool rewriteFunction(Function &Func) = 0;
+};
+
+PNaClRewrite *createConstantInsertExtractElementIndexRewrite();
+PNaClRewrite *createExpandConstantExprRewrite();
+PNaClRewrite *createExpandStructRegsRewrite();
+PNaClRewrite *createPromoteI1OpsRewrite();
+PNaClRewrite *createPromoteIntegersRewrite();
+PNaClRewrite *createRewriteAtomicsRewrite();
+
+// Runs the given rewrites, in order, on each function. The functions that
+// each rewrite may change are found in a single walk over each function,
+// and the other rewrites are skipped. The pass takes ownership of the
+// rewrites.
+ModulePass *createFusedRewritesPass(ArrayRef<PNaClRewrite *> Rewrites);
+
 Instruction *PhiSafeInsertPt(Use *U);
 void PhiSafeReplaceUses(Use *U, Value *NewVal);
 
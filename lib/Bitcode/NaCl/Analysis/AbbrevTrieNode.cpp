@@ -11,6 +11,8 @@
 #include "llvm/Bitcode/NaCl/AbbrevTrieNode.h"
 #include "llvm/Bitcode/NaCl/NaClBitcodeValueDist.h"
 
+#include <algorithm>
+
 using namespace llvm;
 
 void AbbrevTrieNode::GetSuccessorLabels(SuccessorLabels &Labels) const {
@@ -52,7 +54,7 @@ void AbbrevTrieNode::Print(raw_ostream &Stream,
   IndentPlusPlus.append("  ");
   if (! Abbreviations.empty()) {
     Stream << Indent << "Abbreviations:\n";
-    for (std::set<AbbrevIndexPair>::const_iterator
+    for (std::vector<AbbrevIndexPair>::const_iterator
              Iter = Abbreviations.begin(), IterEnd = Abbreviations.end();
          Iter != IterEnd; ++Iter) {
       Stream << IndentPlus;
@@ -193,7 +195,10 @@ void AbbrevTrieNode::Insert(AbbrevIndexPair &AbbrevPair) {
 
   // If reached, no guarantees that any edge was followed, so add
   // to matches of this node.
-  Abbreviations.insert(AbbrevPair);
+  std::vector<AbbrevIndexPair>::iterator Pos =
+      std::lower_bound(Abbreviations.begin(), Abbreviations.end(), AbbrevPair);
+  if (Pos == Abbreviations.end() || *Pos != AbbrevPair)
+    Abbreviations.insert(Pos, AbbrevPair);
 }
 
 const AbbrevTrieNode *AbbrevTrieNode::
@@ -24,6 +24,12 @@ AddRecord(const NaClBitcodeRecord &Record) {
   }
 }
 
+void NaClBitcodeBitsAndAbbrevsDistElement::
+Merge(const NaClBitcodeDistElement &Other) {
+  NaClBitcodeBitsDistElement::Merge(Other);
+  NumAbbrevs += cast<NaClBitcodeBitsAndAbbrevsDistElement>(Other).NumAbbrevs;
+}
+
 void NaClBitcodeBitsAndAbbrevsDistElement::
 PrintStatsHeader(raw_ostream &Stream) const {
   NaClBitcodeBitsDistElement::PrintStatsHeader(Stream);
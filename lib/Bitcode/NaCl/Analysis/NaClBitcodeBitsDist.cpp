@@ -25,6 +25,14 @@ void NaClBitcodeBitsDistElement::AddBlock(const NaClBitcodeBlock &Block) {
   TotalBits += Block.GetLocalNumBits();
 }
 
+void NaClBitcodeBitsDistElement::Merge(const NaClBitcodeDistElement &Other) {
+  NaClBitcodeDistElement::Merge(Other);
+  // Note: Block elements derive from this class without being in its
+  // kind range, so cast<> can't be used here.
+  TotalBits +=
+      static_cast<const NaClBitcodeBitsDistElement&>(Other).TotalBits;
+}
+
 void NaClBitcodeBitsDistElement::PrintStatsHeader(raw_ostream &Stream) const {
   NaClBitcodeDistElement::PrintStatsHeader(Stream);
   Stream << "    # Bits    Bits/Elmt";
@@ -58,6 +58,17 @@ void NaClBitcodeDist::AddBlock(const NaClBitcodeBlock &Block) {
   Element->AddBlock(Block);
 }
 
+void NaClBitcodeDist::Merge(const NaClBitcodeDist &Other) {
+  if (Other.empty())
+    return;
+  RemoveCachedDistribution();
+  Total += Other.Total;
+  for (const_iterator Iter = Other.begin(), IterEnd = Other.end();
+       Iter != IterEnd; ++Iter) {
+    GetElement(Iter->first)->Merge(*Iter->second);
+  }
+}
+
 void NaClBitcodeDist::Print(raw_ostream &Stream,
                             const std::string &Indent) const {
   const Distribution *Dist = GetDistribution();
@@ -113,6 +124,22 @@ void NaClBitcodeDistElement::AddBlock(const NaClBitcodeBlock &Block) {
   ++NumInstances;
 }
 
+void NaClBitcodeDistElement::Merge(const NaClBitcodeDistElement &Other) {
+  assert(getKind() == Other.getKind() &&
+         "Can't merge distribution elements of different kinds");
+  NumInstances += Other.NumInstances;
+  const SmallVectorImpl<NaClBitcodeDist*> *Nested = GetNestedDistributions();
+  if (Nested == 0)
+    return;
+  const SmallVectorImpl<NaClBitcodeDist*> *OtherNested =
+      Other.GetNestedDistributions();
+  assert(OtherNested && Nested->size() == OtherNested->size() &&
+         "Can't merge distribution elements of different kinds");
+  for (size_t i = 0, e = Nested->size(); i < e; ++i) {
+    (*Nested)[i]->Merge(*(*OtherNested)[i]);
+  }
+}
+
 void NaClBitcodeDistElement::GetValueList(const NaClBitcodeRecord &Record,
                                           ValueListType &ValueList) const {
   // By default, assume no record values are defined.
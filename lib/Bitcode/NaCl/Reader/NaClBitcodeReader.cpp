@@ -11,6 +11,7 @@
 #define DEBUG_TYPE "NaClBitcodeReader"
 
 #include "NaClBitcodeReader.h"
+#include "NaClFunctionBlockDecoder.h"
 #include "llvm/ADT/SmallString.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/Analysis/NaCl/PNaClABITypeChecker.h"
@@ -38,6 +39,14 @@ llvm::PNaClAllowLocalSymbolTables(
     cl::desc("Allow (function) local symbol tables in PNaCl bitcode files"),
     cl::init(false));
 
+cl::opt<unsigned>
+llvm::PNaClReaderThreads(
+    "bitcode-reader-threads",
+    cl::desc("Number of threads that decode function blocks ahead of "
+             "IR construction when the whole module is materialized "
+             "(0 decodes on the calling thread)"),
+    cl::init(0));
+
 void NaClBitcodeReader::FreeState() {
   std::vector<Type*>().swap(TypeList);
   ValueList.clear();
@@ -129,6 +138,37 @@ Type *NaClBitcodeReader::getTypeByID(unsigned ID) {
   return TypeList[ID] = StructType::create(Context);
 }
 
+bool NaClBitcodeReader::StreamEnterSubBlock(unsigned BlockID) {
+  if (DecodedBlock)
+    return DecodedBlock->EnterSubBlock();
+  return Stream.EnterSubBlock(BlockID);
+}
+
+NaClBitstreamEntry NaClBitcodeReader::StreamAdvance() {
+  if (DecodedBlock)
+    return DecodedBlock->advance();
+  return Stream.advance(0, 0);
+}
+
+NaClBitstreamEntry NaClBitcodeReader::StreamAdvanceSkippingSubblocks() {
+  if (DecodedBlock)
+    return DecodedBlock->advanceSkippingSubblocks();
+  return Stream.advanceSkippingSubblocks();
+}
+
+bool NaClBitcodeReader::StreamSkipBlock() {
+  if (DecodedBlock)
+    return DecodedBlock->SkipBlock();
+  return Stream.SkipBlock();
+}
+
+unsigned NaClBitcodeReader::StreamReadRecord(unsigned AbbrevID,
+                                             SmallVectorImpl<uint64_t> &Vals) {
+  if (DecodedBlock)
+    return DecodedBlock->readRecord(Vals);
+  return Stream.readRecord(AbbrevID, Vals);
+}
+
 
 //===----------------------------------------------------------------------===//
 //  Functions for parsing blocks from the bitcode file
@@ -555,7 +595,7 @@ bool NaClBitcodeReader::ParseGlobalVars() {
 
 bool NaClBitcodeReader::ParseValueSymbolTable() {
   DEBUG(dbgs() << "-> ParseValueSymbolTable\n");
-  if (Stream.EnterSubBlock(naclbitc::VALUE_SYMTAB_BLOCK_ID))
+  if (StreamEnterSubBlock(naclbitc::VALUE_SYMTAB_BLOCK_ID))
     return Error("Malformed block record");
 
   SmallVector<uint64_t, 64> Record;
@@ -563,7 +603,7 @@ bool NaClBitcodeReader::ParseValueSymbolTable() {
   // Read all the records for this value table.
   SmallString<128> ValueName;
   while (1) {
-    NaClBitstreamEntry Entry = Stream.advanceSkippingSubblocks();
+    NaClBitstreamEntry Entry = StreamAdvanceSkippingSubblocks();
 
     switch (Entry.Kind) {
     case NaClBitstreamEntry::SubBlock: // Handled for us already.
@@ -579,7 +619,7 @@ bool NaClBitcodeReader::ParseValueSymbolTable() {
 
     // Read a record.
     Record.clear();
-    switch (Stream.readRecord(Entry.ID, Record)) {
+    switch (StreamReadRecord(Entry.ID, Record)) {
     default:  // Default behavior: unknown type.
       break;
     case naclbitc::VST_CODE_ENTRY: {  // VST_ENTRY: [valueid, namechar x N]
@@ -611,7 +651,7 @@ bool NaClBitcodeReader::ParseValueSymbolTable() {
 
 bool NaClBitcodeReader::ParseConstants() {
   DEBUG(dbgs() << "-> ParseConstants\n");
-  if (Stream.EnterSubBlock(naclbitc::CONSTANTS_BLOCK_ID))
+  if (StreamEnterSubBlock(naclbitc::CONSTANTS_BLOCK_ID))
     return Error("Malformed block record");
 
   SmallVector<uint64_t, 64> Record;
@@ -620,7 +660,7 @@ bool NaClBitcodeReader::ParseConstants() {
   Type *CurTy = Type::getInt32Ty(Context);
   unsigned NextCstNo = ValueList.size();
   while (1) {
-    NaClBitstreamEntry Entry = Stream.advanceSkippingSubblocks();
+    NaClBitstreamEntry Entry = StreamAdvanceSkippingSubblocks();
 
     switch (Entry.Kind) {
     case NaClBitstreamEntry::SubBlock: // Handled for us already.
@@ -639,7 +679,7 @@ bool NaClBitcodeReader::ParseConstants() {
     // Read a record.
     Record.clear();
     Value *V = 0;
-    unsigned BitCode = Stream.readRecord(Entry.ID, Record);
+    unsigned BitCode = StreamReadRecord(Entry.ID, Record);
     switch (BitCode) {
     default: {
       std::string Message;
@@ -702,6 +742,7 @@ bool NaClBitcodeReader::RememberAndSkipFunctionBody() {
   // Skip over the function block for now.
   if (Stream.SkipBlock())
     return Error("Malformed block record");
+  FunctionBodiesEndBit = Stream.GetCurrentBitNo();
   DEBUG(dbgs() << "<- RememberAndSkipFunctionBody\n");
   return false;
 }
@@ -1044,7 +1085,7 @@ Value *NaClBitcodeReader::ConvertOpToType(Value *Op, Type *T,
 /// ParseFunctionBody - Lazily parse the specified function body block.
 bool NaClBitcodeReader::ParseFunctionBody(Function *F) {
   DEBUG(dbgs() << "-> ParseFunctionBody\n");
-  if (Stream.EnterSubBlock(naclbitc::FUNCTION_BLOCK_ID))
+  if (StreamEnterSubBlock(naclbitc::FUNCTION_BLOCK_ID))
     return Error("Malformed block record");
 
   unsigned ModuleValueListSize = ValueList.size();
@@ -1060,7 +1101,7 @@ bool NaClBitcodeReader::ParseFunctionBody(Function *F) {
   // Read all the records.
   SmallVector<uint64_t, 64> Record;
   while (1) {
-    NaClBitstreamEntry Entry = Stream.advance(0, 0);
+    NaClBitstreamEntry Entry = StreamAdvance();
 
     switch (Entry.Kind) {
     case NaClBitstreamEntry::Error:
@@ -1072,7 +1113,7 @@ bool NaClBitcodeReader::ParseFunctionBody(Function *F) {
       switch (Entry.ID) {
       default:  // Skip unknown content.
         dbgs() << "default skip block\n";
-        if (Stream.SkipBlock())
+        if (StreamSkipBlock())
           return Error("Malformed block record");
         break;
       case naclbitc::CONSTANTS_BLOCK_ID:
@@ -1099,7 +1140,7 @@ bool NaClBitcodeReader::ParseFunctionBody(Function *F) {
     // Read a record.
     Record.clear();
     Instruction *I = 0;
-    unsigned BitCode = Stream.readRecord(Entry.ID, Record);
+    unsigned BitCode = StreamReadRecord(Entry.ID, Record);
     switch (BitCode) {
     default: {// Default behavior: reject
       std::string Message;
@@ -1574,6 +1615,32 @@ bool NaClBitcodeReader::FindFunctionInStream(Function *F,
   return false;
 }
 
+/// getFunctionBodySizes - Sets Sizes to the size in bits of each function
+/// body that is still to be read, in module order, without reading any of
+/// them. The bodies follow one another in the stream, so each one ends where
+/// the next begins. With streaming, this waits for all of them to arrive.
+bool NaClBitcodeReader::getFunctionBodySizes(std::vector<uint64_t> &Sizes) {
+  std::vector<uint64_t> Starts;
+  for (Module::iterator F = TheModule->begin(), E = TheModule->end();
+       F != E; ++F) {
+    if (!F->isMaterializable())
+      continue;
+    DenseMap<Function*, uint64_t>::iterator DFII = DeferredFunctionInfo.find(F);
+    if (DFII->second == 0 && FindFunctionInStream(F, DFII))
+      return true;
+    Starts.push_back(DFII->second);
+  }
+  std::vector<uint64_t> Sorted(Starts);
+  std::sort(Sorted.begin(), Sorted.end());
+  for (unsigned i = 0, e = Starts.size(); i != e; ++i) {
+    std::vector<uint64_t>::iterator Next =
+        std::upper_bound(Sorted.begin(), Sorted.end(), Starts[i]);
+    uint64_t End = Next == Sorted.end() ? FunctionBodiesEndBit : *Next;
+    Sizes.push_back(End - Starts[i]);
+  }
+  return false;
+}
+
 //===----------------------------------------------------------------------===//
 // GVMaterializer implementation
 //===----------------------------------------------------------------------===//
@@ -1656,6 +1723,9 @@ void NaClBitcodeReader::Dematerialize(GlobalValue *GV) {
 std::error_code NaClBitcodeReader::MaterializeModule(Module *M) {
   assert(M == TheModule &&
          "Can only Materialize the Module this NaClBitcodeReader is attached to.");
+  if (std::error_code EC = MaterializeDecodedFunctions())
+    return EC;
+
   // Iterate over the module, deserializing any functions that are still on
   // disk.
   for (Module::iterator F = TheModule->begin(), E = TheModule->end();
@@ -1694,6 +1764,44 @@ std::error_code NaClBitcodeReader::MaterializeModule(Module *M) {
   return std::error_code();
 }
 
+/// If function blocks can be decoded on other threads, materializes all
+/// functions from blocks decoded ahead of time. Otherwise does nothing, and
+/// MaterializeModule materializes them one at a time.
+std::error_code NaClBitcodeReader::MaterializeDecodedFunctions() {
+  // The positions of all function blocks are only known up front when the
+  // whole bitcode is in memory.
+  if (PNaClReaderThreads == 0 || LazyStreamer)
+    return std::error_code();
+
+  std::vector<Function*> Functions;
+  std::vector<uint64_t> StartBits;
+  for (Module::iterator F = TheModule->begin(), E = TheModule->end();
+       F != E; ++F) {
+    if (!F->isMaterializable())
+      continue;
+    DenseMap<Function*, uint64_t>::iterator DFII = DeferredFunctionInfo.find(F);
+    if (DFII == DeferredFunctionInfo.end() || DFII->second == 0)
+      return std::error_code();
+    Functions.push_back(F);
+    StartBits.push_back(DFII->second);
+  }
+  if (Functions.empty())
+    return std::error_code();
+
+  // Only the bits are decoded on the worker threads. Types, constants and
+  // instructions are all created here, as the decoded records are replayed,
+  // since the LLVMContext is not thread safe.
+  NaClFunctionBlockDecoder Decoder(*StreamFile, StartBits, PNaClReaderThreads);
+  for (unsigned i = 0, e = Functions.size(); i != e; ++i) {
+    DecodedBlock = Decoder.get(i);
+    std::error_code EC = Materialize(Functions[i]);
+    DecodedBlock = 0;
+    if (EC)
+      return EC;
+  }
+  return std::error_code();
+}
+
 bool NaClBitcodeReader::InitStream() {
   if (LazyStreamer) return InitLazyStream();
   return InitStreamFromBuffer();
@@ -1774,6 +1882,12 @@ Module *llvm::getNaClStreamedBitcodeModule(const std::string &name,
   return M;
 }
 
+bool llvm::getNaClLazyFunctionBodySizes(Module *M,
+                                        std::vector<uint64_t> &Sizes) {
+  return static_cast<NaClBitcodeReader *>(M->getMaterializer())
+      ->getFunctionBodySizes(Sizes);
+}
+
 /// NaClParseBitcodeFile - Read the specified bitcode file, returning the module.
 /// If an error occurs, return null and fill in *ErrMsg if non-null.
 Module *llvm::NaClParseBitcodeFile(MemoryBuffer *Buffer, LLVMContext& Context,
@@ -31,6 +31,7 @@
 
 namespace llvm {
   class MemoryBuffer;
+  class NaClDecodedBlock;
   class LLVMContext;
   class CastInst;
 
@@ -132,6 +133,8 @@ class NaClBitcodeReader : public GVMaterializer {
   std::unique_ptr<MemoryBuffer> Buffer;
   std::unique_ptr<NaClBitstreamReader> StreamFile;
   NaClBitstreamCursor Stream;
+  // The function body being parsed, if it was decoded ahead of time.
+  NaClDecodedBlock *DecodedBlock;
   StreamingMemoryObject *LazyStreamer;
   uint64_t NextUnreadBit;
   bool SeenValueSymbolTable;
@@ -175,6 +178,10 @@ class NaClBitcodeReader : public GVMaterializer {
   /// stream.
   DenseMap<Function*, uint64_t> DeferredFunctionInfo;
 
+  /// FunctionBodiesEndBit - Where the last function body seen so far ends in
+  /// the stream.
+  uint64_t FunctionBodiesEndBit;
+
   /// \brief True if we should only accept supported bitcode format.
   bool AcceptSupportedBitcodeOnly;
 
@@ -185,10 +192,10 @@ public:
   explicit NaClBitcodeReader(MemoryBuffer *buffer, LLVMContext &C,
                              bool AcceptSupportedOnly = true)
       : Context(C), TheModule(0), AllowedIntrinsics(&C),
-        Buffer(buffer),
+        Buffer(buffer), DecodedBlock(0),
         LazyStreamer(0), NextUnreadBit(0), SeenValueSymbolTable(false),
         ValueList(),
-        SeenFirstFunctionBody(false),
+        SeenFirstFunctionBody(false), FunctionBodiesEndBit(0),
         AcceptSupportedBitcodeOnly(AcceptSupportedOnly),
         IntPtrType(IntegerType::get(C, PNaClIntPtrTypeBitSize)) {
   }
@@ -196,10 +203,10 @@ public:
                              LLVMContext &C,
                              bool AcceptSupportedOnly = true)
       : Context(C), TheModule(0), AllowedIntrinsics(&C),
-        Buffer(nullptr),
+        Buffer(nullptr), DecodedBlock(0),
         LazyStreamer(streamer), NextUnreadBit(0), SeenValueSymbolTable(false),
         ValueList(),
-        SeenFirstFunctionBody(false),
+        SeenFirstFunctionBody(false), FunctionBodiesEndBit(0),
         AcceptSupportedBitcodeOnly(AcceptSupportedOnly),
         IntPtrType(IntegerType::get(C, PNaClIntPtrTypeBitSize)) {
   }
@@ -226,6 +233,10 @@ public:
   /// @returns true if an error occurred.
   bool ParseBitcodeInto(Module *M);
 
+  /// @brief Sizes in bits of the function bodies still to be read.
+  /// @returns true if an error occurred.
+  bool getFunctionBodySizes(std::vector<uint64_t> &Sizes);
+
 private:
   // Returns false if Header is acceptable.
   bool AcceptHeader() const {
@@ -236,6 +247,17 @@ private:
     return Header.GetPNaClVersion();
   }
   Type *getTypeByID(unsigned ID);
+
+  // The parsers of function bodies and their sub-blocks read the stream
+  // through these, which replay DecodedBlock if the body was decoded ahead
+  // of time, and read Stream otherwise.
+  bool StreamEnterSubBlock(unsigned BlockID);
+  NaClBitstreamEntry StreamAdvance();
+  NaClBitstreamEntry StreamAdvanceSkippingSubblocks();
+  bool StreamSkipBlock();
+  unsigned StreamReadRecord(unsigned AbbrevID,
+                            SmallVectorImpl<uint64_t> &Vals);
+
   // Returns the value associated with ID.  The value must already exist,
   // or a forward referenced value created by getOrCreateFnVaueByID.
   Value *getFnValueByID(unsigned ID) {
@@ -323,6 +345,7 @@ private:
   bool InitLazyStream();
   bool FindFunctionInStream(Function *F,
          DenseMap<Function*, uint64_t>::iterator DeferredFunctionInfoIterator);
+  std::error_code MaterializeDecodedFunctions();
 };
 
 } // End llvm namespace
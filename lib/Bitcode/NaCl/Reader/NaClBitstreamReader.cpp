@@ -16,6 +16,39 @@ using namespace llvm;
 //  NaClBitstreamCursor implementation
 //===----------------------------------------------------------------------===//
 
+// Returns the continuation bits of the NumBits-bit chunks of a VBR that
+// starts at bit 0 of a 64-bit word, from bit Bit on.
+static LLVM_CONSTEXPR uint64_t continuationBits(unsigned NumBits,
+                                                unsigned Bit) {
+  return Bit >= 64 ? 0 : (uint64_t(1) << Bit) |
+                             continuationBits(NumBits, Bit + NumBits);
+}
+
+#define VBR_CONTINUATION_BITS(N) continuationBits(N, N - 1)
+
+const NaClBitstreamCursor::word_t
+NaClBitstreamCursor::VBRContinuationBits[33] = {
+  0,
+  VBR_CONTINUATION_BITS(1),  VBR_CONTINUATION_BITS(2),
+  VBR_CONTINUATION_BITS(3),  VBR_CONTINUATION_BITS(4),
+  VBR_CONTINUATION_BITS(5),  VBR_CONTINUATION_BITS(6),
+  VBR_CONTINUATION_BITS(7),  VBR_CONTINUATION_BITS(8),
+  VBR_CONTINUATION_BITS(9),  VBR_CONTINUATION_BITS(10),
+  VBR_CONTINUATION_BITS(11), VBR_CONTINUATION_BITS(12),
+  VBR_CONTINUATION_BITS(13), VBR_CONTINUATION_BITS(14),
+  VBR_CONTINUATION_BITS(15), VBR_CONTINUATION_BITS(16),
+  VBR_CONTINUATION_BITS(17), VBR_CONTINUATION_BITS(18),
+  VBR_CONTINUATION_BITS(19), VBR_CONTINUATION_BITS(20),
+  VBR_CONTINUATION_BITS(21), VBR_CONTINUATION_BITS(22),
+  VBR_CONTINUATION_BITS(23), VBR_CONTINUATION_BITS(24),
+  VBR_CONTINUATION_BITS(25), VBR_CONTINUATION_BITS(26),
+  VBR_CONTINUATION_BITS(27), VBR_CONTINUATION_BITS(28),
+  VBR_CONTINUATION_BITS(29), VBR_CONTINUATION_BITS(30),
+  VBR_CONTINUATION_BITS(31), VBR_CONTINUATION_BITS(32)
+};
+
+#undef VBR_CONTINUATION_BITS
+
 void NaClBitstreamCursor::operator=(const NaClBitstreamCursor &RHS) {
   freeState();
 
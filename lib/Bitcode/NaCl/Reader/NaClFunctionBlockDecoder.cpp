@@ -0,0 +1,205 @@
+//===- NaClFunctionBlockDecoder.cpp ---------------------------------------===//
+//     Decoding of PNaCl function blocks ahead of IR construction
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "NaClFunctionBlockDecoder.h"
+
+using namespace llvm;
+
+//===----------------------------------------------------------------------===//
+//  NaClDecodedBlock implementation
+//===----------------------------------------------------------------------===//
+
+void NaClDecodedBlock::decode(NaClBitstreamCursor &Cursor, uint64_t StartBit,
+                              unsigned BlockID) {
+  Cursor.JumpToBit(StartBit);
+  decodeBlock(Cursor, BlockID);
+}
+
+/// Decodes the block that the cursor is at, and its sub-blocks. Returns
+/// false if decoding stopped at an error.
+bool NaClDecodedBlock::decodeBlock(NaClBitstreamCursor &Cursor,
+                                   unsigned BlockID) {
+  if (Cursor.EnterSubBlock(BlockID)) {
+    add(EnterFailed);
+    return false;
+  }
+
+  SmallVector<uint64_t, 64> Vals;
+  while (1) {
+    NaClBitstreamEntry CursorEntry = Cursor.advance(0, 0);
+    switch (CursorEntry.Kind) {
+    case NaClBitstreamEntry::Error:
+      add(Error);
+      return false;
+    case NaClBitstreamEntry::EndBlock:
+      add(EndBlock);
+      return true;
+    case NaClBitstreamEntry::SubBlock:
+      // Sub-blocks are decoded even if the parser will skip them.
+      add(SubBlock, CursorEntry.ID);
+      if (!decodeBlock(Cursor, CursorEntry.ID))
+        return false;
+      break;
+    case NaClBitstreamEntry::Record: {
+      Vals.clear();
+      unsigned Code = Cursor.readRecord(CursorEntry.ID, Vals);
+      Entry E = { Record, Code, Values.size(), Vals.size() };
+      Entries.push_back(E);
+      Values.insert(Values.end(), Vals.begin(), Vals.end());
+      break;
+    }
+    }
+  }
+}
+
+bool NaClDecodedBlock::EnterSubBlock() {
+  if (Next < Entries.size() && Entries[Next].Kind == EnterFailed) {
+    ++Next;
+    return true;
+  }
+  return false;
+}
+
+NaClBitstreamEntry NaClDecodedBlock::advance() {
+  if (Next == Entries.size())
+    return NaClBitstreamEntry::getError();
+  const Entry &E = Entries[Next++];
+  switch (E.Kind) {
+  case EnterFailed:
+  case Error:
+    break;
+  case EndBlock:
+    return NaClBitstreamEntry::getEndBlock();
+  case SubBlock:
+    return NaClBitstreamEntry::getSubBlock(E.ID);
+  case Record:
+    // The abbreviation is not needed, since readRecord replays the values.
+    return NaClBitstreamEntry::getRecord(0);
+  }
+  return NaClBitstreamEntry::getError();
+}
+
+NaClBitstreamEntry NaClDecodedBlock::advanceSkippingSubblocks() {
+  while (1) {
+    NaClBitstreamEntry Entry = advance();
+    if (Entry.Kind != NaClBitstreamEntry::SubBlock)
+      return Entry;
+    if (SkipBlock())
+      return NaClBitstreamEntry::getError();
+  }
+}
+
+bool NaClDecodedBlock::SkipBlock() {
+  unsigned Depth = 0;
+  while (Next < Entries.size()) {
+    switch (Entries[Next++].Kind) {
+    case EnterFailed:
+    case Error:
+      return true;
+    case SubBlock:
+      ++Depth;
+      break;
+    case EndBlock:
+      if (Depth == 0)
+        return false;
+      --Depth;
+      break;
+    case Record:
+      break;
+    }
+  }
+  return true;
+}
+
+unsigned NaClDecodedBlock::readRecord(SmallVectorImpl<uint64_t> &Vals) {
+  assert(Next > 0 && Entries[Next - 1].Kind == Record &&
+         "readRecord must follow an advance that returned a record");
+  const Entry &E = Entries[Next - 1];
+  Vals.append(Values.begin() + E.Begin, Values.begin() + E.Begin + E.Size);
+  return E.ID;
+}
+
+//===----------------------------------------------------------------------===//
+//  NaClFunctionBlockDecoder implementation
+//===----------------------------------------------------------------------===//
+
+NaClFunctionBlockDecoder::NaClFunctionBlockDecoder(
+    NaClBitstreamReader &Reader, ArrayRef<uint64_t> StartBits,
+    unsigned NumThreads)
+    : Reader(Reader), StartBits(StartBits.begin(), StartBits.end()),
+      Blocks(StartBits.size()), Decoded(StartBits.size()),
+      Window(8 * NumThreads), NextToDecode(0), NextToParse(0),
+      Stopping(false) {
+#if LLVM_ENABLE_THREADS
+  for (unsigned i = 0; i < NumThreads; ++i)
+    Threads.push_back(std::thread(&NaClFunctionBlockDecoder::runWorker, this));
+#endif
+}
+
+NaClFunctionBlockDecoder::~NaClFunctionBlockDecoder() {
+#if LLVM_ENABLE_THREADS
+  {
+    std::lock_guard<std::mutex> L(Lock);
+    Stopping = true;
+  }
+  Changed.notify_all();
+  for (unsigned i = 0; i < Threads.size(); ++i)
+    Threads[i].join();
+#endif
+}
+
+void NaClFunctionBlockDecoder::runWorker() {
+#if LLVM_ENABLE_THREADS
+  std::unique_lock<std::mutex> L(Lock);
+  while (1) {
+    while (!Stopping && NextToDecode < StartBits.size() &&
+           NextToDecode >= NextToParse + Window)
+      Changed.wait(L);
+    if (Stopping || NextToDecode == StartBits.size())
+      return;
+    unsigned i = NextToDecode++;
+    L.unlock();
+
+    std::unique_ptr<NaClDecodedBlock> Block(new NaClDecodedBlock());
+    NaClBitstreamCursor Cursor(Reader);
+    Block->decode(Cursor, StartBits[i], naclbitc::FUNCTION_BLOCK_ID);
+
+    L.lock();
+    Blocks[i] = std::move(Block);
+    Decoded[i] = true;
+    Changed.notify_all();
+  }
+#endif
+}
+
+NaClDecodedBlock *NaClFunctionBlockDecoder::get(unsigned i) {
+  assert(i < StartBits.size() && "No such function block");
+  std::unique_ptr<NaClDecodedBlock> Previous;
+#if LLVM_ENABLE_THREADS
+  if (!Threads.empty()) {
+    std::unique_lock<std::mutex> L(Lock);
+    if (i > 0)
+      Previous = std::move(Blocks[i - 1]);
+    NextToParse = i;
+    Changed.notify_all();
+    while (!Decoded[i])
+      Changed.wait(L);
+    return Blocks[i].get();
+  }
+#endif
+  // Without threads, decode the block now.
+  if (i > 0)
+    Previous = std::move(Blocks[i - 1]);
+  Blocks[i].reset(new NaClDecodedBlock());
+  NaClBitstreamCursor Cursor(Reader);
+  Blocks[i]->decode(Cursor, StartBits[i], naclbitc::FUNCTION_BLOCK_ID);
+  Decoded[i] = true;
+  return Blocks[i].get();
+}
@@ -0,0 +1,122 @@
+//===- NaClFunctionBlockDecoder.h ------------------------------*- C++ -*-===//
+//     Decoding of PNaCl function blocks ahead of IR construction
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Decoding the bits of a function block does not touch the LLVMContext, so
+// it can be done on other threads, with a cursor per thread. The decoded
+// records are then replayed by NaClBitcodeReader on the thread that owns the
+// module, which creates all types, constants and instructions. This avoids
+// any locking in the LLVMContext.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef NACL_FUNCTION_BLOCK_DECODER_H
+#define NACL_FUNCTION_BLOCK_DECODER_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Bitcode/NaCl/NaClBitstreamReader.h"
+#include "llvm/Config/llvm-config.h"
+#include <memory>
+#include <vector>
+
+#if LLVM_ENABLE_THREADS
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+namespace llvm {
+
+/// The entries of a block and its sub-blocks, in the order that
+/// NaClBitstreamCursor::advance returns them, with the values of each record.
+class NaClDecodedBlock {
+public:
+  NaClDecodedBlock() : Next(0) {}
+
+  /// Decodes the block that starts at bit StartBit (just after its block ID)
+  /// with Cursor. Decoding stops at the first error, which is replayed at the
+  /// same point.
+  void decode(NaClBitstreamCursor &Cursor, uint64_t StartBit,
+              unsigned BlockID);
+
+  /// Replays the entries. These have the same meaning as the methods of
+  /// NaClBitstreamCursor with the same names.
+  bool EnterSubBlock();
+  NaClBitstreamEntry advance();
+  NaClBitstreamEntry advanceSkippingSubblocks();
+  bool SkipBlock();
+  unsigned readRecord(SmallVectorImpl<uint64_t> &Vals);
+
+private:
+  enum EntryKind {
+    EnterFailed, // EnterSubBlock returned true
+    Error,
+    EndBlock,
+    SubBlock,
+    Record
+  };
+
+  struct Entry {
+    EntryKind Kind;
+    unsigned ID;    // The block ID or record code.
+    size_t Begin;   // The values of a record, in Values.
+    size_t Size;
+  };
+
+  std::vector<Entry> Entries;
+  std::vector<uint64_t> Values;
+  // The next entry to replay.
+  size_t Next;
+
+  bool decodeBlock(NaClBitstreamCursor &Cursor, unsigned BlockID);
+  void add(EntryKind Kind, unsigned ID = 0) {
+    Entry E = { Kind, ID, 0, 0 };
+    Entries.push_back(E);
+  }
+};
+
+/// Decodes function blocks on worker threads, in the order they will be
+/// parsed, keeping at most a window of decoded blocks ahead of the parser so
+/// that the decoded records of the whole module are never in memory at once.
+class NaClFunctionBlockDecoder {
+public:
+  /// StartBits are the positions of the function blocks, in the order that
+  /// get() will be called.
+  NaClFunctionBlockDecoder(NaClBitstreamReader &Reader,
+                           ArrayRef<uint64_t> StartBits, unsigned NumThreads);
+  ~NaClFunctionBlockDecoder();
+
+  /// Waits for block i to be decoded and returns it. The block is freed by
+  /// the next call to get().
+  NaClDecodedBlock *get(unsigned i);
+
+private:
+  NaClBitstreamReader &Reader;
+  std::vector<uint64_t> StartBits;
+  std::vector<std::unique_ptr<NaClDecodedBlock> > Blocks;
+  std::vector<bool> Decoded;
+  // How many blocks may be decoded ahead of the one being parsed.
+  unsigned Window;
+  unsigned NextToDecode;
+  unsigned NextToParse;
+  bool Stopping;
+
+#if LLVM_ENABLE_THREADS
+  std::mutex Lock;
+  std::condition_variable Changed;
+  std::vector<std::thread> Threads;
+#endif
+
+  void runWorker();
+};
+
+} // End llvm namespace
+
+#endif
@@ -1671,6 +1671,7 @@ std::error_code BitcodeReader::RememberAndSkipFunctionBody() {
   // Skip over the function block for now.
   if (Stream.SkipBlock())
     return Error(InvalidRecord);
+  FunctionBodiesEndBit = Stream.GetCurrentBitNo();
   return std::error_code();
 }
 
@@ -3198,6 +3199,34 @@ std::error_code BitcodeReader::FindFunctionInStream(
   return std::error_code();
 }
 
+/// getFunctionBodySizes - Sets Sizes to the size in bits of each function
+/// body that is still to be read, in module order, without reading any of
+/// them. The bodies follow one another in the stream, so each one ends where
+/// the next begins. With streaming, this waits for all of them to arrive.
+std::error_code
+BitcodeReader::getFunctionBodySizes(std::vector<uint64_t> &Sizes) {
+  std::vector<uint64_t> Starts;
+  for (Module::iterator F = TheModule->begin(), E = TheModule->end();
+       F != E; ++F) {
+    if (!F->isMaterializable())
+      continue;
+    DenseMap<Function*, uint64_t>::iterator DFII = DeferredFunctionInfo.find(F);
+    if (DFII->second == 0)
+      if (std::error_code EC = FindFunctionInStream(F, DFII))
+        return EC;
+    Starts.push_back(DFII->second);
+  }
+  std::vector<uint64_t> Sorted(Starts);
+  std::sort(Sorted.begin(), Sorted.end());
+  for (unsigned i = 0, e = Starts.size(); i != e; ++i) {
+    std::vector<uint64_t>::iterator Next =
+        std::upper_bound(Sorted.begin(), Sorted.end(), Starts[i]);
+    uint64_t End = Next == Sorted.end() ? FunctionBodiesEndBit : *Next;
+    Sizes.push_back(End - Starts[i]);
+  }
+  return std::error_code();
+}
+
 //===----------------------------------------------------------------------===//
 // GVMaterializer implementation
 //===----------------------------------------------------------------------===//
@@ -3470,6 +3499,12 @@ Module *llvm::getStreamedBitcodeModule(const std::string &name,
   return M;
 }
 
+std::error_code llvm::getLazyFunctionBodySizes(Module *M,
+                                               std::vector<uint64_t> &Sizes) {
+  return static_cast<BitcodeReader *>(M->getMaterializer())
+      ->getFunctionBodySizes(Sizes);
+}
+
 ErrorOr<Module *> llvm::parseBitcodeFile(MemoryBuffer *Buffer,
                                          LLVMContext &Context) {
   ErrorOr<Module *> ModuleOrErr = getLazyBitcodeModule(Buffer, Context);
@@ -180,6 +180,10 @@ class BitcodeReader : public GVMaterializer {
   /// stream.
   DenseMap<Function*, uint64_t> DeferredFunctionInfo;
 
+  /// FunctionBodiesEndBit - Where the last function body seen so far ends in
+  /// the stream.
+  uint64_t FunctionBodiesEndBit;
+
   /// BlockAddrFwdRefs - These are blockaddr references to basic blocks.  These
   /// are resolved lazily when functions are loaded.
   typedef std::pair<unsigned, GlobalVariable*> BlockAddrRefTy;
@@ -227,12 +231,14 @@ public:
   explicit BitcodeReader(MemoryBuffer *buffer, LLVMContext &C)
       : Context(C), TheModule(nullptr), Buffer(buffer), LazyStreamer(nullptr),
         NextUnreadBit(0), SeenValueSymbolTable(false), ValueList(C),
-        MDValueList(C), SeenFirstFunctionBody(false), UseRelativeIDs(false) {}
+        MDValueList(C), SeenFirstFunctionBody(false), FunctionBodiesEndBit(0),
+        UseRelativeIDs(false) {}
   // @LOCALMOD -- DataStreamer -> StreamingMemoryObject.
   explicit BitcodeReader(StreamingMemoryObject *streamer, LLVMContext &C)
       : Context(C), TheModule(nullptr), Buffer(nullptr), LazyStreamer(streamer),
         NextUnreadBit(0), SeenValueSymbolTable(false), ValueList(C),
-        MDValueList(C), SeenFirstFunctionBody(false), UseRelativeIDs(false) {}
+        MDValueList(C), SeenFirstFunctionBody(false), FunctionBodiesEndBit(0),
+        UseRelativeIDs(false) {}
   ~BitcodeReader() { FreeState(); }
 
   void materializeForwardReferencedFunctions();
@@ -255,6 +261,9 @@ public:
   /// @returns true if an error occurred.
   ErrorOr<std::string> parseTriple();
 
+  /// @brief Sizes in bits of the function bodies still to be read.
+  std::error_code getFunctionBodySizes(std::vector<uint64_t> &Sizes);
+
   static uint64_t decodeSignRotatedValue(uint64_t V);
 
 private:
@@ -0,0 +1,146 @@
+//=- ThreadedStreamingCache.cpp - Cache for StreamingMemoryObject -*- C++ -*-=//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/Support/ThreadedStreamingCache.h"
+#include "llvm/Support/Compiler.h"
+#include "llvm/Support/Mutex.h"
+#include <cstring>
+
+using namespace llvm;
+using llvm::sys::ScopedLock;
+
+SharedStreamingCache::SharedStreamingCache(StreamingMemoryObject *S)
+    : Streamer(S), BytesDropped(0), FetchedSize(0), ObjectSize(0) {
+  static_assert((kCacheSize & (kCacheSize - 1)) == 0,
+                "kCacheSize must be a power of 2");
+  memset(Chunks, 0, sizeof(Chunks));
+}
+
+SharedStreamingCache::~SharedStreamingCache() {
+  for (unsigned i = 0; i < kMaxChunks; ++i)
+    delete[] Chunks[i];
+}
+
+bool SharedStreamingCache::fetchTo(uint64_t address) {
+  ScopedLock L(StreamerLock);
+  // Another thread may have fetched the bytes while we waited for the lock.
+  uint64_t Fetched = FetchedSize.load(std::memory_order_relaxed);
+  while (Fetched <= address) {
+    // Only the last cache line of the object is fetched partially.
+    if (Fetched & ~kCacheSizeMask)
+      return false;
+    uint64_t End = Fetched + kCacheSize;
+    if (!Streamer->isValidAddress(End - 1)) {
+      if (!Streamer->isValidAddress(Fetched)) {
+        ObjectSize.store(Fetched, std::memory_order_release);
+        return false;
+      }
+      End = Streamer->getExtent();
+      assert(End > Fetched && End < Fetched + kCacheSize);
+      ObjectSize.store(End, std::memory_order_release);
+    }
+    unsigned Chunk = getChunkIndex(Fetched);
+    if (!Chunks[Chunk])
+      Chunks[Chunk] = new uint8_t[getChunkSize(Chunk)];
+    int Ret = Streamer->readBytes(Fetched, End - Fetched,
+                                  Chunks[Chunk] + (Fetched -
+                                                   getChunkBase(Chunk)));
+    assert(Ret == 0);
+    (void)Ret;
+    Fetched = End;
+    // Publish the line only after its bytes are written.
+    FetchedSize.store(Fetched, std::memory_order_release);
+  }
+  return true;
+}
+
+bool SharedStreamingCache::isObjectEnd(uint64_t address) {
+  uint64_t Size = getObjectSize();
+  if (Size)
+    return address == Size;
+  if (fetchTo(address))
+    return false;
+  return address == getObjectSize();
+}
+
+bool SharedStreamingCache::dropLeadingBytes(size_t s) {
+  ScopedLock L(StreamerLock);
+  // The bytes are dropped from the shared streamer, so only the first reader
+  // to find the wrapper drops them; any later request for the same bytes is
+  // already satisfied.
+  if (BytesDropped)
+    return s != BytesDropped;
+  if (Streamer->dropLeadingBytes(s))
+    return true;
+  BytesDropped = s;
+  // The positions of the bytes fetched so far change, so fetch them again.
+  FetchedSize.store(0, std::memory_order_release);
+  ObjectSize.store(0, std::memory_order_release);
+  return false;
+}
+
+void SharedStreamingCache::setKnownObjectSize(size_t size) {
+  ScopedLock L(StreamerLock);
+  Streamer->setKnownObjectSize(size);
+  ObjectSize.store(size, std::memory_order_release);
+}
+
+int ThreadedStreamingCache::readByte(
+    uint64_t address, uint8_t* ptr) const {
+  if (address >= Shared->getFetchedSize() && !Shared->fetchTo(address))
+    return -1;
+  *ptr = *Shared->getFetchedBytes(address);
+  return 0;
+}
+
+int ThreadedStreamingCache::readBytes(
+    uint64_t address, uint64_t size, uint8_t* buf) const {
+  // To keep the chunks simple, we currently require that no request cross
+  // a cache line. This isn't a problem for the bitcode reader because it only
+  // fetches a byte or a word at a time.
+  if (address + size > Shared->getFetchedSize()) {
+    if ((address & SharedStreamingCache::kCacheSizeMask) !=
+        ((address + size - 1) & SharedStreamingCache::kCacheSizeMask))
+      llvm::report_fatal_error("readBytes request spans cache lines");
+    if (!Shared->fetchTo(address + size - 1))
+      return -1;
+  }
+  memcpy(buf, Shared->getFetchedBytes(address), size);
+  return 0;
+}
+
+uint64_t ThreadedStreamingCache::getExtent() const {
+  llvm::report_fatal_error(
+      "getExtent should not be called for pnacl streaming bitcode");
+  return 0;
+}
+
+bool ThreadedStreamingCache::isValidAddress(uint64_t address) const {
+  if (address < Shared->getFetchedSize() || address < Shared->getObjectSize())
+    return true;
+  return Shared->fetchTo(address);
+}
+
+bool ThreadedStreamingCache::isObjectEnd(uint64_t address) const {
+  if (address < Shared->getFetchedSize())
+    return false;
+  return Shared->isObjectEnd(address);
+}
+
+bool ThreadedStreamingCache::dropLeadingBytes(size_t s) {
+  return Shared->dropLeadingBytes(s);
+}
+
+void ThreadedStreamingCache::setKnownObjectSize(size_t size) {
+  Shared->setKnownObjectSize(size);
+}
+
+const uint64_t SharedStreamingCache::kCacheSize;
+const uint64_t SharedStreamingCache::kCacheSizeMask;
+const unsigned SharedStreamingCache::kMaxChunks;
@@ -55,8 +55,19 @@ DEF_CALL_HANDLER(__default__, {
   std::string Sig;
   const Function *F = dyn_cast<const Function>(CV);
   if (F) {
-    NeedCasts = F->isDeclaration(); // if ffi call, need casts
+    NeedCasts = isExternalFunction(F); // if ffi call, need casts
+    if (PrintingColdFunction && !NeedCasts) {
+      // the cold chunk calls the functions of the main module, and its own,
+      // through the exports of the main module
+      ColdImports.insert(Name);
+      NeedCasts = true;
+    }
     FT = F->getFunctionType();
+    if (!NeedCasts && hasI64(FT)) {
+      // ExpandI64 has split the call, but has not reached the body of the
+      // function yet to legalize its signature, so use the call's type
+      FT = cast<FunctionType>(cast<PointerType>(ImmutableCallSite(CI).getCalledValue()->getType())->getElementType());
+    }
   } else {
     FT = dyn_cast<FunctionType>(dyn_cast<PointerType>(CV->getType())->getElementType());
     if (isAbsolute(CV->stripPointerCasts())) {
@@ -108,7 +119,7 @@ DEF_CALL_HANDLER(__default__, {
   if (Invoke) {
     // add first param
     if (F) {
-      text += utostr(getFunctionIndex(F)); // convert to function pointer
+      text += getFunctionPointer(F); // convert to function pointer
     } else {
       text += getValueAsCastStr(CV); // already a function pointer
     }
@@ -206,6 +217,23 @@ DEF_CALL_HANDLER(emscripten_get_longjmp_result, {
   return getAssign(CI) + "tempRet0";
 })
 
+// thread-local storage (see ExpandTls). Each asm.js module instance keeps
+// its own tlsBase, so every worker sees its own block.
+DEF_CALL_HANDLER(llvm_nacl_read_tp, {
+  UsesTls = true;
+  return getAssign(CI) + "tlsBase";
+})
+DEF_CALL_HANDLER(emscripten_set_tls_base, {
+  UsesTls = true;
+  return "tlsBase = " + getValueAsStr(CI->getOperand(0));
+})
+// STACKTOP and STACK_MAX are per-instance globals too, so a new thread can be
+// given its own stack (see emscripten_thread_init in ExpandTls).
+DEF_CALL_HANDLER(emscripten_set_stack_limits, {
+  return "STACKTOP = " + getValueAsStr(CI->getOperand(0)) + ";" +
+         "STACK_MAX = " + getValueAsStr(CI->getOperand(1));
+})
+
 // supporting async functions, see `<emscripten>/src/library_async.js` for detail.
 DEF_CALL_HANDLER(emscripten_alloc_async_context, {
   // insert sp as the 2nd parameter
@@ -607,6 +635,9 @@ void setupCallHandlers() {
   SETUP_CALL_HANDLER(emscripten_longjmp);
   SETUP_CALL_HANDLER(emscripten_check_longjmp);
   SETUP_CALL_HANDLER(emscripten_get_longjmp_result);
+  SETUP_CALL_HANDLER(llvm_nacl_read_tp);
+  SETUP_CALL_HANDLER(emscripten_set_tls_base);
+  SETUP_CALL_HANDLER(emscripten_set_stack_limits);
   SETUP_CALL_HANDLER(emscripten_alloc_async_context);
   SETUP_CALL_HANDLER(emscripten_check_async);
   SETUP_CALL_HANDLER(emscripten_do_not_unwind);
@@ -26,6 +26,7 @@
 
 #include "OptPasses.h"
 #include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/SmallString.h"
 #include "llvm/ADT/StringExtras.h"
@@ -42,6 +43,7 @@
 #include "llvm/Target/TargetLibraryInfo.h"
 #include "llvm/Transforms/Utils/Local.h"
 #include <map>
+#include <set>
 #include <vector>
 
 #include "llvm/Support/raw_ostream.h"
@@ -65,20 +67,30 @@ namespace {
   typedef SmallVector<PHINode *, 8> PHIVec;
   typedef SmallVector<Instruction *, 8> DeadVec;
 
-  // This is a ModulePass because the pass recreates functions in
-  // order to expand i64 arguments to pairs of i32s.
-  class ExpandI64 : public ModulePass {
+  // Declarations are recreated in doInitialization in order to expand i64
+  // arguments to pairs of i32s. A definition keeps its Function, whose
+  // signature is legalized in place when runOnFunction reaches its body, so
+  // that bodies can be expanded one function at a time, including under a
+  // FunctionPassManager on a lazily materialized module, without reading any
+  // of them early.
+  class ExpandI64 : public FunctionPass {
     bool Changed;
     const DataLayout *DL;
     Module *TheModule;
 
     SplitsMap Splits; // old illegal value to new insts
+    std::vector<Function*> Illegal; // declarations that were legalized, unlinked from the module
     PHIVec Phis;
     std::vector<PhiBlockChange> PhiBlockChanges;
 
-    // If the function has an illegal return or argument, create a legal version
+    // If the declaration has an illegal return or argument, create a legal version
     void ensureLegalFunc(Function *F);
 
+    // If the definition has an illegal return or argument, legalize its
+    // signature in place. Returns the function that holds the original
+    // arguments, which must be deleted once the body no longer uses them.
+    Function *legalizeSignature(Function *F);
+
     // If a function is illegal, remove it
     void removeIllegalFunc(Function *F);
 
@@ -109,13 +121,15 @@ namespace {
 
   public:
     static char ID;
-    ExpandI64() : ModulePass(ID) {
+    ExpandI64() : FunctionPass(ID) {
       initializeExpandI64Pass(*PassRegistry::getPassRegistry());
 
       Add = Sub = Mul = SDiv = UDiv = SRem = URem = LShr = AShr = Shl = GetHigh = SetHigh = NULL;
     }
 
-    virtual bool runOnModule(Module &M);
+    virtual bool doInitialization(Module &M);
+    virtual bool runOnFunction(Function &F);
+    virtual bool doFinalization(Module &M);
     virtual void getAnalysisUsage(AnalysisUsage &AU) const;
   };
 }
@@ -210,8 +224,9 @@ static bool isLegalInstruction(const Instruction *I) {
 }
 
 // We can't use RecreateFunction because we need to handle
-// function and argument attributes specially.
-static Function *RecreateFunctionLegalized(Function *F, FunctionType *NewType) {
+// function and argument attributes specially. The new function is not added
+// to the module.
+static Function *CreateFunctionLegalized(Function *F, FunctionType *NewType) {
   Function *NewFunc = Function::Create(NewType, F->getLinkage());
 
   AttributeSet Attrs = F->getAttributes();
@@ -252,11 +267,13 @@ static Function *RecreateFunctionLegalized(Function *F, FunctionType *NewType) {
     }
     NewFunc->addAttributes(j, AttributeSet::get(F->getContext(), j, AB));
   }
+  return NewFunc;
+}
 
+static Function *RecreateFunctionLegalized(Function *F, FunctionType *NewType) {
+  Function *NewFunc = CreateFunctionLegalized(F, NewType);
   F->getParent()->getFunctionList().insert(F, NewFunc);
   NewFunc->takeName(F);
-  NewFunc->getBasicBlockList().splice(NewFunc->begin(),
-                                      F->getBasicBlockList());
   F->replaceAllUsesWith(
       ConstantExpr::getBitCast(NewFunc,
                                F->getFunctionType()->getPointerTo()));
@@ -282,9 +299,34 @@ void ExpandI64::ensureLegalFunc(Function *F) {
     }
     NF->setName(Twine(NewName));
   }
+}
 
-  // Move and update arguments
-  for (Function::arg_iterator Arg = F->arg_begin(), E = F->arg_end(), NewArg = NF->arg_begin();
+Function *ExpandI64::legalizeSignature(Function *F) {
+  if (okToRemainIllegal(F)) return NULL;
+
+  FunctionType *FT = F->getFunctionType();
+  if (isLegalFunctionType(FT)) return NULL;
+
+  Changed = true;
+  // F keeps its identity, as it is what the pass manager is running on, and
+  // a lazy reader may still have to read the bodies that call it. Its uses
+  // outside the body expect the old type, so they move to a cast of F. A
+  // placeholder holds them while the type changes, because a cast of F to
+  // its own type would just fold away.
+  Function *Placeholder = Function::Create(FT, GlobalValue::ExternalLinkage);
+  F->replaceAllUsesWith(Placeholder);
+
+  // Build the legal arguments on a scratch function, and swap them into F.
+  Function *Old = CreateFunctionLegalized(F, getLegalizedFunctionType(FT));
+  F->setAttributes(Old->getAttributes());
+  Function::ArgumentListType &Args = F->getArgumentList();
+  Function::ArgumentListType &NewArgs = Old->getArgumentList();
+  Function::arg_iterator FirstNew = NewArgs.begin();
+  NewArgs.splice(NewArgs.begin(), Args);
+  Args.splice(Args.end(), NewArgs, FirstNew, NewArgs.end());
+  F->mutateType(Old->getType());
+
+  for (Function::arg_iterator Arg = Old->arg_begin(), E = Old->arg_end(), NewArg = F->arg_begin();
        Arg != E; ++Arg) {
     if (Arg->getType() == NewArg->getType()) {
       NewArg->takeName(Arg);
@@ -302,6 +344,11 @@ void ExpandI64::ensureLegalFunc(Function *F) {
       }
     }
   }
+
+  Placeholder->replaceAllUsesWith(
+      ConstantExpr::getBitCast(F, FT->getPointerTo()));
+  delete Placeholder;
+  return Old;
 }
 
 void ExpandI64::removeIllegalFunc(Function *F) {
@@ -309,7 +356,11 @@ void ExpandI64::removeIllegalFunc(Function *F) {
 
   FunctionType *FT = F->getFunctionType();
   if (!isLegalFunctionType(FT)) {
-    F->eraseFromParent();
+    // Don't delete it yet: a lazy bitcode reader may still know about it,
+    // and must not mistake a new function allocated at the same address for
+    // it.
+    F->removeFromParent();
+    Illegal.push_back(F);
   }
 }
 
@@ -736,13 +787,16 @@ bool ExpandI64::splitInst(Instruction *I) {
     case Instruction::Call: {
       CallInst *CI = cast<CallInst>(I);
       Function *F = CI->getCalledFunction();
-      if (F) {
-        assert(okToRemainIllegal(F));
+      if (F && okToRemainIllegal(F)) {
         return false;
       }
       Value *CV = CI->getCalledValue();
       FunctionType *OFT = NULL;
-      if (ConstantExpr *CE = dyn_cast<ConstantExpr>(CV)) {
+      if (F) {
+        // a definition whose signature is legalized when we reach its body
+        OFT = F->getFunctionType();
+        CV = ConstantExpr::getBitCast(F, getLegalizedFunctionType(OFT)->getPointerTo());
+      } else if (ConstantExpr *CE = dyn_cast<ConstantExpr>(CV)) {
         assert(CE);
         assert(CE->getOpcode() == Instruction::BitCast);
         OFT = cast<FunctionType>(cast<PointerType>(CE->getType())->getElementType());
@@ -1067,99 +1121,120 @@ void ExpandI64::ensureFuncs() {
                            "BItoD", TheModule);
 }
 
-bool ExpandI64::runOnModule(Module &M) {
+bool ExpandI64::doInitialization(Module &M) {
   TheModule = &M;
-  DL = &getAnalysis<DataLayoutPass>().getDataLayout();
-  Splits.clear();
+  DataLayoutPass *DLP = getAnalysisIfAvailable<DataLayoutPass>();
+  DL = DLP ? &DLP->getDataLayout() : M.getDataLayout();
   Changed = false;
 
-  // pre pass - legalize functions
+  // pre pass - legalize declarations, and remove the illegal originals.
+  // Definitions wait for runOnFunction, so no body is read before its turn.
+  for (Module::iterator Iter = M.begin(), E = M.end(); Iter != E; ) {
+    Function *Func = Iter++;
+    if (Func->isDeclaration() && !Func->isMaterializable()) {
+      ensureLegalFunc(Func);
+    }
+  }
   for (Module::iterator Iter = M.begin(), E = M.end(); Iter != E; ) {
     Function *Func = Iter++;
-    ensureLegalFunc(Func);
+    if (Func->isDeclaration() && !Func->isMaterializable()) {
+      removeIllegalFunc(Func);
+    }
   }
 
-  // first pass - split
+  return Changed;
+}
+
+bool ExpandI64::runOnFunction(Function &F) {
+  Function *Func = &F;
+  DL = &getAnalysis<DataLayoutPass>().getDataLayout();
+  Changed = false;
+
+  Splits.clear();
+  Function *OldArgs = legalizeSignature(Func);
   DeadVec Dead;
-  for (Module::iterator Iter = M.begin(), E = M.end(); Iter != E; ++Iter) {
-    Function *Func = Iter;
-    if (Func->isDeclaration()) {
-      continue;
-    }
 
-    // Walk the body of the function. We use reverse postorder so that we visit
-    // all operands of an instruction before the instruction itself. The
-    // exception to this is PHI nodes, which we put on a list and handle below.
-    ReversePostOrderTraversal<Function*> RPOT(Func);
-    for (ReversePostOrderTraversal<Function*>::rpo_iterator RI = RPOT.begin(),
-         RE = RPOT.end(); RI != RE; ++RI) {
-      BasicBlock *BB = *RI;
-      for (BasicBlock::iterator Iter = BB->begin(), E = BB->end();
-           Iter != E; ) {
-        Instruction *I = Iter++;
-        if (!isLegalInstruction(I)) {
-          if (splitInst(I)) {
-            Changed = true;
-            Dead.push_back(I);
-          }
+  // split
+
+  // Walk the body of the function. We use reverse postorder so that we visit
+  // all operands of an instruction before the instruction itself. The
+  // exception to this is PHI nodes, which we put on a list and handle below.
+  ReversePostOrderTraversal<Function*> RPOT(Func);
+  for (ReversePostOrderTraversal<Function*>::rpo_iterator RI = RPOT.begin(),
+       RE = RPOT.end(); RI != RE; ++RI) {
+    BasicBlock *BB = *RI;
+    for (BasicBlock::iterator Iter = BB->begin(), E = BB->end();
+         Iter != E; ) {
+      Instruction *I = Iter++;
+      if (!isLegalInstruction(I)) {
+        if (splitInst(I)) {
+          Changed = true;
+          Dead.push_back(I);
         }
       }
     }
+  }
 
-    // Fix up PHI node operands.
-    while (!Phis.empty()) {
-      PHINode *PN = Phis.pop_back_val();
-      ChunksVec OutputChunks = getChunks(PN);
-      for (unsigned j = 0, je = PN->getNumIncomingValues(); j != je; ++j) {
-        Value *Op = PN->getIncomingValue(j);
-        ChunksVec InputChunks = getChunks(Op, true);
-        for (unsigned k = 0, ke = OutputChunks.size(); k != ke; ++k) {
-          PHINode *NewPN = cast<PHINode>(OutputChunks[k]);
-          NewPN->addIncoming(InputChunks[k], PN->getIncomingBlock(j));
-        }
+  // Fix up PHI node operands.
+  while (!Phis.empty()) {
+    PHINode *PN = Phis.pop_back_val();
+    ChunksVec OutputChunks = getChunks(PN);
+    for (unsigned j = 0, je = PN->getNumIncomingValues(); j != je; ++j) {
+      Value *Op = PN->getIncomingValue(j);
+      ChunksVec InputChunks = getChunks(Op, true);
+      for (unsigned k = 0, ke = OutputChunks.size(); k != ke; ++k) {
+        PHINode *NewPN = cast<PHINode>(OutputChunks[k]);
+        NewPN->addIncoming(InputChunks[k], PN->getIncomingBlock(j));
       }
-      PN->dropAllReferences();
     }
+    PN->dropAllReferences();
+  }
 
-    // Delete instructions which were replaced. We do this after the full walk
-    // of the instructions so that all uses are replaced first.
-    while (!Dead.empty()) {
-      Instruction *D = Dead.pop_back_val();
-      D->eraseFromParent();
-    }
+  // Delete instructions which were replaced. We do this after the full walk
+  // of the instructions so that all uses are replaced first.
+  while (!Dead.empty()) {
+    Instruction *D = Dead.pop_back_val();
+    D->eraseFromParent();
+  }
 
-    // Apply basic block changes to phis, now that phis are all processed (and illegal phis erased)
-    for (unsigned i = 0; i < PhiBlockChanges.size(); i++) {
-      PhiBlockChange &Change = PhiBlockChanges[i];
-      for (BasicBlock::iterator I = Change.DD->begin(); I != Change.DD->end(); ++I) {
-        PHINode *Phi = dyn_cast<PHINode>(I);
-        if (!Phi) break;
-        int Index = Phi->getBasicBlockIndex(Change.SwitchBB);
-        assert(Index >= 0);
-        Phi->addIncoming(Phi->getIncomingValue(Index), Change.NewBB);
-      }
+  // Apply basic block changes to phis, now that phis are all processed (and illegal phis erased)
+  for (unsigned i = 0; i < PhiBlockChanges.size(); i++) {
+    PhiBlockChange &Change = PhiBlockChanges[i];
+    for (BasicBlock::iterator I = Change.DD->begin(); I != Change.DD->end(); ++I) {
+      PHINode *Phi = dyn_cast<PHINode>(I);
+      if (!Phi) break;
+      int Index = Phi->getBasicBlockIndex(Change.SwitchBB);
+      assert(Index >= 0);
+      Phi->addIncoming(Phi->getIncomingValue(Index), Change.NewBB);
     }
-    PhiBlockChanges.clear();
-
-    // We only visited blocks found by a DFS walk from the entry, so we haven't
-    // visited any unreachable blocks, and they may still contain illegal
-    // instructions at this point. Being unreachable, they can simply be deleted.
-    removeUnreachableBlocks(*Func);
   }
+  PhiBlockChanges.clear();
 
-  // post pass - clean up illegal functions that were legalized. We do this
-  // after the full walk of the functions so that all uses are replaced first.
-  for (Module::iterator Iter = M.begin(), E = M.end(); Iter != E; ) {
-    Function *Func = Iter++;
-    removeIllegalFunc(Func);
-  }
+  // We only visited blocks found by a DFS walk from the entry, so we haven't
+  // visited any unreachable blocks, and they may still contain illegal
+  // instructions at this point. Being unreachable, they can simply be deleted.
+  removeUnreachableBlocks(*Func);
+
+  // The original arguments are no longer used.
+  delete OldArgs;
 
   return Changed;
 }
 
+bool ExpandI64::doFinalization(Module &M) {
+  // post pass - delete the illegal declarations that were legalized
+  for (unsigned i = 0; i < Illegal.size(); i++) {
+    delete Illegal[i];
+  }
+  Illegal.clear();
+  Splits.clear();
+
+  return false;
+}
+
 void ExpandI64::getAnalysisUsage(AnalysisUsage &AU) const {
   AU.addRequired<DataLayoutPass>();
-  ModulePass::getAnalysisUsage(AU);
+  FunctionPass::getAnalysisUsage(AU);
 }
 
 Pass *llvm::createExpandI64Pass() {
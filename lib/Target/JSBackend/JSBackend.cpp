@@ -18,14 +18,19 @@
 #include "MCTargetDesc/JSBackendMCTargetDesc.h"
 #include "AllocaManager.h"
 #include "llvm/Analysis/ValueTracking.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/SetVector.h"
 #include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/ADT/SmallString.h"
 #include "llvm/ADT/StringExtras.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/Statistic.h"
 #include "llvm/Config/config.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Intrinsics.h"
@@ -36,7 +41,10 @@
 #include "llvm/IR/CallSite.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
 #include "llvm/IR/GetElementPtrTypeIterator.h"
 #include "llvm/Support/MathExtras.h"
 #include "llvm/Support/TargetRegistry.h"
@@ -50,6 +58,13 @@ using namespace llvm;
 #include <OptPasses.h>
 #include <Relooper.h>
 
+#define DEBUG_TYPE "js-backend"
+
+STATISTIC(NumDuplicateFunctions, "Number of duplicate functions not emitted");
+STATISTIC(NumDuplicateBytes, "Number of bytes of JS saved by not emitting duplicate functions");
+STATISTIC(NumColdFunctions, "Number of functions moved to the cold chunk");
+STATISTIC(NumHeapIndexIVs, "Number of induction variables kept as heap indexes");
+
 #ifdef NDEBUG
 #undef assert
 #define assert(x) { if (!(x)) report_fatal_error(#x); }
@@ -93,6 +108,86 @@ GlobalBase("emscripten-global-base",
            cl::desc("Where global variables start out in memory (see emscripten GLOBAL_BASE option)"),
            cl::init(8));
 
+static cl::opt<bool>
+EmulateIrreducible("emscripten-emulate-irreducible",
+                   cl::desc("Emulates irreducible control flow regions with a switch in a loop (just those regions, the rest of the function is relooped normally), instead of loops with label checks"),
+                   cl::init(false));
+
+static cl::opt<bool>
+SplitIrreducible("emscripten-split-irreducible",
+                 cl::desc("Splits nodes in small irreducible control flow regions to make them reducible (this increases code size, and is not done in functions optimized for size)"),
+                 cl::init(false));
+
+static cl::opt<bool>
+RelooperLabelStats("emscripten-relooper-label-stats",
+                   cl::desc("Reports how many operations on the label variable the relooper optimized out, for each function"),
+                   cl::init(false));
+
+static cl::opt<bool>
+MergeableOutput("emscripten-mergeable-output",
+                cl::desc("Emits output that can be merged with that of other threads compiling other functions of the same module: function pointers in function bodies are left to the merge to number, and metadata is in a line-based form (used by pnacl-llc -split-module)"),
+                cl::init(false));
+
+static cl::opt<bool>
+FinalizeFunctionTables("emscripten-finalize-function-tables",
+                       cl::desc("Puts the masks of the function tables into indirect calls, and prints the tables as JS after the functions, instead of leaving #FM_sig# placeholders and JSON strings for emscripten to process (the output is kept in memory until the tables are final)"),
+                       cl::init(false));
+
+static cl::opt<bool>
+MinifyNames("emscripten-minify-names",
+            cl::desc("Gives locals, and functions internal to the module, short names in order of how often they are used, instead of names derived from their LLVM names (so the JS needs no separate pass to minify them)"),
+            cl::init(false));
+
+static cl::opt<std::string>
+NameMapFile("emscripten-name-map",
+            cl::desc("With -emscripten-minify-names, writes each short name, and the name it replaces, to this file (for debugging)"),
+            cl::init(""));
+
+static cl::opt<bool>
+DedupeFunctions("emscripten-dedupe-functions",
+                cl::desc("Emits functions internal to the module only if no function with the same JS was emitted before, and calls that one instead (the output is kept in memory until all functions are printed, so that calls already printed can be redirected)"),
+                cl::init(false));
+
+static cl::opt<unsigned>
+OutlineSize("emscripten-outline-size",
+            cl::desc("Splits functions with more LLVM instructions than this, by moving regions of them into new functions, so that JS engines can compile and optimize them well (0 does not split)"),
+            cl::init(0));
+
+static cl::opt<std::string>
+BlockCountersFile("emscripten-block-counters",
+                  cl::desc("Counts how often each basic block runs, in a region of memory reserved after the static data, and writes to this file which function and block each counter belongs to (see utils/emscripten-block-counts.py, which makes a profile of the counts)"),
+                  cl::init(""));
+
+static cl::opt<std::string>
+ColdFunctionsFile("emscripten-cold-functions",
+                  cl::desc("Moves the functions listed in this file, by LLVM name, one per line, to a separate chunk of JS that is loaded when one of them is first called, and leaves stubs in the main output that call them through imports (see -emscripten-cold-chunk, and the --cold option of utils/emscripten-block-counts.py, which lists the functions that a profile never saw run)"),
+                  cl::init(""));
+
+static cl::opt<std::string>
+ColdChunkFile("emscripten-cold-chunk",
+              cl::desc("With -emscripten-cold-functions, writes the cold functions to this file"),
+              cl::init(""));
+
+static cl::opt<std::string>
+SourceMapFile("emscripten-source-map",
+              cl::desc("Writes a source map (version 3) of the JS to this file, made from the debug locations, instead of //@line comments in the JS (the lines and columns are those of the output of this backend, before emscripten adds its code around it)"),
+              cl::init(""));
+
+static cl::opt<bool>
+HeapIndexIVs("emscripten-heap-index-ivs",
+             cl::desc("Keeps pointer induction variables that are mostly used to access memory of one size as indexes into the heap array of that size, HEAP32[$p] with $p = $p + 1|0 instead of HEAP32[$p>>2] with $p = $p + 4|0, and shifts them back into addresses only where something else uses them (the output does not validate as asm.js, which needs HEAP32[x>>2])"),
+             cl::init(false));
+
+static cl::opt<bool>
+DivByConstant("emscripten-div-by-constant",
+              cl::desc("Emits 32-bit integer division and remainder by a constant as multiplies by a magic number and shifts (see TargetLowering::BuildSDIV), instead of as JS division, which engines that do not already do this run in floating point"),
+              cl::init(false));
+
+static cl::opt<std::string>
+MetadataFile("emscripten-metadata-file",
+             cl::desc("Writes the metadata for emscripten to this file, in a compact line-based form with a string table, instead of as JSON after the JS (so the driver does not need to scan the JS to find it)"),
+             cl::init(""));
+
 
 extern "C" void LLVMInitializeJSBackendTarget() {
   // Register the target.
@@ -127,10 +222,22 @@ namespace {
 
   /// JSWriter - This class is the main chunk of code that converts an LLVM
   /// module to JavaScript.
-  class JSWriter : public ModulePass {
+  // The writer emits one function at a time, so that it can run under a
+  // FunctionPassManager on a lazily materialized module: the module-level
+  // prologue is printed before the first function body, and everything that
+  // is accumulated while printing functions (function tables, declares, and
+  // so forth) is printed as metadata in doFinalization.
+  class JSWriter : public FunctionPass {
+    // With FinalizeFunctionTables, the output is kept in Buffer until the
+    // function tables are final, and then written to FinalOut with the masks.
+    formatted_raw_ostream &FinalOut;
+    std::string Buffer;
+    raw_string_ostream BufferStream;
+    formatted_raw_ostream BufferOut;
     formatted_raw_ostream &Out;
     const Module *TheModule;
     unsigned UniqueNum;
+    unsigned NumDivTemps; // used with DivByConstant
     unsigned NextFunctionIndex; // used with NoAliasingFunctionPointers
     ValueMap ValueNames;
     VarMap UsedVars;
@@ -141,42 +248,81 @@ namespace {
     GlobalAddressMap GlobalAddresses;
     NameSet Externals; // vars
     NameSet Declares; // funcs
+    SmallPtrSet<const Function*, 32> UsedDeclarations; // declared funcs used by emitted function bodies
     StringMap Redirects; // library function redirects actually used, needed for wrapper funcs in tables
     std::string PostSets;
     NameIntMap NamedGlobals; // globals that we export as metadata to JS, so it can access them by name
     std::map<std::string, unsigned> IndexedFunctions; // name -> index
+    NameSet PointedFunctions; // with MergeableOutput, functions whose pointers are left to the merge
+    std::map<const Function*, unsigned> FunctionOrdinals; // with MergeableOutput, position among implemented functions
     FunctionTableMap FunctionTables; // sig => list of functions
     std::vector<std::string> GlobalInitializers;
     std::vector<std::string> Exports; // additional exports
     BlockAddressMap BlockAddresses;
+    ValueMap MinifiedNames; // with MinifyNames, the functions internal to the module that get short names
+    unsigned NumLocalNames; // with MinifyNames, how many short names the locals of the current function use
+    raw_fd_ostream *NameMap; // with NameMapFile
+    SmallPtrSet<const Function*, 8> PinnedFunctions; // functions that the metadata refers to by name
+    struct PrintedFunction {
+      std::string Name;
+      size_t Begin, End; // in Buffer
+    };
+    std::map<size_t, std::vector<PrintedFunction> > PrintedFunctions; // with DedupeFunctions, hash of the JS => functions
+    StringMap DuplicateFunctions; // with DedupeFunctions, JS name of a function not emitted => JS name of the one called instead
+    unsigned NumBlockCounters; // with BlockCountersFile
+    unsigned BlockCountersBase; // with BlockCountersFile, the address of the first counter
+    std::string BlockCounterMap; // with BlockCountersFile, the records of the functions printed so far
+    NameSet ColdFunctionNames; // with ColdFunctionsFile, the LLVM names in it
+    std::vector<std::string> ColdFunctions; // JS names of the functions moved to the cold chunk
+    NameSet ColdImports; // JS names of the functions in the main output that the cold chunk calls
+    std::string ColdChunk; // the JS of the cold functions
+    bool PrintingColdFunction;
+    // With SourceMapFile, each #DL_n# in the output is replaced with nothing,
+    // and maps where it is to the source location n.
+    struct SourceLocation {
+      unsigned Source, Line, Column; // from 0
+    };
+    std::vector<SourceLocation> SourceLocations;
+    std::map<std::string, unsigned> SourceIndexes;
+    std::vector<std::string> Sources;
+    std::string SourceMappings; // VLQ, as in the source map
+    unsigned OutputLine, OutputColumn; // of the final output written so far
+    unsigned MappedLine; // of the last mapping
+    int LastMapping[4]; // output column, source, line and column of the last mapping, to which the next is relative
+    std::map<const Value*, unsigned> HeapIndexes; // with HeapIndexIVs, value kept as an index => log2 of the size of the heap array it indexes
 
     std::string CantValidate;
     bool UsesSIMD;
+    bool UsesTls; // whether the module needs a per-thread tlsBase global
     int InvokeState; // cycles between 0, 1 after preInvoke, 2 after call, 0 again after postInvoke. hackish, no argument there.
     CodeGenOpt::Level OptLevel;
     const DataLayout *DL;
     bool StackBumped;
+    bool ModuleStarted; // whether the prologue has been printed
 
     #include "CallHandlers.h"
 
   public:
     static char ID;
     JSWriter(formatted_raw_ostream &o, CodeGenOpt::Level OptLevel)
-      : ModulePass(ID), Out(o), UniqueNum(0), NextFunctionIndex(0), CantValidate(""), UsesSIMD(false), InvokeState(0),
-        OptLevel(OptLevel), StackBumped(false) {}
+      : FunctionPass(ID), FinalOut(o), BufferStream(Buffer), BufferOut(BufferStream),
+        Out((FinalizeFunctionTables || DedupeFunctions || !BlockCountersFile.empty() || !ColdFunctionsFile.empty() || !SourceMapFile.empty()) && !MergeableOutput ? BufferOut : o), UniqueNum(0), NumDivTemps(0), NextFunctionIndex(0), NumLocalNames(0), NameMap(NULL), NumBlockCounters(0), BlockCountersBase(0), PrintingColdFunction(false), OutputLine(0), OutputColumn(0), MappedLine(0), CantValidate(""), UsesSIMD(false), UsesTls(false), InvokeState(0),
+        OptLevel(OptLevel), StackBumped(false), ModuleStarted(false) {
+      memset(LastMapping, 0, sizeof(LastMapping));
+    }
 
     virtual const char *getPassName() const { return "JavaScript backend"; }
 
-    virtual bool runOnModule(Module &M);
+    virtual bool doInitialization(Module &M);
+    virtual bool runOnFunction(Function &F);
+    virtual bool doFinalization(Module &M);
 
     virtual void getAnalysisUsage(AnalysisUsage &AU) const {
       AU.setPreservesAll();
       AU.addRequired<DataLayoutPass>();
-      ModulePass::getAnalysisUsage(AU);
+      FunctionPass::getAnalysisUsage(AU);
     }
 
-    void printProgram(const std::string& fname, const std::string& modName );
-    void printModule(const std::string& fname, const std::string& modName );
     void printFunction(const Function *F);
 
     LLVM_ATTRIBUTE_NORETURN void error(const std::string& msg);
@@ -184,7 +330,7 @@ namespace {
     formatted_raw_ostream& nl(formatted_raw_ostream &Out, int delta = 0);
 
   private:
-    void printCommaSeparated(const HeapData v);
+    void printCommaSeparated(const HeapData &v);
 
     // parsing of constants has two phases: calculate, and then emit
     void parseConstant(const std::string& name, const Constant* CV, bool calculate);
@@ -277,9 +423,20 @@ namespace {
       for (FunctionType::param_iterator AI = F->param_begin(),
              AE = F->param_end(); AI != AE; ++AI) {
         Ret += getFunctionSignatureLetter(*AI);
+        // ExpandI64 only legalizes a function's signature when it reaches its
+        // body, so we may see an i64 param here, which will become two i32s
+        if ((*AI)->isIntegerTy(64)) Ret += 'i';
       }
       return Ret;
     }
+    bool hasI64(const FunctionType *F) {
+      if (F->getReturnType()->isIntegerTy(64)) return true;
+      for (FunctionType::param_iterator AI = F->param_begin(),
+             AE = F->param_end(); AI != AE; ++AI) {
+        if ((*AI)->isIntegerTy(64)) return true;
+      }
+      return false;
+    }
     FunctionTable& ensureFunctionTable(const FunctionType *FT) {
       FunctionTable &Table = FunctionTables[getFunctionSignature(FT)];
       unsigned MinSize = ReservedFunctionPointers ? 2*(ReservedFunctionPointers+1) : 1; // each reserved slot must be 2-aligned
@@ -312,6 +469,25 @@ namespace {
 
       return Index;
     }
+    // Returns a function pointer for use in a function body. With
+    // MergeableOutput, functions that were not already indexed by the
+    // prologue get a placeholder of the form #FI_sig_name#, which the merge
+    // replaces once it has seen the bodies of all threads, in module order.
+    std::string getFunctionPointer(const Function *F) {
+      if (!MergeableOutput) return utostr(getFunctionIndex(F));
+      const std::string &Name = getJSName(F);
+      if (IndexedFunctions.find(Name) != IndexedFunctions.end()) return utostr(IndexedFunctions[Name]);
+      std::string Sig = getFunctionSignature(F->getFunctionType(), &Name);
+      ensureFunctionTable(F->getFunctionType()); // so the merge sees the reserved slots
+      if (PointedFunctions.insert(Name).second) {
+        // as in getFunctionIndex, the function may only be indexed but never called directly
+        CallHandlerMap::const_iterator CH = CallHandlers.find(Name);
+        if (CH != CallHandlers.end()) {
+          (this->*(CH->second))(NULL, Name, -1);
+        }
+      }
+      return "#FI_" + Sig + "_" + Name + "#";
+    }
 
     unsigned getBlockAddress(const Function *F, const BasicBlock *BB) {
       BlockIndexMap& Blocks = BlockAddresses[F];
@@ -375,6 +551,22 @@ namespace {
       return false;
     }
 
+    // Test whether the JS expression for the given value is already of asm.js type
+    // float, so coercing it with Math_fround would be redundant. Every float
+    // instruction and argument is a local of type float (arguments are coerced
+    // on entry), while float constants are emitted as double literals.
+    bool isKnownFloat(const Value *V) {
+      return PreciseF32 && V->getType()->isFloatTy() && (isa<Instruction>(V) || isa<Argument>(V));
+    }
+
+    // If the given double is a float that was extended, returns that float
+    const Value *getExtendedFloat(const Value *V) {
+      if (const FPExtInst *FPE = dyn_cast<FPExtInst>(V)) {
+        if (FPE->getOperand(0)->getType()->isFloatTy()) return FPE->getOperand(0);
+      }
+      return NULL;
+    }
+
     void checkVectorType(Type *T) {
       VectorType *VT = cast<VectorType>(T);
       // LLVM represents the results of vector comparison as vectors of i1. We
@@ -416,7 +608,7 @@ namespace {
     }
 
     std::string getPtrLoad(const Value* Ptr);
-    std::string getHeapAccess(const std::string& Name, unsigned Bytes, bool Integer=true);
+    std::string getHeapAccess(const std::string& Name, unsigned Bytes, bool Integer=true, bool Indexed=false);
     std::string getPtrUse(const Value* Ptr);
     std::string getConstant(const Constant*, AsmCast sign=ASM_SIGNED);
     std::string getConstantVector(Type *ElementType, std::string x, std::string y, std::string z, std::string w);
@@ -428,6 +620,7 @@ namespace {
     const std::string &getJSName(const Value* val);
 
     std::string getPhiCode(const BasicBlock *From, const BasicBlock *To);
+    std::string getPhiValueStr(const PHINode *P, const Value *V);
 
     void printAttributes(const AttributeSet &PAL, const std::string &name);
     void printType(Type* Ty);
@@ -455,12 +648,20 @@ namespace {
     void generateShiftExpression(const BinaryOperator *I, raw_string_ostream& Code);
     void generateUnrolledExpression(const User *I, raw_string_ostream& Code);
     bool generateSIMDExpression(const User *I, raw_string_ostream& Code);
+    std::string getMulHighU(const std::string &N, uint32_t M, unsigned LeadingZeros, const std::string &Temp, std::string &Pre);
+    bool generateConstantDivExpression(const BinaryOperator *I, raw_string_ostream& Code);
     void generateExpression(const User *I, raw_string_ostream& Code);
 
     std::string getOpName(const Value*);
 
     void processConstants();
 
+    // heap indexes
+
+    bool isMultipleOfHeapSize(const Value *V, unsigned Shift);
+    void findHeapIndexes(const Function *F);
+    std::string getHeapIndexValue(const Instruction *I);
+
     // nativization
 
     typedef std::set<const Value*> NativizedVarsMap;
@@ -474,7 +675,38 @@ namespace {
 
     // main entry point
 
-    void printModuleBody();
+    void printModulePrologue();
+    void printModuleEpilogue();
+    void padFunctionTables();
+    void printFunctionTables();
+    void printBufferedOutput(StringRef Text, raw_ostream &OS);
+    void writeOutput(raw_ostream &OS, StringRef Text);
+    std::string getSourceMapMarker(const Instruction *I);
+    void addSourceMapping(unsigned Location);
+    void printSourceMap();
+    void dedupeFunction(const Function *F, size_t Begin);
+    bool isColdFunction(const Function *F);
+    void printColdFunction(const Function *F);
+    void printColdChunk();
+    void printMergeableMetadata();
+    void printMetadataFile();
+    void printBlockCounterMap(unsigned Base);
+    bool isDeclared(const Function *F);
+    void noteUsedDeclarations(const Function *F);
+
+    // short names, with MinifyNames
+    typedef DenseMap<const Value*, unsigned> UseCountMap;
+    void collectPinnedFunctions();
+    bool hasFixedName(const Function *F);
+    void minifyGlobalNames();
+    void minifyLocalNames(const Function *F);
+    void countLocalUses(const Value *V, unsigned Count, UseCountMap &Uses, std::vector<const Value*> &Locals);
+
+    // A function whose body has not been read yet, or has been dropped after
+    // we emitted it, looks like a declaration, but is not external.
+    bool isExternalFunction(const Function *F) {
+      return F->isDeclaration() && !F->isMaterializable();
+    }
   };
 } // end anonymous namespace.
 
@@ -551,6 +783,21 @@ static inline void sanitizeLocal(std::string& str) {
   }
 }
 
+// Returns the Index-th of the names made of the characters that JS allows
+// after the first one of an identifier, shortest first. Each name must get a
+// prefix that may start an identifier.
+static std::string getShortName(unsigned Index) {
+  static const char Chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+  const unsigned NumChars = sizeof(Chars) - 1;
+  std::string Name;
+  while (1) {
+    Name += Chars[Index % NumChars];
+    if (Index < NumChars) break;
+    Index = Index / NumChars - 1;
+  }
+  return Name;
+}
+
 static inline std::string ensureFloat(const std::string &S, Type *T) {
   if (PreciseF32 && T->isFloatTy()) {
     return "Math_fround(" + S + ")";
@@ -585,6 +832,7 @@ std::string JSWriter::getPhiCode(const BasicBlock *From, const BasicBlock *To) {
   typedef std::map<std::string, std::string> StringMap;
   StringMap assigns; // variable -> assign statement
   std::map<std::string, const Value*> values; // variable -> Value
+  StringMap valueStrs; // variable -> Value as JS
   StringMap deps; // variable -> dependency
   StringMap undeps; // reverse: dependency -> variable
   for (BasicBlock::const_iterator I = To->begin(), E = To->end();
@@ -601,8 +849,9 @@ std::string JSWriter::getPhiCode(const BasicBlock *From, const BasicBlock *To) {
     // thing so that we can detect any resulting dependencies.
     const Value *V = P->getIncomingValue(index)->stripPointerCasts();
     values[name] = V;
-    std::string vname = getValueAsStr(V);
+    valueStrs[name] = getPhiValueStr(P, V);
     if (const Instruction *VI = dyn_cast<const Instruction>(V)) {
+      std::string vname = getJSName(VI);
       if (VI->getParent() == To && PhiVars.find(vname) != PhiVars.end()) {
         deps[name] = vname;
         undeps[vname] = name;
@@ -617,7 +866,7 @@ std::string JSWriter::getPhiCode(const BasicBlock *From, const BasicBlock *To) {
       StringMap::iterator last = I;
       std::string curr = last->first;
       const Value *V = values[curr];
-      std::string CV = getValueAsStr(V);
+      std::string CV = valueStrs[curr];
       I++; // advance now, as we may erase
       // if we have no dependencies, or we found none to emit and are at the end (so there is a cycle), emit
       StringMap::const_iterator dep = deps.find(curr);
@@ -640,6 +889,20 @@ std::string JSWriter::getPhiCode(const BasicBlock *From, const BasicBlock *To) {
   return pre + post;
 }
 
+// A heap index (see findHeapIndexes) only flows into phis that are heap
+// indexes too, which take it as it is; any other value flowing into one of
+// those is an address, and is made an index.
+std::string JSWriter::getPhiValueStr(const PHINode *P, const Value *V) {
+  std::map<const Value*, unsigned>::const_iterator I = HeapIndexes.find(P);
+  if (I == HeapIndexes.end()) {
+    return getValueAsStr(V);
+  } else if (HeapIndexes.count(V)) {
+    return getJSName(V);
+  } else {
+    return "(" + getValueAsStr(V) + ">>" + utostr(I->second) + ")";
+  }
+}
+
 const std::string &JSWriter::getJSName(const Value* val) {
   ValueMap::const_iterator I = ValueNames.find(val);
   if (I != ValueNames.end() && I->first == val)
@@ -655,6 +918,17 @@ const std::string &JSWriter::getJSName(const Value* val) {
     }
   }
 
+  if (MinifyNames) {
+    if (!isa<Constant>(val)) {
+      // A local that minifyLocalNames did not expect to be named
+      return ValueNames[val] = "$" + getShortName(NumLocalNames++);
+    }
+    ValueMap::const_iterator MI = MinifiedNames.find(val);
+    if (MI != MinifiedNames.end()) {
+      return ValueNames[val] = MI->second;
+    }
+  }
+
   std::string name;
   if (val->hasName()) {
     name = val->getName().str();
@@ -971,7 +1245,16 @@ std::string JSWriter::getPtrLoad(const Value* Ptr) {
   return getCast(getPtrUse(Ptr), t, ASM_NONSPECIFIC);
 }
 
-std::string JSWriter::getHeapAccess(const std::string& Name, unsigned Bytes, bool Integer) {
+std::string JSWriter::getHeapAccess(const std::string& Name, unsigned Bytes, bool Integer, bool Indexed) {
+  if (Indexed) {
+    // Name is already an index into the array, see findHeapIndexes
+    switch (Bytes) {
+    default: llvm_unreachable("Unsupported type");
+    case 8: return "HEAPF64[" + Name + "]";
+    case 4: return (Integer ? "HEAP32[" : "HEAPF32[") + Name + "]";
+    case 2: return "HEAP16[" + Name + "]";
+    }
+  }
   switch (Bytes) {
   default: llvm_unreachable("Unsupported type");
   case 8: return "HEAPF64[" + Name + ">>3]";
@@ -1008,6 +1291,10 @@ std::string JSWriter::getPtrUse(const Value* Ptr) {
     case 1: return "HEAP8[" + utostr(Addr) + "]";
     }
   } else {
+    std::map<const Value*, unsigned>::const_iterator I = HeapIndexes.find(Ptr->stripPointerCasts());
+    if (I != HeapIndexes.end() && Bytes == (1U << I->second)) {
+      return getHeapAccess(getJSName(I->first), Bytes, t->isIntegerTy() || t->isPointerTy(), true);
+    }
     return getHeapAccess(getValueAsStr(Ptr), Bytes, t->isIntegerTy() || t->isPointerTy());
   }
 }
@@ -1016,7 +1303,7 @@ std::string JSWriter::getConstant(const Constant* CV, AsmCast sign) {
   if (isa<ConstantPointerNull>(CV)) return "0";
 
   if (const Function *F = dyn_cast<Function>(CV)) {
-    return utostr(getFunctionIndex(F));
+    return getFunctionPointer(F);
   }
 
   if (const GlobalValue *GV = dyn_cast<GlobalValue>(CV)) {
@@ -1034,11 +1321,11 @@ std::string JSWriter::getConstant(const Constant* CV, AsmCast sign) {
   }
 
   if (const ConstantFP *CFP = dyn_cast<ConstantFP>(CV)) {
-    std::string S = ftostr(CFP, sign);
     if (PreciseF32 && CV->getType()->isFloatTy() && !(sign & ASM_FFI_OUT)) {
-      S = "Math_fround(" + S + ")";
+      // We coerce here, so ftostr does not need to
+      return "Math_fround(" + ftostr(CFP, sign & ~ASM_MUST_CAST) + ")";
     }
-    return S;
+    return ftostr(CFP, sign);
   } else if (const ConstantInt *CI = dyn_cast<ConstantInt>(CV)) {
     if (sign != ASM_UNSIGNED && CI->getValue().getBitWidth() == 1) {
       sign = ASM_UNSIGNED; // bools must always be unsigned: either 0 or 1
@@ -1119,6 +1406,8 @@ std::string JSWriter::getConstantVector(Type *ElementType, std::string x, std::s
   if (x == y && x == z && x == w) {
     if (ElementType->isIntegerTy()) {
       return "SIMD_int32x4_splat(" + x + ')';
+    } else if (PreciseF32) {
+      return "SIMD_float32x4_splat(" + x + ')'; // getConstant already coerced it
     } else {
       return "SIMD_float32x4_splat(Math_fround(" + x + "))";
     }
@@ -1126,6 +1415,8 @@ std::string JSWriter::getConstantVector(Type *ElementType, std::string x, std::s
 
   if (ElementType->isIntegerTy()) {
     return "SIMD_int32x4(" + x + ',' + y + ',' + z + ',' + w + ')';
+  } else if (PreciseF32) {
+    return "SIMD_float32x4(" + x + ',' + y + ',' + z + ',' + w + ')';
   } else {
     return "SIMD_float32x4(Math_fround(" + x + "),Math_fround(" + y + "),Math_fround(" + z + "),Math_fround(" + w + "))";
   }
@@ -1138,6 +1429,11 @@ std::string JSWriter::getValueAsStr(const Value* V, AsmCast sign) {
   if (const Constant *CV = dyn_cast<Constant>(V)) {
     return getConstant(CV, sign);
   } else {
+    std::map<const Value*, unsigned>::const_iterator I = HeapIndexes.find(V);
+    if (I != HeapIndexes.end()) {
+      // an index, used as an address
+      return "(" + getJSName(V) + "<<" + utostr(I->second) + ")";
+    }
     return getJSName(V);
   }
 }
@@ -1148,6 +1444,8 @@ std::string JSWriter::getValueAsCastStr(const Value* V, AsmCast sign) {
 
   if (isa<ConstantInt>(V) || isa<ConstantFP>(V)) {
     return getConstant(cast<Constant>(V), sign);
+  } else if (isKnownFloat(V) && !(sign & (ASM_FFI_OUT | ASM_MUST_CAST))) {
+    return getValueAsStr(V);
   } else {
     return getCast(getValueAsStr(V), V->getType(), sign);
   }
@@ -1170,6 +1468,8 @@ std::string JSWriter::getValueAsCastParenStr(const Value* V, AsmCast sign) {
 
   if (isa<ConstantInt>(V) || isa<ConstantFP>(V) || isa<UndefValue>(V)) {
     return getConstant(cast<Constant>(V), sign);
+  } else if (isKnownFloat(V) && !(sign & (ASM_FFI_OUT | ASM_MUST_CAST))) {
+    return "(" + getValueAsStr(V) + ")";
   } else {
     return "(" + getCast(getValueAsStr(V), V->getType(), sign) + ")";
   }
@@ -1722,9 +2022,15 @@ bool JSWriter::generateSIMDExpression(const User *I, raw_string_ostream& Code) {
       checkVectorType(VT);
       const StoreInst *SI = cast<StoreInst>(I);
       const Value *P = SI->getPointerOperand();
-      std::string PS = getOpName(P);
+      std::string PS;
       std::string VS = getValueAsStr(SI->getValueOperand());
-      Code << getAdHocAssign(PS, P->getType()) << getValueAsStr(P) << ';';
+      if (HeapIndexes.count(P->stripPointerCasts())) {
+        // the address of an index, which must not overwrite it
+        PS = getValueAsStr(P);
+      } else {
+        PS = getOpName(P);
+        Code << getAdHocAssign(PS, P->getType()) << getValueAsStr(P) << ';';
+      }
 
       // Determine if this is a partial store.
       static const std::string partialAccess[4] = { "X", "XY", "XYZ", "" };
@@ -1752,6 +2058,109 @@ static uint64_t LSBMask(unsigned numBits) {
   return numBits >= 64 ? 0xFFFFFFFFFFFFFFFFULL : (1ULL << numBits) - 1;
 }
 
+// The high 32 bits of the unsigned 64-bit product of N and M, where N is a
+// variable with LeadingZeros known leading zero bits. JS has no such
+// multiply, so it is built from the products of 16-bit halves, which are
+// exact. Statements that compute parts of it into temporaries named after
+// Temp are appended to Pre; the returned expression needs a cast.
+std::string JSWriter::getMulHighU(const std::string &N, uint32_t M, unsigned LeadingZeros, const std::string &Temp, std::string &Pre) {
+  std::string M0 = utostr(M & 0xffff), M1 = utostr(M >> 16);
+  std::string T = Temp + "$t";
+  Type *i32 = Type::getInt32Ty(TheModule->getContext());
+  if (LeadingZeros >= 16) {
+    // N is a single half
+    Pre += getAdHocAssign(T, i32) + "(" + N + "*" + M0 + ")>>>16;";
+    return "((((" + N + "*" + M1 + ")|0) + " + T + ")>>>16)";
+  }
+  std::string Lo = Temp + "$lo", Hi = Temp + "$hi", W = Temp + "$w";
+  Pre += getAdHocAssign(Lo, i32) + N + " & 65535;";
+  Pre += getAdHocAssign(Hi, i32) + N + " >>> 16;";
+  Pre += getAdHocAssign(T, i32) + "((" + Hi + "*" + M0 + ")|0) + ((" + Lo + "*" + M0 + ")>>>16)|0;";
+  Pre += getAdHocAssign(W, i32) + "((" + Lo + "*" + M1 + ")|0) + (" + T + " & 65535)|0;";
+  return "((" + Hi + "*" + M1 + ")|0) + (" + T + ">>>16) + (" + W + ">>>16)";
+}
+
+// With DivByConstant, emits a 32-bit division or remainder by a constant as
+// TargetLowering::BuildSDIV and BuildUDIV would, using getMulHighU. Returns
+// false for divisors those leave to other lowerings, such as powers of 2,
+// which LLVM turns into shifts itself where it can.
+bool JSWriter::generateConstantDivExpression(const BinaryOperator *I, raw_string_ostream& Code) {
+  unsigned Opcode = I->getOpcode();
+  if (!DivByConstant || I->use_empty() || !I->getType()->isIntegerTy(32)) return false;
+  if (Opcode != Instruction::SDiv && Opcode != Instruction::UDiv &&
+      Opcode != Instruction::SRem && Opcode != Instruction::URem) return false;
+  const ConstantInt *CI = dyn_cast<ConstantInt>(I->getOperand(1));
+  const Value *Dividend = I->getOperand(0)->stripPointerCasts();
+  if (!CI || isa<Constant>(Dividend)) return false;
+  const APInt &Divisor = CI->getValue();
+  bool Signed = Opcode == Instruction::SDiv || Opcode == Instruction::SRem;
+  if (Divisor == 0 || Divisor.isPowerOf2() || (Signed && (Divisor.isAllOnesValue() || Divisor.abs().isPowerOf2()))) {
+    return false;
+  }
+
+  APInt KnownZero(32, 0), KnownOne(32, 0);
+  computeKnownBits(const_cast<Value*>(Dividend), KnownZero, KnownOne, DL);
+  unsigned LeadingZeros = std::min(KnownZero.countLeadingOnes(), 31U);
+
+  Type *i32 = I->getType();
+  // Temporaries are not named after I, as local names start with "$" and
+  // may themselves look like I's name with a suffix.
+  std::string Name = "div" + utostr(NumDivTemps++);
+  std::string Pre;
+  std::string N = getValueAsStr(Dividend);
+  if (HeapIndexes.count(Dividend)) {
+    // not a plain variable
+    Pre += getAdHocAssign(Name + "$n", i32) + N + ";";
+    N = Name + "$n";
+  }
+  std::string Q = Name + "$q";
+  if (Signed) {
+    APInt::ms Magics = Divisor.magic();
+    uint32_t M = Magics.m.getZExtValue();
+    std::string Sum = getMulHighU(N, M, LeadingZeros, Name, Pre);
+    // The signed high part is the unsigned one, less M if N is negative, and
+    // less N if M is.
+    if (LeadingZeros == 0) Sum += " - (" + N + ">>31 & " + itostr((int32_t)M) + ")";
+    int NFactor = Magics.m.isNegative() ? -1 : 0;
+    if (Divisor.isStrictlyPositive() && Magics.m.isNegative()) NFactor++;
+    if (Divisor.isNegative() && Magics.m.isStrictlyPositive()) NFactor--;
+    if (NFactor > 0) Sum += " + " + N;
+    else if (NFactor < 0) Sum += " - " + N;
+    Pre += getAdHocAssign(Q, i32) + "(" + Sum + ")|0;";
+    if (Magics.s > 0) Pre += Q + " = " + Q + " >> " + utostr(Magics.s) + ";";
+    Pre += Q + " = " + Q + " + (" + Q + ">>>31)|0;";
+  } else {
+    APInt::mu Magics = Divisor.magicu(LeadingZeros);
+    std::string Shifted = N;
+    if (Magics.a != 0 && !Divisor[0]) {
+      // the divisor is even, so shift N first, which usually avoids the fixup
+      unsigned Shift = Divisor.countTrailingZeros();
+      Shifted = Name + "$s";
+      Pre += getAdHocAssign(Shifted, i32) + N + " >>> " + utostr(Shift) + ";";
+      Magics = Divisor.lshr(Shift).magicu(std::min(LeadingZeros + Shift, 31U));
+      LeadingZeros += Shift;
+    }
+    uint32_t M = Magics.m.getZExtValue();
+    Pre += getAdHocAssign(Q, i32) + "(" + getMulHighU(Shifted, M, LeadingZeros, Name, Pre) + ")|0;";
+    if (Magics.a == 0) {
+      if (Magics.s > 0) Pre += Q + " = " + Q + " >>> " + utostr(Magics.s) + ";";
+    } else {
+      Pre += Q + " = ((((" + Shifted + " - " + Q + ")>>>1) + " + Q + ")>>>" + utostr(Magics.s - 1) + ")|0;";
+    }
+  }
+
+  Code << Pre << getAssign(I);
+  if (Opcode == Instruction::SDiv || Opcode == Instruction::UDiv) {
+    Code << Q;
+  } else {
+    // N - Q * Divisor; Q is less than 2^32, so small divisors need no imul
+    uint32_t D = Divisor.getZExtValue();
+    std::string Product = Divisor.abs().ult(1 << 20) ? "(" + Q + "*" + itostr((int32_t)D) + ")|0" : "Math_imul(" + Q + ", " + itostr((int32_t)D) + ")|0";
+    Code << "(" << N << " - (" << Product << "))|0";
+  }
+  return true;
+}
+
 // Generate code for and operator, either an Instruction or a ConstantExpr.
 void JSWriter::generateExpression(const User *I, raw_string_ostream& Code) {
   // To avoid emiting code and variables for the no-op pointer bitcasts
@@ -1766,7 +2175,9 @@ void JSWriter::generateExpression(const User *I, raw_string_ostream& Code) {
     report_fatal_error("legalization problem");
   }
 
-  if (!generateSIMDExpression(I, Code)) switch (Operator::getOpcode(I)) {
+  if (HeapIndexes.count(I) && !isa<PHINode>(I)) {
+    Code << getAssignIfNeeded(I) << getHeapIndexValue(cast<Instruction>(I));
+  } else if (!generateSIMDExpression(I, Code)) switch (Operator::getOpcode(I)) {
   default: {
     I->dump();
     error("Invalid instruction");
@@ -1810,6 +2221,9 @@ void JSWriter::generateExpression(const User *I, raw_string_ostream& Code) {
   case Instruction::Shl:
   case Instruction::LShr:
   case Instruction::AShr:{
+    if (const BinaryOperator *BO = dyn_cast<BinaryOperator>(I)) {
+      if (generateConstantDivExpression(BO, Code)) break;
+    }
     Code << getAssignIfNeeded(I);
     unsigned opcode = Operator::getOpcode(I);
     switch (opcode) {
@@ -2015,7 +2429,14 @@ void JSWriter::generateExpression(const User *I, raw_string_ostream& Code) {
     const Value *P = SI->getPointerOperand();
     const Value *V = SI->getValueOperand();
     unsigned Alignment = SI->getAlignment();
-    std::string VS = getValueAsStr(V);
+    std::string VS;
+    if (isa<ConstantFP>(V) && !NativizedVars.count(P)) {
+      // A float heap store rounds by itself, so a double literal is valid and has
+      // the same result as a coerced one
+      VS = getValueAsStr(V, ASM_FFI_OUT);
+    } else {
+      VS = getValueAsStr(V);
+    }
     if (NativizedVars.count(P)) {
       Code << getValueAsStr(P) << " = " << VS;
     } else {
@@ -2105,6 +2526,13 @@ void JSWriter::generateExpression(const User *I, raw_string_ostream& Code) {
       break;
     }
     case Instruction::FPTrunc: {
+      // Truncating a float we extended gives us back that float, no need to round
+      if (const Value *Float = getExtendedFloat(I->getOperand(0))) {
+        if (I->getType()->isFloatTy()) {
+          Code << getValueAsStr(Float);
+          break;
+        }
+      }
       Code << ensureFloat(getValueAsStr(I->getOperand(0)), I->getType());
       break;
     }
@@ -2178,8 +2606,8 @@ void JSWriter::generateExpression(const User *I, raw_string_ostream& Code) {
 
   if (const Instruction *Inst = dyn_cast<Instruction>(I)) {
     Code << ';';
-    // append debug info
-    emitDebugInfo(Code, Inst);
+    // append debug info, unless it goes to the source map
+    if (SourceMapFile.empty()) emitDebugInfo(Code, Inst);
     Code << '\n';
   }
 }
@@ -2209,10 +2637,28 @@ void JSWriter::addBlock(const BasicBlock *BB, Relooper& R, LLVMToRelooperMap& LL
   for (BasicBlock::const_iterator I = BB->begin(), E = BB->end();
        I != E; ++I) {
     if (I->stripPointerCasts() == I) {
-      generateExpression(I, CodeStream);
+      if (!SourceMapFile.empty() && I->getMetadata("dbg")) {
+        // the marker goes before the statement, unless there is none
+        CodeStream.flush();
+        size_t Start = Code.size();
+        CodeStream << getSourceMapMarker(I);
+        CodeStream.flush();
+        size_t End = Code.size();
+        generateExpression(I, CodeStream);
+        CodeStream.flush();
+        if (Code.size() == End) Code.resize(Start);
+      } else {
+        generateExpression(I, CodeStream);
+      }
     }
   }
   CodeStream.flush();
+  if (!BlockCountersFile.empty()) {
+    // the address is known once the static data is laid out; see printBufferedOutput
+    std::string Counter = "#BC_" + utostr(NumBlockCounters++) + "#";
+    Code = "HEAP32[" + Counter + ">>2] = (HEAP32[" + Counter + ">>2]|0) + 1|0;\n" + Code;
+    BlockCounterMap += "block " + (BB->hasName() ? BB->getName().str() : "-") + "\n";
+  }
   const Value* Condition = considerConditionVar(BB->getTerminator());
   Block *Curr = new Block(Code.c_str(), Condition ? getValueAsCastStr(Condition).c_str() : NULL);
   LLVMToRelooper[BB] = Curr;
@@ -2230,10 +2676,16 @@ void JSWriter::printFunctionBody(const Function *F) {
       F->getAttributes().hasAttribute(AttributeSet::FunctionIndex, Attribute::OptimizeForSize)) {
     R.SetMinSize(true);
   }
+  R.SetEmulateIrreducible(EmulateIrreducible);
+  R.SetSplitIrreducible(SplitIrreducible);
   R.SetAsmJSMode(1);
   Block *Entry = NULL;
   LLVMToRelooperMap LLVMToRelooper;
 
+  if (!BlockCountersFile.empty()) {
+    BlockCounterMap += "function " + F->getName().str() + " " + getJSName(F) + " " + utostr(NumBlockCounters) + " " + utostr(F->size()) + "\n";
+  }
+
   // Create relooper blocks with their contents. TODO: We could optimize
   // indirectbr by emitting indexed blocks first, so their indexes
   // match up with the label index.
@@ -2327,6 +2779,9 @@ void JSWriter::printFunctionBody(const Function *F) {
   // Calculate relooping and print
   R.Calculate(Entry);
   R.Render();
+  if (RelooperLabelStats) {
+    errs() << "relooper: removed " << R.GetRemovedLabelOps() << " label operations in " << getJSName(F) << "\n";
+  }
 
   // Emit local variables
   UsedVars["sp"] = Type::getInt32Ty(F->getContext());
@@ -2437,6 +2892,7 @@ void JSWriter::printFunction(const Function *F) {
 
   UsedVars.clear();
   UniqueNum = 0;
+  NumDivTemps = 0;
 
   // When optimizing, the regular optimizer (mem2reg, SROA, GVN, and others)
   // will have already taken all the opportunities for nativization.
@@ -2446,11 +2902,13 @@ void JSWriter::printFunction(const Function *F) {
   // Do alloca coloring at -O1 and higher.
   Allocas.analyze(*F, *DL, OptLevel != CodeGenOpt::None);
 
+  if (MinifyNames) minifyLocalNames(F);
+
+  findHeapIndexes(F);
+
   // Emit the function
 
-  std::string Name = F->getName();
-  sanitizeGlobal(Name);
-  Out << "function " << Name << "(";
+  Out << "function " << getJSName(F) << "(";
   for (Function::const_arg_iterator AI = F->arg_begin(), AE = F->arg_end();
        AI != AE; ++AI) {
     if (AI != F->arg_begin()) Out << ",";
@@ -2472,23 +2930,234 @@ void JSWriter::printFunction(const Function *F) {
   StackBumped = false;
 }
 
-void JSWriter::printModuleBody() {
+void JSWriter::printModulePrologue() {
+  ModuleStarted = true;
+
+  if (MinifyNames || DedupeFunctions) collectPinnedFunctions();
+  if (MinifyNames) minifyGlobalNames();
+
   processConstants();
 
-  // Emit function bodies.
+  if (MergeableOutput) {
+    unsigned Ordinal = 0;
+    for (Module::const_iterator I = TheModule->begin(), E = TheModule->end();
+         I != E; ++I) {
+      if (!isExternalFunction(I)) FunctionOrdinals[I] = Ordinal++;
+    }
+  }
+
+  // Function bodies follow, one per runOnFunction.
   nl(Out) << "// EMSCRIPTEN_START_FUNCTIONS"; nl(Out);
-  for (Module::const_iterator I = TheModule->begin(), E = TheModule->end();
-       I != E; ++I) {
-    if (!I->isDeclaration()) printFunction(I);
+}
+
+void JSWriter::noteUsedDeclarations(const Function *F) {
+  // Uses from the body go away if it is dematerialized, so remember which
+  // declarations it needs for the declares metadata.
+  for (const_inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
+    for (User::const_op_iterator OI = I->op_begin(), OE = I->op_end(); OI != OE; ++OI) {
+      const Function *Callee = dyn_cast<Function>((*OI)->stripPointerCasts());
+      if (Callee && isExternalFunction(Callee)) UsedDeclarations.insert(Callee);
+    }
+  }
+}
+
+// Adds the functions that C refers to, perhaps through other constants, to
+// Functions.
+static void collectReferencedFunctions(const Constant *C, SmallPtrSet<const Function*, 8> &Functions) {
+  if (const Function *F = dyn_cast<Function>(C)) {
+    Functions.insert(F);
+    return;
+  }
+  if (isa<GlobalValue>(C)) return;
+  for (User::const_op_iterator OI = C->op_begin(), OE = C->op_end(); OI != OE; ++OI) {
+    collectReferencedFunctions(cast<Constant>(*OI), Functions);
+  }
+}
+
+namespace {
+  struct MoreUsedFunction {
+    bool operator()(const Function *A, const Function *B) const {
+      return A->getNumUses() > B->getNumUses();
+    }
+  };
+
+  struct MoreUsedLocal {
+    const DenseMap<const Value*, unsigned> &Uses;
+    MoreUsedLocal(const DenseMap<const Value*, unsigned> &Uses) : Uses(Uses) {}
+    bool operator()(const Value *A, const Value *B) const {
+      return Uses.lookup(A) > Uses.lookup(B);
+    }
+  };
+}
+
+// Gives the functions that are internal to the module short names, prefixed
+// with "_$", which sanitizeGlobal never produces. Functions that the metadata
+// refers to by name (exports and global initializers), and functions with a
+// call handler, keep their names. The most used functions get the shortest
+// names when all their uses are known; when bodies are materialized lazily,
+// or the threads of MergeableOutput must agree on the names, the functions
+// are named in module order instead.
+void JSWriter::collectPinnedFunctions() {
+  const char *const PinningGlobals[] = { "llvm.used", "__init_array_start", "__fini_array_start" };
+  for (unsigned i = 0; i < array_lengthof(PinningGlobals); i++) {
+    const GlobalVariable *GV = TheModule->getNamedGlobal(PinningGlobals[i]);
+    if (GV && GV->hasInitializer()) collectReferencedFunctions(GV->getInitializer(), PinnedFunctions);
+  }
+}
+
+// Whether F must keep its name: it is visible outside the module, the
+// metadata refers to it, or calls to it are handled by name.
+bool JSWriter::hasFixedName(const Function *F) {
+  if (!F->hasLocalLinkage() || PinnedFunctions.count(F)) return true;
+  std::string Name = F->getName();
+  sanitizeGlobal(Name);
+  return CallHandlers.find(Name) != CallHandlers.end();
+}
+
+void JSWriter::minifyGlobalNames() {
+  std::vector<const Function*> Functions;
+  bool UsesKnown = !MergeableOutput;
+  for (Module::const_iterator I = TheModule->begin(), E = TheModule->end(); I != E; ++I) {
+    if (I->isMaterializable()) UsesKnown = false;
+    if (!hasFixedName(I)) Functions.push_back(I);
+  }
+  if (UsesKnown) {
+    std::stable_sort(Functions.begin(), Functions.end(), MoreUsedFunction());
+  }
+
+  for (unsigned i = 0; i < Functions.size(); i++) {
+    std::string &Name = MinifiedNames[Functions[i]] = "_$" + getShortName(i);
+    if (NameMap) {
+      std::string Original = Functions[i]->getName();
+      sanitizeGlobal(Original);
+      *NameMap << "function " << Name << " " << Original << "\n";
+    }
+  }
+}
+
+void JSWriter::countLocalUses(const Value *V, unsigned Count, UseCountMap &Uses, std::vector<const Value*> &Locals) {
+  // A static alloca may share the name of the alloca that represents it.
+  if (const AllocaInst *AI = dyn_cast<AllocaInst>(V)) {
+    if (AI->isStaticAlloca()) V = Allocas.getRepresentative(AI);
   }
+  unsigned &Num = Uses[V];
+  if (Num == 0) Locals.push_back(V);
+  Num += Count;
+}
+
+// Gives the locals of F short names, prefixed with "$" like the names of
+// sanitizeLocal, the shortest to the most used. Uses are counted the way
+// printFunctionBody emits them: each parameter appears in the parameter list
+// and in its coercion, and each other local is assigned once and declared
+// once, where pointer casts that are skipped in expressions do not count.
+void JSWriter::minifyLocalNames(const Function *F) {
+  UseCountMap Uses;
+  std::vector<const Value*> Locals; // in order of appearance
+  for (Function::const_arg_iterator AI = F->arg_begin(), AE = F->arg_end();
+       AI != AE; ++AI) {
+    countLocalUses(AI, 3, Uses, Locals);
+  }
+  for (const_inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
+    if (I->stripPointerCasts() != &*I) continue;
+    if (!I->use_empty()) countLocalUses(&*I, 2, Uses, Locals);
+    for (User::const_op_iterator OI = I->op_begin(), OE = I->op_end(); OI != OE; ++OI) {
+      const Value *V = (*OI)->stripPointerCasts();
+      if (isa<Instruction>(V) || isa<Argument>(V)) countLocalUses(V, 1, Uses, Locals);
+    }
+  }
+  std::stable_sort(Locals.begin(), Locals.end(), MoreUsedLocal(Uses));
+
+  unsigned NumUnnamed = 0;
+  for (unsigned i = 0; i < Locals.size(); i++) {
+    const std::string &Name = ValueNames[Locals[i]] = "$" + getShortName(i);
+    if (NameMap) {
+      std::string Original = Locals[i]->hasName() ? Locals[i]->getName().str() : utostr(NumUnnamed++);
+      sanitizeLocal(Original);
+      *NameMap << "local " << getJSName(F) << " " << Name << " " << Original << "\n";
+    }
+  }
+  NumLocalNames = Locals.size();
+}
+
+// Whether V is used by a global's initializer, perhaps through constants.
+static bool isUsedByGlobals(const Value *V) {
+  for (Value::const_user_iterator UI = V->user_begin(), UE = V->user_end(); UI != UE; ++UI) {
+    if (isa<Instruction>(*UI)) continue;
+    if (isa<GlobalValue>(*UI) || isUsedByGlobals(*UI)) return true;
+  }
+  return false;
+}
+
+bool JSWriter::isDeclared(const Function *F) {
+  if (!isExternalFunction(F)) return false;
+  // With MergeableOutput, the functions that other threads print may be left
+  // here in any state, so only uses from our own bodies and globals count.
+  if (MergeableOutput ? !UsedDeclarations.count(F) && !isUsedByGlobals(F)
+                      : F->use_empty() && !UsedDeclarations.count(F))
+    return false;
+  // Ignore intrinsics that are always no-ops or expanded into other code
+  // which doesn't require the intrinsic function itself to be declared.
+  if (F->isIntrinsic()) {
+    switch (F->getIntrinsicID()) {
+    case Intrinsic::dbg_declare:
+    case Intrinsic::dbg_value:
+    case Intrinsic::lifetime_start:
+    case Intrinsic::lifetime_end:
+    case Intrinsic::invariant_start:
+    case Intrinsic::invariant_end:
+    case Intrinsic::prefetch:
+    case Intrinsic::memcpy:
+    case Intrinsic::memset:
+    case Intrinsic::memmove:
+    case Intrinsic::expect:
+    case Intrinsic::flt_rounds:
+    case Intrinsic::nacl_read_tp:
+      return false;
+    }
+  }
+  // Implemented inline by its call handler.
+  if (F->getName() == "emscripten_set_tls_base" ||
+      F->getName() == "emscripten_set_stack_limits") return false;
+  return true;
+}
+
+void JSWriter::printModuleEpilogue() {
   Out << "function runPostSets() {\n";
   Out << " " << PostSets << "\n";
   Out << "}\n";
   PostSets = "";
   Out << "// EMSCRIPTEN_END_FUNCTIONS\n\n";
 
+  // tables refer to the functions of duplicates that were not emitted
+  if (!DuplicateFunctions.empty()) {
+    for (FunctionTableMap::iterator I = FunctionTables.begin(), E = FunctionTables.end(); I != E; ++I) {
+      FunctionTable &Table = I->second;
+      for (unsigned i = 0; i < Table.size(); i++) {
+        StringMap::const_iterator Kept = DuplicateFunctions.find(Table[i]);
+        if (Kept != DuplicateFunctions.end()) Table[i] = Kept->second;
+      }
+    }
+  }
+
+  if (FinalizeFunctionTables && !MergeableOutput) printFunctionTables();
+
+  // the cold chunk calls these through the exports of the main module
+  for (NameSet::const_iterator I = ColdImports.begin(), E = ColdImports.end(); I != E; ++I) {
+    if (std::find(Exports.begin(), Exports.end(), *I) == Exports.end()) Exports.push_back(*I);
+  }
+
   assert(GlobalData32.size() == 0 && GlobalData8.size() == 0); // FIXME when we use optimal constant alignments
 
+  // The block counters are zeros after the static data, so the memory
+  // initializer reserves them, and the runtime finds them by name.
+  if (!BlockCountersFile.empty()) {
+    while (GlobalData64.size() % 8 != 0) GlobalData64.push_back(0);
+    BlockCountersBase = GlobalBase + GlobalData64.size();
+    GlobalData64.resize(GlobalData64.size() + 4*NumBlockCounters, 0);
+    NamedGlobals["emscripten_block_counters"] = BlockCountersBase;
+    printBlockCounterMap(BlockCountersBase);
+  }
+
   // TODO fix commas
   Out << "/* memory initializer */ allocate([";
   printCommaSeparated(GlobalData64);
@@ -2502,35 +3171,25 @@ void JSWriter::printModuleBody() {
   printCommaSeparated(GlobalData8);
   Out << "], \"i8\", ALLOC_NONE, Runtime.GLOBAL_BASE);";
 
+  if (!MetadataFile.empty() && !MergeableOutput) {
+    Out << "\n";
+    printMetadataFile();
+    return;
+  }
+
   // Emit metadata for emcc driver
   Out << "\n\n// EMSCRIPTEN_METADATA\n";
+  if (MergeableOutput) {
+    printMergeableMetadata();
+    return;
+  }
   Out << "{\n";
 
   Out << "\"declares\": [";
   bool first = true;
   for (Module::const_iterator I = TheModule->begin(), E = TheModule->end();
        I != E; ++I) {
-    if (I->isDeclaration() && !I->use_empty()) {
-      // Ignore intrinsics that are always no-ops or expanded into other code
-      // which doesn't require the intrinsic function itself to be declared.
-      if (I->isIntrinsic()) {
-        switch (I->getIntrinsicID()) {
-        case Intrinsic::dbg_declare:
-        case Intrinsic::dbg_value:
-        case Intrinsic::lifetime_start:
-        case Intrinsic::lifetime_end:
-        case Intrinsic::invariant_start:
-        case Intrinsic::invariant_end:
-        case Intrinsic::prefetch:
-        case Intrinsic::memcpy:
-        case Intrinsic::memset:
-        case Intrinsic::memmove:
-        case Intrinsic::expect:
-        case Intrinsic::flt_rounds:
-          continue;
-        }
-      }
-
+    if (isDeclared(I)) {
       if (first) {
         first = false;
       } else {
@@ -2580,28 +3239,24 @@ void JSWriter::printModuleBody() {
   first = true;
   for (Module::const_iterator I = TheModule->begin(), E = TheModule->end();
        I != E; ++I) {
-    if (!I->isDeclaration()) {
+    if (!isExternalFunction(I) && !DuplicateFunctions.count(getJSName(I))) {
       if (first) {
         first = false;
       } else {
         Out << ", ";
       }
-      std::string name = I->getName();
-      sanitizeGlobal(name);
-      Out << "\"" << name << '"';
+      Out << "\"" << getJSName(I) << '"';
     }
   }
   Out << "],";
 
   Out << "\"tables\": {";
-  unsigned Num = FunctionTables.size();
-  for (FunctionTableMap::iterator I = FunctionTables.begin(), E = FunctionTables.end(); I != E; ++I) {
+  // with FinalizeFunctionTables, the tables were printed as JS instead
+  unsigned Num = FinalizeFunctionTables ? 0 : FunctionTables.size();
+  padFunctionTables();
+  for (FunctionTableMap::iterator I = FunctionTables.begin(), E = FunctionTables.end(); Num > 0 && I != E; ++I) {
     Out << "  \"" << I->first << "\": \"var FUNCTION_TABLE_" << I->first << " = [";
     FunctionTable &Table = I->second;
-    // ensure power of two
-    unsigned Size = 1;
-    while (Size < Table.size()) Size <<= 1;
-    while (Table.size() < Size) Table.push_back("0");
     for (unsigned i = 0; i < Table.size(); i++) {
       Out << Table[i];
       if (i < Table.size()-1) Out << ",";
@@ -2642,6 +3297,19 @@ void JSWriter::printModuleBody() {
   Out << (UsesSIMD ? "1" : "0");
   Out << ",";
 
+  Out << "\"tls\": ";
+  Out << (UsesTls ? "1" : "0");
+  Out << ",";
+
+  if (!ColdFunctionsFile.empty()) {
+    Out << "\"coldFunctions\": [";
+    for (unsigned i = 0; i < ColdFunctions.size(); i++) {
+      if (i > 0) Out << ", ";
+      Out << "\"" << ColdFunctions[i] << "\"";
+    }
+    Out << "],";
+  }
+
   Out << "\"namedGlobals\": {";
   first = true;
   for (NameIntMap::const_iterator I = NamedGlobals.begin(), E = NamedGlobals.end(); I != E; ++I) {
@@ -2657,6 +3325,585 @@ void JSWriter::printModuleBody() {
   Out << "\n}\n";
 }
 
+// Pads each function table to a power of two, so that a mask of its size can
+// bound the indexes of indirect calls.
+void JSWriter::padFunctionTables() {
+  for (FunctionTableMap::iterator I = FunctionTables.begin(), E = FunctionTables.end(); I != E; ++I) {
+    FunctionTable &Table = I->second;
+    unsigned Size = 1;
+    while (Size < Table.size()) Size <<= 1;
+    while (Table.size() < Size) Table.push_back("0");
+  }
+}
+
+// With FinalizeFunctionTables, prints the function tables as the JS that
+// emscripten would otherwise make of the "tables" metadata. They go after
+// the functions, where the asm.js module needs them.
+void JSWriter::printFunctionTables() {
+  padFunctionTables();
+  Out << "// EMSCRIPTEN_START_TABLES\n";
+  for (FunctionTableMap::const_iterator I = FunctionTables.begin(), E = FunctionTables.end(); I != E; ++I) {
+    Out << "var FUNCTION_TABLE_" << I->first << " = [";
+    const FunctionTable &Table = I->second;
+    for (unsigned i = 0; i < Table.size(); i++) {
+      Out << Table[i];
+      if (i < Table.size()-1) Out << ",";
+    }
+    Out << "];\n";
+  }
+  Out << "// EMSCRIPTEN_END_TABLES\n\n";
+}
+
+static bool isIdentifierChar(char C) {
+  return isalnum((unsigned char)C) || C == '_' || C == '$';
+}
+
+// Returns the JS of the function Name in Text, in a form that is the same for
+// functions that differ only in their names, the names of their locals, or
+// their debug locations: Name becomes #SELF#, the locals (the identifiers
+// that start with "$") are renumbered in order of first appearance, and the
+// //@line comments and #DL_index# markers are dropped.
+static std::string normalizeFunctionJS(StringRef Text, StringRef Name) {
+  static const char LineComment[] = " //@line ";
+  static const char LocationMarker[] = "#DL_";
+  std::string Result;
+  std::map<StringRef, unsigned> Locals;
+  size_t Pos = 0;
+  while (Pos < Text.size()) {
+    if (Text[Pos] == ' ' && Text.substr(Pos).startswith(LineComment)) {
+      Result += Text.substr(0, Pos);
+      Text = Text.substr(Text.find('\n', Pos));
+      Pos = 0;
+    } else if (Text[Pos] == '#' && Text.substr(Pos).startswith(LocationMarker)) {
+      Result += Text.substr(0, Pos);
+      size_t End = Text.find('#', Pos + strlen(LocationMarker));
+      Text = Text.substr(End == StringRef::npos ? Text.size() : End + 1);
+      Pos = 0;
+    } else if (isIdentifierChar(Text[Pos]) && (Pos == 0 || !isIdentifierChar(Text[Pos-1]))) {
+      size_t End = Pos + 1;
+      while (End < Text.size() && isIdentifierChar(Text[End])) End++;
+      StringRef Identifier = Text.slice(Pos, End);
+      if (Identifier == Name) {
+        Result += Text.substr(0, Pos);
+        Result += "#SELF#";
+      } else if (Identifier[0] == '$') {
+        unsigned Index = Locals.insert(std::make_pair(Identifier, (unsigned)Locals.size())).first->second;
+        Result += Text.substr(0, Pos);
+        Result += "$" + utostr(Index);
+      } else {
+        Pos = End;
+        continue;
+      }
+      Text = Text.substr(End);
+      Pos = 0;
+    } else {
+      Pos++;
+    }
+  }
+  Result += Text;
+  return Result;
+}
+
+// With DedupeFunctions, drops the JS of F, which starts at Begin in Buffer,
+// if a function with the same JS was printed before, and records that calls
+// to F should call that one instead. The JS is compared as normalized by
+// normalizeFunctionJS, so that recursive functions can match too. Only
+// functions that can lose their name are dropped, but any function can be
+// the one kept.
+void JSWriter::dedupeFunction(const Function *F, size_t Begin) {
+  Out.flush();
+  const std::string &Text = BufferStream.str();
+  std::string Name = getJSName(F);
+  std::string Body = normalizeFunctionJS(StringRef(Text).substr(Begin), Name);
+  std::vector<PrintedFunction> &Candidates = PrintedFunctions[hash_value(Body)];
+  if (!hasFixedName(F)) {
+    for (unsigned i = 0; i < Candidates.size(); i++) {
+      const PrintedFunction &Other = Candidates[i];
+      StringRef OtherText = StringRef(Text).slice(Other.Begin, Other.End);
+      if (normalizeFunctionJS(OtherText, Other.Name) != Body) continue;
+      DuplicateFunctions[Name] = Other.Name;
+      NumDuplicateFunctions++;
+      NumDuplicateBytes += Text.size() - Begin;
+      Buffer.resize(Begin);
+      return;
+    }
+  }
+  PrintedFunction Printed;
+  Printed.Name = Name;
+  Printed.Begin = Begin;
+  Printed.End = Text.size();
+  Candidates.push_back(Printed);
+}
+
+// Whether F is listed in ColdFunctionsFile and can run in the cold chunk,
+// which is a separate asm.js module: it must not use the state that each
+// module keeps in its own variables and that is passed between functions,
+// such as the high bits of i64 results, exceptions, setjmp, thread-local
+// storage and async support, nor make indirect calls, which go through the
+// function tables of the main module. (The stack pointer is passed in and
+// out with each call into the chunk.)
+static const char *const ModuleStateCalls[] = {
+  "getHigh32", "setHigh32", "llvm.nacl.read.tp", "emscripten_set_tls_base",
+  "emscripten_set_stack_limits", "emscripten_preinvoke",
+  "emscripten_postinvoke", "emscripten_landingpad",
+  "emscripten_prep_setjmp", "emscripten_setjmp", "emscripten_cleanup_setjmp",
+  "emscripten_check_longjmp", "emscripten_get_longjmp_result",
+  "emscripten_alloc_async_context", "emscripten_check_async",
+  "emscripten_do_not_unwind", "emscripten_do_not_unwind_async",
+  "emscripten_get_async_return_value_addr"
+};
+
+bool JSWriter::isColdFunction(const Function *F) {
+  if (ColdFunctionNames.empty() || !ColdFunctionNames.count(F->getName())) return false;
+  if (F->callsFunctionThatReturnsTwice()) return false;
+  for (const_inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
+    ImmutableCallSite CS(&*I);
+    if (!CS) continue;
+    if (CS.isInvoke()) return false;
+    const Function *Callee = dyn_cast<Function>(CS.getCalledValue()->stripPointerCasts());
+    if (!Callee) return false;
+    StringRef Name = Callee->getName();
+    for (unsigned i = 0; i < array_lengthof(ModuleStateCalls); i++) {
+      if (Name == ModuleStateCalls[i]) return false;
+    }
+  }
+  return true;
+}
+
+// Prints F to the cold chunk, and in its place a stub that calls it through
+// the import cold$name, which the loader of the chunk provides.
+void JSWriter::printColdFunction(const Function *F) {
+  Out.flush();
+  size_t Begin = BufferStream.str().size();
+  PrintingColdFunction = true;
+  printFunction(F);
+  PrintingColdFunction = false;
+  Out.flush();
+  ColdChunk.append(Buffer, Begin, std::string::npos);
+  Buffer.resize(Begin);
+  ColdFunctions.push_back(getJSName(F));
+  NumColdFunctions++;
+
+  FunctionType *FT = F->getFunctionType();
+  std::string Call = "cold$" + getJSName(F) + "(";
+  Out << "function " << getJSName(F) << "(";
+  for (unsigned i = 0; i < FT->getNumParams(); i++) {
+    if (i > 0) {
+      Out << ",";
+      Call += ",";
+    }
+    std::string Param = "$" + utostr(i);
+    Out << Param;
+    Call += getCast(Param, FT->getParamType(i), ASM_NONSPECIFIC | ASM_FFI_OUT);
+  }
+  Call += ")";
+  Out << ") {";
+  nl(Out);
+  for (unsigned i = 0; i < FT->getNumParams(); i++) {
+    std::string Param = "$" + utostr(i);
+    Out << " " << Param << " = " << getCast(Param, FT->getParamType(i), ASM_NONSPECIFIC) << ";";
+    nl(Out);
+  }
+  if (FT->getReturnType()->isVoidTy()) {
+    Out << " " << Call << ";";
+  } else {
+    Out << " return (" << getCast(Call, FT->getReturnType(), ASM_NONSPECIFIC | ASM_FFI_IN) << ");";
+  }
+  nl(Out);
+  Out << "}";
+  nl(Out);
+}
+
+// Writes the cold functions to ColdChunkFile, followed by metadata for the
+// loader: the functions it implements, and the functions of the main module
+// that it calls, which the main module exports, and which the chunk imports
+// as FFIs.
+void JSWriter::printColdChunk() {
+  std::string ErrorInfo;
+  raw_fd_ostream File(ColdChunkFile.c_str(), ErrorInfo, sys::fs::F_Text);
+  if (!ErrorInfo.empty()) {
+    report_fatal_error("cannot open cold chunk " + Twine(ColdChunkFile) + ": " + ErrorInfo);
+  }
+  File << "// EMSCRIPTEN_START_FUNCTIONS\n";
+  printBufferedOutput(ColdChunk, File);
+  File << "// EMSCRIPTEN_END_FUNCTIONS\n\n";
+  File << "// EMSCRIPTEN_METADATA\n";
+  File << "{\n\"implementedFunctions\": [";
+  for (unsigned i = 0; i < ColdFunctions.size(); i++) {
+    if (i > 0) File << ", ";
+    File << "\"" << ColdFunctions[i] << "\"";
+  }
+  File << "],\"imports\": [";
+  for (NameSet::const_iterator I = ColdImports.begin(), E = ColdImports.end(); I != E; ++I) {
+    if (I != ColdImports.begin()) File << ", ";
+    File << "\"" << *I << "\"";
+  }
+  File << "]\n}\n";
+  ColdChunk.clear();
+}
+
+// Writes the buffered output to OS. With FinalizeFunctionTables, each
+// #FM_sig# that an indirect call left is replaced with the mask of that
+// function table, which is only known once all the functions are printed.
+// With BlockCountersFile, each #BC_index# is replaced with the address of
+// that counter, which follows the static data. With SourceMapFile, each
+// #DL_index# is removed, and where it was in the main output is mapped to
+// that source location. With DedupeFunctions, references to functions that
+// were not emitted are replaced with the functions called instead (string
+// literals, such as the file names of //@line comments, are left alone). The
+// cold chunk is written the same way.
+void JSWriter::printBufferedOutput(StringRef Text, raw_ostream &OS) {
+  static const char MaskMarker[] = "#FM_";
+  static const char CounterMarker[] = "#BC_";
+  static const char LocationMarker[] = "#DL_";
+  size_t Pos = 0;
+  while (Pos < Text.size()) {
+    if (Text[Pos] == '#' && Text.substr(Pos).startswith(LocationMarker)) {
+      writeOutput(OS, Text.substr(0, Pos));
+      Text = Text.substr(Pos + strlen(LocationMarker));
+      size_t End = Text.find('#');
+      unsigned Index;
+      if (End == StringRef::npos || Text.substr(0, End).getAsInteger(10, Index) || Index >= SourceLocations.size()) {
+        report_fatal_error("malformed source location in JS output");
+      }
+      if (&OS == &FinalOut) addSourceMapping(Index);
+      Text = Text.substr(End + 1);
+      Pos = 0;
+    } else if (Text[Pos] == '#' && Text.substr(Pos).startswith(CounterMarker)) {
+      writeOutput(OS, Text.substr(0, Pos));
+      Text = Text.substr(Pos + strlen(CounterMarker));
+      size_t End = Text.find('#');
+      unsigned Index;
+      if (End == StringRef::npos || Text.substr(0, End).getAsInteger(10, Index) || Index >= NumBlockCounters) {
+        report_fatal_error("malformed block counter in JS output");
+      }
+      writeOutput(OS, utostr(BlockCountersBase + 4*Index));
+      Text = Text.substr(End + 1);
+      Pos = 0;
+    } else if (Text[Pos] == '#' && Text.substr(Pos).startswith(MaskMarker)) {
+      writeOutput(OS, Text.substr(0, Pos));
+      Text = Text.substr(Pos + strlen(MaskMarker));
+      size_t End = Text.find('#');
+      FunctionTableMap::const_iterator Table = End == StringRef::npos ? FunctionTables.end() : FunctionTables.find(Text.substr(0, End).str());
+      if (Table == FunctionTables.end()) {
+        report_fatal_error("malformed function table mask in JS output");
+      }
+      writeOutput(OS, utostr(Table->second.size() - 1));
+      Text = Text.substr(End + 1);
+      Pos = 0;
+    } else if (Text[Pos] == '"' && !DuplicateFunctions.empty()) {
+      // string literals in the output do not span lines
+      size_t End = Text.find_first_of("\"\n", Pos + 1);
+      Pos = End == StringRef::npos ? Text.size() : End + 1;
+    } else if (Text[Pos] == '_' && !DuplicateFunctions.empty() && (Pos == 0 || !isIdentifierChar(Text[Pos-1]))) {
+      size_t End = Pos + 1;
+      while (End < Text.size() && isIdentifierChar(Text[End])) End++;
+      StringMap::const_iterator Kept = DuplicateFunctions.find(Text.slice(Pos, End).str());
+      if (Kept == DuplicateFunctions.end()) {
+        Pos = End;
+        continue;
+      }
+      writeOutput(OS, Text.substr(0, Pos));
+      writeOutput(OS, Kept->second);
+      Text = Text.substr(End);
+      Pos = 0;
+    } else {
+      Pos++;
+    }
+  }
+  writeOutput(OS, Text);
+}
+
+// Writes Text to OS, and with SourceMapFile, keeps track of the line and
+// column in the main output.
+void JSWriter::writeOutput(raw_ostream &OS, StringRef Text) {
+  OS << Text;
+  if (SourceMapFile.empty() || &OS != &FinalOut) return;
+  for (size_t i = 0; i < Text.size(); i++) {
+    if (Text[i] == '\n') {
+      OutputLine++;
+      OutputColumn = 0;
+    } else {
+      OutputColumn++;
+    }
+  }
+}
+
+// Returns the marker of the debug location of I, which printBufferedOutput
+// turns into a mapping.
+std::string JSWriter::getSourceMapMarker(const Instruction *I) {
+  DILocation Loc(I->getMetadata("dbg"));
+  std::string File = Loc.getFilename();
+  if (File.empty()) {
+    File = "?";
+  } else if (!sys::path::is_absolute(File) && !Loc.getDirectory().empty()) {
+    File = (Loc.getDirectory() + "/" + File).str();
+  }
+  std::pair<std::map<std::string, unsigned>::iterator, bool> Inserted =
+    SourceIndexes.insert(std::make_pair(File, (unsigned)Sources.size()));
+  if (Inserted.second) Sources.push_back(File);
+  SourceLocation Location;
+  Location.Source = Inserted.first->second;
+  Location.Line = Loc.getLineNumber() > 0 ? Loc.getLineNumber() - 1 : 0;
+  Location.Column = Loc.getColumnNumber() > 0 ? Loc.getColumnNumber() - 1 : 0;
+  SourceLocations.push_back(Location);
+  return "#DL_" + utostr(SourceLocations.size() - 1) + "#";
+}
+
+// Appends Value to Out as a base64 VLQ: the sign in the lowest bit, then five
+// bits per digit, the lowest first, with 32 set on all digits but the last.
+static void appendVLQ(std::string &Out, int Value) {
+  static const char Base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  unsigned VLQ = Value < 0 ? ((unsigned)-Value << 1) | 1 : (unsigned)Value << 1;
+  do {
+    unsigned Digit = VLQ & 31;
+    VLQ >>= 5;
+    if (VLQ) Digit |= 32;
+    Out += Base64[Digit];
+  } while (VLQ);
+}
+
+// Maps the current position in the main output to the source location with
+// index Location. Lines of the output are separated by ';' and mappings on a
+// line by ','. Each mapping is the output column, the source, and the source
+// line and column, each relative to the same field of the mapping before it,
+// except that the output column starts from 0 on each line.
+void JSWriter::addSourceMapping(unsigned Location) {
+  const SourceLocation &L = SourceLocations[Location];
+  if (OutputLine > MappedLine) {
+    SourceMappings.append(OutputLine - MappedLine, ';');
+    MappedLine = OutputLine;
+    LastMapping[0] = 0;
+  } else if (!SourceMappings.empty() && SourceMappings[SourceMappings.size()-1] != ';') {
+    SourceMappings += ',';
+  }
+  int Fields[4] = { (int)OutputColumn, (int)L.Source, (int)L.Line, (int)L.Column };
+  for (unsigned i = 0; i < 4; i++) {
+    appendVLQ(SourceMappings, Fields[i] - LastMapping[i]);
+    LastMapping[i] = Fields[i];
+  }
+}
+
+// Writes S to OS as a JSON string. Bytes of UTF-8 are written as they are,
+// control characters as \uXXXX.
+static void writeJSONString(raw_ostream &OS, StringRef S) {
+  static const char Hex[] = "0123456789abcdef";
+  OS << '"';
+  for (size_t i = 0; i < S.size(); i++) {
+    unsigned char C = S[i];
+    if (C == '"' || C == '\\') {
+      OS << '\\' << C;
+    } else if (C < 0x20 || C == 0x7f) {
+      OS << "\\u00" << Hex[C >> 4] << Hex[C & 15];
+    } else {
+      OS << C;
+    }
+  }
+  OS << '"';
+}
+
+// Writes the source map of the main output to SourceMapFile.
+void JSWriter::printSourceMap() {
+  std::string ErrorInfo;
+  raw_fd_ostream File(SourceMapFile.c_str(), ErrorInfo, sys::fs::F_Text);
+  if (!ErrorInfo.empty()) {
+    report_fatal_error("cannot open source map " + Twine(SourceMapFile) + ": " + ErrorInfo);
+  }
+  File << "{\"version\":3,\"sources\":[";
+  for (unsigned i = 0; i < Sources.size(); i++) {
+    if (i > 0) File << ",";
+    writeJSONString(File, Sources[i]);
+  }
+  File << "],\"names\":[],\"mappings\":\"" << SourceMappings << "\"}\n";
+}
+
+
+namespace {
+  // The string table of the metadata file: each distinct string gets the
+  // index of its first use.
+  class MetadataStrings {
+    std::map<std::string, unsigned> Indexes;
+    std::vector<const std::string*> Strings;
+  public:
+    unsigned get(const std::string &S) {
+      std::pair<std::map<std::string, unsigned>::iterator, bool> Inserted =
+        Indexes.insert(std::make_pair(S, (unsigned)Strings.size()));
+      if (Inserted.second) Strings.push_back(&Inserted.first->first);
+      return Inserted.first->second;
+    }
+    size_t size() const { return Strings.size(); }
+    const std::string &operator[](unsigned i) const { return *Strings[i]; }
+  };
+}
+
+// With MetadataFile, writes the metadata that would be JSON after the JS to
+// that file instead. After an "emscripten-metadata 1" header, the file has
+// "strings N" and then N lines, one string each, and then one record per
+// line: a kind, a count, and that many items, where names are indexes into
+// the strings. The kinds are declares, redirects (pairs of names), externs,
+// implementedFunctions, table (one per table, with the signature before the
+// entries), initializers, exports, namedGlobals (pairs of a name and an
+// address), cantValidate (the reason, if any), coldFunctions (only with
+// ColdFunctionsFile), and simd and tls, which are flags. Since the strings
+// come first, a reader can decode each record as it reads it.
+void JSWriter::printMetadataFile() {
+  MetadataStrings Strings;
+  std::string Records;
+  raw_string_ostream R(Records);
+
+  SmallVector<unsigned, 32> Items;
+  for (Module::const_iterator I = TheModule->begin(), E = TheModule->end(); I != E; ++I) {
+    if (isDeclared(I)) Items.push_back(Strings.get(I->getName()));
+  }
+  for (NameSet::const_iterator I = Declares.begin(), E = Declares.end(); I != E; ++I) {
+    Items.push_back(Strings.get(*I));
+  }
+  R << "declares " << Items.size();
+  for (unsigned i = 0; i < Items.size(); i++) R << " " << Items[i];
+  R << "\n";
+
+  R << "redirects " << Redirects.size();
+  for (StringMap::const_iterator I = Redirects.begin(), E = Redirects.end(); I != E; ++I) {
+    R << " " << Strings.get("_" + I->first) << " " << Strings.get(I->second);
+  }
+  R << "\n";
+
+  R << "externs " << Externals.size();
+  for (NameSet::const_iterator I = Externals.begin(), E = Externals.end(); I != E; ++I) {
+    R << " " << Strings.get(*I);
+  }
+  R << "\n";
+
+  Items.clear();
+  for (Module::const_iterator I = TheModule->begin(), E = TheModule->end(); I != E; ++I) {
+    if (!isExternalFunction(I) && !DuplicateFunctions.count(getJSName(I))) Items.push_back(Strings.get(getJSName(I)));
+  }
+  R << "implementedFunctions " << Items.size();
+  for (unsigned i = 0; i < Items.size(); i++) R << " " << Items[i];
+  R << "\n";
+
+  // with FinalizeFunctionTables, the tables were printed as JS instead
+  if (!FinalizeFunctionTables) {
+    padFunctionTables();
+    for (FunctionTableMap::const_iterator I = FunctionTables.begin(), E = FunctionTables.end(); I != E; ++I) {
+      const FunctionTable &Table = I->second;
+      R << "table " << Table.size() << " " << Strings.get(I->first);
+      for (unsigned i = 0; i < Table.size(); i++) R << " " << Strings.get(Table[i]);
+      R << "\n";
+    }
+  }
+
+  R << "initializers " << GlobalInitializers.size();
+  for (unsigned i = 0; i < GlobalInitializers.size(); i++) R << " " << Strings.get(GlobalInitializers[i]);
+  R << "\n";
+
+  R << "exports " << Exports.size();
+  for (unsigned i = 0; i < Exports.size(); i++) R << " " << Strings.get(Exports[i]);
+  R << "\n";
+
+  R << "namedGlobals " << NamedGlobals.size();
+  for (NameIntMap::const_iterator I = NamedGlobals.begin(), E = NamedGlobals.end(); I != E; ++I) {
+    R << " " << Strings.get("_" + I->first) << " " << I->second;
+  }
+  R << "\n";
+
+  if (CantValidate.empty()) {
+    R << "cantValidate 0\n";
+  } else {
+    R << "cantValidate 1 " << Strings.get(CantValidate) << "\n";
+  }
+  if (!ColdFunctionsFile.empty()) {
+    R << "coldFunctions " << ColdFunctions.size();
+    for (unsigned i = 0; i < ColdFunctions.size(); i++) R << " " << Strings.get(ColdFunctions[i]);
+    R << "\n";
+  }
+  R << "simd " << (UsesSIMD ? "1" : "0") << "\n";
+  R << "tls " << (UsesTls ? "1" : "0") << "\n";
+  R.flush();
+
+  std::string ErrorInfo;
+  raw_fd_ostream File(MetadataFile.c_str(), ErrorInfo, sys::fs::F_Text);
+  if (!ErrorInfo.empty()) {
+    report_fatal_error("cannot open metadata file " + Twine(MetadataFile) + ": " + ErrorInfo);
+  }
+  File << "emscripten-metadata 1\n";
+  File << "strings " << Strings.size() << "\n";
+  for (unsigned i = 0; i < Strings.size(); i++) File << Strings[i] << "\n";
+  File << Records;
+}
+
+// With BlockCountersFile, writes which function and block each counter
+// belongs to. After an "emscripten-block-counters 1" header and a line with
+// the address of the first counter and the number of counters, each function
+// that was printed has a "function" line with its LLVM name, its JS name, the
+// index of its first counter and its number of blocks, followed by a "block"
+// line for each block in order, with its LLVM name, or "-" if it has none.
+// The counters are 32-bit, one after another from that address.
+void JSWriter::printBlockCounterMap(unsigned Base) {
+  std::string ErrorInfo;
+  raw_fd_ostream File(BlockCountersFile.c_str(), ErrorInfo, sys::fs::F_Text);
+  if (!ErrorInfo.empty()) {
+    report_fatal_error("cannot open block counter map " + Twine(BlockCountersFile) + ": " + ErrorInfo);
+  }
+  File << "emscripten-block-counters 1\n";
+  File << "counters " << Base << " " << NumBlockCounters << "\n";
+  File << BlockCounterMap;
+}
+
+// The metadata of MergeableOutput: one "kind value" record per line, which
+// pnacl-llc combines across threads and prints as the JSON above.
+void JSWriter::printMergeableMetadata() {
+  unsigned Position = 0;
+  for (Module::const_iterator I = TheModule->begin(), E = TheModule->end();
+       I != E; ++I, ++Position) {
+    if (isDeclared(I)) Out << "declare " << Position << " " << I->getName() << "\n";
+  }
+  for (NameSet::const_iterator I = Declares.begin(), E = Declares.end(); I != E; ++I) {
+    Out << "libraryDeclare " << *I << "\n";
+  }
+  for (StringMap::const_iterator I = Redirects.begin(), E = Redirects.end(); I != E; ++I) {
+    Out << "redirect " << I->first << " " << I->second << "\n";
+  }
+  for (NameSet::const_iterator I = Externals.begin(), E = Externals.end(); I != E; ++I) {
+    Out << "extern " << *I << "\n";
+  }
+  for (Module::const_iterator I = TheModule->begin(), E = TheModule->end();
+       I != E; ++I) {
+    if (!isExternalFunction(I)) {
+      Out << "implemented " << getJSName(I) << "\n";
+    }
+  }
+  for (FunctionTableMap::const_iterator I = FunctionTables.begin(), E = FunctionTables.end(); I != E; ++I) {
+    Out << "table " << I->first << " ";
+    const FunctionTable &Table = I->second;
+    for (unsigned i = 0; i < Table.size(); i++) {
+      Out << Table[i];
+      if (i < Table.size()-1) Out << ",";
+    }
+    Out << "\n";
+  }
+  if (NoAliasingFunctionPointers) {
+    Out << "nextFunctionIndex " << NextFunctionIndex << "\n";
+  }
+  if (FinalizeFunctionTables) {
+    Out << "finalizeTables\n"; // the merge knows the final tables
+  }
+  for (unsigned i = 0; i < GlobalInitializers.size(); i++) {
+    Out << "initializer " << GlobalInitializers[i] << "\n";
+  }
+  for (unsigned i = 0; i < Exports.size(); i++) {
+    Out << "export " << Exports[i] << "\n";
+  }
+  if (!CantValidate.empty()) {
+    Out << "cantValidate " << CantValidate << "\n";
+  }
+  if (UsesSIMD) Out << "simd 1\n";
+  if (UsesTls) Out << "tls 1\n";
+  for (NameIntMap::const_iterator I = NamedGlobals.begin(), E = NamedGlobals.end(); I != E; ++I) {
+    Out << "namedGlobal " << I->first << " " << I->second << "\n";
+  }
+}
+
 void JSWriter::parseConstant(const std::string& name, const Constant* CV, bool calculate) {
   if (isa<GlobalValue>(CV))
     return;
@@ -2669,9 +3916,7 @@ void JSWriter::parseConstant(const std::string& name, const Constant* CV, bool c
     if (calculate) {
       HeapData *GlobalData = allocateAddress(name);
       StringRef Str = CDS->getAsString();
-      for (unsigned int i = 0; i < Str.size(); i++) {
-        GlobalData->push_back(Str.data()[i]);
-      }
+      GlobalData->insert(GlobalData->end(), Str.begin(), Str.end());
     }
   } else if (const ConstantFP *CFP = dyn_cast<ConstantFP>(CV)) {
     APFloat APF = CFP->getValueAPF();
@@ -2714,9 +3959,7 @@ void JSWriter::parseConstant(const std::string& name, const Constant* CV, bool c
     if (calculate) {
       unsigned Bytes = DL->getTypeStoreSize(CV->getType());
       HeapData *GlobalData = allocateAddress(name);
-      for (unsigned i = 0; i < Bytes; ++i) {
-        GlobalData->push_back(0);
-      }
+      GlobalData->insert(GlobalData->end(), Bytes, 0);
       // FIXME: create a zero section at the end, avoid filling meminit with zeros
     }
   } else if (const ConstantArray *CA = dyn_cast<ConstantArray>(CV)) {
@@ -2753,15 +3996,24 @@ void JSWriter::parseConstant(const std::string& name, const Constant* CV, bool c
         }
       }
     } else if (calculate) {
-      HeapData *GlobalData = allocateAddress(name);
-      unsigned Bytes = DL->getTypeStoreSize(CV->getType());
-      for (unsigned i = 0; i < Bytes; ++i) {
-        GlobalData->push_back(0);
-      }
-    } else {
       // Per the PNaCl abi, this must be a packed struct of a very specific type
       // https://chromium.googlesource.com/native_client/pnacl-llvm/+/7287c45c13dc887cebe3db6abfa2f1080186bb97/lib/Transforms/NaCl/FlattenGlobals.cpp
       assert(CS->getType()->isPacked());
+      // The byte arrays are copied now, in bulk; the relocations between them
+      // are left as zeros until the second phase
+      HeapData *GlobalData = allocateAddress(name);
+      unsigned Num = CS->getNumOperands();
+      for (unsigned i = 0; i < Num; i++) {
+        const Constant* C = CS->getOperand(i);
+        if (const ConstantDataSequential *CDS = dyn_cast<ConstantDataSequential>(C)) {
+          assert(CDS->isString());
+          StringRef Str = CDS->getAsString();
+          GlobalData->insert(GlobalData->end(), Str.begin(), Str.end());
+        } else {
+          GlobalData->insert(GlobalData->end(), DL->getTypeStoreSize(C->getType()), 0);
+        }
+      }
+    } else {
       // This is the only constant where we cannot just emit everything during the first phase, 'calculate', as we may refer to other globals
       unsigned Num = CS->getNumOperands();
       unsigned Offset = getRelativeGlobalAddress(name);
@@ -2792,13 +4044,9 @@ void JSWriter::parseConstant(const std::string& name, const Constant* CV, bool c
           for (unsigned i = 0; i < 4; ++i) {
             GlobalData64[Offset++] = integer.b[i];
           }
-        } else if (const ConstantDataSequential *CDS = dyn_cast<ConstantDataSequential>(C)) {
-          assert(CDS->isString());
-          StringRef Str = CDS->getAsString();
-          assert(Offset+Str.size() <= GlobalData64.size());
-          for (unsigned int i = 0; i < Str.size(); i++) {
-            GlobalData64[Offset++] = Str.data()[i];
-          }
+        } else if (isa<ConstantDataSequential>(C)) {
+          unsigned Bytes = DL->getTypeStoreSize(C->getType());
+          Offset += Bytes; // already copied during 'calculate'
         } else {
           C->dump();
           llvm_unreachable("Unexpected constant kind");
@@ -2893,6 +4141,199 @@ void JSWriter::calculateNativizedVars(const Function *F) {
   }
 }
 
+// heap indexes
+
+// Whether V is known to be a multiple of the size of a heap array.
+bool JSWriter::isMultipleOfHeapSize(const Value *V, unsigned Shift) {
+  APInt KnownZero(32, 0), KnownOne(32, 0);
+  computeKnownBits(const_cast<Value*>(V), KnownZero, KnownOne, DL);
+  return KnownZero.countTrailingOnes() >= Shift;
+}
+
+// Whether the add A steps a pointer of Family: its result is cast to a
+// pointer, or goes around the loop into a phi of Family.
+static bool isPointerStep(const Instruction *A, const SmallSetVector<const Instruction*, 8> &Family) {
+  for (Value::const_user_iterator UI = A->user_begin(), UE = A->user_end(); UI != UE; ++UI) {
+    const Instruction *U = dyn_cast<Instruction>(*UI);
+    if (U && (isa<IntToPtrInst>(U) || (isa<PHINode>(U) && Family.count(U)))) return true;
+  }
+  return false;
+}
+
+// With HeapIndexIVs, finds the pointer induction variables that are better
+// kept as indexes into a heap array than as addresses. Each phi is taken with
+// the adds and geps that step it, the casts between i32 and pointers of
+// those, and the phis they reach, which together hold one value; all of them
+// become indexes if more of their uses are accesses of the same size than
+// anything else, since each other use shifts the index back into an address.
+// (Other adds, that do not make a pointer, are just other uses.) A family
+// that reaches the phis of one found before is left alone, as those phis
+// were already decided on.
+// An index is the address shifted right, so an index made from an address
+// that is not a multiple of the size loses the low bits of the address. The
+// accesses do not mind, as they shift those away too, but the other uses do,
+// so with any of those the values coming into the phis must be multiples.
+void JSWriter::findHeapIndexes(const Function *F) {
+  HeapIndexes.clear();
+  if (!HeapIndexIVs) return;
+
+  std::set<const Value*> Seen;
+  for (Function::const_iterator BI = F->begin(), BE = F->end(); BI != BE; ++BI) {
+    for (BasicBlock::const_iterator II = BI->begin(), E = BI->end(); II != E; ++II) {
+      const PHINode *P = dyn_cast<PHINode>(II);
+      if (!P) break;
+      if (Seen.count(P)) continue;
+      Type *T = P->getType();
+      if (!T->isPointerTy() && !T->isIntegerTy(32)) continue;
+
+      SmallSetVector<const Instruction*, 8> Family;
+      SmallVector<const Instruction*, 8> Accesses; // loads and stores through the family
+      SmallVector<const Instruction*, 4> Steps;
+      unsigned Others = 0; // uses that need an address
+      Family.insert(P);
+      for (unsigned i = 0; i < Family.size(); i++) {
+        SmallVector<const Value*, 4> Worklist; // the member, and bitcasts of it
+        Worklist.push_back(Family[i]);
+        while (!Worklist.empty()) {
+          const Value *V = Worklist.pop_back_val();
+          for (Value::const_user_iterator UI = V->user_begin(), UE = V->user_end(); UI != UE; ++UI) {
+            const Instruction *U = dyn_cast<Instruction>(*UI);
+            if (!U) {
+              Others++;
+            } else if (U->stripPointerCasts() != U) {
+              Worklist.push_back(U); // not emitted, its users use V
+            } else if (isa<PHINode>(U) || isa<IntToPtrInst>(U) || isa<PtrToIntInst>(U)) {
+              Family.insert(U);
+            } else if (U->getOpcode() == Instruction::Add && isPointerStep(U, Family)) {
+              Steps.push_back(U);
+              Family.insert(U);
+            } else if (const GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(U)) {
+              if (GEP->getPointerOperand() == V && GEP->getNumIndices() == 1) {
+                Steps.push_back(U);
+                Family.insert(U);
+              } else {
+                Others++;
+              }
+            } else if (const LoadInst *LI = dyn_cast<LoadInst>(U)) {
+              if (!LI->getType()->isVectorTy()) {
+                Accesses.push_back(U);
+              } else {
+                Others++;
+              }
+            } else if (const StoreInst *SI = dyn_cast<StoreInst>(U)) {
+              if (SI->getValueOperand() != V && !SI->getValueOperand()->getType()->isVectorTy()) {
+                Accesses.push_back(U);
+              } else {
+                Others++;
+              }
+            } else {
+              Others++;
+            }
+          }
+        }
+      }
+      bool Overlaps = false;
+      for (unsigned i = 0; i < Family.size() && !Overlaps; i++) {
+        Overlaps = Seen.count(Family[i]);
+      }
+      Seen.insert(Family.begin(), Family.end());
+      if (Overlaps) continue;
+
+      // The size is that of the first access that getPtrUse can index, and
+      // any access of another size needs an address.
+      unsigned Shift = 0, Indexed = 0;
+      for (unsigned i = 0; i < Accesses.size(); i++) {
+        const Instruction *A = Accesses[i];
+        Type *AT = isa<LoadInst>(A) ? A->getType() : cast<StoreInst>(A)->getValueOperand()->getType();
+        unsigned Bytes = DL->getTypeAllocSize(AT);
+        unsigned Alignment = isa<LoadInst>(A) ? cast<LoadInst>(A)->getAlignment() : cast<StoreInst>(A)->getAlignment();
+        bool Aligned = Alignment == 0 || Alignment >= Bytes;
+        if (Shift == 0 && Aligned && (Bytes == 2 || Bytes == 4 || Bytes == 8)) {
+          Shift = Log2_32(Bytes);
+        }
+        if (Shift != 0 && Aligned && Bytes == (1U << Shift)) {
+          Indexed++;
+        } else {
+          Others++;
+        }
+      }
+      if (Shift == 0 || Indexed <= Others) continue;
+
+      // Each step must move by whole elements.
+      bool Fail = false;
+      for (unsigned i = 0; i < Steps.size() && !Fail; i++) {
+        const Instruction *S = Steps[i];
+        if (const GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(S)) {
+          uint64_t ElementSize = DL->getTypeAllocSize(GEP->getType()->getElementType());
+          const Value *Index = GEP->getOperand(1);
+          if (const ConstantInt *CI = dyn_cast<ConstantInt>(Index)) {
+            Fail = ((uint32_t)CI->getSExtValue() * ElementSize) % (1U << Shift) != 0;
+          } else {
+            Fail = ElementSize % (1U << Shift) != 0;
+          }
+        } else {
+          bool First = Family.count(dyn_cast<Instruction>(S->getOperand(0)->stripPointerCasts()));
+          bool Second = Family.count(dyn_cast<Instruction>(S->getOperand(1)->stripPointerCasts()));
+          Fail = (First && Second) || !isMultipleOfHeapSize(S->getOperand(First ? 1 : 0), Shift);
+        }
+      }
+      if (Fail) continue;
+
+      if (Others > 0) {
+        for (unsigned i = 0; i < Family.size() && !Fail; i++) {
+          const PHINode *FP = dyn_cast<PHINode>(Family[i]);
+          if (!FP) continue;
+          for (unsigned j = 0; j < FP->getNumIncomingValues() && !Fail; j++) {
+            const Value *V = FP->getIncomingValue(j)->stripPointerCasts();
+            Fail = !Family.count(dyn_cast<Instruction>(V)) && !isMultipleOfHeapSize(V, Shift);
+          }
+        }
+        if (Fail) continue;
+      }
+
+      for (unsigned i = 0; i < Family.size(); i++) {
+        HeapIndexes[Family[i]] = Shift;
+      }
+      NumHeapIndexIVs++;
+      // asm.js only allows HEAP32[x>>2] and the like
+      CantValidate = "heap indexes are used (-emscripten-heap-index-ivs)";
+    }
+  }
+}
+
+// The JS of a heap index that is not a phi: a cast of another index, which is
+// the same index, or a step of one.
+std::string JSWriter::getHeapIndexValue(const Instruction *I) {
+  unsigned Shift = HeapIndexes[I];
+  if (isa<IntToPtrInst>(I) || isa<PtrToIntInst>(I)) {
+    return getJSName(I->getOperand(0)->stripPointerCasts());
+  }
+  const Value *Base, *Offset;
+  uint32_t Scale; // of Offset, in bytes
+  if (const GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(I)) {
+    Base = GEP->getPointerOperand()->stripPointerCasts();
+    Offset = GEP->getOperand(1);
+    Scale = DL->getTypeAllocSize(GEP->getType()->getElementType());
+  } else {
+    Base = I->getOperand(0)->stripPointerCasts();
+    Offset = I->getOperand(1);
+    if (!HeapIndexes.count(Base)) std::swap(Base, Offset);
+    Base = Base->stripPointerCasts();
+    Scale = 1;
+  }
+  std::string Step;
+  if (const ConstantInt *CI = dyn_cast<ConstantInt>(Offset)) {
+    int32_t Bytes = (uint32_t)CI->getSExtValue() * Scale;
+    Step = itostr(Bytes / (1 << Shift));
+  } else if (Scale < (1U << Shift)) {
+    Step = "(" + getValueAsStr(Offset) + ">>" + utostr(Shift) + ")";
+  } else if (Scale == (1U << Shift)) {
+    Step = getValueAsParenStr(Offset);
+  } else {
+    Step = "(" + getIMul(Offset, ConstantInt::get(Type::getInt32Ty(I->getContext()), Scale >> Shift)) + ")";
+  }
+  return "((" + getJSName(Base) + ") + " + Step + ")|0";
+}
 // special analyses
 
 bool JSWriter::canReloop(const Function *F) {
@@ -2901,7 +4342,7 @@ bool JSWriter::canReloop(const Function *F) {
 
 // main entry
 
-void JSWriter::printCommaSeparated(const HeapData data) {
+void JSWriter::printCommaSeparated(const HeapData &data) {
   for (HeapData::const_iterator I = data.begin();
        I != data.end(); ++I) {
     if (I != data.begin()) {
@@ -2911,27 +4352,107 @@ void JSWriter::printCommaSeparated(const HeapData data) {
   }
 }
 
-void JSWriter::printProgram(const std::string& fname,
-                             const std::string& mName) {
-  printModule(fname,mName);
-}
-
-void JSWriter::printModule(const std::string& fname,
-                            const std::string& mName) {
-  printModuleBody();
-}
-
-bool JSWriter::runOnModule(Module &M) {
+bool JSWriter::doInitialization(Module &M) {
   if (M.getTargetTriple() != "asmjs-unknown-emscripten") {
     prettyWarning() << "incorrect target triple '" << M.getTargetTriple() << "' (did you use emcc/em++ on all source files and not clang directly?)\n";
   }
 
   TheModule = &M;
-  DL = &getAnalysis<DataLayoutPass>().getDataLayout();
+  DataLayoutPass *DLP = getAnalysisIfAvailable<DataLayoutPass>();
+  DL = DLP ? &DLP->getDataLayout() : M.getDataLayout();
 
   setupCallHandlers();
 
-  printProgram("", "");
+  if (OutlineSize > 0 && MergeableOutput) {
+    report_fatal_error("-emscripten-outline-size cannot be used with mergeable output");
+  }
+
+  if (DedupeFunctions && MergeableOutput) {
+    report_fatal_error("-emscripten-dedupe-functions cannot be used with mergeable output");
+  }
+
+  if (!MetadataFile.empty() && MergeableOutput) {
+    report_fatal_error("-emscripten-metadata-file cannot be used with mergeable output");
+  }
+
+  if (!BlockCountersFile.empty() && MergeableOutput) {
+    report_fatal_error("-emscripten-block-counters cannot be used with mergeable output");
+  }
+
+  if (!SourceMapFile.empty() && MergeableOutput) {
+    report_fatal_error("-emscripten-source-map cannot be used with mergeable output");
+  }
+
+  if (!ColdFunctionsFile.empty()) {
+    if (MergeableOutput) {
+      report_fatal_error("-emscripten-cold-functions cannot be used with mergeable output");
+    }
+    if (ColdChunkFile.empty()) {
+      report_fatal_error("-emscripten-cold-functions needs -emscripten-cold-chunk");
+    }
+    ErrorOr<std::unique_ptr<MemoryBuffer>> List = MemoryBuffer::getFile(ColdFunctionsFile);
+    if (std::error_code EC = List.getError()) {
+      report_fatal_error("cannot read cold functions " + Twine(ColdFunctionsFile) + ": " + EC.message());
+    }
+    SmallVector<StringRef, 64> Lines;
+    List.get()->getBuffer().split(Lines, "\n", -1, false);
+    for (unsigned i = 0; i < Lines.size(); i++) {
+      StringRef Name = Lines[i].trim();
+      if (!Name.empty()) ColdFunctionNames.insert(Name);
+    }
+  }
+
+  if (MinifyNames && !NameMapFile.empty()) {
+    if (MergeableOutput) {
+      report_fatal_error("-emscripten-name-map cannot be used with mergeable output");
+    }
+    std::string ErrorInfo;
+    NameMap = new raw_fd_ostream(NameMapFile.c_str(), ErrorInfo, sys::fs::F_Text);
+    if (!ErrorInfo.empty()) {
+      report_fatal_error("cannot open name map " + Twine(NameMapFile) + ": " + ErrorInfo);
+    }
+  }
+
+  return false;
+}
+
+bool JSWriter::runOnFunction(Function &F) {
+  // Module passes that run before us may still change the globals, so wait
+  // until the first function to lay them out.
+  if (!ModuleStarted) printModulePrologue();
+
+  if (MergeableOutput) Out << "// EMSCRIPTEN_FUNCTION " << FunctionOrdinals[&F] << "\n";
+  if (isColdFunction(&F)) {
+    printColdFunction(&F);
+  } else if (DedupeFunctions && !MergeableOutput) {
+    Out.flush();
+    size_t Begin = BufferStream.str().size();
+    printFunction(&F);
+    dedupeFunction(&F, Begin);
+  } else {
+    printFunction(&F);
+  }
+  noteUsedDeclarations(&F);
+
+  return false;
+}
+
+bool JSWriter::doFinalization(Module &M) {
+  if (!ModuleStarted) printModulePrologue();
+
+  printModuleEpilogue();
+
+  if (&Out != &FinalOut) {
+    Out.flush();
+    printBufferedOutput(BufferStream.str(), FinalOut);
+    Buffer.clear();
+  }
+
+  if (!ColdFunctionsFile.empty()) printColdChunk();
+  if (!SourceMapFile.empty()) printSourceMap();
+
+  delete NameMap;
+  NameMap = NULL;
 
   return false;
 }
@@ -2952,6 +4473,7 @@ bool JSTargetMachine::addPassesToEmitFile(PassManagerBase &PM,
 
   PM.add(createExpandInsertExtractElementPass());
   PM.add(createExpandI64Pass());
+  if (OutlineSize > 0) PM.add(createOutlineLargeFunctionsPass(OutlineSize));
 
   CodeGenOpt::Level OptLevel = getOptLevel();
 
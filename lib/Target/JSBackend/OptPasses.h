@@ -18,6 +18,7 @@ namespace llvm {
 
   extern Pass *createExpandI64Pass();
   extern Pass *createExpandInsertExtractElementPass();
+  extern ModulePass *createOutlineLargeFunctionsPass(unsigned MaxSize);
 
 } // End llvm namespace
 
@@ -0,0 +1,321 @@
+//===-- OutlineLargeFunctions.cpp - Split oversized functions ---*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===-----------------------------------------------------------------------===//
+//
+// JS engines take much longer to compile and optimize large functions, and
+// some do not optimize functions beyond a size limit at all. This pass
+// splits functions with more instructions than -emscripten-outline-size by
+// moving single-entry, single-exit regions of them into new functions, the
+// largest region that fits the limit first, until they fit. Values used in
+// a region are passed to its function as arguments, and values defined in
+// it and used after it are returned through allocas in the caller's frame.
+//
+// This is a module pass, so that the new functions are in the module before
+// the JS backend starts to print it (and e.g. minifies the names of the
+// functions). They are placed right after the function they come from.
+//
+//===-----------------------------------------------------------------------===//
+
+#define DEBUG_TYPE "outline-large-functions"
+#include "OptPasses.h"
+
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/DominanceFrontier.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/RegionInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/CodeExtractor.h"
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#ifdef NDEBUG
+#undef assert
+#define assert(x) { if (!(x)) report_fatal_error(#x); }
+#endif
+
+using namespace llvm;
+
+STATISTIC(NumSplitFunctions, "Number of functions split because they were too large");
+STATISTIC(NumOutlinedRegions, "Number of regions outlined into new functions");
+
+static cl::opt<bool>
+OutlineReport("emscripten-outline-report",
+              cl::desc("With -emscripten-outline-size, prints the sizes of the functions that were split, and of the functions outlined from them, to stderr"),
+              cl::init(false));
+
+namespace llvm {
+
+// Regions smaller than this are not worth a call.
+static const unsigned MinRegionSize = 8;
+
+struct OutlineLargeFunctions : public ModulePass {
+  static char ID; // Pass identification, replacement for typeid
+  explicit OutlineLargeFunctions(unsigned MaxSize) : ModulePass(ID), MaxSize(MaxSize) {}
+
+  virtual bool runOnModule(Module &M);
+
+  virtual const char *getPassName() const { return "OutlineLargeFunctions"; }
+
+private:
+  typedef std::map<const BasicBlock*, unsigned> BlockSizeMap;
+
+  unsigned MaxSize; // in instructions
+  // For the report, the sizes of the functions that were too large, before
+  // and after, and of the functions outlined from them.
+  std::vector<unsigned> OriginalSizes, SplitSizes, OutlinedSizes;
+  SmallPtrSet<const Function*, 8> OutlinedFunctions; // which are not split again
+
+  Region *findRegion(Region *R, const BlockSizeMap &Sizes, unsigned &BestSize);
+  bool canOutline(ArrayRef<BasicBlock*> Blocks, unsigned Size);
+  Function *outline(Region *R);
+  BasicBlock *findBlock(Function &F, unsigned MinSize);
+  Function *outlineChunk(BasicBlock *BB);
+  bool splitFunction(Function &F);
+  void printReport(raw_ostream &OS, const std::vector<unsigned> &Sizes, const char *What);
+};
+
+char OutlineLargeFunctions::ID = 0;
+
+static unsigned getSize(const Function &F) {
+  unsigned Size = 0;
+  for (Function::const_iterator BB = F.begin(), E = F.end(); BB != E; ++BB) {
+    Size += BB->size();
+  }
+  return Size;
+}
+
+static bool isCallTo(const Instruction *I, StringRef Name) {
+  const CallInst *CI = dyn_cast<CallInst>(I);
+  return CI && CI->getCalledFunction() && CI->getCalledFunction()->getName() == Name;
+}
+
+// Whether a function must keep all its code, because setjmp support keeps
+// state in the function's locals.
+static bool mustKeepCode(const Function &F) {
+  if (F.callsFunctionThatReturnsTwice()) return true;
+  for (Function::const_iterator BB = F.begin(), E = F.end(); BB != E; ++BB) {
+    for (BasicBlock::const_iterator I = BB->begin(), IE = BB->end(); I != IE; ++I) {
+      if (isCallTo(I, "emscripten_prep_setjmp") || isCallTo(I, "emscripten_setjmp")) return true;
+    }
+  }
+  return false;
+}
+
+// Whether the JS backend can pass V to or from an outlined function: the
+// backend only expects the types that the PNaCl ABI allows in arguments.
+static bool isPassable(const Value *V) {
+  Type *T = V->getType();
+  if (T->isIntegerTy()) return T->isIntegerTy(32);
+  return T->isFloatTy() || T->isDoubleTy() || T->isPointerTy();
+}
+
+// Whether Blocks, which have Size instructions, can be outlined, are larger
+// than the code that replaces them, and fit the limit with the code that the
+// new function adds around them. Blocks with allocas are kept, as the memory
+// would be freed when the new function returns.
+bool OutlineLargeFunctions::canOutline(ArrayRef<BasicBlock*> Blocks, unsigned Size) {
+  for (unsigned i = 0; i < Blocks.size(); i++) {
+    for (BasicBlock::const_iterator I = Blocks[i]->begin(), E = Blocks[i]->end(); I != E; ++I) {
+      if (isa<AllocaInst>(I)) return false;
+    }
+  }
+  CodeExtractor Extractor(Blocks);
+  if (!Extractor.isEligible()) return false;
+  SetVector<Value*> Inputs, Outputs;
+  Extractor.findInputsOutputs(Inputs, Outputs);
+  for (unsigned i = 0; i < Inputs.size(); i++) {
+    if (!isPassable(Inputs[i])) return false;
+  }
+  for (unsigned i = 0; i < Outputs.size(); i++) {
+    if (!isPassable(Outputs[i])) return false;
+  }
+  // The caller gets the call and a branch, and an alloca and a load for each
+  // output. The new function gets an entry branch, a store for each output,
+  // and a return.
+  return Size > 2 + 2 * Outputs.size() && Size + 2 + Outputs.size() <= MaxSize;
+}
+
+// Moves the blocks of R into a new function, and returns it.
+Function *OutlineLargeFunctions::outline(Region *R) {
+  std::vector<BasicBlock*> Blocks(R->block_begin(), R->block_end()); // the entry first
+  // After outlining, the exit has one edge from the region, from the call,
+  // so phis there that merge several edges from the region are merged in a
+  // new block in the region first.
+  BasicBlock *Exit = R->getExit();
+  if (isa<PHINode>(Exit->begin())) {
+    std::vector<BasicBlock*> Preds;
+    for (pred_iterator PI = pred_begin(Exit), PE = pred_end(Exit); PI != PE; ++PI) {
+      if (R->contains(*PI)) Preds.push_back(*PI);
+    }
+    if (Preds.size() > 1) Blocks.push_back(SplitBlockPredecessors(Exit, Preds, ".outline"));
+  }
+  return CodeExtractor(Blocks).extractCodeRegion();
+}
+
+// The instructions of BB that can be moved to another function: not its
+// phis, allocas, or terminator.
+static BasicBlock::iterator getChunkStart(BasicBlock *BB) {
+  BasicBlock::iterator Start = BB->getFirstInsertionPt();
+  while (isa<AllocaInst>(Start)) ++Start;
+  return Start;
+}
+
+// Returns the block of F with the most instructions that can be outlined, if
+// it has more than MinSize of them. Blocks are not regions of their own, but
+// a block of code (e.g. a case of a large switch, or a part of long
+// straight-line code) can be outlined too.
+BasicBlock *OutlineLargeFunctions::findBlock(Function &F, unsigned MinSize) {
+  BasicBlock *Best = NULL;
+  unsigned BestSize = std::max(MinSize, MinRegionSize - 1);
+  for (Function::iterator BB = F.begin(), E = F.end(); BB != E; ++BB) {
+    unsigned Size = std::distance(getChunkStart(BB), BasicBlock::iterator(BB->getTerminator()));
+    if (Size > BestSize) {
+      Best = BB;
+      BestSize = Size;
+    }
+  }
+  return Best;
+}
+
+// Splits a chunk of the instructions of BB into a block of its own, which
+// branches to the rest of BB, and outlines it.
+Function *OutlineLargeFunctions::outlineChunk(BasicBlock *BB) {
+  BasicBlock::iterator Start = getChunkStart(BB);
+  // Even if every instruction were an output, the outlined function would
+  // fit the limit.
+  unsigned ChunkSize = (MaxSize - 2) / 2;
+  BasicBlock::iterator End = Start;
+  bool InInvoke = false;
+  for (unsigned i = 0; i < ChunkSize && !isa<TerminatorInst>(End); i++) {
+    if (isCallTo(End, "emscripten_preinvoke")) InInvoke = true;
+    else if (isCallTo(End, "emscripten_postinvoke")) InInvoke = false;
+    ++End;
+  }
+  // The JS backend prints the call between emscripten_preinvoke and
+  // emscripten_postinvoke as an invoke, so all three stay together.
+  if (InInvoke) {
+    while (!isa<TerminatorInst>(End) && !isCallTo(End, "emscripten_postinvoke")) ++End;
+    if (!isa<TerminatorInst>(End)) ++End;
+  }
+
+  BasicBlock *Chunk = Start == BB->begin() ? BB : BB->splitBasicBlock(Start, BB->getName() + ".chunk");
+  Chunk->splitBasicBlock(End, BB->getName() + ".rest");
+  if (!canOutline(Chunk, Chunk->size())) return NULL;
+  return CodeExtractor(Chunk).extractCodeRegion();
+}
+
+// Returns the largest region under R that fits the size limit and can be
+// outlined, or NULL, and its size in BestSize.
+Region *OutlineLargeFunctions::findRegion(Region *R, const BlockSizeMap &Sizes, unsigned &BestSize) {
+  unsigned Size = 0;
+  for (Region::block_iterator BI = R->block_begin(), BE = R->block_end(); BI != BE; ++BI) {
+    Size += Sizes.find(*BI)->second;
+  }
+  if (Size <= BestSize) return NULL; // neither this region nor those in it can do better
+  if (Size <= MaxSize && Size >= MinRegionSize && !R->isTopLevelRegion() &&
+      canOutline(std::vector<BasicBlock*>(R->block_begin(), R->block_end()), Size)) {
+    BestSize = Size;
+    return R;
+  }
+  Region *Best = NULL;
+  for (Region::iterator I = R->begin(), E = R->end(); I != E; ++I) {
+    if (Region *Found = findRegion(I->get(), Sizes, BestSize)) Best = Found;
+  }
+  return Best;
+}
+
+// Prints a histogram of Sizes, in powers of two.
+void OutlineLargeFunctions::printReport(raw_ostream &OS, const std::vector<unsigned> &Sizes, const char *What) {
+  std::map<unsigned, unsigned> Buckets;
+  for (unsigned i = 0; i < Sizes.size(); i++) {
+    unsigned Bucket = 1;
+    while (Bucket < Sizes[i]) Bucket <<= 1;
+    Buckets[Bucket]++;
+  }
+  OS << What << ":\n";
+  for (std::map<unsigned, unsigned>::const_iterator I = Buckets.begin(), E = Buckets.end(); I != E; ++I) {
+    OS << "  <= " << I->first << " instructions: " << I->second << "\n";
+  }
+}
+
+// Outlines parts of F until it fits the limit, if it does not.
+bool OutlineLargeFunctions::splitFunction(Function &F) {
+  if (getSize(F) <= MaxSize || OutlinedFunctions.count(&F) || mustKeepCode(F)) return false;
+
+  OriginalSizes.push_back(getSize(F));
+  if (OutlineReport) errs() << "outline: " << F.getName() << ": " << getSize(F) << " instructions";
+  Function *Last = &F;
+  bool Changed = false;
+  // Outlined regions fit the limit, so only F needs splitting, one region at
+  // a time, until it fits too.
+  while (getSize(F) > MaxSize) {
+    BlockSizeMap Sizes;
+    for (Function::const_iterator BB = F.begin(), E = F.end(); BB != E; ++BB) {
+      Sizes[BB] = BB->size();
+    }
+    // Outlining changes F, so the regions are found anew each time.
+    DominatorTree DT;
+    DT.recalculate(F);
+    PostDominatorTree PDT;
+    PDT.runOnFunction(F);
+    DominanceFrontier DF;
+    DF.getBase().analyze(DT);
+    RegionInfo RI;
+    RI.recalculate(F, &DT, &PDT, &DF);
+
+    unsigned BestSize = 0;
+    Region *Best = findRegion(RI.getTopLevelRegion(), Sizes, BestSize);
+    BasicBlock *Block = findBlock(F, BestSize);
+    unsigned OldSize = getSize(F);
+    Changed |= Block || Best; // a chunk is split off its block even if it cannot be outlined
+    Function *Outlined = Block ? outlineChunk(Block) : Best ? outline(Best) : NULL;
+    if (!Outlined) break;
+    Outlined->removeFromParent();
+    F.getParent()->getFunctionList().insertAfter(Last, Outlined);
+    Last = Outlined;
+    OutlinedFunctions.insert(Outlined);
+    NumOutlinedRegions++;
+    OutlinedSizes.push_back(getSize(*Outlined));
+    if (OutlineReport) errs() << ", " << Outlined->getName() << " " << OutlinedSizes.back();
+    if (getSize(F) >= OldSize) break; // the estimate was wrong; do not loop
+  }
+  SplitSizes.push_back(getSize(F));
+  if (OutlineReport) errs() << " -> " << SplitSizes.back() << "\n";
+  if (Last != &F) NumSplitFunctions++;
+  return Changed;
+}
+
+bool OutlineLargeFunctions::runOnModule(Module &M) {
+  bool Changed = false;
+  // The functions outlined from a function are inserted after it, and are
+  // skipped as they already fit.
+  for (Module::iterator I = M.begin(), E = M.end(); I != E; ++I) {
+    if (!I->isDeclaration()) Changed |= splitFunction(*I);
+  }
+  if (OutlineReport && !OriginalSizes.empty()) {
+    printReport(errs(), OriginalSizes, "outline: functions over the limit, before");
+    printReport(errs(), SplitSizes, "outline: the same functions, after");
+    printReport(errs(), OutlinedSizes, "outline: outlined functions");
+  }
+  return Changed;
+}
+
+ModulePass *createOutlineLargeFunctionsPass(unsigned MaxSize) {
+  return new OutlineLargeFunctions(MaxSize);
+}
+
+} // End llvm namespace
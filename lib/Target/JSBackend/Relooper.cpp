@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <list>
 #include <stack>
+#include <vector>
 
 #if EMSCRIPTEN
 #include "ministring.h"
@@ -35,8 +36,18 @@ static void PrintDebug(const char *Format, ...);
 
 #define INDENTATION 1
 
+// Printing state is per thread, so that several threads can each run their
+// own relooper (as pnacl-llc -split-module does).
+#if EMSCRIPTEN
+#define RELOOPER_THREAD_LOCAL
+#elif defined(_MSC_VER)
+#define RELOOPER_THREAD_LOCAL __declspec(thread)
+#else
+#define RELOOPER_THREAD_LOCAL __thread
+#endif
+
 struct Indenter {
-  static int CurrIndent;
+  static RELOOPER_THREAD_LOCAL int CurrIndent;
 
   static void Indent() { CurrIndent++; }
   static void Unindent() { CurrIndent--; }
@@ -45,10 +56,10 @@ struct Indenter {
 static void PrintIndented(const char *Format, ...);
 static void PutIndented(const char *String);
 
-static char *OutputBufferRoot = NULL;
-static char *OutputBuffer = NULL;
-static int OutputBufferSize = 0;
-static int OutputBufferOwned = false;
+static RELOOPER_THREAD_LOCAL char *OutputBufferRoot = NULL;
+static RELOOPER_THREAD_LOCAL char *OutputBuffer = NULL;
+static RELOOPER_THREAD_LOCAL int OutputBufferSize = 0;
+static RELOOPER_THREAD_LOCAL int OutputBufferOwned = false;
 
 static int LeftInOutputBuffer() {
   return OutputBufferSize - (OutputBuffer - OutputBufferRoot);
@@ -115,15 +126,17 @@ void PutIndented(const char *String) {
   *OutputBuffer = 0;
 }
 
-static int AsmJS = 0;
+static RELOOPER_THREAD_LOCAL int AsmJS = 0;
+
+static RELOOPER_THREAD_LOCAL unsigned NextBlockSerial = 0;
 
 // Indenter
 
-int Indenter::CurrIndent = 1;
+RELOOPER_THREAD_LOCAL int Indenter::CurrIndent = 1;
 
 // Branch
 
-Branch::Branch(const char *ConditionInit, const char *CodeInit) : Ancestor(NULL), Labeled(true) {
+Branch::Branch(const char *ConditionInit, const char *CodeInit) : Ancestor(NULL), Labeled(true), LabelNeeded(true) {
   Condition = ConditionInit ? strdup(ConditionInit) : NULL;
   Code = CodeInit ? strdup(CodeInit) : NULL;
 }
@@ -149,7 +162,7 @@ void Branch::Render(Block *Target, bool SetLabel) {
 
 // Block
 
-Block::Block(const char *CodeInit, const char *BranchVarInit) : Parent(NULL), Id(-1), IsCheckedMultipleEntry(false) {
+Block::Block(const char *CodeInit, const char *BranchVarInit) : Parent(NULL), Id(-1), IsCheckedMultipleEntry(false), LabelClearNeeded(true), Serial(NextBlockSerial++) {
   Code = strdup(CodeInit);
   BranchVar = BranchVarInit ? strdup(BranchVarInit) : NULL;
 }
@@ -169,7 +182,7 @@ void Block::AddBranchTo(Block *Target, const char *Condition, const char *Code)
 }
 
 void Block::Render(bool InLoop) {
-  if (IsCheckedMultipleEntry && InLoop) {
+  if (IsCheckedMultipleEntry && InLoop && LabelClearNeeded) {
     PrintIndented("label = 0;\n");
   }
 
@@ -203,17 +216,17 @@ void Block::Render(bool InLoop) {
   //
   // (Note that this case is impossible due to fusing, but that is not
   // material here.) So setting to 0 is important just to clear the 1 for
-  // future iterations.
-  // TODO: When inside a loop, if necessary clear the label variable
-  //       once on the top, and never do settings that are in effect clears
+  // future iterations. The post optimizations find the cases where neither
+  // the setting nor the clearing can be observed, see RemoveUnneededLabels.
 
   // Fusing: If the next is a Multiple, we can fuse it with this block. Note
   // that we must be the Inner of a Simple, so fusing means joining a Simple
   // to a Multiple. What happens there is that all options in the Multiple
   // *must* appear in the Simple (the Simple is the only one reaching the
   // Multiple), so we can remove the Multiple and add its independent groups
-  // into the Simple's branches.
-  MultipleShape *Fused = Shape::IsMultiple(Parent->Next);
+  // into the Simple's branches. (Blocks in an emulated region are not the
+  // only thing reaching the shape after that region, so they never fuse.)
+  MultipleShape *Fused = Shape::IsSimple(Parent) ? Shape::IsMultiple(Parent->Next) : NULL;
   if (Fused) {
     PrintDebug("Fusing Multiple to Simple\n");
     Parent->Next = Parent->Next->Next;
@@ -258,7 +271,7 @@ void Block::Render(bool InLoop) {
       Target = DefaultTarget;
       Details = ProcessedBranchesOut[DefaultTarget];
     }
-    bool SetCurrLabel = (SetLabel && Target->IsCheckedMultipleEntry) || ForceSetLabel;
+    bool SetCurrLabel = ((SetLabel && Target->IsCheckedMultipleEntry) || ForceSetLabel) && Details->LabelNeeded;
     bool HasFusedContent = Fused && contains(Fused->InnerMap, Target->Id);
     bool HasContent = SetCurrLabel || Details->Type != Branch::Direct || HasFusedContent || Details->Code;
     if (iter != ProcessedBranchesOut.end()) {
@@ -351,17 +364,30 @@ void MultipleShape::RenderLoopPostfix() {
   }
 }
 
-void MultipleShape::Render(bool InLoop) {
+void MultipleShape::RenderSelf(bool InLoop) {
   RenderLoopPrefix();
 
+  // If we are exhaustive, the label must be that of the last entry if it is
+  // none of the others, so we do not check it
+  IdShapeMap::iterator Unchecked = InnerMap.end();
+  if (Exhaustive) Unchecked--;
+
   if (!UseSwitch) {
     // emit an if-else chain
     bool First = true;
     for (IdShapeMap::iterator iter = InnerMap.begin(); iter != InnerMap.end(); iter++) {
-      if (AsmJS) {
-        PrintIndented("%sif ((label|0) == %d) {\n", First ? "" : "else ", iter->first);
+      if (iter != Unchecked) {
+        if (AsmJS) {
+          PrintIndented("%sif ((label|0) == %d) {\n", First ? "" : "else ", iter->first);
+        } else {
+          PrintIndented("%sif (label == %d) {\n", First ? "" : "else ", iter->first);
+        }
+      } else if (!First) {
+        PrintIndented("else {\n");
       } else {
-        PrintIndented("%sif (label == %d) {\n", First ? "" : "else ", iter->first);
+        // A single entry which is always reached
+        iter->second->Render(InLoop);
+        break;
       }
       First = false;
       Indenter::Indent();
@@ -378,7 +404,11 @@ void MultipleShape::Render(bool InLoop) {
     }
     Indenter::Indent();
     for (IdShapeMap::iterator iter = InnerMap.begin(); iter != InnerMap.end(); iter++) {
-      PrintIndented("case %d: {\n", iter->first);
+      if (iter != Unchecked) {
+        PrintIndented("case %d: {\n", iter->first);
+      } else {
+        PrintIndented("default: {\n");
+      }
       Indenter::Indent();
       iter->second->Render(InLoop);
       PrintIndented("break;\n");
@@ -390,12 +420,11 @@ void MultipleShape::Render(bool InLoop) {
   }
 
   RenderLoopPostfix();
-  if (Next) Next->Render(InLoop);
 }
 
 // LoopShape
 
-void LoopShape::Render(bool InLoop) {
+void LoopShape::RenderSelf(bool InLoop) {
   if (Labeled) {
     PrintIndented("L%d: while(1) {\n", Id);
   } else {
@@ -405,13 +434,14 @@ void LoopShape::Render(bool InLoop) {
   Inner->Render(true);
   Indenter::Unindent();
   PrintIndented("}\n");
-  if (Next) Next->Render(InLoop);
 }
 
 // EmulatedShape
 
-void EmulatedShape::Render(bool InLoop) {
-  PrintIndented("label = %d;\n", Entry->Id);
+void EmulatedShape::RenderSelf(bool InLoop) {
+  if (Entry) {
+    PrintIndented("label = %d;\n", Entry->Id);
+  }
   if (Labeled) {
     PrintIndented("L%d: ", Id);
   }
@@ -432,12 +462,12 @@ void EmulatedShape::Render(bool InLoop) {
   PrintIndented("}\n");
   Indenter::Unindent();
   PrintIndented("}\n");
-  if (Next) Next->Render(InLoop);
 }
 
 // Relooper
 
-Relooper::Relooper() : Root(NULL), Emulate(false), MinSize(false), BlockIdCounter(1), ShapeIdCounter(0) { // block ID 0 is reserved for clearings
+Relooper::Relooper() : Root(NULL), Emulate(false), MinSize(false), EmulateIrreducible(false), SplitIrreducible(false), SplitBudget(0),
+                       BlockIdCounter(1), ShapeIdCounter(0), RemovedLabelOps(0) { // block ID 0 is reserved for clearings
 }
 
 Relooper::~Relooper() {
@@ -543,6 +573,15 @@ void Relooper::Calculate(Block *Entry) {
 
   if (!Emulate && !MinSize) Pre.SplitDeadEnds();
 
+  if (SplitIrreducible && !Emulate && !MinSize) {
+    // Like splitting dead ends, do not let splitting increase code size by a significant amount
+    unsigned TotalCodeSize = 0;
+    for (BlockSet::iterator iter = Pre.Live.begin(); iter != Pre.Live.end(); iter++) {
+      TotalCodeSize += strlen((*iter)->Code);
+    }
+    SplitBudget = TotalCodeSize/5;
+  }
+
   // Recursively process the graph
 
   struct Analyzer : public RelooperRecursor {
@@ -622,18 +661,16 @@ void Relooper::Calculate(Block *Entry) {
       return Emulated;
     }
 
-    Shape *MakeLoop(BlockSet &Blocks, BlockSet& Entries, BlockSet &NextEntries) {
-      // Find the inner blocks in this loop. Proceed backwards from the entries until
-      // you reach a seen block, collecting as you go.
-      BlockSet InnerBlocks;
+    // Find the inner blocks in a loop. Proceed backwards from the entries until
+    // you reach a seen block, collecting as you go.
+    void FindLoopBlocks(BlockSet &Entries, BlockSet &InnerBlocks) {
       BlockSet Queue = Entries;
       while (Queue.size() > 0) {
         Block *Curr = *(Queue.begin());
         Queue.erase(Queue.begin());
         if (!contains(InnerBlocks, Curr)) {
-          // This element is new, mark it as inner and remove from outer
+          // This element is new, mark it as inner
           InnerBlocks.insert(Curr);
-          Blocks.erase(Curr);
           // Add the elements prior to it
           for (BlockSet::iterator iter = Curr->BranchesIn.begin(); iter != Curr->BranchesIn.end(); iter++) {
             Queue.insert(*iter);
@@ -650,6 +687,164 @@ void Relooper::Calculate(Block *Entry) {
 #endif
         }
       }
+    }
+
+    // Emulate an irreducible region: the loop formed by several entries, which
+    // cannot be split into independent groups. The region becomes a switch in a
+    // loop, and everything else is still relooped normally.
+    Shape *MakeEmulatedRegion(BlockSet &Blocks, BlockSet& Entries, BlockSet &NextEntries) {
+      BlockSet InnerBlocks;
+      FindLoopBlocks(Entries, InnerBlocks);
+      PrintDebug("creating emulated region with %d entries, %d blocks\n", Entries.size(), InnerBlocks.size());
+      EmulatedShape *Emulated = new EmulatedShape;
+      Notice(Emulated);
+      for (BlockSet::iterator iter = InnerBlocks.begin(); iter != InnerBlocks.end(); iter++) {
+        Block *Curr = *iter;
+        Blocks.erase(Curr);
+        Emulated->Blocks.insert(Curr);
+        Curr->Parent = Emulated;
+        for (BlockBranchMap::iterator iter = Curr->BranchesOut.begin(); iter != Curr->BranchesOut.end(); iter++) {
+          if (!contains(InnerBlocks, iter->first)) {
+            NextEntries.insert(iter->first);
+          }
+        }
+      }
+      // Reaching us requires the label to be set, which selects the block to run
+      for (BlockSet::iterator iter = Entries.begin(); iter != Entries.end(); iter++) {
+        (*iter)->IsCheckedMultipleEntry = true;
+      }
+      // Branches inside the region continue the switch-loop, and branches out of it break it
+      for (BlockSet::iterator iter = InnerBlocks.begin(); iter != InnerBlocks.end(); iter++) {
+        Solipsize(*iter, Branch::Continue, Emulated, InnerBlocks);
+      }
+      for (BlockSet::iterator iter = NextEntries.begin(); iter != NextEntries.end(); iter++) {
+        Solipsize(*iter, Branch::Break, Emulated, InnerBlocks);
+      }
+      return Emulated;
+    }
+
+    // Find the blocks that must be copied to make Entry reach the rest of an
+    // irreducible region only through Main: everything Entry can reach in the
+    // region without passing through Main.
+    void FindSplitBlocks(Block *Entry, Block *Main, BlockSet &Region, BlockSet &Split) {
+      BlockList Queue;
+      Queue.push_back(Entry);
+      while (Queue.size() > 0) {
+        Block *Curr = Queue.front();
+        Queue.pop_front();
+        if (contains(Split, Curr)) continue;
+        Split.insert(Curr);
+        for (BlockBranchMap::iterator iter = Curr->BranchesOut.begin(); iter != Curr->BranchesOut.end(); iter++) {
+          Block *Target = iter->first;
+          if (Target != Main && contains(Region, Target)) {
+            Queue.push_back(Target);
+          }
+        }
+      }
+    }
+
+    static unsigned GetCodeSize(BlockSet &Blocks) {
+      unsigned Size = 0;
+      for (BlockSet::iterator iter = Blocks.begin(); iter != Blocks.end(); iter++) {
+        Size += strlen((*iter)->Code);
+      }
+      return Size;
+    }
+
+    // Try to make an irreducible region reducible by node splitting: we keep one
+    // entry as the main one, and the other entries, when reached from outside,
+    // go to copies of the blocks they reach before they get to the main entry.
+    // Returns whether we split, in which case NewEntries is set to the entries
+    // we now have.
+    bool SplitIrreducibleRegion(BlockSet &Blocks, BlockSet &Entries, BlockSet &NewEntries) {
+      BlockSet InnerBlocks;
+      FindLoopBlocks(Entries, InnerBlocks);
+      // Pick the main entry that needs the least code copied
+      Block *Main = NULL;
+      unsigned MainCost = 0;
+      for (BlockSet::iterator iter = Entries.begin(); iter != Entries.end(); iter++) {
+        unsigned Cost = 0;
+        for (BlockSet::iterator iterOther = Entries.begin(); iterOther != Entries.end(); iterOther++) {
+          if (*iterOther == *iter) continue;
+          BlockSet Split;
+          FindSplitBlocks(*iterOther, *iter, InnerBlocks, Split);
+          Cost += GetCodeSize(Split) + Split.size(); // count blocks too, so even empty ones use up the budget
+        }
+        if (!Main || Cost < MainCost) {
+          Main = *iter;
+          MainCost = Cost;
+        }
+      }
+      if (MainCost > Parent->SplitBudget) return false;
+      Parent->SplitBudget -= MainCost;
+      PrintDebug("splitting irreducible region with main entry %d, copying %d bytes\n", Main->Id, MainCost);
+
+      NewEntries.clear();
+      NewEntries.insert(Main);
+      for (BlockSet::iterator iter = Entries.begin(); iter != Entries.end(); iter++) {
+        Block *Entry = *iter;
+        if (Entry == Main) continue;
+        BlockSet Split;
+        FindSplitBlocks(Entry, Main, InnerBlocks, Split);
+        // Create the copies. Unlike when splitting dead ends, these get new ids: a copy
+        // and its original may both be reached in a single run through the code, and
+        // the label must tell them apart.
+        std::map<Block*, Block*> Copies;
+        for (BlockSet::iterator iter = Split.begin(); iter != Split.end(); iter++) {
+          Block *Original = *iter;
+          Block *Copy = new Block(Original->Code, Original->BranchVar);
+          Parent->AddBlock(Copy);
+          Copies[Original] = Copy;
+          Blocks.insert(Copy);
+        }
+        for (BlockSet::iterator iter = Split.begin(); iter != Split.end(); iter++) {
+          Block *Original = *iter;
+          Block *Copy = Copies[Original];
+          for (BlockBranchMap::iterator iter = Original->BranchesOut.begin(); iter != Original->BranchesOut.end(); iter++) {
+            Block *Target = contains(Copies, iter->first) ? Copies[iter->first] : iter->first;
+            Branch *Details = iter->second;
+            Copy->BranchesOut[Target] = new Branch(Details->Condition, Details->Code);
+            Target->BranchesIn.insert(Copy);
+          }
+          // Branches already processed (to outer loops, etc.) are copied as they are
+          for (BlockBranchMap::iterator iter = Original->ProcessedBranchesOut.begin(); iter != Original->ProcessedBranchesOut.end(); iter++) {
+            Block *Target = iter->first;
+            Branch *Details = iter->second;
+            Branch *New = new Branch(Details->Condition, Details->Code);
+            New->Ancestor = Details->Ancestor;
+            New->Type = Details->Type;
+            New->Labeled = Details->Labeled;
+            if (MultipleShape *Multiple = Shape::IsMultiple(New->Ancestor)) {
+              Multiple->Breaks++;
+            }
+            Copy->ProcessedBranchesOut[Target] = New;
+            Target->ProcessedBranchesIn.insert(Copy);
+          }
+        }
+        // Branches into the entry from before the region now go to the copy
+        Block *EntryCopy = Copies[Entry];
+        for (BlockSet::iterator iter = Entry->ProcessedBranchesIn.begin(); iter != Entry->ProcessedBranchesIn.end();) {
+          Block *Prior = *iter;
+          iter++; // carefully increment iter before erasing
+          if (contains(InnerBlocks, Prior)) continue;
+          Prior->ProcessedBranchesOut[EntryCopy] = Prior->ProcessedBranchesOut[Entry];
+          Prior->ProcessedBranchesOut.erase(Entry);
+          Entry->ProcessedBranchesIn.erase(Prior);
+          EntryCopy->ProcessedBranchesIn.insert(Prior);
+        }
+        NewEntries.insert(EntryCopy);
+      }
+      return true;
+    }
+
+    Shape *MakeLoop(BlockSet &Blocks, BlockSet& Entries, BlockSet &NextEntries) {
+      // Find the inner blocks in this loop, and remove them from the outer ones
+      BlockSet InnerBlocks;
+      FindLoopBlocks(Entries, InnerBlocks);
+      for (BlockSet::iterator iter = InnerBlocks.begin(); iter != InnerBlocks.end(); iter++) {
+        Block *Curr = *iter;
+        Blocks.erase(Curr);
+      }
       assert(InnerBlocks.size() > 0);
 
       for (BlockSet::iterator iter = InnerBlocks.begin(); iter != InnerBlocks.end(); iter++) {
@@ -891,11 +1086,14 @@ void Relooper::Calculate(Block *Entry) {
         }
       }
       DebugDump(Blocks, "  remaining blocks after multiple:");
-      // Add entries not handled as next entries, they are deferred
+      // Add entries not handled as next entries, they are deferred. If there are
+      // none, then control flow only reaches us through our own entries
+      Multiple->Exhaustive = true;
       for (BlockSet::iterator iter = Entries.begin(); iter != Entries.end(); iter++) {
         Block *Entry = *iter;
         if (!contains(IndependentGroups, Entry)) {
           NextEntries.insert(Entry);
+          Multiple->Exhaustive = false;
         }
       }
       // The multiple has been created, we can decide how to implement it
@@ -1026,7 +1224,19 @@ void Relooper::Calculate(Block *Entry) {
             Make(MakeMultiple(Blocks, *Entries, IndependentGroups, Prev, *NextEntries));
           }
         }
-        // No independent groups, must be loopable ==> Loop
+        // No independent groups, so the entries are part of a loop with more than one
+        // entry, which is irreducible control flow. If it is small, we can split nodes to
+        // make it reducible (SplitBudget is 0 when optimizing for size); otherwise, we can
+        // emulate just this region.
+        if (Parent->SplitBudget > 0 && SplitIrreducibleRegion(Blocks, *Entries, *NextEntries)) {
+          // Continue with the new entries, in which the copies replace the original blocks
+          Entries = NextEntries;
+          continue;
+        }
+        if (Parent->EmulateIrreducible) {
+          Make(MakeEmulatedRegion(Blocks, *Entries, *NextEntries));
+        }
+        // Otherwise, it must be loopable ==> Loop
         Make(MakeLoop(Blocks, *Entries, *NextEntries));
       }
     }
@@ -1052,74 +1262,123 @@ void Relooper::Calculate(Block *Entry) {
 
   struct PostOptimizer {
     Relooper *Parent;
-    void *Closure;
 
-    PostOptimizer(Relooper *ParentInit) : Parent(ParentInit), Closure(NULL) {}
+    PostOptimizer(Relooper *ParentInit) : Parent(ParentInit) {}
 
-    #define RECURSE_Multiple(shape, func) \
-      for (IdShapeMap::iterator iter = shape->InnerMap.begin(); iter != shape->InnerMap.end(); iter++) { \
-        func(iter->second); \
-      }
-    #define RECURSE_Loop(shape, func) \
-      func(shape->Inner);
-    #define RECURSE(shape, func) RECURSE_##shape(shape, func);
+    // All the traversals here use explicit worklists rather than recursion, both
+    // on Next chains (which can be extremely long in machine-generated code)
+    // and into nested shapes.
 
-    #define SHAPE_SWITCH(var, simple, multiple, loop) \
+    #define SHAPE_SWITCH(var, simple, multiple, loop, emulated) \
       if (SimpleShape *Simple = Shape::IsSimple(var)) { \
         simple; \
       } else if (MultipleShape *Multiple = Shape::IsMultiple(var)) { \
         multiple; \
       } else if (LoopShape *Loop = Shape::IsLoop(var)) { \
         loop; \
+      } else if (EmulatedShape *Emulated = Shape::IsEmulated(var)) { \
+        emulated; \
       }
 
     // Find the blocks that natural control flow can get us directly to, or through a multiple that we ignore
     void FollowNaturalFlow(Shape *S, BlockSet &Out) {
-      SHAPE_SWITCH(S, {
-        Out.insert(Simple->Inner);
-      }, {
-        for (IdShapeMap::iterator iter = Multiple->InnerMap.begin(); iter != Multiple->InnerMap.end(); iter++) {
-          FollowNaturalFlow(iter->second, Out);
-        }
-        FollowNaturalFlow(Multiple->Next, Out);
-      }, {
-        FollowNaturalFlow(Loop->Inner, Out);
-      });
+      std::vector<Shape*> Work;
+      Work.push_back(S);
+      while (Work.size() > 0) {
+        Shape *Curr = Work.back();
+        Work.pop_back();
+        SHAPE_SWITCH(Curr, {
+          Out.insert(Simple->Inner);
+        }, {
+          for (IdShapeMap::iterator iter = Multiple->InnerMap.begin(); iter != Multiple->InnerMap.end(); iter++) {
+            Work.push_back(iter->second);
+          }
+          Work.push_back(Multiple->Next);
+        }, {
+          Work.push_back(Loop->Inner);
+        }, {
+          // An emulated region is entered through the label, not naturally
+        });
+      }
     }
 
-    void FindNaturals(Shape *Root, Shape *Otherwise=NULL) {
-      if (Root->Next) {
-        Root->Natural = Root->Next;
-        FindNaturals(Root->Next, Otherwise);
-      } else {
-        Root->Natural = Otherwise;
+    void FindNaturals(Shape *Root) {
+      // Each item is a chain of shapes, and where control flow goes after the chain ends
+      typedef std::pair<Shape*, Shape*> ShapeOtherwise;
+      std::vector<ShapeOtherwise> Work;
+      Work.push_back(ShapeOtherwise(Root, (Shape*)NULL));
+      while (Work.size() > 0) {
+        Shape *Curr = Work.back().first;
+        Shape *Otherwise = Work.back().second;
+        Work.pop_back();
+        for (; Curr; Curr = Curr->Next) {
+          Curr->Natural = Curr->Next ? Curr->Next : Otherwise;
+
+          SHAPE_SWITCH(Curr, {
+          }, {
+            for (IdShapeMap::iterator iter = Multiple->InnerMap.begin(); iter != Multiple->InnerMap.end(); iter++) {
+              Work.push_back(ShapeOtherwise(iter->second, Curr->Natural));
+            }
+          }, {
+            Work.push_back(ShapeOtherwise(Loop->Inner, Loop->Inner));
+          }, {
+          });
+        }
       }
+    }
 
-      SHAPE_SWITCH(Root, {
-      }, {
-        for (IdShapeMap::iterator iter = Multiple->InnerMap.begin(); iter != Multiple->InnerMap.end(); iter++) {
-          FindNaturals(iter->second, Root->Natural);
-        }
-      }, {
-        FindNaturals(Loop->Inner, Loop->Inner);
-      });
+    // The state of a walk along one chain of shapes in RemoveUnneededFlows. When
+    // we reach a Multiple we visit its inner shapes one at a time, each to
+    // completion, before continuing along the chain.
+    struct FlowState {
+      Shape *Curr;
+      LoopShape *LastLoop;
+      unsigned Depth;
+      BlockSet NaturalBlocks;
+      MultipleShape *InMultiple; // if not NULL, we are visiting the inner shapes of this
+      IdShapeMap::iterator NextInner;
+
+      FlowState(Shape *CurrInit, LoopShape *LastLoopInit, unsigned DepthInit) :
+        Curr(CurrInit), LastLoop(LastLoopInit), Depth(DepthInit), InMultiple(NULL) {}
+    };
+
+    typedef std::deque<FlowState> FlowStack; // a deque, so references to the back stay valid as we push
+
+    void PushFlow(FlowStack &Work, Shape *Root, Shape *Natural, LoopShape *LastLoop, unsigned Depth) {
+      Work.push_back(FlowState(Root, LastLoop, Depth));
+      FollowNaturalFlow(Natural, Work.back().NaturalBlocks);
     }
 
     // Remove unneeded breaks and continues.
     // A flow operation is trivially unneeded if the shape we naturally get to by normal code
     // execution is the same as the flow forces us to.
-    void RemoveUnneededFlows(Shape *Root, Shape *Natural=NULL, LoopShape *LastLoop=NULL, unsigned Depth=0) {
-      BlockSet NaturalBlocks;
-      FollowNaturalFlow(Natural, NaturalBlocks);
-      Shape *Next = Root;
-      while (Next) {
-        Root = Next;
-        Next = NULL;
+    void RemoveUnneededFlows(Shape *Root) {
+      FlowStack Work;
+      PushFlow(Work, Root, NULL, NULL, 0);
+      while (Work.size() > 0) {
+        FlowState &State = Work.back();
+        if (State.InMultiple) {
+          MultipleShape *Multiple = State.InMultiple;
+          if (State.NextInner != Multiple->InnerMap.end()) {
+            Shape *Inner = (State.NextInner++)->second;
+            // Note that Breaks is read only now, after the previous inner shapes were optimized
+            PushFlow(Work, Inner, Multiple->Next, Multiple->Breaks ? NULL : State.LastLoop, State.Depth+1);
+            continue;
+          }
+          State.InMultiple = NULL;
+          State.Curr = Multiple->Next;
+        }
+        if (!State.Curr) {
+          Work.pop_back();
+          continue;
+        }
+        Shape *Root = State.Curr;
+        State.Curr = NULL;
         SHAPE_SWITCH(Root, {
-          if (Simple->Inner->BranchVar) LastLoop = NULL; // a switch clears out the loop (TODO: only for breaks, not continue)
+          if (Simple->Inner->BranchVar) State.LastLoop = NULL; // a switch clears out the loop (TODO: only for breaks, not continue)
 
           if (Simple->Next) {
-            if (!Simple->Inner->BranchVar && Simple->Inner->ProcessedBranchesOut.size() == 2 && Depth < 20) {
+            if (!Simple->Inner->BranchVar && Simple->Inner->ProcessedBranchesOut.size() == 2 && State.Depth < 20) {
               // If there is a next block, we already know at Simple creation time to make direct branches,
               // and we can do nothing more in general. But, we try to optimize the case of a break and
               // a direct: This would normally be  if (break?) { break; } ..  but if we
@@ -1135,14 +1394,13 @@ void Relooper::Calculate(Block *Entry) {
                 Branch *Details = iter->second;
                 if (Details->Type == Branch::Break) {
                   Found = true;
-                  if (!contains(NaturalBlocks, Target)) Abort = true;
+                  if (!contains(State.NaturalBlocks, Target)) Abort = true;
                 } else if (Details->Type != Branch::Direct) {
                   Abort = true;
                 }
               }
               if (Found && !Abort) {
                 for (BlockBranchMap::iterator iter = Simple->Inner->ProcessedBranchesOut.begin(); iter != Simple->Inner->ProcessedBranchesOut.end(); iter++) {
-                  Block *Target = iter->first;
                   Branch *Details = iter->second;
                   if (Details->Type == Branch::Break) {
                     Details->Type = Branch::Direct;
@@ -1155,21 +1413,21 @@ void Relooper::Calculate(Block *Entry) {
                   }
                 }
               }
-              Depth++; // this optimization increases depth, for us and all our next chain (i.e., until this call returns)
+              State.Depth++; // this optimization increases depth, for us and all the rest of our chain
             }
-            Next = Simple->Next;
+            State.Curr = Simple->Next;
           } else {
             // If there is no next then Natural is where we will
             // go to by doing nothing, so we can potentially optimize some branches to direct.
             for (BlockBranchMap::iterator iter = Simple->Inner->ProcessedBranchesOut.begin(); iter != Simple->Inner->ProcessedBranchesOut.end(); iter++) {
               Block *Target = iter->first;
               Branch *Details = iter->second;
-              if (Details->Type != Branch::Direct && contains(NaturalBlocks, Target)) { // note: cannot handle split blocks
+              if (Details->Type != Branch::Direct && contains(State.NaturalBlocks, Target)) { // note: cannot handle split blocks
                 Details->Type = Branch::Direct;
                 if (MultipleShape *Multiple = Shape::IsMultiple(Details->Ancestor)) {
                   Multiple->Breaks--;
                 }
-              } else if (Details->Type == Branch::Break && LastLoop && LastLoop->Natural == Details->Ancestor->Natural) {
+              } else if (Details->Type == Branch::Break && State.LastLoop && State.LastLoop->Natural == Details->Ancestor->Natural) {
                 // it is important to simplify breaks, as simpler breaks enable other optimizations
                 Details->Labeled = false;
                 if (MultipleShape *Multiple = Shape::IsMultiple(Details->Ancestor)) {
@@ -1179,98 +1437,222 @@ void Relooper::Calculate(Block *Entry) {
             }
           }
         }, {
-          for (IdShapeMap::iterator iter = Multiple->InnerMap.begin(); iter != Multiple->InnerMap.end(); iter++) {
-            RemoveUnneededFlows(iter->second, Multiple->Next, Multiple->Breaks ? NULL : LastLoop, Depth+1);
-          }
-          Next = Multiple->Next;
+          State.InMultiple = Multiple;
+          State.NextInner = Multiple->InnerMap.begin();
+        }, {
+          // Continue along our chain after the loop's inner shapes are done
+          State.Curr = Loop->Next;
+          PushFlow(Work, Loop->Inner, Loop->Inner, Loop, State.Depth+1);
         }, {
-          RemoveUnneededFlows(Loop->Inner, Loop->Inner, Loop, Depth+1);
-          Next = Loop->Next;
+          // All the branches in an emulated region are needed, as they go through the switch
+          State.Curr = Emulated->Next;
         });
       }
     }
 
-    // After we know which loops exist, we can calculate which need to be labeled
-    void FindLabeledLoops(Shape *Root) {
-      bool First = Closure == NULL;
-      if (First) {
-        Closure = (void*)(new std::stack<Shape*>);
+    // Mark the branches of a block that need a label, and the shapes they need
+    void FindLabeledBranches(Block *Curr, std::stack<Shape*> &LoopStack) {
+      for (BlockBranchMap::iterator iter = Curr->ProcessedBranchesOut.begin(); iter != Curr->ProcessedBranchesOut.end(); iter++) {
+        Branch *Details = iter->second;
+        if (Details->Type == Branch::Break || Details->Type == Branch::Continue) {
+          assert(LoopStack.size() > 0);
+          if (Details->Ancestor != LoopStack.top() && Details->Labeled) {
+            LabeledShape *Labeled = Shape::IsLabeled(Details->Ancestor);
+            Labeled->Labeled = true;
+          } else {
+            Details->Labeled = false;
+          }
+        }
       }
-      std::stack<Shape*> &LoopStack = *((std::stack<Shape*>*)Closure);
+    }
 
-      Shape *Next = Root;
-      while (Next) {
-        Root = Next;
-        Next = NULL;
+    // After we know which loops exist, we can calculate which need to be labeled
+    void FindLabeledLoops(Shape *Root) {
+      std::stack<Shape*> LoopStack;
+
+      // Work items are either a chain of shapes to visit, or (when Chain is NULL)
+      // a number of entries to pop off LoopStack once the items above are done
+      struct LabelWork {
+        Shape *Chain;
+        int Pops;
+        LabelWork(Shape *ChainInit, int PopsInit=0) : Chain(ChainInit), Pops(PopsInit) {}
+      };
+      std::vector<LabelWork> Work;
+      Work.push_back(LabelWork(Root));
+
+      while (Work.size() > 0) {
+        LabelWork Item = Work.back();
+        Work.pop_back();
+        if (!Item.Chain) {
+          for (int i = 0; i < Item.Pops; i++) LoopStack.pop();
+          continue;
+        }
 
-        SHAPE_SWITCH(Root, {
-          MultipleShape *Fused = Shape::IsMultiple(Root->Next);
-          // If we are fusing a Multiple with a loop into this Simple, then visit it now
-          if (Fused && Fused->Breaks) {
-            LoopStack.push(Fused);
-          }
-          if (Simple->Inner->BranchVar) {
-            LoopStack.push(NULL); // a switch means breaks are now useless, push a dummy
-          }
-          if (Fused) {
-            if (Fused->UseSwitch) {
+        Shape *Next = Item.Chain;
+        while (Next) {
+          Root = Next;
+          Next = NULL;
+
+          // Shapes with nested content schedule it, then the popping of what
+          // they pushed, then the rest of the chain, so the nested content is
+          // visited first
+          MultipleShape *InnerMultiple = NULL;
+          Shape *Inner = NULL;
+          int Pushed = 0;
+
+          SHAPE_SWITCH(Root, {
+            MultipleShape *Fused = Shape::IsMultiple(Root->Next);
+            // If we are fusing a Multiple with a loop into this Simple, then visit it now
+            if (Fused && Fused->Breaks) {
+              LoopStack.push(Fused);
+              Pushed++;
+            }
+            if (Simple->Inner->BranchVar) {
               LoopStack.push(NULL); // a switch means breaks are now useless, push a dummy
+              Pushed++;
             }
-            RECURSE_Multiple(Fused, FindLabeledLoops);
-          }
-          for (BlockBranchMap::iterator iter = Simple->Inner->ProcessedBranchesOut.begin(); iter != Simple->Inner->ProcessedBranchesOut.end(); iter++) {
-            Block *Target = iter->first;
-            Branch *Details = iter->second;
-            if (Details->Type == Branch::Break || Details->Type == Branch::Continue) {
-              assert(LoopStack.size() > 0);
-              if (Details->Ancestor != LoopStack.top() && Details->Labeled) {
-                LabeledShape *Labeled = Shape::IsLabeled(Details->Ancestor);
-                Labeled->Labeled = true;
-              } else {
-                Details->Labeled = false;
+            if (Fused) {
+              if (Fused->UseSwitch) {
+                LoopStack.push(NULL); // a switch means breaks are now useless, push a dummy
+                Pushed++;
               }
+              InnerMultiple = Fused;
             }
-          }
-          if (Fused && Fused->UseSwitch) {
-            LoopStack.pop();
-          }
-          if (Simple->Inner->BranchVar) {
-            LoopStack.pop();
-          }
-          if (Fused && Fused->Breaks) {
-            LoopStack.pop();
-          }
-          if (Fused) {
-            Next = Fused->Next;
-          } else {
+            FindLabeledBranches(Simple->Inner, LoopStack);
+            if (Fused) {
+              Next = Fused->Next;
+            } else {
+              Next = Root->Next;
+            }
+          }, {
+            if (Multiple->Breaks) {
+              LoopStack.push(Multiple);
+              Pushed++;
+            }
+            InnerMultiple = Multiple;
             Next = Root->Next;
-          }
-        }, {
-          if (Multiple->Breaks) {
-            LoopStack.push(Multiple);
-          }
-          RECURSE(Multiple, FindLabeledLoops);
-          if (Multiple->Breaks) {
+          }, {
+            LoopStack.push(Loop);
+            Pushed++;
+            Inner = Loop->Inner;
+            Next = Root->Next;
+          }, {
+            // Blocks are rendered inside a switch in the emulated loop, so breaks are
+            // useless and continues may also be needed for enclosing loops: push a dummy
+            LoopStack.push(NULL);
+            for (BlockSet::iterator iter = Emulated->Blocks.begin(); iter != Emulated->Blocks.end(); iter++) {
+              FindLabeledBranches(*iter, LoopStack);
+            }
             LoopStack.pop();
+            Next = Root->Next;
+          });
+
+          if (InnerMultiple || Inner) {
+            Work.push_back(LabelWork(Next));
+            Work.push_back(LabelWork(NULL, Pushed));
+            if (Inner) {
+              Work.push_back(LabelWork(Inner));
+            } else {
+              // Push in reverse, so the inner shapes are visited in order
+              for (IdShapeMap::reverse_iterator iter = InnerMultiple->InnerMap.rbegin(); iter != InnerMultiple->InnerMap.rend(); iter++) {
+                Work.push_back(LabelWork(iter->second));
+              }
+            }
+            break;
           }
-          Next = Root->Next;
-        }, {
-          LoopStack.push(Loop);
-          RECURSE(Loop, FindLabeledLoops);
-          LoopStack.pop();
-          Next = Root->Next;
-        });
+          for (int i = 0; i < Pushed; i++) LoopStack.pop();
+        }
       }
+    }
 
-      if (First) {
-        delete (std::stack<Shape*>*)Closure;
+    // Remove label operations whose effect cannot be observed. The label is only
+    // read by the checks of Multiples that are not fused, and the switches of
+    // emulated regions, so
+    //  * A checked entry in a loop need not clear the label if it is always
+    //    written again before it is next read. That is the case when its
+    //    Multiple is exhaustive (we always set the label to get to it), all of
+    //    its own branches set the label, or it is in an emulated region (whose
+    //    blocks are only reached through branches that set it).
+    //  * A branch out of an emulated region need not set the label if the
+    //    target is not checked.
+    //  * The last check of an exhaustive Multiple always succeeds.
+    void RemoveUnneededLabels(Shape *Root) {
+      // Each item is a chain of shapes, and whether it is rendered inside a loop
+      typedef std::pair<Shape*, bool> ShapeInLoop;
+      std::vector<ShapeInLoop> Work;
+      Work.push_back(ShapeInLoop(Root, false));
+      while (Work.size() > 0) {
+        Shape *Curr = Work.back().first;
+        bool InLoop = Work.back().second;
+        Work.pop_back();
+        for (Shape *Prev = NULL; Curr; Prev = Curr, Curr = Curr->Next) {
+          SHAPE_SWITCH(Curr, {
+            Block *Inner = Simple->Inner;
+            // If we fuse a Multiple, we may not set the label on some branches
+            if (Inner->IsCheckedMultipleEntry && InLoop && Inner->LabelClearNeeded && !Shape::IsMultiple(Simple->Next)) {
+              bool AllSet = true;
+              for (BlockBranchMap::iterator iter = Inner->ProcessedBranchesOut.begin(); iter != Inner->ProcessedBranchesOut.end(); iter++) {
+                if (!iter->first->IsCheckedMultipleEntry) {
+                  AllSet = false;
+                  break;
+                }
+              }
+              // A block without branches is a dead end, or leaves the relooped code
+              if (AllSet && Inner->ProcessedBranchesOut.size() > 0) {
+                RemoveLabelClear(Inner);
+              }
+            }
+          }, {
+            // A fused Multiple does not check the label
+            if (Multiple->Exhaustive && !Shape::IsSimple(Prev)) {
+              Parent->RemovedLabelOps++;
+              if (InLoop) {
+                for (IdShapeMap::iterator iter = Multiple->InnerMap.begin(); iter != Multiple->InnerMap.end(); iter++) {
+                  BlockSet Entries;
+                  FollowNaturalFlow(iter->second, Entries);
+                  for (BlockSet::iterator iter2 = Entries.begin(); iter2 != Entries.end(); iter2++) {
+                    Block *Entry = *iter2;
+                    if (Entry->Id == iter->first && Entry->IsCheckedMultipleEntry && Entry->LabelClearNeeded) {
+                      RemoveLabelClear(Entry);
+                    }
+                  }
+                }
+              }
+            }
+            for (IdShapeMap::iterator iter = Multiple->InnerMap.begin(); iter != Multiple->InnerMap.end(); iter++) {
+              Work.push_back(ShapeInLoop(iter->second, InLoop));
+            }
+          }, {
+            Work.push_back(ShapeInLoop(Loop->Inner, true));
+          }, {
+            for (BlockSet::iterator iter = Emulated->Blocks.begin(); iter != Emulated->Blocks.end(); iter++) {
+              Block *Curr = *iter;
+              if (Curr->IsCheckedMultipleEntry && InLoop && Curr->LabelClearNeeded) {
+                RemoveLabelClear(Curr);
+              }
+              for (BlockBranchMap::iterator iter2 = Curr->ProcessedBranchesOut.begin(); iter2 != Curr->ProcessedBranchesOut.end(); iter2++) {
+                Block *Target = iter2->first;
+                if (Target->Parent != Emulated && !Target->IsCheckedMultipleEntry) {
+                  iter2->second->LabelNeeded = false;
+                  Parent->RemovedLabelOps++;
+                }
+              }
+            }
+          });
+        }
       }
     }
 
+    void RemoveLabelClear(Block *Curr) {
+      Curr->LabelClearNeeded = false;
+      Parent->RemovedLabelOps++;
+    }
+
     void Process(Shape *Root) {
       FindNaturals(Root);
       RemoveUnneededFlows(Root);
       FindLabeledLoops(Root);
+      RemoveUnneededLabels(Root);
     }
   };
 
@@ -1338,6 +1720,8 @@ void Debugging::Dump(Shape *S, const char *prefix) {
     }
   }, {
     printf("<< Loop\n");
+  }, {
+    printf("<< Emulated\n");
   });
 }
 
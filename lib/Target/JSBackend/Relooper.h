@@ -35,6 +35,7 @@ struct Branch {
   bool Labeled; // If a break or continue, whether we need to use a label
   const char *Condition; // The condition for which we branch. For example, "my_var == 1". Conditions are checked one by one. One of the conditions should have NULL as the condition, in which case it is the default
   const char *Code; // If provided, code that is run right before the branch is taken. This is useful for phis
+  bool LabelNeeded; // If false, setting the label on this branch can never be observed, so we do not do it (see RemoveUnneededLabels)
 
   Branch(const char *ConditionInit, const char *CodeInit=NULL);
   ~Branch();
@@ -43,8 +44,14 @@ struct Branch {
   void Render(Block *Target, bool SetLabel);
 };
 
-typedef std::set<Block*> BlockSet;
-typedef std::map<Block*, Branch*> BlockBranchMap;
+// Sets and maps of blocks are ordered by when the blocks were created, not by
+// their addresses, so that the output does not depend on the allocator.
+struct BlockCompare {
+  bool operator()(const Block *A, const Block *B) const;
+};
+
+typedef std::set<Block*, BlockCompare> BlockSet;
+typedef std::map<Block*, Branch*, BlockCompare> BlockBranchMap;
 
 // Represents a basic block of code - some instructions that end with a
 // control flow modifier (a branch, return or throw).
@@ -63,6 +70,8 @@ struct Block {
   const char *Code; // The string representation of the code in this block. Owning pointer (we copy the input)
   const char *BranchVar; // A variable whose value determines where we go; if this is not NULL, emit a switch on that variable
   bool IsCheckedMultipleEntry; // If true, we are a multiple entry, so reaching us requires setting the label variable
+  bool LabelClearNeeded; // If false, there is no need to clear the label when we are a checked entry reached in a loop
+  unsigned Serial; // Order of creation, see BlockCompare
 
   Block(const char *CodeInit, const char *BranchVarInit);
   ~Block();
@@ -113,12 +122,24 @@ struct Shape {
   Shape(ShapeType TypeInit) : Id(-1), Next(NULL), Type(TypeInit) {}
   virtual ~Shape() {}
 
-  virtual void Render(bool InLoop) = 0;
+  // Renders this shape and then the chain of shapes after it. We iterate on
+  // Next instead of recursing, as the chain can be very long. Note that Next
+  // is read only after rendering a shape, as fusing and nesting modify it.
+  void Render(bool InLoop) {
+    Shape *Curr = this;
+    while (Curr) {
+      Curr->RenderSelf(InLoop);
+      Curr = Curr->Next;
+    }
+  }
+
+  // Renders just this shape (and what is nested in it), but not Next
+  virtual void RenderSelf(bool InLoop) = 0;
 
   static SimpleShape *IsSimple(Shape *It) { return It && It->Type == Simple ? (SimpleShape*)It : NULL; }
   static MultipleShape *IsMultiple(Shape *It) { return It && It->Type == Multiple ? (MultipleShape*)It : NULL; }
   static LoopShape *IsLoop(Shape *It) { return It && It->Type == Loop ? (LoopShape*)It : NULL; }
-  static LabeledShape *IsLabeled(Shape *It) { return IsMultiple(It) || IsLoop(It) ? (LabeledShape*)It : NULL; }
+  static LabeledShape *IsLabeled(Shape *It) { return IsMultiple(It) || IsLoop(It) || IsEmulated(It) ? (LabeledShape*)It : NULL; }
   static EmulatedShape *IsEmulated(Shape *It) { return It && It->Type == Emulated ? (EmulatedShape*)It : NULL; }
 };
 
@@ -126,9 +147,8 @@ struct SimpleShape : public Shape {
   Block *Inner;
 
   SimpleShape() : Shape(Simple), Inner(NULL) {}
-  void Render(bool InLoop) {
+  void RenderSelf(bool InLoop) {
     Inner->Render(InLoop);
-    if (Next) Next->Render(InLoop);
   }
 };
 
@@ -147,30 +167,34 @@ struct MultipleShape : public LabeledShape {
   int Breaks; // If we have branches on us, we need a loop (or a switch). This is a counter of requirements,
                      // if we optimize it to 0, the loop is unneeded
   bool UseSwitch; // Whether to switch on label as opposed to an if-else chain
+  bool Exhaustive; // If true, we are only reached by branches to our entries, so the label always holds one of them
+                   // and there is no need to check the last one
 
-  MultipleShape() : LabeledShape(Multiple), Breaks(0), UseSwitch(false) {}
+  MultipleShape() : LabeledShape(Multiple), Breaks(0), UseSwitch(false), Exhaustive(false) {}
 
   void RenderLoopPrefix();
   void RenderLoopPostfix();
 
-  void Render(bool InLoop);
+  void RenderSelf(bool InLoop);
 };
 
 struct LoopShape : public LabeledShape {
   Shape *Inner;
 
   LoopShape() : LabeledShape(Loop), Inner(NULL) {}
-  void Render(bool InLoop);
+  void RenderSelf(bool InLoop);
 };
 
-// TODO EmulatedShape is only partially functional. Currently it can be used for the
-//      entire set of blocks being relooped, but not subsets.
+// An EmulatedShape is used either for the entire set of blocks being relooped
+// (when emulating everything), or for an irreducible region inside the function.
+// In the latter case there is no single Entry, and we are entered with the label
+// already set by our predecessors, as with the entries of a Multiple.
 struct EmulatedShape : public LabeledShape {
-  Block *Entry;
+  Block *Entry; // If NULL, we have several entries, and the label is set when we are reached
   BlockSet Blocks;
 
-  EmulatedShape() : LabeledShape(Emulated) { Labeled = true; }
-  void Render(bool InLoop);
+  EmulatedShape() : LabeledShape(Emulated), Entry(NULL) { Labeled = true; }
+  void RenderSelf(bool InLoop);
 };
 
 // Implements the relooper algorithm for a function's blocks.
@@ -190,8 +214,12 @@ struct Relooper {
   Shape *Root;
   bool Emulate;
   bool MinSize;
+  bool EmulateIrreducible;
+  bool SplitIrreducible;
+  unsigned SplitBudget; // How much code we may still add by splitting irreducible regions
   int BlockIdCounter;
   int ShapeIdCounter;
+  int RemovedLabelOps; // How many label settings, clearings and checks the post optimizations removed
 
   Relooper();
   ~Relooper();
@@ -204,6 +232,9 @@ struct Relooper {
   // Renders the result.
   void Render();
 
+  // Returns how many label operations were optimized out, valid after Calculate
+  int GetRemovedLabelOps() { return RemovedLabelOps; }
+
   // Sets the global buffer all printing goes to. Must call this or MakeOutputBuffer.
   // XXX: this is deprecated, see MakeOutputBuffer
   static void SetOutputBuffer(char *Buffer, int Size);
@@ -223,9 +254,23 @@ struct Relooper {
 
   // Sets us to try to minimize size
   void SetMinSize(bool MinSize_) { MinSize = MinSize_; }
+
+  // Sets whether irreducible regions are emulated with switch-loop code (only
+  // that region, the rest of the function is relooped as usual). If not, they
+  // become loops whose entries are chosen by checking the label.
+  void SetEmulateIrreducible(bool E) { EmulateIrreducible = E; }
+
+  // Sets whether small irreducible regions are made reducible by splitting
+  // nodes. This increases code size, so it is not done when minimizing size.
+  void SetSplitIrreducible(bool S) { SplitIrreducible = S; }
 };
 
-typedef std::map<Block*, BlockSet> BlockBlockSetMap;
+inline bool BlockCompare::operator()(const Block *A, const Block *B) const {
+  // NULL (no block, e.g. an invalidated owner) orders before all blocks
+  return B && (!A || A->Serial < B->Serial);
+}
+
+typedef std::map<Block*, BlockSet, BlockCompare> BlockBlockSetMap;
 
 #if DEBUG
 struct Debugging {
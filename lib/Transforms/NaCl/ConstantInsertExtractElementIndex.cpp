@@ -27,6 +27,31 @@
 using namespace llvm;
 
 namespace {
+class ConstantInsertExtractElementIndexRewrite : public PNaClRewrite {
+public:
+  ConstantInsertExtractElementIndexRewrite() : M(0), DL(0) {}
+  virtual void initialize(Module &Mod, const DataLayout &Layout) {
+    M = &Mod;
+    DL = &Layout;
+  }
+  virtual bool mayRewrite(const Instruction &Inst) const;
+  virtual bool rewriteFunction(Function &Func);
+  bool rewriteBlock(BasicBlock &BB);
+
+private:
+  typedef SmallVector<Instruction *, 8> Instructions;
+  const Module *M;
+  const DataLayout *DL;
+
+  void findNonConstantInsertExtractElements(
+      const BasicBlock &BB, Instructions &OutOfRangeConstantIndices,
+      Instructions &NonConstantVectorIndices) const;
+  void fixOutOfRangeConstantIndices(BasicBlock &BB,
+                                    const Instructions &Instrs) const;
+  void fixNonConstantVectorIndices(BasicBlock &BB,
+                                   const Instructions &Instrs) const;
+};
+
 class ConstantInsertExtractElementIndex : public BasicBlockPass {
 public:
   static char ID; // Pass identification, replacement for typeid
@@ -45,17 +70,9 @@ public:
   virtual bool runOnBasicBlock(BasicBlock &BB);
 
 private:
-  typedef SmallVector<Instruction *, 8> Instructions;
-  const Module *M;
+  Module *M;
   const DataLayout *DL;
-
-  void findNonConstantInsertExtractElements(
-      const BasicBlock &BB, Instructions &OutOfRangeConstantIndices,
-      Instructions &NonConstantVectorIndices) const;
-  void fixOutOfRangeConstantIndices(BasicBlock &BB,
-                                    const Instructions &Instrs) const;
-  void fixNonConstantVectorIndices(BasicBlock &BB,
-                                   const Instructions &Instrs) const;
+  ConstantInsertExtractElementIndexRewrite Rewrite;
 };
 
 /// Number of elements in a vector instruction.
@@ -90,7 +107,7 @@ INITIALIZE_PASS(
     "Force insert and extract vector element to always be in bounds", false,
     false)
 
-void ConstantInsertExtractElementIndex::findNonConstantInsertExtractElements(
+void ConstantInsertExtractElementIndexRewrite::findNonConstantInsertExtractElements(
     const BasicBlock &BB, Instructions &OutOfRangeConstantIndices,
     Instructions &NonConstantVectorIndices) const {
   for (BasicBlock::const_iterator BBI = BB.begin(), BBE = BB.end(); BBI != BBE;
@@ -106,7 +123,7 @@ void ConstantInsertExtractElementIndex::findNonConstantInsertExtractElements(
   }
 }
 
-void ConstantInsertExtractElementIndex::fixOutOfRangeConstantIndices(
+void ConstantInsertExtractElementIndexRewrite::fixOutOfRangeConstantIndices(
     BasicBlock &BB, const Instructions &Instrs) const {
   for (Instructions::const_iterator IB = Instrs.begin(), IE = Instrs.end();
        IB != IE; ++IB) {
@@ -119,7 +136,7 @@ void ConstantInsertExtractElementIndex::fixOutOfRangeConstantIndices(
   }
 }
 
-void ConstantInsertExtractElementIndex::fixNonConstantVectorIndices(
+void ConstantInsertExtractElementIndexRewrite::fixNonConstantVectorIndices(
     BasicBlock &BB, const Instructions &Instrs) const {
   for (Instructions::const_iterator IB = Instrs.begin(), IE = Instrs.end();
        IB != IE; ++IB) {
@@ -158,10 +175,26 @@ void ConstantInsertExtractElementIndex::fixNonConstantVectorIndices(
   }
 }
 
-bool ConstantInsertExtractElementIndex::runOnBasicBlock(BasicBlock &BB) {
+bool ConstantInsertExtractElementIndexRewrite::mayRewrite(
+    const Instruction &Inst) const {
+  if (Value *Idx = getInsertExtractElementIdx(&Inst)) {
+    if (ConstantInt *CI = dyn_cast<ConstantInt>(Idx))
+      return !CI->getValue().ult(vectorNumElements(&Inst));
+    return true;
+  }
+  return false;
+}
+
+bool ConstantInsertExtractElementIndexRewrite::rewriteFunction(
+    Function &Func) {
+  bool Changed = false;
+  for (Function::iterator BB = Func.begin(), E = Func.end(); BB != E; ++BB)
+    Changed |= rewriteBlock(*BB);
+  return Changed;
+}
+
+bool ConstantInsertExtractElementIndexRewrite::rewriteBlock(BasicBlock &BB) {
   bool Changed = false;
-  if (!DL)
-    DL = &getAnalysis<DataLayoutPass>().getDataLayout();
   Instructions OutOfRangeConstantIndices;
   Instructions NonConstantVectorIndices;
 
@@ -178,6 +211,18 @@ bool ConstantInsertExtractElementIndex::runOnBasicBlock(BasicBlock &BB) {
   return Changed;
 }
 
+bool ConstantInsertExtractElementIndex::runOnBasicBlock(BasicBlock &BB) {
+  if (!DL) {
+    DL = &getAnalysis<DataLayoutPass>().getDataLayout();
+    Rewrite.initialize(*M, *DL);
+  }
+  return Rewrite.rewriteBlock(BB);
+}
+
 BasicBlockPass *llvm::createConstantInsertExtractElementIndexPass() {
   return new ConstantInsertExtractElementIndex();
 }
+
+PNaClRewrite *llvm::createConstantInsertExtractElementIndexRewrite() {
+  return new ConstantInsertExtractElementIndexRewrite();
+}
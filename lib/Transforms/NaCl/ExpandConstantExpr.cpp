@@ -42,6 +42,12 @@ namespace {
 
     virtual bool runOnFunction(Function &Func);
   };
+
+  class ExpandConstantExprRewrite : public PNaClRewrite {
+  public:
+    virtual bool mayRewrite(const Instruction &Inst) const;
+    virtual bool rewriteFunction(Function &Func);
+  };
 }
 
 char ExpandConstantExpr::ID = 0;
@@ -79,6 +85,15 @@ static bool ContainsIllegalTypes(const Value *Expr) {
   return false;
 }
 
+// Returns true if operand OpNum of Inst is a ConstantExpr that is expanded.
+static bool shouldExpandOperand(const Instruction *Inst, unsigned OpNum) {
+  // XXX Emscripten: Only do the expansion of the expression contains
+  // illegal types, for now, since we can handle legal ConstantExprs
+  // in the backend directly.
+  const ConstantExpr *Expr = dyn_cast<ConstantExpr>(Inst->getOperand(OpNum));
+  return Expr && ContainsIllegalTypes(Expr);
+}
+
 static bool expandInstruction(Instruction *Inst) {
   // A landingpad can only accept ConstantExprs, so it should remain
   // unmodified.
@@ -87,22 +102,17 @@ static bool expandInstruction(Instruction *Inst) {
 
   bool Modified = false;
   for (unsigned OpNum = 0; OpNum < Inst->getNumOperands(); OpNum++) {
-    if (ConstantExpr *Expr =
-        dyn_cast<ConstantExpr>(Inst->getOperand(OpNum))) {
-      // XXX Emscripten: Only do the expansion of the expression contains
-      // illegal types, for now, since we can handle legal ConstantExprs
-      // in the backend directly.
-      if (ContainsIllegalTypes(Expr)) {
-        Modified = true;
-        Use *U = &Inst->getOperandUse(OpNum);
-        PhiSafeReplaceUses(U, expandConstantExpr(PhiSafeInsertPt(U), Expr));
-      }
+    if (shouldExpandOperand(Inst, OpNum)) {
+      Modified = true;
+      Use *U = &Inst->getOperandUse(OpNum);
+      PhiSafeReplaceUses(U, expandConstantExpr(
+          PhiSafeInsertPt(U), cast<ConstantExpr>(Inst->getOperand(OpNum))));
     }
   }
   return Modified;
 }
 
-bool ExpandConstantExpr::runOnFunction(Function &Func) {
+static bool expandFunction(Function &Func) {
   bool Modified = false;
   for (llvm::Function::iterator BB = Func.begin(), E = Func.end();
        BB != E;
@@ -116,6 +126,28 @@ bool ExpandConstantExpr::runOnFunction(Function &Func) {
   return Modified;
 }
 
+bool ExpandConstantExpr::runOnFunction(Function &Func) {
+  return expandFunction(Func);
+}
+
+bool ExpandConstantExprRewrite::mayRewrite(const Instruction &Inst) const {
+  if (isa<LandingPadInst>(Inst))
+    return false;
+  for (unsigned OpNum = 0; OpNum < Inst.getNumOperands(); OpNum++) {
+    if (shouldExpandOperand(&Inst, OpNum))
+      return true;
+  }
+  return false;
+}
+
+bool ExpandConstantExprRewrite::rewriteFunction(Function &Func) {
+  return expandFunction(Func);
+}
+
 FunctionPass *llvm::createExpandConstantExprPass() {
   return new ExpandConstantExpr();
 }
+
+PNaClRewrite *llvm::createExpandConstantExprRewrite() {
+  return new ExpandConstantExprRewrite();
+}
@@ -57,6 +57,12 @@ namespace {
 
     virtual bool runOnFunction(Function &F);
   };
+
+  class ExpandStructRegsRewrite : public PNaClRewrite {
+  public:
+    virtual bool mayRewrite(const Instruction &Inst) const;
+    virtual bool rewriteFunction(Function &Func);
+  };
 }
 
 char ExpandStructRegs::ID = 0;
@@ -225,7 +231,7 @@ static bool ExpandExtractValue(ExtractValueInst *EV) {
   return true;
 }
 
-bool ExpandStructRegs::runOnFunction(Function &Func) {
+static bool expandFunction(Function &Func) {
   bool Changed = false;
 
   // Split up aggregate loads, stores and phi nodes into operations on
@@ -294,6 +300,26 @@ bool ExpandStructRegs::runOnFunction(Function &Func) {
   return Changed;
 }
 
+bool ExpandStructRegs::runOnFunction(Function &Func) {
+  return expandFunction(Func);
+}
+
+bool ExpandStructRegsRewrite::mayRewrite(const Instruction &Inst) const {
+  if (const StoreInst *Store = dyn_cast<StoreInst>(&Inst))
+    return Store->getValueOperand()->getType()->isStructTy();
+  if (isa<LoadInst>(Inst) || isa<PHINode>(Inst) || isa<SelectInst>(Inst))
+    return Inst.getType()->isStructTy();
+  return isa<ExtractValueInst>(Inst) || isa<InsertValueInst>(Inst);
+}
+
+bool ExpandStructRegsRewrite::rewriteFunction(Function &Func) {
+  return expandFunction(Func);
+}
+
 FunctionPass *llvm::createExpandStructRegsPass() {
   return new ExpandStructRegs();
 }
+
+PNaClRewrite *llvm::createExpandStructRegsRewrite() {
+  return new ExpandStructRegsRewrite();
+}
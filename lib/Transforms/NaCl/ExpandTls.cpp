@@ -20,6 +20,15 @@
 // a template for initializing TLS variables' values for each thread.
 // This is a task normally performed by the linker in ELF systems.
 //
+// XXX EMSCRIPTEN: When targeting asm.js, the TLS variables are instead
+// laid out *above* the thread pointer, which emscripten keeps in a
+// per-thread asm.js global rather than in a register. Each thread (that
+// is, each asm.js module instance sharing the heap) must call
+// emscripten_tls_init() on a block of emscripten_tls_size() bytes before
+// touching any TLS variable; that copies in the template and makes the
+// block the thread's TLS base. emscripten_thread_init() does that and
+// also gives the thread its own stack.
+//
 //===----------------------------------------------------------------------===//
 
 #include <vector>
@@ -28,6 +37,7 @@
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/Module.h"
@@ -224,6 +234,12 @@ static PointerType *buildTlsTemplate(Module &M, std::vector<VarInfo> *TlsVars) {
   return TemplatePtrType;
 }
 
+// XXX EMSCRIPTEN: asm.js output uses a layout in which the TLS
+// variables live at and above the thread pointer.
+static bool isEmscriptenLayout(Module &M) {
+  return M.getTargetTriple() == "asmjs-unknown-emscripten";
+}
+
 static void rewriteTlsVars(Module &M, std::vector<VarInfo> *TlsVars,
                            PointerType *TemplatePtrType) {
   // Set up the intrinsic that reads the thread pointer.
@@ -248,8 +264,10 @@ static void rewriteTlsVars(Module &M, std::vector<VarInfo> *TlsVars,
       // TODO(mseaborn): I intend to remove that check because it is
       // non-portable.  In the mean time, we want PNaCl pexes to work
       // in older Chromium releases when translated to nexes.
+      // Emscripten has no such constraint, and keeps the TLS data at
+      // the thread pointer.
       Indexes.push_back(ConstantInt::get(
-          M.getContext(), APInt(32, -1)));
+          M.getContext(), APInt(32, isEmscriptenLayout(M) ? 0 : -1)));
       Indexes.push_back(ConstantInt::get(
           M.getContext(), APInt(32, VarInfo->IsBss ? 1 : 0)));
       Indexes.push_back(ConstantInt::get(
@@ -305,16 +323,125 @@ static void defineTlsLayoutFunctions(Module &M) {
   //     return -tls_size;
   //   }
   // This means the TLS variables are stored below the thread pointer.
+  // In the emscripten layout they are stored at it, so we return 0.
   NewFunc = Function::Create(FuncType, GlobalValue::InternalLinkage,
                              "nacl_tp_tls_offset", &M);
   BB = BasicBlock::Create(M.getContext(), "entry", NewFunc);
   Value *Arg = NewFunc->arg_begin();
   Arg->setName("size");
-  Value *Result = BinaryOperator::CreateNeg(Arg, "result", BB);
+  Value *Result;
+  if (isEmscriptenLayout(M)) {
+    Result = ConstantInt::get(M.getContext(), APInt(32, 0));
+  } else {
+    Result = BinaryOperator::CreateNeg(Arg, "result", BB);
+  }
   ReturnInst::Create(M.getContext(), Result, BB);
   replaceFunction(M, "__nacl_tp_tls_offset", NewFunc);
 }
 
+static Function *createEmscriptenTlsFunction(Module &M, const char *Name,
+                                             FunctionType *FuncType) {
+  if (Function *Existing = M.getFunction(Name)) {
+    if (!Existing->isDeclaration())
+      report_fatal_error(std::string("Function already defined: ") + Name);
+    Existing->setName("");
+    Function *NewFunc = Function::Create(FuncType,
+                                         GlobalValue::ExternalLinkage,
+                                         Name, &M);
+    Existing->replaceAllUsesWith(
+        ConstantExpr::getBitCast(NewFunc, Existing->getType()));
+    Existing->eraseFromParent();
+    return NewFunc;
+  }
+  return Function::Create(FuncType, GlobalValue::ExternalLinkage, Name, &M);
+}
+
+// XXX EMSCRIPTEN: Define the hooks the emscripten runtime uses to set up
+// TLS for a new thread:
+//   uint32_t emscripten_tls_size(void);
+//     Returns how many bytes each thread's TLS block needs. The block must
+//     be aligned to __tls_template_alignment.
+//   void emscripten_tls_init(void *tp);
+//     Copies the TLS template into the block at tp, zeroes its bss part,
+//     and makes tp the calling thread's TLS base (which the backend keeps
+//     in a per-module-instance global, so each worker has its own).
+//   void emscripten_thread_init(void *block, uint32_t size);
+//     Sets up the calling thread in a block of size bytes: its TLS block
+//     goes at the start (as with emscripten_tls_init) and its stack takes
+//     the rest, from the next 16-byte boundary. Like tlsBase, STACKTOP and
+//     STACK_MAX are per-instance globals, so threads never share a stack.
+static void defineEmscriptenTlsFunctions(Module &M,
+                                         PointerType *TemplatePtrType) {
+  DataLayout DL(&M);
+  LLVMContext &C = M.getContext();
+  Type *i8Ptr = Type::getInt8PtrTy(C);
+  Type *i32 = Type::getInt32Ty(C);
+  Type *Void = Type::getVoidTy(C);
+
+  GlobalVariable *TemplateData = M.getNamedGlobal("__tls_template_start");
+  assert(TemplateData);
+  uint64_t InitSize =
+      DL.getTypeAllocSize(TemplateData->getType()->getElementType());
+  uint64_t TotalSize =
+      DL.getTypeAllocSize(TemplatePtrType->getElementType());
+
+  FunctionType *SizeType = FunctionType::get(i32, /*isVarArg=*/false);
+  Function *SizeFunc = createEmscriptenTlsFunction(M, "emscripten_tls_size",
+                                                   SizeType);
+  BasicBlock *BB = BasicBlock::Create(C, "entry", SizeFunc);
+  ReturnInst::Create(C, ConstantInt::get(i32, TotalSize), BB);
+
+  // The backend implements this as an assignment to the TLS base.
+  Constant *SetBase = M.getOrInsertFunction("emscripten_set_tls_base",
+                                            Void, i8Ptr, NULL);
+
+  Type *InitArgs[] = { i8Ptr };
+  FunctionType *InitType = FunctionType::get(Void, InitArgs,
+                                             /*isVarArg=*/false);
+  Function *InitFunc = createEmscriptenTlsFunction(M, "emscripten_tls_init",
+                                                   InitType);
+  Value *Tp = InitFunc->arg_begin();
+  Tp->setName("tp");
+  BB = BasicBlock::Create(C, "entry", InitFunc);
+  IRBuilder<> Builder(BB);
+  unsigned Alignment = TemplateData->getAlignment();
+  // Sizes are i32, as pointers are 32-bit in asm.js
+  if (InitSize > 0) {
+    Builder.CreateMemCpy(Tp, Builder.CreateBitCast(TemplateData, i8Ptr),
+                         Builder.getInt32(InitSize), Alignment ? Alignment : 1);
+  }
+  if (TotalSize > InitSize) {
+    Value *Bss = Builder.CreateConstGEP1_32(Tp, InitSize, "bss");
+    Builder.CreateMemSet(Bss, Builder.getInt8(0),
+                         Builder.getInt32(TotalSize - InitSize), 1);
+  }
+  Builder.CreateCall(SetBase, Tp);
+  Builder.CreateRetVoid();
+
+  // The backend implements this as assignments to STACKTOP and STACK_MAX.
+  Constant *SetStackLimits = M.getOrInsertFunction(
+      "emscripten_set_stack_limits", Void, i8Ptr, i8Ptr, NULL);
+
+  Type *ThreadInitArgs[] = { i8Ptr, i32 };
+  FunctionType *ThreadInitType = FunctionType::get(Void, ThreadInitArgs,
+                                                   /*isVarArg=*/false);
+  Function *ThreadInitFunc = createEmscriptenTlsFunction(
+      M, "emscripten_thread_init", ThreadInitType);
+  Function::arg_iterator Arg = ThreadInitFunc->arg_begin();
+  Value *Block = Arg++;
+  Block->setName("block");
+  Value *Size = Arg;
+  Size->setName("size");
+  BB = BasicBlock::Create(C, "entry", ThreadInitFunc);
+  Builder.SetInsertPoint(BB);
+  Builder.CreateCall(InitFunc, Block);
+  uint64_t StackOffset = (TotalSize + 15) & ~uint64_t(15);
+  Value *StackBase = Builder.CreateConstGEP1_32(Block, StackOffset, "stack");
+  Value *StackMax = Builder.CreateGEP(Block, Size, "stack_max");
+  Builder.CreateCall2(SetStackLimits, StackBase, StackMax);
+  Builder.CreateRetVoid();
+}
+
 bool ExpandTls::runOnModule(Module &M) {
   ModulePass *Pass = createExpandTlsConstantExprPass();
   Pass->runOnModule(M);
@@ -325,6 +452,8 @@ bool ExpandTls::runOnModule(Module &M) {
   rewriteTlsVars(M, &TlsVars, TemplatePtrType);
 
   defineTlsLayoutFunctions(M);
+  if (isEmscriptenLayout(M))
+    defineEmscriptenTlsFunctions(M, TemplatePtrType);
 
   return true;
 }
@@ -158,38 +158,44 @@ namespace {
 
   // A FlattenedConstant represents a global variable initializer that
   // has been flattened and may be converted into the normal form.
+  //
+  // The initializer is walked in address order, and is represented as
+  // the list of pieces of its normal form, so that the bytes of a large
+  // initializer are never all copied into one buffer. Only the bytes
+  // since the last relocation are buffered, and these are released as
+  // soon as the next relocation (or the end) is reached. When these
+  // bytes are exactly those of an i8 array in the original initializer,
+  // such as a string, that array is used as the piece without copying it.
   class FlattenedConstant {
     FlattenGlobalsState &State;
 
-    // A flattened global variable initializer is represented as:
-    // 1) an array of bytes;
-    unsigned BufSize;
-    uint8_t *Buf;
-    uint8_t *BufEnd;
-
-    // 2) an array of relocations.
-    class Reloc {
+    // A piece of the flattened initializer is either:
+    // 1) an i8 array literal; or
+    // 2) a relocation.
+    class Piece {
     private:
-      unsigned RelOffset;  // Offset at which the relocation is to be applied.
+      Constant *Data;
       RelocUserType *RelocUser;
-   public:
-
-      unsigned getRelOffset() const { return RelOffset; }
-      Constant *getRelocUse() const { return getRelocUseConstant(RelocUser); }
-      Reloc(FlattenGlobalsState &State, unsigned RelOffset, Constant *NewVal)
-          : RelOffset(RelOffset),
-            RelocUser(State.getRelocUserHandle(NewVal)) {}
-
-      explicit Reloc(const Reloc &R)
-          : RelOffset(R.RelOffset), RelocUser(R.RelocUser) {}
+    public:
+      explicit Piece(Constant *Data) : Data(Data), RelocUser(NULL) {}
+      Piece(FlattenGlobalsState &State, Constant *NewVal)
+          : Data(NULL), RelocUser(State.getRelocUserHandle(NewVal)) {}
 
-      void operator=(const Reloc &R) {
-        RelOffset = R.RelOffset;
-        RelocUser = R.RelocUser;
+      Constant *getConstant() const {
+        return Data ? Data : getRelocUseConstant(RelocUser);
       }
     };
-    typedef SmallVector<Reloc, 10> RelocArray;
-    RelocArray Relocs;
+    typedef SmallVector<Piece, 10> PieceArray;
+    PieceArray Pieces;
+
+    // The size of the initializer.
+    uint64_t Size;
+    // The offset of the next byte of the initializer to be flattened.
+    uint64_t Pos;
+    // The bytes since the last relocation. If PendingArray is not NULL,
+    // these bytes are instead all of the bytes of PendingArray.
+    std::vector<uint8_t> PendingBytes;
+    ConstantDataSequential *PendingArray;
 
     const DataLayout &getDataLayout() const { return State.DL; }
 
@@ -201,30 +207,57 @@ namespace {
 
     unsigned getPtrSize() const { return State.PtrSize; }
 
-    void putAtDest(Constant *Value, uint8_t *Dest);
+    void putAtPos(Constant *Value);
+
+    // Copies the bytes of PendingArray into PendingBytes, so that more
+    // bytes can be added.
+    void copyPendingArray() {
+      if (PendingArray == NULL)
+        return;
+      StringRef Data = PendingArray->getRawDataValues();
+      PendingBytes.assign(Data.begin(), Data.end());
+      PendingArray = NULL;
+    }
 
-    Constant *dataSlice(unsigned StartPos, unsigned EndPos) const {
-      return ConstantDataArray::get(
-          getModule().getContext(),
-          ArrayRef<uint8_t>(Buf + StartPos, Buf + EndPos));
+    void putBytes(const void *Data, uint64_t NumBytes) {
+      copyPendingArray();
+      const uint8_t *Bytes = static_cast<const uint8_t *>(Data);
+      PendingBytes.insert(PendingBytes.end(), Bytes, Bytes + NumBytes);
+      Pos += NumBytes;
     }
 
-    Type *dataSliceType(unsigned StartPos, unsigned EndPos) const {
-      return ArrayType::get(getByteType(), EndPos - StartPos);
+    // Adds zeroes up to offset NewPos.
+    void putZerosUntil(uint64_t NewPos) {
+      assert(NewPos >= Pos && NewPos <= Size);
+      if (NewPos == Pos)
+        return;
+      copyPendingArray();
+      PendingBytes.resize(PendingBytes.size() + (NewPos - Pos), 0);
+      Pos = NewPos;
+    }
+
+    // Ends the pending i8 array literal, if any.
+    void flushPendingBytes() {
+      if (PendingArray) {
+        Pieces.push_back(Piece(PendingArray));
+        PendingArray = NULL;
+      } else if (!PendingBytes.empty()) {
+        Pieces.push_back(Piece(ConstantDataArray::get(getModule().getContext(),
+                                                      PendingBytes)));
+        // Release the buffer, rather than keeping its capacity.
+        std::vector<uint8_t>().swap(PendingBytes);
+      }
     }
 
   public:
     FlattenedConstant(FlattenGlobalsState &State, Constant *Value):
         State(State),
-        BufSize(getDataLayout().getTypeAllocSize(Value->getType())),
-        Buf(new uint8_t[BufSize]),
-        BufEnd(Buf + BufSize) {
-      memset(Buf, 0, BufSize);
-      putAtDest(Value, Buf);
-    }
-
-    ~FlattenedConstant() {
-      delete[] Buf;
+        Size(getDataLayout().getTypeAllocSize(Value->getType())),
+        Pos(0),
+        PendingArray(NULL) {
+      putAtPos(Value);
+      putZerosUntil(Size);
+      flushPendingBytes();
     }
 
     // Returns the corresponding flattened initializer.
@@ -379,37 +412,47 @@ static void ExpandConstant(const DataLayout *DL, Constant *Val,
   }
 }
 
-void FlattenedConstant::putAtDest(Constant *Val, uint8_t *Dest) {
+void FlattenedConstant::putAtPos(Constant *Val) {
+  uint64_t Start = Pos;
   uint64_t ValSize = getDataLayout().getTypeAllocSize(Val->getType());
-  assert(Dest + ValSize <= BufEnd);
+  assert(Start + ValSize <= Size);
   if (isa<ConstantAggregateZero>(Val) ||
       isa<UndefValue>(Val) ||
       isa<ConstantPointerNull>(Val)) {
-    // The buffer is already zero-initialized.
+    // Filled with zeroes below.
   } else if (ConstantInt *CI = dyn_cast<ConstantInt>(Val)) {
-    memcpy(Dest, CI->getValue().getRawData(), ValSize);
+    putBytes(CI->getValue().getRawData(), ValSize);
   } else if (ConstantFP *CF = dyn_cast<ConstantFP>(Val)) {
     APInt Data = CF->getValueAPF().bitcastToAPInt();
     assert((Data.getBitWidth() + 7) / 8 == ValSize);
     assert(Data.getBitWidth() % 8 == 0);
-    memcpy(Dest, Data.getRawData(), ValSize);
+    putBytes(Data.getRawData(), ValSize);
   } else if (ConstantDataSequential *CD =
              dyn_cast<ConstantDataSequential>(Val)) {
     // Note that getRawDataValues() assumes the host endianness is the same.
     StringRef Data = CD->getRawDataValues();
     assert(Data.size() == ValSize);
-    memcpy(Dest, Data.data(), Data.size());
+    if (PendingBytes.empty() && PendingArray == NULL &&
+        isa<ConstantDataArray>(CD) && CD->getElementType() == getByteType()) {
+      // Use the array as is, unless more bytes are added to it.
+      PendingArray = CD;
+      Pos += ValSize;
+    } else {
+      putBytes(Data.data(), Data.size());
+    }
   } else if (isa<ConstantArray>(Val) || isa<ConstantDataVector>(Val) ||
              isa<ConstantVector>(Val)) {
     uint64_t ElementSize = getDataLayout().getTypeAllocSize(
         Val->getType()->getSequentialElementType());
     for (unsigned I = 0; I < Val->getNumOperands(); ++I) {
-      putAtDest(cast<Constant>(Val->getOperand(I)), Dest + ElementSize * I);
+      putZerosUntil(Start + ElementSize * I);
+      putAtPos(cast<Constant>(Val->getOperand(I)));
     }
   } else if (ConstantStruct *CS = dyn_cast<ConstantStruct>(Val)) {
     const StructLayout *Layout = getDataLayout().getStructLayout(CS->getType());
     for (unsigned I = 0; I < CS->getNumOperands(); ++I) {
-      putAtDest(CS->getOperand(I), Dest + Layout->getElementOffset(I));
+      putZerosUntil(Start + Layout->getElementOffset(I));
+      putAtPos(CS->getOperand(I));
     }
   } else {
     Constant *GV;
@@ -428,59 +471,46 @@ void FlattenedConstant::putAtDest(Constant *Val, uint8_t *Dest) {
             NewVal, ConstantInt::get(getIntPtrType(), Offset,
                                      /* isSigned= */ true));
       }
-      Reloc NewRel(State, Dest - Buf, NewVal);
-      Relocs.push_back(NewRel);
+      flushPendingBytes();
+      Pieces.push_back(Piece(State, NewVal));
+      Pos += getPtrSize();
     } else {
-      memcpy(Dest, &Offset, ValSize);
+      putBytes(&Offset, ValSize);
     }
   }
+  putZerosUntil(Start + ValSize);
 }
 
 Constant *FlattenedConstant::getAsNormalFormConstant() const {
   // Return a single SimpleElement.
-  if (Relocs.size() == 0)
-    return dataSlice(0, BufSize);
-  if (Relocs.size() == 1 && BufSize == getPtrSize()) {
-    assert(Relocs[0].getRelOffset() == 0);
-    return Relocs[0].getRelocUse();
-  }
+  if (Pieces.size() == 0)
+    return ConstantDataArray::get(getModule().getContext(),
+                                  ArrayRef<uint8_t>());
+  if (Pieces.size() == 1)
+    return Pieces[0].getConstant();
 
   // Return a CompoundElement.
   SmallVector<Constant *, 10> Elements;
-  unsigned PrevPos = 0;
-  for (RelocArray::const_iterator Rel = Relocs.begin(), E = Relocs.end();
-       Rel != E; ++Rel) {
-    if (Rel->getRelOffset() > PrevPos)
-      Elements.push_back(dataSlice(PrevPos, Rel->getRelOffset()));
-    Elements.push_back(Rel->getRelocUse());
-    PrevPos = Rel->getRelOffset() + getPtrSize();
+  for (PieceArray::const_iterator I = Pieces.begin(), E = Pieces.end();
+       I != E; ++I) {
+    Elements.push_back(I->getConstant());
   }
-  if (PrevPos < BufSize)
-    Elements.push_back(dataSlice(PrevPos, BufSize));
   return ConstantStruct::getAnon(getModule().getContext(), Elements, true);
 }
 
 Type *FlattenedConstant::getAsNormalFormType() const {
   // Return a single element type.
-  if (Relocs.size() == 0)
-    return dataSliceType(0, BufSize);
-  if (Relocs.size() == 1 && BufSize == getPtrSize()) {
-    assert(Relocs[0].getRelOffset() == 0);
-    return Relocs[0].getRelocUse()->getType();
-  }
+  if (Pieces.size() == 0)
+    return ArrayType::get(getByteType(), 0);
+  if (Pieces.size() == 1)
+    return Pieces[0].getConstant()->getType();
 
   // Return a compound type.
   SmallVector<Type *, 10> Elements;
-  unsigned PrevPos = 0;
-  for (RelocArray::const_iterator Rel = Relocs.begin(), E = Relocs.end();
-       Rel != E; ++Rel) {
-    if (Rel->getRelOffset() > PrevPos)
-      Elements.push_back(dataSliceType(PrevPos, Rel->getRelOffset()));
-    Elements.push_back(Rel->getRelocUse()->getType());
-    PrevPos = Rel->getRelOffset() + getPtrSize();
+  for (PieceArray::const_iterator I = Pieces.begin(), E = Pieces.end();
+       I != E; ++I) {
+    Elements.push_back(I->getConstant()->getType());
   }
-  if (PrevPos < BufSize)
-    Elements.push_back(dataSliceType(PrevPos, BufSize));
   return StructType::get(getModule().getContext(), Elements, true);
 }
 
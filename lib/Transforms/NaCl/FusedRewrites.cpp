@@ -0,0 +1,179 @@
+//===- FusedRewrites.cpp - Run instruction-local rewrites together --------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This pass runs the instruction-local rewrites of several ABI
+// simplification passes (see PNaClRewrite) as one pass.
+//
+// Run separately, each of these passes walks every instruction of the
+// module, although most functions need none of the rewrites. Instead,
+// this pass walks each function once, asking every rewrite whether it
+// may change each instruction, and then runs only the rewrites that
+// may change the function. Since finding these rewrites only reads the
+// IR, it is done on several threads (see -pnacl-rewrite-threads).
+// Rewriting itself adds uses of constants, which are shared by all
+// functions, so it is done on the calling thread.
+//
+// The rewrites are run on each function in the order they were given,
+// which is the order that the passes would run them, so the output is
+// the same as that of the passes. When a rewrite changes a function,
+// the function is walked again for the rewrites after it.
+//
+//===----------------------------------------------------------------------===//
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/NaCl.h"
+#include <algorithm>
+
+#if LLVM_ENABLE_THREADS
+#include <atomic>
+#include <thread>
+#endif
+
+using namespace llvm;
+
+static cl::opt<unsigned>
+RewriteThreads("pnacl-rewrite-threads",
+               cl::desc("Number of threads that look for instructions to "
+                        "rewrite in the fused ABI simplification passes "
+                        "(0 looks on the calling thread)"),
+               cl::init(0));
+
+namespace {
+class FusedRewrites : public ModulePass {
+public:
+  static char ID; // Pass identification, replacement for typeid
+  explicit FusedRewrites(ArrayRef<PNaClRewrite *> Rewrites)
+      : ModulePass(ID), Rewrites(Rewrites.begin(), Rewrites.end()) {
+    assert(Rewrites.size() <= MaxRewrites && "Too many rewrites to fuse");
+  }
+  ~FusedRewrites() { DeleteContainerPointers(Rewrites); }
+
+  virtual const char *getPassName() const {
+    return "Fused PNaCl ABI simplification rewrites";
+  }
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const {
+    AU.addRequired<DataLayoutPass>();
+  }
+  virtual bool runOnModule(Module &M);
+
+private:
+  // The set of rewrites that may change a function, one bit per rewrite.
+  typedef uint32_t RewriteSet;
+  static const size_t MaxRewrites = 32;
+
+  std::vector<PNaClRewrite *> Rewrites;
+
+  // Returns the rewrites, starting with the First-th, that may change
+  // Func.
+  RewriteSet findRewrites(const Function &Func, size_t First) const;
+  // Finds the rewrites that may change each function in Funcs.
+  void findRewrites(const std::vector<Function *> &Funcs,
+                    std::vector<RewriteSet> &Sets) const;
+};
+}
+
+char FusedRewrites::ID = 0;
+
+FusedRewrites::RewriteSet
+FusedRewrites::findRewrites(const Function &Func, size_t First) const {
+  RewriteSet Found = 0;
+  RewriteSet Remaining = 0;
+  for (size_t i = First; i < Rewrites.size(); ++i) {
+    if (Rewrites[i]->mayRewriteFunction(Func))
+      Found |= RewriteSet(1) << i;
+    else
+      Remaining |= RewriteSet(1) << i;
+  }
+  for (Function::const_iterator BB = Func.begin(), E = Func.end();
+       BB != E && Remaining; ++BB) {
+    for (BasicBlock::const_iterator I = BB->begin(), IE = BB->end();
+         I != IE && Remaining; ++I) {
+      for (size_t i = First; i < Rewrites.size(); ++i) {
+        RewriteSet Bit = RewriteSet(1) << i;
+        if ((Remaining & Bit) && Rewrites[i]->mayRewrite(*I)) {
+          Found |= Bit;
+          Remaining &= ~Bit;
+        }
+      }
+    }
+  }
+  return Found;
+}
+
+void FusedRewrites::findRewrites(const std::vector<Function *> &Funcs,
+                                 std::vector<RewriteSet> &Sets) const {
+  Sets.resize(Funcs.size());
+#if LLVM_ENABLE_THREADS
+  if (RewriteThreads > 0) {
+    // Threads take a few functions at a time, so that they stay busy
+    // when function sizes vary.
+    const size_t ChunkSize = 16;
+    std::atomic<size_t> NextChunk(0);
+    auto FindChunks = [&]() {
+      while (1) {
+        size_t Begin = NextChunk.fetch_add(ChunkSize);
+        if (Begin >= Funcs.size())
+          return;
+        size_t End = std::min(Begin + ChunkSize, Funcs.size());
+        for (size_t i = Begin; i < End; ++i)
+          Sets[i] = findRewrites(*Funcs[i], 0);
+      }
+    };
+    std::vector<std::thread> Threads;
+    for (unsigned i = 0; i < RewriteThreads; ++i)
+      Threads.push_back(std::thread(FindChunks));
+    for (unsigned i = 0; i < RewriteThreads; ++i)
+      Threads[i].join();
+    return;
+  }
+#endif
+  for (size_t i = 0; i < Funcs.size(); ++i)
+    Sets[i] = findRewrites(*Funcs[i], 0);
+}
+
+bool FusedRewrites::runOnModule(Module &M) {
+  const DataLayout &DL = getAnalysis<DataLayoutPass>().getDataLayout();
+  for (size_t i = 0; i < Rewrites.size(); ++i)
+    Rewrites[i]->initialize(M, DL);
+
+  // Rewrites may add declarations to the module, so the functions to
+  // rewrite are collected first.
+  std::vector<Function *> Funcs;
+  for (Module::iterator Func = M.begin(), E = M.end(); Func != E; ++Func) {
+    if (!Func->isDeclaration())
+      Funcs.push_back(Func);
+  }
+  std::vector<RewriteSet> Sets;
+  findRewrites(Funcs, Sets);
+
+  bool Changed = false;
+  for (size_t FuncIndex = 0; FuncIndex < Funcs.size(); ++FuncIndex) {
+    Function &Func = *Funcs[FuncIndex];
+    RewriteSet Set = Sets[FuncIndex];
+    for (size_t i = 0; i < Rewrites.size(); ++i) {
+      if (!(Set & (RewriteSet(1) << i)) || !Rewrites[i]->rewriteFunction(Func))
+        continue;
+      Changed = true;
+      // The rewrite may have added instructions that the following
+      // rewrites change.
+      Set = (Set & ((RewriteSet(2) << i) - 1)) | findRewrites(Func, i + 1);
+    }
+  }
+  return Changed;
+}
+
+ModulePass *llvm::createFusedRewritesPass(ArrayRef<PNaClRewrite *> Rewrites) {
+  return new FusedRewrites(Rewrites);
+}
@@ -9,7 +9,8 @@
 //
 // This file implements the meta-passes "-pnacl-abi-simplify-preopt"
 // and "-pnacl-abi-simplify-postopt".  It lists their constituent
-// passes.
+// passes.  The instruction-local rewrites of consecutive post-opt
+// passes are fused into one pass, which walks each function once.
 //
 //===----------------------------------------------------------------------===//
 
@@ -37,6 +38,55 @@ EnableEmAsyncify("emscripten-asyncify",
                 cl::desc("Enable asyncify transformation (see emscripten ASYNCIFY option)"),
                 cl::init(false));
 
+static cl::opt<bool>
+UnfusedRewrites("pnacl-abi-simplify-unfused",
+                cl::desc("Run the instruction-local rewrites of the "
+                         "pnacl-abi-simplify passes as separate passes"),
+                cl::init(false));
+
+static cl::opt<bool> // XXX EMSCRIPTEN
+EnableEmTls("emscripten-tls",
+            cl::desc("Lay out thread-local variables in per-thread blocks "
+                     "(for multithreaded asm.js)"),
+            cl::init(false));
+
+
+namespace {
+// Adds passes to a pass manager, fusing the instruction-local rewrites
+// of consecutive passes into one pass (see createFusedRewritesPass).
+class FusingPassAdder {
+public:
+  explicit FusingPassAdder(PassManagerBase &PM) : PM(PM) {}
+  ~FusingPassAdder() { flush(); }
+
+  void add(Pass *P) {
+    flush();
+    PM.add(P);
+  }
+
+  // Adds the pass that CreatePass returns, or, unless
+  // -pnacl-abi-simplify-unfused is given, fuses the equivalent rewrite
+  // that CreateRewrite returns with the rewrites around it.
+  template <typename PassT>
+  void addRewrite(PassT *(*CreatePass)(), PNaClRewrite *(*CreateRewrite)()) {
+    if (UnfusedRewrites)
+      PM.add(CreatePass());
+    else
+      Rewrites.push_back(CreateRewrite());
+  }
+
+private:
+  PassManagerBase &PM;
+  SmallVector<PNaClRewrite *, 4> Rewrites;
+
+  void flush() {
+    if (Rewrites.empty())
+      return;
+    PM.add(createFusedRewritesPass(Rewrites));
+    Rewrites.clear();
+  }
+};
+}
 
 void llvm::PNaClABISimplifyAddPreOptPasses(PassManagerBase &PM) {
   if (EnableSjLjEH) {
@@ -92,9 +142,9 @@ void llvm::PNaClABISimplifyAddPreOptPasses(PassManagerBase &PM) {
 #if 0 // XXX EMSCRIPTEN: We handle aliases.
   PM.add(createResolveAliasesPass());
 #endif
-#if 0 // EMSCRIPTEN: no need for tls
-  PM.add(createExpandTlsPass());
-#endif
+  if (EnableEmTls) { // XXX EMSCRIPTEN: without threads, tls vars are globals
+    PM.add(createExpandTlsPass());
+  }
   // GlobalCleanup needs to run after ExpandTls because
   // __tls_template_start etc. are extern_weak before expansion
 #if 0 // XXX EMSCRIPTEN: We don't currently have tls, and we don't have the same complications with extern_weak
@@ -106,7 +156,9 @@ void llvm::PNaClABISimplifyAddPreOptPasses(PassManagerBase &PM) {
   }
 }
 
-void llvm::PNaClABISimplifyAddPostOptPasses(PassManagerBase &PM) {
+void llvm::PNaClABISimplifyAddPostOptPasses(PassManagerBase &PassMgr) {
+  FusingPassAdder PM(PassMgr);
+
 #if 0 // XXX EMSCRIPTEN: No need for this.
   PM.add(createRewritePNaClLibraryCallsPass());
 #endif
@@ -125,7 +177,7 @@ void llvm::PNaClABISimplifyAddPostOptPasses(PassManagerBase &PM) {
 #if 0 // EMSCRIPTEN: we don't need to worry about the issue this works around
   PM.add(createExpandSmallArgumentsPass());
 #endif
-  PM.add(createPromoteI1OpsPass());
+  PM.addRewrite(createPromoteI1OpsPass, createPromoteI1OpsRewrite);
 
   // Vector simplifications.
   //
@@ -138,7 +190,8 @@ void llvm::PNaClABISimplifyAddPostOptPasses(PassManagerBase &PM) {
 #endif
   // We should not place arbitrary passes after ExpandConstantExpr
   // because they might reintroduce ConstantExprs.
-  PM.add(createExpandConstantExprPass());
+  PM.addRewrite(createExpandConstantExprPass,
+                createExpandConstantExprRewrite);
 #if 0 // EMSCRIPTEN: We can handle constant vectors.
   // GlobalizeConstantVectors does not handle nested ConstantExprs, so we
   // run ExpandConstantExpr first.
@@ -147,7 +200,8 @@ void llvm::PNaClABISimplifyAddPostOptPasses(PassManagerBase &PM) {
   // The following pass inserts GEPs, it must precede ExpandGetElementPtr. It
   // also creates vector loads and stores, the subsequent pass cleans them up to
   // fix their alignment.
-  PM.add(createConstantInsertExtractElementIndexPass());
+  PM.addRewrite(createConstantInsertExtractElementIndexPass,
+                createConstantInsertExtractElementIndexRewrite);
 #if 0 // EMSCRIPTEN: We can handle unaligned vector loads and stores.
   PM.add(createFixVectorLoadStoreAlignmentPass());
 #endif
@@ -175,14 +229,14 @@ void llvm::PNaClABISimplifyAddPostOptPasses(PassManagerBase &PM) {
 
   // PromoteIntegersPass does not handle constexprs and creates GEPs,
   // so it goes between those passes.
-  PM.add(createPromoteIntegersPass());
+  PM.addRewrite(createPromoteIntegersPass, createPromoteIntegersRewrite);
 #if 0 // XXX EMSCRIPTEN: We can handle GEPs in our backend.
   // ExpandGetElementPtr must follow ExpandConstantExpr to expand the
   // getelementptr instructions it creates.
   PM.add(createExpandGetElementPtrPass());
 #endif
   // Rewrite atomic and volatile instructions with intrinsic calls.
-  PM.add(createRewriteAtomicsPass());
+  PM.addRewrite(createRewriteAtomicsPass, createRewriteAtomicsRewrite);
   // Remove ``asm("":::"memory")``. This must occur after rewriting
   // atomics: a ``fence seq_cst`` surrounded by ``asm("":::"memory")``
   // has special meaning and is translated differently.
@@ -198,7 +252,7 @@ void llvm::PNaClABISimplifyAddPostOptPasses(PassManagerBase &PM) {
   // The atomic cmpxchg instruction returns a struct, and is rewritten to an
   // intrinsic as a post-opt pass, we therefore need to expand struct regs one
   // last time.
-  PM.add(createExpandStructRegsPass());
+  PM.addRewrite(createExpandStructRegsPass, createExpandStructRegsRewrite);
 
   // We place StripAttributes after optimization passes because many
   // analyses add attributes to reflect their results.
@@ -29,6 +29,7 @@
 
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/Function.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/Pass.h"
 #include "llvm/Transforms/NaCl.h"
@@ -45,6 +46,12 @@ namespace {
 
     virtual bool runOnBasicBlock(BasicBlock &BB);
   };
+
+  class PromoteI1OpsRewrite : public PNaClRewrite {
+  public:
+    virtual bool mayRewrite(const Instruction &Inst) const;
+    virtual bool rewriteFunction(Function &Func);
+  };
 }
 
 char PromoteI1Ops::ID = 0;
@@ -61,7 +68,7 @@ static Value *promoteValue(Value *Val, bool SignExt, Instruction *InsertPt) {
                                     InsertPt), InsertPt);
 }
 
-bool PromoteI1Ops::runOnBasicBlock(BasicBlock &BB) {
+static bool promoteBlock(BasicBlock &BB) {
   bool Changed = false;
 
   Type *I1Ty = Type::getInt1Ty(BB.getContext());
@@ -72,6 +79,7 @@ bool PromoteI1Ops::runOnBasicBlock(BasicBlock &BB) {
     Value *Condition = Switch->getCondition();
     Type *ConditionTy = Condition->getType();
     if (ConditionTy->isIntegerTy(1)) {
+      Changed = true;
       ConstantInt *False =
         cast<ConstantInt>(ConstantInt::getFalse(ConditionTy));
       ConstantInt *True =
@@ -139,6 +147,7 @@ bool PromoteI1Ops::runOnBasicBlock(BasicBlock &BB) {
           !(Op->getOpcode() == Instruction::And ||
             Op->getOpcode() == Instruction::Or ||
             Op->getOpcode() == Instruction::Xor)) {
+        Changed = true;
         Value *Arg1 = promoteValue(Op->getOperand(0), false, Op);
         Value *Arg2 = promoteValue(Op->getOperand(1), false, Op);
         Value *NewOp = CopyDebug(
@@ -152,6 +161,7 @@ bool PromoteI1Ops::runOnBasicBlock(BasicBlock &BB) {
       }
     } else if (ICmpInst *Op = dyn_cast<ICmpInst>(Inst)) {
       if (Op->getOperand(0)->getType() == I1Ty) {
+        Changed = true;
         Value *Arg1 = promoteValue(Op->getOperand(0), Op->isSigned(), Op);
         Value *Arg2 = promoteValue(Op->getOperand(1), Op->isSigned(), Op);
         Value *Result = CopyDebug(
@@ -165,6 +175,39 @@ bool PromoteI1Ops::runOnBasicBlock(BasicBlock &BB) {
   return Changed;
 }
 
+bool PromoteI1Ops::runOnBasicBlock(BasicBlock &BB) {
+  return promoteBlock(BB);
+}
+
+bool PromoteI1OpsRewrite::mayRewrite(const Instruction &Inst) const {
+  Type *I1Ty = Type::getInt1Ty(Inst.getContext());
+  if (const SwitchInst *Switch = dyn_cast<SwitchInst>(&Inst))
+    return Switch->getCondition()->getType() == I1Ty;
+  if (const LoadInst *Load = dyn_cast<LoadInst>(&Inst))
+    return Load->getType() == I1Ty;
+  if (const StoreInst *Store = dyn_cast<StoreInst>(&Inst))
+    return Store->getValueOperand()->getType() == I1Ty;
+  if (const BinaryOperator *Op = dyn_cast<BinaryOperator>(&Inst))
+    return Op->getType() == I1Ty &&
+           !(Op->getOpcode() == Instruction::And ||
+             Op->getOpcode() == Instruction::Or ||
+             Op->getOpcode() == Instruction::Xor);
+  if (const ICmpInst *Op = dyn_cast<ICmpInst>(&Inst))
+    return Op->getOperand(0)->getType() == I1Ty;
+  return false;
+}
+
+bool PromoteI1OpsRewrite::rewriteFunction(Function &Func) {
+  bool Changed = false;
+  for (Function::iterator BB = Func.begin(), E = Func.end(); BB != E; ++BB)
+    Changed |= promoteBlock(*BB);
+  return Changed;
+}
+
 BasicBlockPass *llvm::createPromoteI1OpsPass() {
   return new PromoteI1Ops();
 }
+
+PNaClRewrite *llvm::createPromoteI1OpsRewrite() {
+  return new PromoteI1OpsRewrite();
+}
@@ -43,13 +43,26 @@ using namespace llvm;
 namespace {
 class ConversionState;
 
-class PromoteIntegers : public FunctionPass {
+class PromoteIntegersRewrite : public PNaClRewrite {
   const DataLayout *DL;
 
   Value *splitLoad(LoadInst *Inst, ConversionState &State);
   Value *splitStore(StoreInst *Inst, ConversionState &State);
   void convertInstruction(Instruction *Inst, ConversionState &State);
 
+ public:
+  PromoteIntegersRewrite() : DL(0) {}
+  virtual void initialize(Module &M, const DataLayout &Layout) {
+    DL = &Layout;
+  }
+  virtual bool mayRewriteFunction(const Function &F) const;
+  virtual bool mayRewrite(const Instruction &Inst) const;
+  virtual bool rewriteFunction(Function &F);
+};
+
+class PromoteIntegers : public FunctionPass {
+  PromoteIntegersRewrite Rewrite;
+
  public:
   static char ID;
   PromoteIntegers() : FunctionPass(ID) {
@@ -100,8 +113,8 @@ static Type *getPromotedType(Type *Ty) {
 }
 
 // Return true if Val is an int which should be converted.
-static bool shouldConvert(Value *Val) {
-  if (IntegerType *ITy = dyn_cast<IntegerType>(Val->getType())) {
+static bool shouldConvert(const Value *Val) {
+  if (const IntegerType *ITy = dyn_cast<IntegerType>(Val->getType())) {
     if (!isLegalSize(ITy->getBitWidth())) {
       return true;
     }
@@ -215,7 +228,7 @@ class ConversionState {
 
 // Split an illegal load into multiple legal loads and return the resulting
 // promoted value. The size of the load is assumed to be a multiple of 8.
-Value *PromoteIntegers::splitLoad(LoadInst *Inst, ConversionState &State) {
+Value *PromoteIntegersRewrite::splitLoad(LoadInst *Inst, ConversionState &State) {
   if (Inst->isVolatile() || Inst->isAtomic())
     report_fatal_error("Can't split volatile/atomic loads");
   if (DL->getTypeSizeInBits(Inst->getType()) % 8 != 0)
@@ -269,7 +282,7 @@ Value *PromoteIntegers::splitLoad(LoadInst *Inst, ConversionState &State) {
   return Result;
 }
 
-Value *PromoteIntegers::splitStore(StoreInst *Inst, ConversionState &State) {
+Value *PromoteIntegersRewrite::splitStore(StoreInst *Inst, ConversionState &State) {
   if (Inst->isVolatile() || Inst->isAtomic())
     report_fatal_error("Can't split volatile/atomic stores");
   if (DL->getTypeSizeInBits(Inst->getValueOperand()->getType()) % 8 != 0)
@@ -392,7 +405,7 @@ static Value *getSignExtend(Value *Operand, Value *OrigOperand,
       InsertPt), Shl);
 }
 
-void PromoteIntegers::convertInstruction(Instruction *Inst, ConversionState &State) {
+void PromoteIntegersRewrite::convertInstruction(Instruction *Inst, ConversionState &State) {
   if (SExtInst *Sext = dyn_cast<SExtInst>(Inst)) {
     Value *Op = Sext->getOperand(0);
     Value *NewInst = NULL;
@@ -631,8 +644,27 @@ void PromoteIntegers::convertInstruction(Instruction *Inst, ConversionState &Sta
   }
 }
 
-bool PromoteIntegers::runOnFunction(Function &F) {
-  DL = &getAnalysis<DataLayoutPass>().getDataLayout();
+bool PromoteIntegersRewrite::mayRewriteFunction(const Function &F) const {
+  for (Function::const_arg_iterator I = F.arg_begin(), E = F.arg_end();
+       I != E; ++I) {
+    if (shouldConvert(I))
+      return true;
+  }
+  return false;
+}
+
+bool PromoteIntegersRewrite::mayRewrite(const Instruction &Inst) const {
+  if (shouldConvert(&Inst))
+    return true;
+  for (User::const_op_iterator OI = Inst.op_begin(), OE = Inst.op_end();
+       OI != OE; ++OI) {
+    if (shouldConvert(*OI))
+      return true;
+  }
+  return false;
+}
+
+bool PromoteIntegersRewrite::rewriteFunction(Function &F) {
   // Don't support changing the function arguments. This should not be
   // generated by clang.
   for (Function::arg_iterator I = F.arg_begin(), E = F.arg_end(); I != E; ++I) {
@@ -665,6 +697,16 @@ bool PromoteIntegers::runOnFunction(Function &F) {
   return Modified;
 }
 
+bool PromoteIntegers::runOnFunction(Function &F) {
+  Rewrite.initialize(*F.getParent(),
+                     getAnalysis<DataLayoutPass>().getDataLayout());
+  return Rewrite.rewriteFunction(F);
+}
+
 FunctionPass *llvm::createPromoteIntegersPass() {
   return new PromoteIntegers();
 }
+
+PNaClRewrite *llvm::createPromoteIntegersRewrite() {
+  return new PromoteIntegersRewrite();
+}
@@ -29,6 +29,7 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/NaCl.h"
 #include <climits>
+#include <memory>
 #include <string>
 
 using namespace llvm;
@@ -58,12 +59,11 @@ template <class T> std::string ToStr(const T &V) {
 
 class AtomicVisitor : public InstVisitor<AtomicVisitor> {
 public:
-  AtomicVisitor(Module &M, Pass &P)
-      : M(M), C(M.getContext()),
-        TD(P.getAnalysis<DataLayoutPass>().getDataLayout()), AI(C),
-        ModifiedModule(false) {}
+  AtomicVisitor(Module &M, const DataLayout &TD)
+      : M(M), C(M.getContext()), TD(TD), AI(C), ModifiedModule(false) {}
   ~AtomicVisitor() {}
   bool modifiedModule() const { return ModifiedModule; }
+  void resetModifiedModule() { ModifiedModule = false; }
 
   void visitLoadInst(LoadInst &I);
   void visitStoreInst(StoreInst &I);
@@ -146,6 +146,22 @@ private:
     }
   };
 };
+
+class RewriteAtomicsRewrite : public PNaClRewrite {
+public:
+  virtual void initialize(Module &M, const DataLayout &DL) {
+    AV.reset(new AtomicVisitor(M, DL));
+  }
+  virtual bool mayRewrite(const Instruction &Inst) const;
+  virtual bool rewriteFunction(Function &F) {
+    AV->resetModifiedModule();
+    AV->visit(F);
+    return AV->modifiedModule();
+  }
+
+private:
+  std::unique_ptr<AtomicVisitor> AV;
+};
 }
 
 char RewriteAtomics::ID = 0;
@@ -155,11 +171,20 @@ INITIALIZE_PASS(RewriteAtomics, "nacl-rewrite-atomics",
                 false, false)
 
 bool RewriteAtomics::runOnModule(Module &M) {
-  AtomicVisitor AV(M, *this);
+  AtomicVisitor AV(M, getAnalysis<DataLayoutPass>().getDataLayout());
   AV.visit(M);
   return AV.modifiedModule();
 }
 
+bool RewriteAtomicsRewrite::mayRewrite(const Instruction &Inst) const {
+  if (const LoadInst *Load = dyn_cast<LoadInst>(&Inst))
+    return !Load->isSimple();
+  if (const StoreInst *Store = dyn_cast<StoreInst>(&Inst))
+    return !Store->isSimple();
+  return isa<AtomicCmpXchgInst>(Inst) || isa<AtomicRMWInst>(Inst) ||
+         isa<FenceInst>(Inst);
+}
+
 template <class Instruction>
 ConstantInt *AtomicVisitor::freezeMemoryOrder(const Instruction &I,
                                               AtomicOrdering O) const {
@@ -408,3 +433,7 @@ void AtomicVisitor::visitFenceInst(FenceInst &I) {
 }
 
 ModulePass *llvm::createRewriteAtomicsPass() { return new RewriteAtomics(); }
+
+PNaClRewrite *llvm::createRewriteAtomicsRewrite() {
+  return new RewriteAtomicsRewrite();
+}
@@ -0,0 +1,79 @@
+// Runs each function of two llc-generated files, one without and one with
+// -emscripten-div-by-constant, on the same inputs and prints the inputs on
+// which they differ. Every function takes one i32. Used by
+// div-by-constant-run.ll and utils/emscripten-div-check.py.
+//
+// Usage: node div-check.js <plain.js> <magic.js> [samples | all]
+//
+// By default each function gets the edge cases and 1000 other inputs, from
+// a fixed pseudo-random sequence; "all" tries every 32-bit input.
+
+var fs = require('fs');
+
+function load(file) {
+  var src = fs.readFileSync(file, 'utf8');
+  var funcs = src.substring(src.indexOf('// EMSCRIPTEN_START_FUNCTIONS'),
+                            src.indexOf('// EMSCRIPTEN_END_FUNCTIONS'));
+  var names = [], re = /^function (_\w+)\(/gm, m;
+  while ((m = re.exec(funcs))) {
+    if (m[1] != '_runPostSets') names.push(m[1]);
+  }
+  var make = new Function('buffer',
+    'var HEAP32 = new Int32Array(buffer);' +
+    ' var STACKTOP = 0, STACK_MAX = 0, tempRet0 = 0;' +
+    ' var Math_imul = Math.imul;\n' +
+    funcs +
+    '\nreturn {' + names.map(function(n) { return n + ': ' + n; }).join(',') + '};');
+  return make(new ArrayBuffer(65536));
+}
+
+var plain = load(process.argv[2]);
+var magic = load(process.argv[3]);
+var exhaustive = process.argv[4] == 'all';
+var samples = exhaustive ? 0 : Number(process.argv[4] || 1000);
+
+// The divisor, where the function name ends in it, as _udiv_10 or _sdiv_m7.
+function divisor(name) {
+  var m = /_(m?)(\d+)(_\w)?$/.exec(name);
+  return m ? (m[1] ? -1 : 1) * Number(m[2]) : 0;
+}
+
+function inputs(name) {
+  var d = divisor(name), list = [0, 1, -1, 2, -2, 0x7fffffff, -0x80000000,
+                                 0xffff, 0x10000, 0x7fff, -0x8000];
+  for (var k = -3; k <= 3; k++) {
+    var q = d * k;
+    list.push(q - 1, q, q + 1);
+    if (d) {
+      var top = (Math.floor(0xffffffff / Math.abs(d)) - k) * Math.abs(d);
+      list.push(top - 1, top, top + 1);
+    }
+  }
+  // xorshift32, the same sequence for each function
+  var x = 2463534242;
+  for (var i = 0; i < samples; i++) {
+    x ^= x << 13; x ^= x >>> 17; x ^= x << 5;
+    list.push(i % 4 == 0 ? x & 0xffff : x);
+  }
+  return list.map(function(v) { return v | 0; });
+}
+
+var names = Object.keys(plain), mismatches = 0, tried = 0;
+names.forEach(function(name) {
+  var p = plain[name], q = magic[name];
+  function check(x) {
+    // division of INT_MIN by -1 is undefined
+    if (x == -0x80000000 && divisor(name) == -1) return;
+    tried++;
+    var a = p(x), b = q(x);
+    if (a !== b) {
+      if (mismatches++ < 20) console.log('mismatch ' + name + '(' + x + '): ' + a + ' != ' + b);
+    }
+  }
+  if (exhaustive) {
+    for (var x = 0; x <= 0xffffffff; x++) check(x | 0);
+  } else {
+    inputs(name).forEach(check);
+  }
+});
+console.log(names.length + ' functions, ' + tried + ' inputs, ' + mismatches + ' mismatches');
@@ -0,0 +1,44 @@
+// Runs the functions in an llc-generated file as two asm.js module
+// instances sharing one heap, the way two workers would, and prints what
+// each instance sees. Used by thread-instances.ll.
+//
+// Usage: node two-instances.js <file.js>
+
+var fs = require('fs');
+var src = fs.readFileSync(process.argv[2], 'utf8');
+
+var funcs = src.substring(src.indexOf('// EMSCRIPTEN_START_FUNCTIONS'),
+                          src.indexOf('// EMSCRIPTEN_END_FUNCTIONS'));
+var init = /allocate\(\[([^\]]*)\]/.exec(src);
+var GLOBAL_BASE = 8;
+
+var buffer = new ArrayBuffer(65536);
+if (init) {
+  new Uint8Array(buffer).set(init[1].split(',').map(Number), GLOBAL_BASE);
+}
+
+// Each instance gets its own module-level variables (tlsBase, STACKTOP,
+// STACK_MAX) but the same buffer, as separate asm.js modules would.
+var makeInstance = new Function('buffer',
+  'var HEAP8 = new Int8Array(buffer), HEAP16 = new Int16Array(buffer),' +
+  ' HEAP32 = new Int32Array(buffer), HEAPU8 = new Uint8Array(buffer),' +
+  ' HEAPU16 = new Uint16Array(buffer), HEAPU32 = new Uint32Array(buffer),' +
+  ' HEAPF32 = new Float32Array(buffer), HEAPF64 = new Float64Array(buffer);' +
+  ' var STACKTOP = 0, STACK_MAX = 0, tlsBase = 0;' +
+  ' var Math_imul = Math.imul;' +
+  ' function abort() { throw new Error("abort"); }\n' +
+  funcs +
+  '\nreturn { thread_init: _emscripten_thread_init, bump: _bump,' +
+  ' stack_probe: _stack_probe };');
+
+var a = makeInstance(buffer);
+var b = makeInstance(buffer);
+a.thread_init(1024, 1024);
+b.thread_init(4096, 1024);
+
+console.log('a bump ' + a.bump(1));
+console.log('b bump ' + b.bump(10));
+console.log('a bump ' + a.bump(1));
+console.log('b bump ' + b.bump(10));
+console.log('a stack ' + a.stack_probe());
+console.log('b stack ' + b.stack_probe());
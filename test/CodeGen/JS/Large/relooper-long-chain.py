@@ -0,0 +1,27 @@
+# Test that the relooper handles a very long chain of sequential blocks,
+# which it must process iteratively rather than recursively.
+# RUN: python %s | llc | FileCheck %s
+
+# CHECK: function _f($p) {
+# CHECK: HEAP32[$p>>2] = 0;
+# CHECK: HEAP32[$p>>2] = 1;
+# CHECK: HEAP32[$p>>2] = 99999;
+# CHECK-NEXT: return;
+# CHECK-NEXT: }
+count = 100000
+
+print('target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"')
+print('target triple = "asmjs-unknown-emscripten"')
+print('')
+print('define void @f(i32* %p) {')
+print('entry:')
+print('  br label %b0')
+
+for i in range(count):
+    print('b%d:' % i)
+    print('  store i32 %d, i32* %%p' % i)
+    if i + 1 < count:
+        print('  br label %%b%d' % (i + 1))
+
+print('  ret void')
+print('}')
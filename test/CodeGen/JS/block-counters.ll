@@ -0,0 +1,63 @@
+; RUN: llc -emscripten-block-counters=%t.map < %s | FileCheck %s
+; RUN: FileCheck %s -check-prefix=MAP < %t.map
+
+; Each block increments its own counter when it starts. The counters follow
+; the static data, here @g at 8, and the map says which function and block
+; each one belongs to.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+@g = global i32 7
+
+; CHECK: function _sum($n) {
+; CHECK: HEAP32[16>>2] = (HEAP32[16>>2]|0) + 1|0;
+; CHECK: while(1) {
+; CHECK-NEXT: HEAP32[20>>2] = (HEAP32[20>>2]|0) + 1|0;
+; CHECK: HEAP32[24>>2] = (HEAP32[24>>2]|0) + 1|0;
+; CHECK-NEXT: return ($s$next|0);
+define i32 @sum(i32 %n) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %s = phi i32 [ 0, %entry ], [ %s.next, %loop ]
+  %s.next = add i32 %s, %i
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i32 %s.next
+}
+
+; CHECK: function _main() {
+; CHECK: HEAP32[28>>2] = (HEAP32[28>>2]|0) + 1|0;
+; CHECK: HEAP32[32>>2] = (HEAP32[32>>2]|0) + 1|0;
+; CHECK: HEAP32[36>>2] = (HEAP32[36>>2]|0) + 1|0;
+; CHECK-NOT: #BC_
+define i32 @main() {
+  %r = call i32 @sum(i32 10)
+  %1 = icmp sgt i32 %r, 0
+  br i1 %1, label %pos, label %neg
+pos:
+  ret i32 %r
+neg:
+  ret i32 0
+}
+
+; The counters are zero in the memory initializer, which reserves them.
+; CHECK: allocate([7,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0], "i8"
+; CHECK: "namedGlobals": {"_emscripten_block_counters": "16"}
+
+; MAP: emscripten-block-counters 1
+; MAP-NEXT: counters 16 6
+; MAP-NEXT: function sum _sum 0 3
+; MAP-NEXT: block entry
+; MAP-NEXT: block loop
+; MAP-NEXT: block exit
+; MAP-NEXT: function main _main 3 3
+; MAP-NEXT: block -
+; MAP-NEXT: block pos
+; MAP-NEXT: block neg
@@ -0,0 +1,92 @@
+; RUN: echo cold > %t.list
+; RUN: echo coldf >> %t.list
+; RUN: echo high >> %t.list
+; RUN: echo indirect >> %t.list
+; RUN: llc -emscripten-precise-f32 -emscripten-cold-functions=%t.list -emscripten-cold-chunk=%t.chunk.js < %s | FileCheck %s
+; RUN: FileCheck %s -check-prefix=CHUNK < %t.chunk.js
+
+; The listed functions move to the cold chunk, and stubs that call them
+; through imports take their place, so calls and function pointers in the
+; main module still work. The chunk calls functions of the main module
+; through its exports. @high reads the high bits of an i64 result, which each
+; module keeps in its own tempRet0, so it stays. So does @indirect, as its
+; call through a pointer goes through the function tables of the main module.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+declare void @puts(i8*)
+declare i32 @getHigh32()
+
+; CHECK: function _hot($x) {
+; CHECK: $a = (_cold($x,+2)|0);
+define i32 @hot(i32 %x) {
+  %a = call i32 @cold(i32 %x, double 2.0)
+  %b = call float @coldf(float 1.0)
+  %c = call i32 @high(i32 %x)
+  %d = add i32 %a, %c
+  %e = call i32 @indirect(i32 %d)
+  ret i32 %e
+}
+
+define i32 @helper(i32 %x) {
+  %r = mul i32 %x, 3
+  ret i32 %r
+}
+
+; CHECK: function _cold($0,$1) {
+; CHECK-NEXT: $0 = $0|0;
+; CHECK-NEXT: $1 = +$1;
+; CHECK-NEXT: return (cold$_cold($0|0,+$1)|0);
+; CHECK-NEXT: }
+; CHECK: function _coldf($0) {
+; CHECK-NEXT: $0 = Math_fround($0);
+; CHECK-NEXT: return (Math_fround(+(cold$_coldf(+$0))));
+; CHECK-NEXT: }
+; CHECK: function _high($x) {
+; CHECK: $h = tempRet0;
+; CHECK: function _indirect($x) {
+; CHECK: FUNCTION_TABLE_vi[$f & 0]($x);
+
+; CHUNK: // EMSCRIPTEN_START_FUNCTIONS
+; CHUNK-NEXT: function _cold($x,$y) {
+; CHUNK: $h = (_helper(($x|0))|0);
+; CHUNK: _puts((0|0));
+define i32 @cold(i32 %x, double %y) {
+  %h = call i32 @helper(i32 %x)
+  call void @puts(i8* null)
+  %z = fptosi double %y to i32
+  %r = add i32 %h, %z
+  ret i32 %r
+}
+
+; CHUNK: function _coldf($x) {
+; CHUNK: $r = Math_fround($x + $x);
+; CHUNK-NOT: function
+; CHUNK: // EMSCRIPTEN_END_FUNCTIONS
+define float @coldf(float %x) {
+  %r = fadd float %x, %x
+  ret float %r
+}
+
+define i32 @high(i32 %x) {
+  %h = call i32 @getHigh32()
+  ret i32 %h
+}
+
+define i32 @indirect(i32 %x) {
+  %f = inttoptr i32 %x to void (i32)*
+  call void %f(i32 %x)
+  ret i32 %x
+}
+
+define i32 @take() {
+  %p = ptrtoint i32 (i32, double)* @cold to i32
+  ret i32 %p
+}
+
+; CHECK: "tables": {  "iid": "var FUNCTION_TABLE_iid = [0,_cold];"
+; CHECK: "exports": ["_helper"]
+; CHECK: "coldFunctions": ["_cold", "_coldf"]
+
+; CHUNK: "implementedFunctions": ["_cold", "_coldf"],"imports": ["_helper"]
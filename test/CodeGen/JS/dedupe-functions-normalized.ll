@@ -0,0 +1,57 @@
+; RUN: llc -emscripten-dedupe-functions < %s | FileCheck %s
+
+; Functions whose JS differs only in the names of their locals or in their
+; //@line comments are duplicates too. References to the functions that are
+; not emitted are replaced only outside string literals, so the file name of
+; a //@line comment is kept as it is.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+; CHECK: function _main($x) {
+; CHECK: $a = (_first($x)|0);
+; CHECK: $b = (_first($a)|0);
+; CHECK: $c = (_first($b)|0);
+define i32 @main(i32 %x) {
+  %a = call i32 @first(i32 %x)
+  %b = call i32 @renamed(i32 %a)
+  %c = call i32 @lined(i32 %b)
+  ret i32 %c
+}
+
+; CHECK: function _first($v) {
+; CHECK: $r = ($v*7)|0; //@line 2 "_renamed"
+define internal i32 @first(i32 %v) {
+  %r = mul i32 %v, 7, !dbg !10
+  ret i32 %r
+}
+
+; CHECK-NOT: function _renamed(
+define internal i32 @renamed(i32 %w) {
+  %s = mul i32 %w, 7
+  ret i32 %s
+}
+
+; CHECK-NOT: function _lined(
+define internal i32 @lined(i32 %u) {
+  %q = mul i32 %u, 7, !dbg !11
+  ret i32 %q
+}
+
+; CHECK: // EMSCRIPTEN_END_FUNCTIONS
+; CHECK: "implementedFunctions": ["_main", "_first"]
+
+!llvm.dbg.cu = !{!0}
+!llvm.module.flags = !{!9}
+
+!0 = metadata !{i32 786449, metadata !1, i32 12, metadata !"clang", i1 true, metadata !"", i32 0, metadata !2, metadata !2, metadata !3, null, null, metadata !""} ; [ DW_TAG_compile_unit ]
+!1 = metadata !{metadata !"_renamed", metadata !"/src"}
+!2 = metadata !{i32 0}
+!3 = metadata !{metadata !4, metadata !7}
+!4 = metadata !{i32 786478, metadata !1, metadata !5, metadata !"first", metadata !"first", metadata !"", i32 1, metadata !6, i1 true, i1 true, i32 0, i32 0, null, i32 256, i1 true, i32 (i32)* @first, null, null, null, i32 1} ; [ DW_TAG_subprogram ]
+!5 = metadata !{i32 786473, metadata !1} ; [ DW_TAG_file_type ]
+!6 = metadata !{i32 786453, metadata !1, metadata !5, metadata !"", i32 0, i64 0, i64 0, i64 0, i32 0, null, metadata !2, i32 0, null, null, null} ; [ DW_TAG_subroutine_type ]
+!7 = metadata !{i32 786478, metadata !1, metadata !5, metadata !"lined", metadata !"lined", metadata !"", i32 4, metadata !6, i1 true, i1 true, i32 0, i32 0, null, i32 256, i1 true, i32 (i32)* @lined, null, null, null, i32 4} ; [ DW_TAG_subprogram ]
+!9 = metadata !{i32 1, metadata !"Debug Info Version", i32 1}
+!10 = metadata !{i32 2, i32 5, metadata !4, null}
+!11 = metadata !{i32 5, i32 5, metadata !7, null}
@@ -0,0 +1,75 @@
+; RUN: llc -emscripten-dedupe-functions < %s | FileCheck %s
+
+; Internal functions whose JS is the same as that of a function printed
+; before are not emitted, and calls and function table entries go to that
+; function instead, including calls printed before the duplicate was found.
+; Recursive functions match although they call themselves by name.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+; CHECK: function _main($x) {
+; CHECK: $a = (_first($x)|0);
+; CHECK: $b = (_first($a)|0);
+; CHECK: $c = (_third($b)|0);
+; CHECK: $r1 = (_rec1($t)|0);
+; CHECK: $r2 = (_rec1($r1)|0);
+define i32 @main(i32 %x) {
+  %a = call i32 @first(i32 %x)
+  %b = call i32 @second(i32 %a)
+  %c = call i32 @third(i32 %b)
+  %p = ptrtoint i32 (i32)* @second to i32
+  %q = ptrtoint i32 (i32)* @first to i32
+  %s = add i32 %c, %p
+  %t = add i32 %s, %q
+  %r1 = call i32 @rec1(i32 %t)
+  %r2 = call i32 @rec2(i32 %r1)
+  ret i32 %r2
+}
+
+define internal i32 @first(i32 %v) {
+  %r = mul i32 %v, 7
+  ret i32 %r
+}
+
+define internal i32 @second(i32 %v) {
+  %r = mul i32 %v, 7
+  ret i32 %r
+}
+
+define internal i32 @third(i32 %v) {
+  %r = mul i32 %v, 8
+  ret i32 %r
+}
+
+define internal i32 @rec1(i32 %v) {
+  %c = icmp eq i32 %v, 0
+  br i1 %c, label %done, label %more
+more:
+  %w = sub i32 %v, 1
+  %r = call i32 @rec1(i32 %w)
+  ret i32 %r
+done:
+  ret i32 0
+}
+
+define internal i32 @rec2(i32 %v) {
+  %c = icmp eq i32 %v, 0
+  br i1 %c, label %done, label %more
+more:
+  %w = sub i32 %v, 1
+  %r = call i32 @rec2(i32 %w)
+  ret i32 %r
+done:
+  ret i32 0
+}
+
+; CHECK: function _first($v) {
+; CHECK-NOT: function _second(
+; CHECK: function _third($v) {
+; CHECK: function _rec1($v) {
+; CHECK: $r = (_rec1($w)|0);
+; CHECK-NOT: function _rec2(
+; CHECK: // EMSCRIPTEN_END_FUNCTIONS
+; CHECK: "implementedFunctions": ["_main", "_first", "_third", "_rec1"]
+; CHECK: var FUNCTION_TABLE_ii = [0,_first,_first,0];
@@ -0,0 +1,90 @@
+; RUN: llc < %s -o %t.plain.js
+; RUN: llc -emscripten-div-by-constant < %s -o %t.magic.js
+; RUN: node %S/Inputs/div-check.js %t.plain.js %t.magic.js | FileCheck %s
+; REQUIRES: node
+
+; Runs the sequences of -emscripten-div-by-constant and the plain divisions
+; on the same inputs, near multiples of the divisor and pseudo-random ones,
+; for each kind of sequence: odd and even divisors, magic numbers that need
+; the fixup, and dividends known to fit in 16 or 31 bits.
+; utils/emscripten-div-check.py does the same for many more divisors.
+
+; CHECK-NOT: mismatch
+; CHECK: 14 functions, {{[0-9]+}} inputs, 0 mismatches
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+define i32 @udiv_10(i32 %x) {
+  %r = udiv i32 %x, 10
+  ret i32 %r
+}
+
+define i32 @udiv_7(i32 %x) {
+  %r = udiv i32 %x, 7
+  ret i32 %r
+}
+
+define i32 @udiv_14(i32 %x) {
+  %r = udiv i32 %x, 14
+  ret i32 %r
+}
+
+define i32 @udiv_1000000000(i32 %x) {
+  %r = udiv i32 %x, 1000000000
+  ret i32 %r
+}
+
+define i32 @urem_641(i32 %x) {
+  %r = urem i32 %x, 641
+  ret i32 %r
+}
+
+define i32 @urem_10_h(i32 %x) {
+  %y = and i32 %x, 65535
+  %r = urem i32 %y, 10
+  ret i32 %r
+}
+
+define i32 @udiv_7_w(i32 %x) {
+  %y = lshr i32 %x, 1
+  %r = udiv i32 %y, 7
+  ret i32 %r
+}
+
+define i32 @sdiv_7(i32 %x) {
+  %r = sdiv i32 %x, 7
+  ret i32 %r
+}
+
+define i32 @sdiv_m7(i32 %x) {
+  %r = sdiv i32 %x, -7
+  ret i32 %r
+}
+
+define i32 @sdiv_3(i32 %x) {
+  %r = sdiv i32 %x, 3
+  ret i32 %r
+}
+
+define i32 @sdiv_1000(i32 %x) {
+  %r = sdiv i32 %x, 1000
+  ret i32 %r
+}
+
+define i32 @srem_m10(i32 %x) {
+  %r = srem i32 %x, -10
+  ret i32 %r
+}
+
+define i32 @srem_7_h(i32 %x) {
+  %y = and i32 %x, 65535
+  %r = srem i32 %y, 7
+  ret i32 %r
+}
+
+define i32 @sdiv_m1000_w(i32 %x) {
+  %y = lshr i32 %x, 1
+  %r = sdiv i32 %y, -1000
+  ret i32 %r
+}
@@ -0,0 +1,82 @@
+; RUN: llc -emscripten-div-by-constant < %s | FileCheck %s
+; RUN: llc < %s | FileCheck -check-prefix=OFF %s
+
+; With -emscripten-div-by-constant, 32-bit division and remainder by a
+; constant are multiplies by a magic number, built from 16-bit halves, and
+; shifts.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+; CHECK: function _udiv10(
+; CHECK: div0$lo = $x & 65535;div0$hi = $x >>> 16;div0$t = ((div0$hi*52429)|0) + ((div0$lo*52429)>>>16)|0;div0$w = ((div0$lo*52428)|0) + (div0$t & 65535)|0;div0$q = (((div0$hi*52428)|0) + (div0$t>>>16) + (div0$w>>>16))|0;div0$q = div0$q >>> 3;$q = div0$q;
+; OFF: function _udiv10(
+; OFF: $q = (($x>>>0) / 10)&-1;
+define i32 @udiv10(i32 %x) {
+  %q = udiv i32 %x, 10
+  ret i32 %q
+}
+
+; CHECK: function _sdiv7(
+; CHECK: div0$q = (((div0$hi*37449)|0) + (div0$t>>>16) + (div0$w>>>16) - ($x>>31 & -1840700269))|0;div0$q = div0$q >> 2;div0$q = div0$q + (div0$q>>>31)|0;$q = div0$q;
+define i32 @sdiv7(i32 %x) {
+  %q = sdiv i32 %x, 7
+  ret i32 %q
+}
+
+; The fixup for divisors whose magic number does not fit in 32 bits.
+
+; CHECK: function _udiv7(
+; CHECK: div0$q = (((($x - div0$q)>>>1) + div0$q)>>>2)|0;$q = div0$q;
+define i32 @udiv7(i32 %x) {
+  %q = udiv i32 %x, 7
+  ret i32 %q
+}
+
+; A dividend of 16 bits needs only its products with the halves of the magic
+; number, and a remainder multiplies back.
+
+; CHECK: function _urem10(
+; CHECK: div0$t = ($y*39322)>>>16;div0$q = ((((($y*6553)|0) + div0$t)>>>16))|0;$r = ($y - ((div0$q*10)|0))|0;
+define i32 @urem10(i16 %x) {
+  %y = zext i16 %x to i32
+  %r = urem i32 %y, 10
+  ret i32 %r
+}
+
+; CHECK: function _srem_neg1000(
+; CHECK: $r = ($x - ((div0$q*-1000)|0))|0;
+define i32 @srem_neg1000(i32 %x) {
+  %r = srem i32 %x, -1000
+  ret i32 %r
+}
+
+; The temporaries are numbered in each function, and do not clash with locals
+; that have the same suffixes.
+
+; CHECK: function _clash(
+; CHECK: $d$lo = (($y) + 1)|0;
+; CHECK: div0$lo = $x & 65535;
+; CHECK: $d = div0$q;
+; CHECK: div1$lo = $d$lo & 65535;
+; CHECK: $e = div1$q;
+define i32 @clash(i32 %x, i32 %y) {
+  %d.lo = add i32 %y, 1
+  %d = udiv i32 %x, 10
+  %e = udiv i32 %d.lo, 10
+  %s = add i32 %d, %d.lo
+  %t = add i32 %s, %e
+  ret i32 %t
+}
+
+; Powers of 2 and divisors that are not constants are left as they are.
+
+; CHECK: function _other(
+; CHECK: $a = (($x|0) / 4)&-1;
+; CHECK: $b = (($x>>>0) % ($y>>>0))&-1;
+define i32 @other(i32 %x, i32 %y) {
+  %a = sdiv i32 %x, 4
+  %b = urem i32 %x, %y
+  %c = add i32 %a, %b
+  ret i32 %c
+}
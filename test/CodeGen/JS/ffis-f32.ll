@@ -8,7 +8,7 @@ target triple = "asmjs-unknown-emscripten"
 ; CHECK:      (+Math_sqrt(+1));
 ; CHECK-NEXT: (Math_fround(Math_sqrt(Math_fround(+1))));
 ; CHECK-NEXT: (+Math_sqrt((+$d)));
-; CHECK-NEXT: (Math_fround(Math_sqrt((Math_fround($f)))));
+; CHECK-NEXT: (Math_fround(Math_sqrt(($f))));
 ; CHECK-NEXT: (+Math_ceil(+1));
 ; CHECK-NEXT: (Math_fround(Math_ceil(Math_fround(+1))));
 ; CHECK-NEXT: (+Math_floor(+1));
@@ -0,0 +1,57 @@
+; RUN: llc -emscripten-finalize-function-tables < %s | FileCheck %s
+; RUN: llvm-as %s -o %t.bc
+; RUN: llc -emscripten-finalize-function-tables < %s > %t.llc.js
+; RUN: pnacl-llc -mtriple=asmjs-unknown-emscripten -streaming-bitcode -split-module=2 -emscripten-finalize-function-tables %t.bc -o %t.2.js
+; RUN: diff %t.llc.js %t.2.js
+
+; With -emscripten-finalize-function-tables, the masks of indirect calls are
+; the sizes of the final tables, which grow after the calls are printed, and
+; the tables are printed as JS instead of as strings in the metadata. With
+; -split-module, the merge does the same.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+; CHECK: function _call(
+; CHECK: FUNCTION_TABLE_ii[$f & 3]($x)|0)
+; CHECK: FUNCTION_TABLE_vi[$g & 1]($x);
+; CHECK-NOT: #FM_
+define i32 @call(i32 (i32)* %f, void (i32)* %g, i32 %x) {
+  %r = call i32 %f(i32 %x)
+  call void %g(i32 %x)
+  ret i32 %r
+}
+
+define i32 @one(i32 %x) {
+  ret i32 1
+}
+
+define i32 @two(i32 %x) {
+  ret i32 2
+}
+
+define i32 @three(i32 %x) {
+  ret i32 3
+}
+
+define void @none(i32 %x) {
+  ret void
+}
+
+define i32 @take() {
+  %a = ptrtoint i32 (i32)* @one to i32
+  %b = ptrtoint i32 (i32)* @two to i32
+  %c = ptrtoint i32 (i32)* @three to i32
+  %d = ptrtoint void (i32)* @none to i32
+  %s1 = add i32 %a, %b
+  %s2 = add i32 %s1, %c
+  %s3 = add i32 %s2, %d
+  ret i32 %s3
+}
+
+; CHECK: // EMSCRIPTEN_END_FUNCTIONS
+; CHECK: // EMSCRIPTEN_START_TABLES
+; CHECK-NEXT: var FUNCTION_TABLE_ii = [0,_one,_two,_three];
+; CHECK-NEXT: var FUNCTION_TABLE_vi = [0,_none];
+; CHECK-NEXT: // EMSCRIPTEN_END_TABLES
+; CHECK: "tables": {},
@@ -0,0 +1,191 @@
+; RUN: llc -emscripten-heap-index-ivs < %s | FileCheck %s
+; RUN: llc < %s | FileCheck -check-prefix=OFF %s
+
+; With -emscripten-heap-index-ivs, pointer induction variables that are mostly
+; used to access memory of one size are kept as indexes into the heap array of
+; that size, and shifted back into addresses only for their other uses.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+; CHECK: function _dot(
+; CHECK: $pa = ($a>>3);$pb = ($b>>3);
+; CHECK: $x = +HEAPF64[$pa];
+; CHECK: $y = +HEAPF64[$pb];
+; CHECK: $pa$next = (($pa) + 1)|0;
+; CHECK: $pb$next = (($pb) + ($stride))|0;
+; OFF: function _dot(
+; OFF: $x = +HEAPF64[$pa>>3];
+; OFF: $pb$next = (($pb) + ($stride<<3)|0);
+define double @dot(double* %a, double* %b, i32 %n, i32 %stride) {
+entry:
+  br label %loop
+
+loop:
+  %pa = phi double* [ %a, %entry ], [ %pa.next, %loop ]
+  %pb = phi double* [ %b, %entry ], [ %pb.next, %loop ]
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %acc = phi double [ 0.0, %entry ], [ %acc.next, %loop ]
+  %x = load double* %pa, align 8
+  %y = load double* %pb, align 8
+  %m = fmul double %x, %y
+  %acc.next = fadd double %acc, %m
+  %pa.next = getelementptr double* %pa, i32 1
+  %pb.next = getelementptr double* %pb, i32 %stride
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret double %acc.next
+}
+
+; The source pointer is compared as often as it is loaded from, so only the
+; destination pointer becomes an index.
+
+; CHECK: function _copy(
+; CHECK: $d = ($dst>>2);$s = $src;
+; CHECK: $v = HEAP32[$sp>>2]|0;
+; CHECK: HEAP32[$dp] = $v;
+; CHECK: $s$next = (($s) + 4)|0;
+; CHECK: $d$next = (($d) + 1)|0;
+define void @copy(i32 %dst, i32 %src, i32 %n) {
+entry:
+  %end = shl i32 %n, 2
+  %last = add i32 %src, %end
+  br label %loop
+
+loop:
+  %s = phi i32 [ %src, %entry ], [ %s.next, %loop ]
+  %d = phi i32 [ %dst, %entry ], [ %d.next, %loop ]
+  %sp = inttoptr i32 %s to i32*
+  %v = load i32* %sp, align 4
+  %dp = inttoptr i32 %d to i32*
+  store i32 %v, i32* %dp, align 4
+  %s.next = add i32 %s, 4
+  %d.next = add i32 %d, 4
+  %done = icmp eq i32 %s.next, %last
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret void
+}
+
+; The end pointer is returned, which needs the low bits of the start, so the
+; pointer is an index only when the start is known to be a multiple of 4.
+
+; CHECK: function _bump(
+; CHECK: $v = HEAP32[$p>>2]|0;
+; CHECK: HEAP32[$p>>2] = $v$next;
+define i32* @bump(i32* %start, i32 %n) {
+entry:
+  br label %loop
+
+loop:
+  %p = phi i32* [ %start, %entry ], [ %p.next, %loop ]
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %v = load i32* %p, align 4
+  %v.next = add i32 %v, 1
+  store i32 %v.next, i32* %p, align 4
+  %p.next = getelementptr i32* %p, i32 1
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i32* %p.next
+}
+
+; CHECK: function _bump_aligned(
+; CHECK: $p = ($aligned>>2);
+; CHECK: $v = HEAP32[$ptr]|0;
+; CHECK: HEAP32[$ptr] = $v$next;
+; CHECK: $p$next = (($p) + 1)|0;
+; CHECK: return (($p$next<<2)|0);
+define i32 @bump_aligned(i32 %start, i32 %n) {
+entry:
+  %aligned = and i32 %start, -4
+  br label %loop
+
+loop:
+  %p = phi i32 [ %aligned, %entry ], [ %p.next, %loop ]
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %ptr = inttoptr i32 %p to i32*
+  %v = load i32* %ptr, align 4
+  %v.next = add i32 %v, 1
+  store i32 %v.next, i32* %ptr, align 4
+  %p.next = add i32 %p, 4
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i32 %p.next
+}
+
+; Adding the pointer into a sum is just another use of it, and does not keep
+; the pointer from being an index.
+
+; CHECK: function _sum_addrs(
+; CHECK: $p = ($aligned>>2);
+; CHECK: $v = HEAP32[$ptr]|0;
+; CHECK: $p$next = (($p) + 1)|0;
+; CHECK: $r = (($acc) + (($p$next<<2)))|0;
+define i32 @sum_addrs(i32 %start, i32 %n) {
+entry:
+  %aligned = and i32 %start, -4
+  br label %loop
+
+loop:
+  %p = phi i32 [ %aligned, %entry ], [ %p.next, %loop ]
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %acc = phi i32 [ 0, %entry ], [ %r, %loop ]
+  %ptr = inttoptr i32 %p to i32*
+  %v = load i32* %ptr, align 4
+  %v.next = add i32 %v, 1
+  store i32 %v.next, i32* %ptr, align 4
+  %p.next = add i32 %p, 4
+  %r = add i32 %acc, %p.next
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i32 %r
+}
+
+; A vector store takes the address of the index, and leaves the index as it is.
+
+; CHECK: function _clear_quads(
+; CHECK: $v = HEAP32[$p]|0;
+; CHECK: SIMD_int32x4_store(HEAPU8, ($p<<2), SIMD_int32x4_splat(0));
+; CHECK: $w = HEAP32[$p]|0;
+; CHECK: $p$next = (($p) + 4)|0;
+define void @clear_quads(i32 %start, i32 %n) {
+entry:
+  %aligned = and i32 %start, -4
+  %base = inttoptr i32 %aligned to <4 x i32>*
+  br label %loop
+
+loop:
+  %p = phi <4 x i32>* [ %base, %entry ], [ %p.next, %loop ]
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %sp = bitcast <4 x i32>* %p to i32*
+  %v = load i32* %sp, align 4
+  %v.next = add i32 %v, 1
+  store i32 %v.next, i32* %sp, align 4
+  store <4 x i32> zeroinitializer, <4 x i32>* %p, align 4
+  %w = load i32* %sp, align 4
+  %w.next = add i32 %w, 1
+  store i32 %w.next, i32* %sp, align 4
+  %p.next = getelementptr <4 x i32>* %p, i32 1
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret void
+}
+
+; CHECK: "cantValidate": "heap indexes are used (-emscripten-heap-index-ivs)"
+; OFF: "cantValidate": ""
@@ -0,0 +1,151 @@
+; RUN: llc -emscripten-emulate-irreducible < %s | FileCheck %s
+; RUN: llc < %s | FileCheck %s -check-prefix=LOOP
+; RUN: llc -emscripten-emulate-irreducible -emscripten-split-irreducible < %s | FileCheck %s -check-prefix=SPLIT
+
+; Irreducible control flow: a loop that can be entered at either %a or %b.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+; With emulation, only the irreducible region becomes a switch in a loop,
+; after the relooped entry block.
+; CHECK: function _irreducible($x) {
+; CHECK-NOT: switch(label|0)
+; CHECK: if ($c) {
+; CHECK: label = [[A:[0-9]+]];
+; CHECK: } else {
+; CHECK: label = [[B:[0-9]+]];
+; CHECK: }
+; CHECK: L{{[0-9]+}}: while(1) {
+; CHECK-NEXT: switch(label|0) {
+; CHECK-DAG: case [[A]]: {
+; CHECK-DAG: case [[B]]: {
+; CHECK: break L{{[0-9]+}};
+; CHECK: return ($r|0);
+
+; By default, we get a loop whose entries check the label.
+; LOOP: function _irreducible($x) {
+; LOOP-NOT: switch(label|0)
+; LOOP: while(1) {
+; LOOP: if ((label|0) ==
+; LOOP: return ($r|0);
+
+; The region is too big compared to the rest of the function to split, so
+; it is still emulated.
+; SPLIT: function _irreducible($x) {
+; SPLIT: switch(label|0) {
+; SPLIT: return ($r|0);
+define i32 @irreducible(i32 %x) {
+entry:
+  %c = icmp eq i32 %x, 0
+  br i1 %c, label %a, label %b
+
+a:
+  %pa = phi i32 [ 0, %entry ], [ %nb, %b ]
+  %na = add i32 %pa, 1
+  %ca = icmp slt i32 %na, 10
+  br i1 %ca, label %b, label %exit
+
+b:
+  %pb = phi i32 [ 5, %entry ], [ %na, %a ]
+  %nb = add i32 %pb, 2
+  %cb = icmp slt i32 %nb, 20
+  br i1 %cb, label %a, label %exit
+
+exit:
+  %r = phi i32 [ %na, %a ], [ %nb, %b ]
+  ret i32 %r
+}
+
+; With node splitting, one of the entries is copied, and the region becomes
+; a loop with a single entry, which is neither emulated nor a multiple-entry
+; loop. The copy of %b runs on the way in from the entry block, and the loop
+; runs %a and then %b.
+; SPLIT: function _split($x,$p) {
+; SPLIT-NOT: switch(label|0)
+; SPLIT: if ($c) {
+; SPLIT-NEXT: $pa = 0;
+; SPLIT: } else {
+; SPLIT-NEXT: $pb = 5;
+; SPLIT-NEXT: $nb = (($pb) + 2)|0;
+; SPLIT-NEXT: $cb = ($nb|0)<(20);
+; SPLIT: while(1) {
+; SPLIT: $na = (($pa) + 1)|0;
+; SPLIT-NEXT: $ca = ($na|0)<(10);
+; SPLIT-NEXT: if ($ca) {
+; SPLIT-NEXT: $pb = $na;
+; SPLIT: $nb = (($pb) + 2)|0;
+; SPLIT-NEXT: $cb = ($nb|0)<(20);
+; SPLIT-NEXT: if ($cb) {
+; SPLIT-NEXT: $pa = $nb;
+; SPLIT-NOT: switch(label|0)
+; SPLIT: return ($r|0);
+define i32 @split(i32 %x, i32* %p) {
+entry:
+  store volatile i32 0, i32* %p, align 4
+  store volatile i32 1, i32* %p, align 4
+  store volatile i32 2, i32* %p, align 4
+  store volatile i32 3, i32* %p, align 4
+  store volatile i32 4, i32* %p, align 4
+  store volatile i32 5, i32* %p, align 4
+  store volatile i32 6, i32* %p, align 4
+  store volatile i32 7, i32* %p, align 4
+  store volatile i32 8, i32* %p, align 4
+  store volatile i32 9, i32* %p, align 4
+  store volatile i32 10, i32* %p, align 4
+  store volatile i32 11, i32* %p, align 4
+  store volatile i32 12, i32* %p, align 4
+  store volatile i32 13, i32* %p, align 4
+  store volatile i32 14, i32* %p, align 4
+  store volatile i32 15, i32* %p, align 4
+  store volatile i32 16, i32* %p, align 4
+  store volatile i32 17, i32* %p, align 4
+  store volatile i32 18, i32* %p, align 4
+  store volatile i32 19, i32* %p, align 4
+  %c = icmp eq i32 %x, 0
+  br i1 %c, label %a, label %b
+
+a:
+  %pa = phi i32 [ 0, %entry ], [ %nb, %b ]
+  %na = add i32 %pa, 1
+  %ca = icmp slt i32 %na, 10
+  br i1 %ca, label %b, label %exit
+
+b:
+  %pb = phi i32 [ 5, %entry ], [ %na, %a ]
+  %nb = add i32 %pb, 2
+  %cb = icmp slt i32 %nb, 20
+  br i1 %cb, label %a, label %exit
+
+exit:
+  %r = phi i32 [ %na, %a ], [ %nb, %b ]
+  ret i32 %r
+}
+
+; When both entries reach the exit, the exit is invalidated and has no
+; owning entry, which must not be looked up as a block.
+; CHECK: function _both_reach_exit($x,$out) {
+; CHECK: switch(label|0)
+; CHECK: HEAP32[$out>>2] = $r;
+define void @both_reach_exit(i32 %x, i32* %out) {
+entry:
+  %c = icmp eq i32 %x, 0
+  br i1 %c, label %a, label %b
+
+a:
+  %pa = phi i32 [ 0, %entry ], [ %nb, %b ]
+  %na = add i32 %pa, 1
+  %ca = icmp slt i32 %na, 10
+  br i1 %ca, label %b, label %exit
+
+b:
+  %pb = phi i32 [ 5, %entry ], [ %na, %a ]
+  %nb = add i32 %pb, 2
+  %cb = icmp slt i32 %nb, 20
+  br i1 %cb, label %a, label %exit
+
+exit:
+  %r = phi i32 [ %na, %a ], [ %nb, %b ]
+  store i32 %r, i32* %out
+  ret void
+}
@@ -0,0 +1,51 @@
+; RUN: llc < %s | FileCheck %s
+; RUN: llvm-as %s -o %t.bc
+; RUN: pnacl-llc -mtriple=asmjs-unknown-emscripten %t.bc -o - | FileCheck %s
+; RUN: pnacl-llc -mtriple=asmjs-unknown-emscripten -streaming-bitcode %t.bc -o - | FileCheck %s
+
+; Functions are emitted one at a time, so with streaming bitcode the callees
+; are not read yet, or already dropped, when a call to them is emitted. That
+; must not make them look external.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+; CHECK: function _caller($x) {
+; CHECK: $0 = (_wide(5,0,$x)|0);
+; CHECK: (_ext(($0|0))|0);
+define double @caller(i32 %x) {
+  %r = call i64 @wide(i64 5, i32 %x)
+  %t = trunc i64 %r to i32
+  %e = call i32 @ext(i32 %t)
+  %d = call double @half(double 1.0)
+  ret double %d
+}
+
+; @wide's signature is only legalized when its own body is reached, but a
+; pointer to it taken earlier already goes in the table for the legal one.
+; CHECK: function _pointer() {
+; CHECK: $p = 1;
+define i32 @pointer() {
+  %p = ptrtoint i64 (i64, i32)* @wide to i32
+  ret i32 %p
+}
+
+; CHECK: function _wide($0,$1,$b) {
+; CHECK: $2 = (_i64Add(($0|0),($1|0),($b|0),0)|0);
+; CHECK: $3 = tempRet0;
+; CHECK: tempRet0 = $3;
+; CHECK: return ($2|0);
+define i64 @wide(i64 %a, i32 %b) {
+  %c = zext i32 %b to i64
+  %s = add i64 %a, %c
+  ret i64 %s
+}
+
+define double @half(double %x) {
+  %h = fmul double %x, 5.000000e-01
+  ret double %h
+}
+
+declare i32 @ext(i32)
+
+; CHECK: "declares": ["ext", {{.*}}"i64Add", "getHigh32", "setHigh32"],{{.*}}"implementedFunctions": ["_caller", "_pointer", "_wide", "_half"],"tables": {{.}}  "iiii": "var FUNCTION_TABLE_iiii = [0,_wide];"
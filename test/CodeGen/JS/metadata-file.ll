@@ -0,0 +1,49 @@
+; RUN: llc -emscripten-metadata-file=%t.meta < %s | FileCheck %s
+; RUN: FileCheck %s -check-prefix=META < %t.meta
+
+; With -emscripten-metadata-file, the metadata is written to that file, with
+; names as indexes into a string table, instead of as JSON after the JS.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+@g = global i32 5
+
+declare i32 @ext(i32)
+
+define i32 @main(i32 (i32)* %f) {
+  %a = call i32 %f(i32 1)
+  %b = load i32* @g
+  %c = call i32 @ext(i32 %b)
+  %p = ptrtoint i32 (i32)* @ext to i32
+  %q = ptrtoint i32 (i32)* @two to i32
+  %s = add i32 %p, %q
+  ret i32 %s
+}
+
+define internal i32 @two(i32 %x) {
+  ret i32 2
+}
+
+; CHECK: /* memory initializer */ allocate([5,0,0,0,0,0,0,0], "i8", ALLOC_NONE, Runtime.GLOBAL_BASE);
+; CHECK-NOT: EMSCRIPTEN_METADATA
+
+; META: emscripten-metadata 1
+; META-NEXT: strings 6
+; META-NEXT: ext
+; META-NEXT: _main
+; META-NEXT: _two
+; META-NEXT: ii
+; META-NEXT: 0
+; META-NEXT: _ext
+; META-NEXT: declares 1 0
+; META-NEXT: redirects 0
+; META-NEXT: externs 0
+; META-NEXT: implementedFunctions 2 1 2
+; META-NEXT: table 4 3 4 5 2 4
+; META-NEXT: initializers 0
+; META-NEXT: exports 0
+; META-NEXT: namedGlobals 0
+; META-NEXT: cantValidate 0
+; META-NEXT: simd 0
+; META-NEXT: tls 0
@@ -0,0 +1,57 @@
+; RUN: llc -emscripten-minify-names -emscripten-name-map=%t.map < %s | FileCheck %s
+; RUN: FileCheck %s -check-prefix=MAP < %t.map
+
+; Locals get short names, the most used first, and so do functions that are
+; internal to the module. Exported functions, and internal functions that
+; the metadata refers to by name, keep their names. @twice is called more
+; often than @once, so it gets the shorter name.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+@llvm.used = appending global [1 x i8*] [i8* bitcast (i32 ()* @kept to i8*)], section "llvm.metadata"
+
+; %b is used most, after the parameters, which also appear in their
+; coercions. Ties go to the local that appears first.
+; CHECK: function _caller($a,$b) {
+; CHECK: var $c = 0, $d = 0, $e = 0, $f = 0, label = 0, sp = 0;
+; CHECK: $d = (_$a($a)|0);
+; CHECK: $c = (($d) + ($b))|0;
+; CHECK: $e = Math_imul($c, $c)|0;
+; CHECK: $f = (_$b($e)|0);
+; CHECK: return ($f|0);
+define i32 @caller(i32 %x, i32 %y) {
+  %a = call i32 @twice(i32 %x)
+  %b = add i32 %a, %y
+  %c = mul i32 %b, %b
+  %d = call i32 @once(i32 %c)
+  ret i32 %d
+}
+
+; CHECK: function _$b($a) {
+define internal i32 @once(i32 %v) {
+  %r = call i32 @twice(i32 %v)
+  ret i32 %r
+}
+
+; CHECK: function _$a($a) {
+define internal i32 @twice(i32 %long.value.name) {
+  %r = add i32 %long.value.name, %long.value.name
+  ret i32 %r
+}
+
+; CHECK: function _kept() {
+define internal i32 @kept() {
+  ret i32 1
+}
+
+; CHECK: "implementedFunctions": ["_caller", "_$b", "_$a", "_kept"]
+; CHECK: "exports": ["_kept"]
+
+; MAP: function _$a _twice
+; MAP: function _$b _once
+; MAP: local _caller $a $x
+; MAP: local _caller $b $y
+; MAP: local _caller $c $b
+; MAP: local _caller $d $a
+; MAP: local _$a $a $long$value$name
@@ -0,0 +1,127 @@
+; RUN: llc -emscripten-outline-size=40 < %s | FileCheck %s
+
+; Blocks too large for the limit are split into chunks that are outlined.
+; A chunk never ends between emscripten_preinvoke, the call it guards, and
+; emscripten_postinvoke, which the backend prints together as an invoke; the
+; chunk of @invoker grows to take the postinvoke. Code with an alloca is not
+; outlined, as the memory would be freed when the new function returns, so
+; @dynamic stays whole.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+declare void @emscripten_preinvoke()
+declare i32 @emscripten_postinvoke()
+declare i32 @ext(i32)
+
+; CHECK: function _invoker($x) {
+; CHECK-NOT: __THREW__
+; CHECK: _invoker_entry_ce(
+; CHECK-NOT: __THREW__
+; CHECK: function _invoker_entry_ce(
+; CHECK: __THREW__ = 0;
+; CHECK-NEXT: invoke_ii(
+; CHECK-NEXT: __THREW__; __THREW__ = 0;
+define i32 @invoker(i32 %x) {
+entry:
+  %a0 = add i32 %x, 1
+  %a1 = add i32 %a0, 2
+  %a2 = add i32 %a1, 3
+  %a3 = add i32 %a2, 4
+  %a4 = add i32 %a3, 5
+  %a5 = add i32 %a4, 6
+  %a6 = add i32 %a5, 7
+  %a7 = add i32 %a6, 8
+  %a8 = add i32 %a7, 9
+  %a9 = add i32 %a8, 10
+  %a10 = add i32 %a9, 11
+  %a11 = add i32 %a10, 12
+  %a12 = add i32 %a11, 13
+  %a13 = add i32 %a12, 14
+  %a14 = add i32 %a13, 15
+  %a15 = add i32 %a14, 16
+  %a16 = add i32 %a15, 17
+  call void @emscripten_preinvoke()
+  %r = call i32 @ext(i32 %a16)
+  %t = call i32 @emscripten_postinvoke()
+  %threw = trunc i32 %t to i1
+  br i1 %threw, label %lpad, label %cont
+
+cont:
+  %c0 = mul i32 %r, 3
+  %c1 = mul i32 %c0, 4
+  %c2 = mul i32 %c1, 5
+  %c3 = mul i32 %c2, 6
+  %c4 = mul i32 %c3, 7
+  %c5 = mul i32 %c4, 8
+  %c6 = mul i32 %c5, 9
+  %c7 = mul i32 %c6, 10
+  %c8 = mul i32 %c7, 11
+  %c9 = mul i32 %c8, 12
+  %c10 = mul i32 %c9, 13
+  %c11 = mul i32 %c10, 14
+  %c12 = mul i32 %c11, 15
+  %c13 = mul i32 %c12, 16
+  %c14 = mul i32 %c13, 17
+  %c15 = mul i32 %c14, 18
+  %c16 = mul i32 %c15, 19
+  %c17 = mul i32 %c16, 20
+  %c18 = mul i32 %c17, 21
+  %c19 = mul i32 %c18, 22
+  ret i32 %c19
+
+lpad:
+  ret i32 0
+}
+
+; CHECK: function _dynamic($x,$n) {
+; CHECK-NOT: function _dynamic_
+; CHECK: "implementedFunctions": ["_invoker", "_invoker_entry_ce", "_dynamic"]
+define i32 @dynamic(i32 %x, i32 %n) {
+entry:
+  %d0 = add i32 %x, 1
+  %d1 = add i32 %d0, 2
+  %d2 = add i32 %d1, 3
+  %d3 = add i32 %d2, 4
+  %buf = alloca i32, i32 %n
+  store i32 %d3, i32* %buf
+  %d4 = add i32 %d3, 5
+  %d5 = add i32 %d4, 6
+  %d6 = add i32 %d5, 7
+  %d7 = add i32 %d6, 8
+  %d8 = add i32 %d7, 9
+  %d9 = add i32 %d8, 10
+  %d10 = add i32 %d9, 11
+  %d11 = add i32 %d10, 12
+  %d12 = add i32 %d11, 13
+  %d13 = add i32 %d12, 14
+  %d14 = add i32 %d13, 15
+  %d15 = add i32 %d14, 16
+  %d16 = add i32 %d15, 17
+  %d17 = add i32 %d16, 18
+  %d18 = add i32 %d17, 19
+  %d19 = add i32 %d18, 20
+  %d20 = add i32 %d19, 21
+  %d21 = add i32 %d20, 22
+  %d22 = add i32 %d21, 23
+  %d23 = add i32 %d22, 24
+  %d24 = add i32 %d23, 25
+  %d25 = add i32 %d24, 26
+  %d26 = add i32 %d25, 27
+  %d27 = add i32 %d26, 28
+  %d28 = add i32 %d27, 29
+  %d29 = add i32 %d28, 30
+  %d30 = add i32 %d29, 31
+  %d31 = add i32 %d30, 32
+  %d32 = add i32 %d31, 33
+  %d33 = add i32 %d32, 34
+  %d34 = add i32 %d33, 35
+  %d35 = add i32 %d34, 36
+  %d36 = add i32 %d35, 37
+  %d37 = add i32 %d36, 38
+  %d38 = add i32 %d37, 39
+  %d39 = add i32 %d38, 40
+  %l = load i32* %buf
+  %s = add i32 %l, %d39
+  ret i32 %s
+}
@@ -0,0 +1,112 @@
+; RUN: llc -emscripten-outline-size=40 < %s | FileCheck %s
+; RUN: llc -emscripten-outline-size=40 -emscripten-minify-names < %s | FileCheck %s -check-prefix=MINIFY
+
+; @big has more than 40 instructions, so single-entry, single-exit regions of
+; it, the if-else diamonds, are moved into functions of their own until it
+; fits, so the last diamond stays where it is. The value that a region
+; defines for the code after it is returned through an alloca.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+; CHECK: function _big($x,$p) {
+; CHECK: _big_b0($x,$p,$v0$ph$loc);
+; CHECK-NEXT: $v0$ph$reload = HEAP32[$v0$ph$loc>>2]|0;
+; CHECK: _big_b1($v0,$p,$v1$ph$loc);
+; CHECK-NOT: _big_b2
+; CHECK: if ($c2) {
+; CHECK: return ($v2|0);
+; CHECK: function _big_b0($x,$p,$v0$ph$out) {
+; CHECK: HEAP32[$v0$ph$out>>2] = $v0$ph;
+; CHECK: function _big_b1($v0,$p,$v1$ph$out) {
+; CHECK: "implementedFunctions": ["_big", "_big_b0", "_big_b1"]
+
+; The outlined functions are internal, so their names are minified too.
+
+; MINIFY: function _big($c,$a) {
+; MINIFY: _$a($c,$a,$e);
+; MINIFY: _$b($h,$a,$d);
+; MINIFY: function _$a($a,$b,$c) {
+; MINIFY: function _$b($a,$b,$c) {
+; MINIFY: "implementedFunctions": ["_big", "_$a", "_$b"]
+define i32 @big(i32 %x, i32* %p) {
+entry:
+  br label %b0
+b0:
+  %c0 = icmp sgt i32 %x, 0
+  br i1 %c0, label %t0, label %f0
+
+t0:
+  %t0_0 = mul i32 %x, 3
+  %t0_1 = mul i32 %t0_0, 4
+  %t0_2 = mul i32 %t0_1, 5
+  %t0_3 = mul i32 %t0_2, 6
+  %t0_4 = mul i32 %t0_3, 7
+  store i32 %t0_4, i32* %p
+  br label %m0
+
+f0:
+  %f0_0 = add i32 %x, 7
+  %f0_1 = add i32 %f0_0, 8
+  %f0_2 = add i32 %f0_1, 9
+  %f0_3 = add i32 %f0_2, 10
+  %f0_4 = add i32 %f0_3, 11
+  br label %m0
+
+m0:
+  %v0 = phi i32 [ %t0_4, %t0 ], [ %f0_4, %f0 ]
+  br label %b1
+
+b1:
+  %c1 = icmp sgt i32 %v0, 1
+  br i1 %c1, label %t1, label %f1
+
+t1:
+  %t1_0 = mul i32 %v0, 3
+  %t1_1 = mul i32 %t1_0, 4
+  %t1_2 = mul i32 %t1_1, 5
+  %t1_3 = mul i32 %t1_2, 6
+  %t1_4 = mul i32 %t1_3, 7
+  store i32 %t1_4, i32* %p
+  br label %m1
+
+f1:
+  %f1_0 = add i32 %v0, 7
+  %f1_1 = add i32 %f1_0, 8
+  %f1_2 = add i32 %f1_1, 9
+  %f1_3 = add i32 %f1_2, 10
+  %f1_4 = add i32 %f1_3, 11
+  br label %m1
+
+m1:
+  %v1 = phi i32 [ %t1_4, %t1 ], [ %f1_4, %f1 ]
+  br label %b2
+
+b2:
+  %c2 = icmp sgt i32 %v1, 2
+  br i1 %c2, label %t2, label %f2
+
+t2:
+  %t2_0 = mul i32 %v1, 3
+  %t2_1 = mul i32 %t2_0, 4
+  %t2_2 = mul i32 %t2_1, 5
+  %t2_3 = mul i32 %t2_2, 6
+  %t2_4 = mul i32 %t2_3, 7
+  store i32 %t2_4, i32* %p
+  br label %m2
+
+f2:
+  %f2_0 = add i32 %v1, 7
+  %f2_1 = add i32 %f2_0, 8
+  %f2_2 = add i32 %f2_1, 9
+  %f2_3 = add i32 %f2_2, 10
+  %f2_4 = add i32 %f2_3, 11
+  br label %m2
+
+m2:
+  %v2 = phi i32 [ %t2_4, %t2 ], [ %f2_4, %f2 ]
+  br label %b3
+
+b3:
+  ret i32 %v2
+}
@@ -0,0 +1,58 @@
+; RUN: llc -emscripten-precise-f32 < %s | FileCheck %s
+
+; Math_fround is only emitted where asm.js validation or rounding needs it
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+; Arguments are coerced on entry, and then known to be floats. Constants
+; are double literals, so they are coerced, as are the results of arithmetic.
+; CHECK: function _arith($f,$p) {
+; CHECK: $f = Math_fround($f);
+; CHECK: $a = Math_fround($f + Math_fround(+1.5));
+; CHECK: $s = (Math_fround(Math_sqrt(($a))));
+; CHECK: return (Math_fround($s));
+define float @arith(float %f, float* %p) {
+entry:
+  %a = fadd float %f, 1.5
+  %s = call float @sqrtf(float %a)
+  ret float %s
+}
+
+; A float heap store rounds the value itself.
+; CHECK: function _store($p,$f) {
+; CHECK: HEAPF32[$p>>2] = +1.5;
+; CHECK: HEAPF32[$p>>2] = $f;
+define void @store(float* %p, float %f) {
+entry:
+  store float 1.5, float* %p, align 4
+  store float %f, float* %p, align 4
+  ret void
+}
+
+; Truncating a float we extended does not need rounding, while truncating
+; another double does.
+; CHECK: function _trunc($f,$d) {
+; CHECK: $e = +$f;
+; CHECK: $t = $f;
+; CHECK: $u = Math_fround($d);
+define float @trunc(float %f, double %d) {
+entry:
+  %e = fpext float %f to double
+  %t = fptrunc double %e to float
+  %u = fptrunc double %d to float
+  %r = fadd float %t, %u
+  call void @use(double %e)
+  ret float %r
+}
+
+; Infinities are coerced just once.
+; CHECK: function _inf() {
+; CHECK: return Math_fround(inf);
+define float @inf() {
+entry:
+  ret float 0x7FF0000000000000
+}
+
+declare float @sqrtf(float)
+declare void @use(double)
@@ -0,0 +1,58 @@
+; RUN: llc -emscripten-relooper-label-stats < %s 2>%t.stats | FileCheck %s
+; RUN: FileCheck %s -check-prefix=STATS < %t.stats
+
+; A loop with two exits, which join again inside an outer loop. Both exits
+; set the label, so the Multiple after the inner loop need not check the
+; last one, and its entries need not clear the label.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+; STATS: relooper: removed 3 label operations in _exits
+
+; CHECK: function _exits($x) {
+; CHECK: while(1) {
+; CHECK: while(1) {
+; CHECK: label = [[X:[0-9]+]];
+; CHECK: label = [[Y:[0-9]+]];
+; CHECK: if ((label|0) == [[X]]) {
+; CHECK-NOT: label = 0;
+; CHECK: else {
+; CHECK-NOT: label
+; CHECK: return ($r|0);
+define i32 @exits(i32 %x) {
+entry:
+  br label %outer
+
+outer:
+  %po = phi i32 [ %x, %entry ], [ %nj, %join ]
+  br label %inner
+
+inner:
+  %pi = phi i32 [ %po, %outer ], [ %n2, %inner2 ]
+  %n1 = add i32 %pi, 1
+  %c1 = icmp eq i32 %n1, 10
+  br i1 %c1, label %exitx, label %inner2
+
+inner2:
+  %n2 = mul i32 %n1, 3
+  %c2 = icmp eq i32 %n2, 99
+  br i1 %c2, label %exity, label %inner
+
+exitx:
+  %ax = add i32 %n1, 7
+  br label %join
+
+exity:
+  %ay = sub i32 %n2, 5
+  br label %join
+
+join:
+  %nj = phi i32 [ %ax, %exitx ], [ %ay, %exity ]
+  %c3 = icmp slt i32 %nj, 1000
+  br i1 %c3, label %outer, label %done
+
+done:
+  %r = add i32 %nj, 1
+  ret i32 %r
+}
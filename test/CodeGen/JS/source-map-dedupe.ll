@@ -0,0 +1,48 @@
+; RUN: llc -emscripten-dedupe-functions -emscripten-source-map=%t.map < %s | FileCheck %s
+; RUN: FileCheck %s -check-prefix=MAP < %t.map
+
+; Functions that differ only in their debug locations are duplicates with a
+; source map too. The names of the sources are JSON strings, where UTF-8 is
+; kept as it is and control characters are escaped.
+
+; CHECK: function _main($x) {
+; CHECK: $a = (_first($x)|0);
+; CHECK: $b = (_first($a)|0);
+; CHECK-NOT: function _second(
+; CHECK: "implementedFunctions": ["_main", "_first"]
+
+; MAP: {"version":3,"sources":["/src/café \"q\"\\\u0009.c"],"names":[],"mappings":";;;;;;;;;;;;;;CACI;CAAA"}
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+define i32 @main(i32 %x) {
+  %a = call i32 @first(i32 %x)
+  %b = call i32 @second(i32 %a)
+  ret i32 %b
+}
+
+define internal i32 @first(i32 %v) {
+  %r = mul i32 %v, 7, !dbg !10
+  ret i32 %r, !dbg !10
+}
+
+define internal i32 @second(i32 %v) {
+  %r = mul i32 %v, 7, !dbg !11
+  ret i32 %r, !dbg !11
+}
+
+!llvm.dbg.cu = !{!0}
+!llvm.module.flags = !{!9}
+
+!0 = metadata !{i32 786449, metadata !1, i32 12, metadata !"clang", i1 true, metadata !"", i32 0, metadata !2, metadata !2, metadata !3, null, null, metadata !""} ; [ DW_TAG_compile_unit ]
+!1 = metadata !{metadata !"caf\C3\A9 \22q\22\5C\09.c", metadata !"/src"}
+!2 = metadata !{i32 0}
+!3 = metadata !{metadata !4, metadata !7}
+!4 = metadata !{i32 786478, metadata !1, metadata !5, metadata !"first", metadata !"first", metadata !"", i32 1, metadata !6, i1 true, i1 true, i32 0, i32 0, null, i32 256, i1 true, i32 (i32)* @first, null, null, null, i32 1} ; [ DW_TAG_subprogram ]
+!5 = metadata !{i32 786473, metadata !1} ; [ DW_TAG_file_type ]
+!6 = metadata !{i32 786453, metadata !1, metadata !5, metadata !"", i32 0, i64 0, i64 0, i64 0, i32 0, null, metadata !2, i32 0, null, null, null} ; [ DW_TAG_subroutine_type ]
+!7 = metadata !{i32 786478, metadata !1, metadata !5, metadata !"second", metadata !"second", metadata !"", i32 4, metadata !6, i1 true, i1 true, i32 0, i32 0, null, i32 256, i1 true, i32 (i32)* @second, null, null, null, i32 4} ; [ DW_TAG_subprogram ]
+!9 = metadata !{i32 1, metadata !"Debug Info Version", i32 1}
+!10 = metadata !{i32 2, i32 5, metadata !4, null}
+!11 = metadata !{i32 5, i32 5, metadata !7, null}
@@ -0,0 +1,58 @@
+; RUN: llc < %s | FileCheck %s -check-prefix=COMMENTS
+; RUN: llc -emscripten-source-map=%t.map < %s | FileCheck %s
+; RUN: FileCheck %s -check-prefix=MAP < %t.map
+
+; Without -emscripten-source-map, the debug locations are comments in the
+; JS. With it, they go to the map instead, which maps the start of each
+; statement (the first on line 7 of the output, after its indentation) to
+; its source location. The branch prints nothing, so it has no mapping.
+
+; COMMENTS: $a = (($x) + ($y))|0; //@line 2 "test.c"
+; COMMENTS: $r = (_add($x,1)|0); //@line 11 "/inc/other.h"
+
+; CHECK-NOT: //@line
+; CHECK-NOT: #DL_
+
+; MAP: {"version":3,"sources":["/src/test.c","/inc/other.h"],"names":[],"mappings":";;;;;;;CACU;CACN;CAAA;;EAEA;;EACF;;;;;;;;CCKO;CAAA"}
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+define i32 @add(i32 %x, i32 %y) {
+entry:
+  %a = add i32 %x, %y, !dbg !10
+  %b = mul i32 %a, %a, !dbg !11
+  %c = icmp sgt i32 %b, 10, !dbg !11
+  br i1 %c, label %big, label %small, !dbg !12
+
+big:
+  ret i32 %b, !dbg !13
+
+small:
+  ret i32 %a, !dbg !14
+}
+
+define i32 @other(i32 %x) {
+  %r = call i32 @add(i32 %x, i32 1), !dbg !15
+  ret i32 %r, !dbg !15
+}
+
+!llvm.dbg.cu = !{!0}
+!llvm.module.flags = !{!9}
+
+!0 = metadata !{i32 786449, metadata !1, i32 12, metadata !"clang", i1 true, metadata !"", i32 0, metadata !2, metadata !2, metadata !3, null, null, metadata !""} ; [ DW_TAG_compile_unit ]
+!1 = metadata !{metadata !"test.c", metadata !"/src"}
+!2 = metadata !{i32 0}
+!3 = metadata !{metadata !4, metadata !7}
+!4 = metadata !{i32 786478, metadata !1, metadata !5, metadata !"add", metadata !"add", metadata !"", i32 1, metadata !6, i1 false, i1 true, i32 0, i32 0, null, i32 256, i1 true, i32 (i32, i32)* @add, null, null, null, i32 1} ; [ DW_TAG_subprogram ]
+!5 = metadata !{i32 786473, metadata !1} ; [ DW_TAG_file_type ]
+!6 = metadata !{i32 786453, metadata !1, metadata !5, metadata !"", i32 0, i64 0, i64 0, i64 0, i32 0, null, metadata !2, i32 0, null, null, null} ; [ DW_TAG_subroutine_type ]
+!7 = metadata !{i32 786478, metadata !8, metadata !5, metadata !"other", metadata !"other", metadata !"", i32 10, metadata !6, i1 false, i1 true, i32 0, i32 0, null, i32 256, i1 true, i32 (i32)* @other, null, null, null, i32 10} ; [ DW_TAG_subprogram ]
+!8 = metadata !{metadata !"/inc/other.h", metadata !"/src"}
+!9 = metadata !{i32 1, metadata !"Debug Info Version", i32 1}
+!10 = metadata !{i32 2, i32 11, metadata !4, null}
+!11 = metadata !{i32 3, i32 5, metadata !4, null}
+!12 = metadata !{i32 4, i32 3, metadata !4, null}
+!13 = metadata !{i32 5, i32 5, metadata !4, null}
+!14 = metadata !{i32 6, i32 3, metadata !4, null}
+!15 = metadata !{i32 11, i32 10, metadata !7, null}
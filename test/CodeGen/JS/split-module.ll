@@ -0,0 +1,93 @@
+; RUN: llvm-as %s -o %t.bc
+; RUN: pnacl-llc -mtriple=asmjs-unknown-emscripten -streaming-bitcode -split-module=1 %t.bc -o %t.1.js
+; RUN: pnacl-llc -mtriple=asmjs-unknown-emscripten -streaming-bitcode -split-module=3 -split-module-sched=static %t.bc -o %t.3s.js
+; RUN: pnacl-llc -mtriple=asmjs-unknown-emscripten -streaming-bitcode -split-module=3 -split-module-sched=dynamic %t.bc -o %t.3d.js
+; RUN: pnacl-llc -mtriple=asmjs-unknown-emscripten -streaming-bitcode -split-module=3 -split-module-sched=cost -split-module-stats %t.bc -o %t.3c.js 2>&1 | FileCheck %s -check-prefix=STATS
+; RUN: diff %t.1.js %t.3s.js
+; RUN: diff %t.1.js %t.3d.js
+; RUN: diff %t.1.js %t.3c.js
+; RUN: FileCheck %s < %t.1.js
+; RUN: llc < %s | diff %t.1.js -
+
+; With -split-module, each thread prints the functions it compiles, and the
+; outputs are merged into the same output as llc's, however many threads
+; there are: function pointers are numbered in module order, and the
+; declares of all threads are combined.
+
+; STATS: thread 0: {{[0-9]+}} functions ({{[0-9]+}} stolen), cost {{[0-9]+}}, busy {{.*}} sec, idle {{.*}} sec
+; STATS: thread 2:
+; STATS: total: {{.*}} sec, {{.*}}% of thread time busy
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+@table = global i32 ptrtoint (void (i32)* @inData to i32)
+@counter = internal global i32 7
+
+declare i32 @ext(i32)
+declare void @ext2(i32)
+
+; CHECK: function _inData($x) {
+define void @inData(i32 %x) {
+  store i32 %x, i32* @counter
+  ret void
+}
+
+; CHECK: function _a($x) {
+; CHECK: $p = 1;
+define i32 @a(i32 %x) {
+  %p = ptrtoint i32 (i32)* @b to i32
+  %r = add i32 %x, %p
+  ret i32 %r
+}
+
+; CHECK: function _b($x) {
+; CHECK: $p = 2;
+; CHECK: $q = 2;
+define i32 @b(i32 %x) {
+  %p = ptrtoint void (i32)* @c to i32
+  %q = ptrtoint i32 (i32)* @a to i32
+  %r = add i32 %p, %q
+  %s = call i32 @ext(i32 %r)
+  ret i32 %s
+}
+
+; CHECK: function _c($x) {
+; CHECK: $p = 1;
+define void @c(i32 %x) {
+  %p = ptrtoint i64 (i64)* @wide to i32
+  call void @ext2(i32 %p)
+  ret void
+}
+
+define i64 @wide(i64 %x) {
+  %y = mul i64 %x, 3
+  ret i64 %y
+}
+
+; CHECK: function _d($x) {
+; CHECK: $p = 3;
+define internal i32 @d(i32 %x) {
+  %p = ptrtoint i32 (i32)* @d to i32
+  %f = inttoptr i32 %x to i32 (i32)*
+  %r = call i32 %f(i32 %p)
+  ret i32 %r
+}
+
+; CHECK: function _e($x) {
+; CHECK: $p = 3;
+; CHECK: $q = 1;
+define i32 @e(i32 %x) {
+  %p = ptrtoint i32 (i32)* @d to i32
+  %q = ptrtoint void (i32)* @inData to i32
+  %r = add i32 %p, %q
+  %w = call i64 @wide(i64 5)
+  %t = trunc i64 %w to i32
+  %s = add i32 %r, %t
+  ret i32 %s
+}
+
+; CHECK: "declares": ["ext", "ext2", "__muldi3", "getHigh32", "setHigh32"]
+; CHECK: "ii": "var FUNCTION_TABLE_ii = [0,_b,_a,_d];"
+; CHECK: "iii": "var FUNCTION_TABLE_iii = [0,_wide];"
+; CHECK: "vi": "var FUNCTION_TABLE_vi = [0,_inData,_c,0];"
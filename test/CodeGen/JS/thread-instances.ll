@@ -0,0 +1,32 @@
+; RUN: opt < %s -pnacl-abi-simplify-preopt -pnacl-abi-simplify-postopt -emscripten-tls | llc -o %t.js
+; RUN: node %S/Inputs/two-instances.js %t.js | FileCheck %s
+; REQUIRES: node
+
+; Two module instances sharing a heap, each set up with
+; emscripten_thread_init in its own block, must get separate copies of
+; the thread-local variable and separate stacks.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+@counter = thread_local global i32 100
+
+; CHECK: a bump 101
+; CHECK: b bump 110
+; CHECK: a bump 102
+; CHECK: b bump 120
+define i32 @bump(i32 %n) {
+  %1 = load i32* @counter
+  %2 = add i32 %1, %n
+  store i32 %2, i32* @counter
+  ret i32 %2
+}
+
+; The stacks start after each 16-byte TLS block.
+; CHECK: a stack 1040
+; CHECK: b stack 4112
+define i32 @stack_probe() {
+  %buf = alloca i32, align 4
+  %1 = ptrtoint i32* %buf to i32
+  ret i32 %1
+}
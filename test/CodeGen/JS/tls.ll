@@ -0,0 +1,42 @@
+; RUN: llc < %s | FileCheck %s
+
+; Thread pointer reads and writes (as emitted by ExpandTls) use the
+; per-instance tlsBase global.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+; CHECK: function _get_tvar() {
+; CHECK:  $tls_raw = tlsBase;
+; CHECK:  $0 = HEAP32[$tls_raw>>2]|0;
+; CHECK:  return ($0|0);
+; CHECK: }
+define i32 @get_tvar() {
+  %tls_raw = call i8* @llvm.nacl.read.tp()
+  %tls = bitcast i8* %tls_raw to i32*
+  %1 = load i32* %tls
+  ret i32 %1
+}
+
+; CHECK: function _set_base($tp) {
+; CHECK:  tlsBase = $tp;
+; CHECK: }
+define void @set_base(i8* %tp) {
+  call void @emscripten_set_tls_base(i8* %tp)
+  ret void
+}
+
+; CHECK: function _set_stack($base,$max) {
+; CHECK:  STACKTOP = $base;STACK_MAX = $max;
+; CHECK: }
+define void @set_stack(i8* %base, i8* %max) {
+  call void @emscripten_set_stack_limits(i8* %base, i8* %max)
+  ret void
+}
+
+declare i8* @llvm.nacl.read.tp()
+declare void @emscripten_set_tls_base(i8*)
+declare void @emscripten_set_stack_limits(i8*, i8*)
+
+; CHECK: "declares": [],
+; CHECK: "tls": 1,
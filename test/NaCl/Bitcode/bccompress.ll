@@ -15,6 +15,24 @@
 ; RUN:              | pnacl-bcanalyzer -operands-per-line=6 -dump-records \
 ; RUN:              | FileCheck %s --check-prefix DUMP
 
+; Test 3: Show that analyzing function blocks on worker threads doesn't
+; change the generated records, and that block statistics are printed.
+; RUN: llvm-as < %s | pnacl-freeze \
+; RUN:              | pnacl-bccompress -analysis-threads=2 \
+; RUN:              | pnacl-bcanalyzer -operands-per-line=6 -dump-records \
+; RUN:              | FileCheck %s --check-prefix DUMP
+; RUN: llvm-as < %s | pnacl-freeze \
+; RUN:              | pnacl-bccompress -analysis-threads=2 -block-stats \
+; RUN:                    -o /dev/null 2>&1 \
+; RUN:              | FileCheck %s --check-prefix STATS
+
+; STATS: Block ID  # Blocks    Input bits   Output bits  % Change  Copy (s)
+; STATS:       12         {{[0-9]+}}
+; STATS:    Total
+; STATS: Analysis:
+; STATS: Abbreviation selection:
+; STATS: Copy:
+
 @bytes7 = internal global [7 x i8] c"abcdefg"
 ; CHECK: @bytes7 = internal global [7 x i8] c"abcdefg"
 
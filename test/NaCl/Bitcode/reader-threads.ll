@@ -0,0 +1,242 @@
+; RUN: llvm-as < %s | pnacl-freeze > %t.pexe
+; RUN: pnacl-thaw %t.pexe | llvm-dis - > %t.ll
+; RUN: pnacl-thaw -bitcode-reader-threads=1 %t.pexe | llvm-dis - | diff %t.ll -
+; RUN: pnacl-thaw -bitcode-reader-threads=3 %t.pexe | llvm-dis - | diff %t.ll -
+; RUN: FileCheck %s < %t.ll
+
+; Test that decoding function blocks on other threads reads the same module
+; as decoding them while they are parsed. There are more functions than
+; blocks decoded ahead of the parser with one thread, and the functions have
+; constants blocks and forward references.
+
+@g = internal global [4 x i8] zeroinitializer
+
+declare i32 @ext(i32)
+
+; CHECK: define i32 @f0(i32
+define i32 @f0(i32 %x) {
+entry:
+  %c = icmp ult i32 %x, 7
+  br i1 %c, label %small, label %big
+small:
+  %s = call i32 @f1(i32 %x)
+  br label %done
+big:
+  %b = mul i32 %x, 3
+  %p = ptrtoint [4 x i8]* @g to i32
+  %q = add i32 %b, %p
+  br label %done
+done:
+  %r = phi i32 [ %s, %small ], [ %q, %big ]
+  %e = call i32 @ext(i32 %r)
+  ret i32 %e
+}
+
+; CHECK: define i32 @f1(i32
+define i32 @f1(i32 %x) {
+entry:
+  %c = icmp ult i32 %x, 1007
+  br i1 %c, label %small, label %big
+small:
+  %s = call i32 @f2(i32 %x)
+  br label %done
+big:
+  %b = mul i32 %x, 65540
+  %p = ptrtoint [4 x i8]* @g to i32
+  %q = add i32 %b, %p
+  br label %done
+done:
+  %r = phi i32 [ %s, %small ], [ %q, %big ]
+  %e = call i32 @ext(i32 %r)
+  ret i32 %e
+}
+
+; CHECK: define i32 @f2(i32
+define i32 @f2(i32 %x) {
+entry:
+  %c = icmp ult i32 %x, 2007
+  br i1 %c, label %small, label %big
+small:
+  %s = call i32 @f3(i32 %x)
+  br label %done
+big:
+  %b = mul i32 %x, 131077
+  %p = ptrtoint [4 x i8]* @g to i32
+  %q = add i32 %b, %p
+  br label %done
+done:
+  %r = phi i32 [ %s, %small ], [ %q, %big ]
+  %e = call i32 @ext(i32 %r)
+  ret i32 %e
+}
+
+; CHECK: define i32 @f3(i32
+define i32 @f3(i32 %x) {
+entry:
+  %c = icmp ult i32 %x, 3007
+  br i1 %c, label %small, label %big
+small:
+  %s = call i32 @f4(i32 %x)
+  br label %done
+big:
+  %b = mul i32 %x, 196614
+  %p = ptrtoint [4 x i8]* @g to i32
+  %q = add i32 %b, %p
+  br label %done
+done:
+  %r = phi i32 [ %s, %small ], [ %q, %big ]
+  %e = call i32 @ext(i32 %r)
+  ret i32 %e
+}
+
+; CHECK: define i32 @f4(i32
+define i32 @f4(i32 %x) {
+entry:
+  %c = icmp ult i32 %x, 4007
+  br i1 %c, label %small, label %big
+small:
+  %s = call i32 @f5(i32 %x)
+  br label %done
+big:
+  %b = mul i32 %x, 262151
+  %p = ptrtoint [4 x i8]* @g to i32
+  %q = add i32 %b, %p
+  br label %done
+done:
+  %r = phi i32 [ %s, %small ], [ %q, %big ]
+  %e = call i32 @ext(i32 %r)
+  ret i32 %e
+}
+
+; CHECK: define i32 @f5(i32
+define i32 @f5(i32 %x) {
+entry:
+  %c = icmp ult i32 %x, 5007
+  br i1 %c, label %small, label %big
+small:
+  %s = call i32 @f6(i32 %x)
+  br label %done
+big:
+  %b = mul i32 %x, 327688
+  %p = ptrtoint [4 x i8]* @g to i32
+  %q = add i32 %b, %p
+  br label %done
+done:
+  %r = phi i32 [ %s, %small ], [ %q, %big ]
+  %e = call i32 @ext(i32 %r)
+  ret i32 %e
+}
+
+; CHECK: define i32 @f6(i32
+define i32 @f6(i32 %x) {
+entry:
+  %c = icmp ult i32 %x, 6007
+  br i1 %c, label %small, label %big
+small:
+  %s = call i32 @f7(i32 %x)
+  br label %done
+big:
+  %b = mul i32 %x, 393225
+  %p = ptrtoint [4 x i8]* @g to i32
+  %q = add i32 %b, %p
+  br label %done
+done:
+  %r = phi i32 [ %s, %small ], [ %q, %big ]
+  %e = call i32 @ext(i32 %r)
+  ret i32 %e
+}
+
+; CHECK: define i32 @f7(i32
+define i32 @f7(i32 %x) {
+entry:
+  %c = icmp ult i32 %x, 7007
+  br i1 %c, label %small, label %big
+small:
+  %s = call i32 @f8(i32 %x)
+  br label %done
+big:
+  %b = mul i32 %x, 458762
+  %p = ptrtoint [4 x i8]* @g to i32
+  %q = add i32 %b, %p
+  br label %done
+done:
+  %r = phi i32 [ %s, %small ], [ %q, %big ]
+  %e = call i32 @ext(i32 %r)
+  ret i32 %e
+}
+
+; CHECK: define i32 @f8(i32
+define i32 @f8(i32 %x) {
+entry:
+  %c = icmp ult i32 %x, 8007
+  br i1 %c, label %small, label %big
+small:
+  %s = call i32 @f9(i32 %x)
+  br label %done
+big:
+  %b = mul i32 %x, 524299
+  %p = ptrtoint [4 x i8]* @g to i32
+  %q = add i32 %b, %p
+  br label %done
+done:
+  %r = phi i32 [ %s, %small ], [ %q, %big ]
+  %e = call i32 @ext(i32 %r)
+  ret i32 %e
+}
+
+; CHECK: define i32 @f9(i32
+define i32 @f9(i32 %x) {
+entry:
+  %c = icmp ult i32 %x, 9007
+  br i1 %c, label %small, label %big
+small:
+  %s = call i32 @f10(i32 %x)
+  br label %done
+big:
+  %b = mul i32 %x, 589836
+  %p = ptrtoint [4 x i8]* @g to i32
+  %q = add i32 %b, %p
+  br label %done
+done:
+  %r = phi i32 [ %s, %small ], [ %q, %big ]
+  %e = call i32 @ext(i32 %r)
+  ret i32 %e
+}
+
+; CHECK: define i32 @f10(i32
+define i32 @f10(i32 %x) {
+entry:
+  %c = icmp ult i32 %x, 10007
+  br i1 %c, label %small, label %big
+small:
+  %s = call i32 @f11(i32 %x)
+  br label %done
+big:
+  %b = mul i32 %x, 655373
+  %p = ptrtoint [4 x i8]* @g to i32
+  %q = add i32 %b, %p
+  br label %done
+done:
+  %r = phi i32 [ %s, %small ], [ %q, %big ]
+  %e = call i32 @ext(i32 %r)
+  ret i32 %e
+}
+
+; CHECK: define i32 @f11(i32
+define i32 @f11(i32 %x) {
+entry:
+  %c = icmp ult i32 %x, 11007
+  br i1 %c, label %small, label %big
+small:
+  %s = call i32 @f0(i32 %x)
+  br label %done
+big:
+  %b = mul i32 %x, 720910
+  %p = ptrtoint [4 x i8]* @g to i32
+  %q = add i32 %b, %p
+  br label %done
+done:
+  %r = phi i32 [ %s, %small ], [ %q, %big ]
+  %e = call i32 @ext(i32 %r)
+  ret i32 %e
+}
@@ -0,0 +1,55 @@
+; RUN: llvm-as < %s | pnacl-freeze | pnacl-thaw | llvm-dis - | FileCheck %s
+
+; Test that values of every size read back correctly. The constants are
+; multi-chunk VBRs, and there are enough of them that some straddle the
+; 64-bit words that in-memory bitcode is read in.
+
+define i64 @wide(i64 %x) {
+  %a1 = add i64 %x, 1
+  %a2 = add i64 %a1, 127
+  %a3 = add i64 %a2, 128
+  %a4 = add i64 %a3, 2147483647
+  %a5 = add i64 %a4, 4294967296
+  %a6 = add i64 %a5, 1099511627781
+  %a7 = add i64 %a6, 12345678901234
+  %a8 = add i64 %a7, 281474976710655
+  %a9 = add i64 %a8, 72057594037927935
+  %a10 = add i64 %a9, 9223372036854775807
+  %a11 = add i64 %a10, -9223372036854775808
+  %a12 = add i64 %a11, -1
+  %a13 = add i64 %a12, -4294967297
+  %a14 = add i64 %a13, -72057594037927936
+  ret i64 %a14
+}
+
+; CHECK: = add i64 %{{[0-9]+}}, 1
+; CHECK: = add i64 %{{[0-9]+}}, 127
+; CHECK: = add i64 %{{[0-9]+}}, 128
+; CHECK: = add i64 %{{[0-9]+}}, 2147483647
+; CHECK: = add i64 %{{[0-9]+}}, 4294967296
+; CHECK: = add i64 %{{[0-9]+}}, 1099511627781
+; CHECK: = add i64 %{{[0-9]+}}, 12345678901234
+; CHECK: = add i64 %{{[0-9]+}}, 281474976710655
+; CHECK: = add i64 %{{[0-9]+}}, 72057594037927935
+; CHECK: = add i64 %{{[0-9]+}}, 9223372036854775807
+; CHECK: = add i64 %{{[0-9]+}}, -9223372036854775808
+; CHECK: = add i64 %{{[0-9]+}}, -1
+; CHECK: = add i64 %{{[0-9]+}}, -4294967297
+; CHECK: = add i64 %{{[0-9]+}}, -72057594037927936
+
+define i32 @narrow(i32 %x) {
+  %b1 = add i32 %x, 63
+  %b2 = add i32 %b1, 64
+  %b3 = add i32 %b2, 65535
+  %b4 = add i32 %b3, 16777216
+  %b5 = add i32 %b4, 2147483647
+  %b6 = add i32 %b5, -2147483648
+  ret i32 %b6
+}
+
+; CHECK: = add i32 %{{[0-9]+}}, 63
+; CHECK: = add i32 %{{[0-9]+}}, 64
+; CHECK: = add i32 %{{[0-9]+}}, 65535
+; CHECK: = add i32 %{{[0-9]+}}, 16777216
+; CHECK: = add i32 %{{[0-9]+}}, 2147483647
+; CHECK: = add i32 %{{[0-9]+}}, -2147483648
@@ -0,0 +1,41 @@
+; Test that pnacl-bccompress picks abbreviations for the records that are
+; frequent enough to pay for them, and that the output is smaller than the
+; input without abbreviations.
+
+; RUN: llvm-as < %s | pnacl-freeze | pnacl-bccompress -remove-abbreviations \
+; RUN:     > %t.raw
+; RUN: pnacl-bccompress -abbreviations -block-stats %t.raw -o %t.pexe 2>&1 \
+; RUN:     | FileCheck %s
+; RUN: pnacl-thaw %t.pexe | llvm-dis - | FileCheck %s --check-prefix DIS
+
+; The binary operators of the function block share one abbreviation, whose
+; operands are small relative value indices, and so do the integer
+; constants.
+; CHECK: -- New abbrevations:
+; CHECK-NEXT: Abbrev(block 11): [4, VBR(2)]
+; CHECK-NEXT: Abbrev(block 12): [2, VBR(2), 8, Fixed(2)]
+; CHECK-NEXT: --
+
+; Those blocks shrink, and so does the whole file.
+; CHECK: Block ID  # Blocks    Input bits   Output bits  % Change
+; CHECK:       11         1           268           203   -24.25%
+; CHECK:       12         1           372           181   -51.34%
+; CHECK:    Total         7          1280          1184    -7.50%
+
+define i32 @f(i32 %x) {
+  %a = add i32 %x, 1
+  %b = add i32 %a, 2
+  %c = add i32 %b, 3
+  %d = add i32 %c, 4
+  %e = mul i32 %d, 5
+  %f = mul i32 %e, 6
+  %g = mul i32 %f, 7
+  %h = add i32 %g, 8
+  ret i32 %h
+}
+; The records are the same.
+; DIS: define i32 @f(i32) {
+; DIS-NEXT: %2 = add i32 %0, 1
+; DIS: %8 = mul i32 %7, 7
+; DIS-NEXT: %9 = add i32 %8, 8
+; DIS-NEXT: ret i32 %9
@@ -0,0 +1,53 @@
+; RUN: opt < %s -nacl-expand-tls -S | FileCheck %s
+
+; With the asm.js triple, TLS variables are laid out above the thread
+; pointer and hooks are defined for setting up each thread's block.
+
+target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+@tvar_data = thread_local global i32 123
+@tvar_bss = thread_local global i64 0
+
+; CHECK: %tls_struct = type <{ %tls_init_template, %tls_bss_template }>
+
+
+define i32* @get_tvar_data() {
+  ret i32* @tvar_data
+}
+; CHECK: define i32* @get_tvar_data()
+; CHECK: %tls_raw = call i8* @llvm.nacl.read.tp()
+; CHECK: %field = getelementptr %tls_struct* %tls_struct, i32 0, i32 0, i32 0
+; CHECK: ret i32* %field
+
+define i64* @get_tvar_bss() {
+  ret i64* @tvar_bss
+}
+; CHECK: define i64* @get_tvar_bss()
+; CHECK: %field = getelementptr %tls_struct* %tls_struct, i32 0, i32 1, i32 1
+; CHECK: ret i64* %field
+
+
+; CHECK: define internal i32 @nacl_tp_tls_offset(i32 %size) {
+; CHECK-NEXT: entry:
+; CHECK-NEXT: ret i32 0
+
+; CHECK: define i32 @emscripten_tls_size() {
+; CHECK-NEXT: entry:
+; CHECK-NEXT: ret i32 16
+
+; CHECK: define void @emscripten_tls_init(i8* %tp) {
+; CHECK-NEXT: entry:
+; CHECK-NEXT: call void @llvm.memcpy.p0i8.p0i8.i32(i8* %tp, i8* bitcast (%tls_init_template* @__tls_template_start to i8*), i32 4, i32 1, i1 false)
+; CHECK-NEXT: %bss = getelementptr i8* %tp, i32 4
+; CHECK-NEXT: call void @llvm.memset.p0i8.i32(i8* %bss, i8 0, i32 12, i32 1, i1 false)
+; CHECK-NEXT: call void @emscripten_set_tls_base(i8* %tp)
+; CHECK-NEXT: ret void
+
+; CHECK: define void @emscripten_thread_init(i8* %block, i32 %size) {
+; CHECK-NEXT: entry:
+; CHECK-NEXT: call void @emscripten_tls_init(i8* %block)
+; CHECK-NEXT: %stack = getelementptr i8* %block, i32 16
+; CHECK-NEXT: %stack_max = getelementptr i8* %block, i32 %size
+; CHECK-NEXT: call void @emscripten_set_stack_limits(i8* %stack, i8* %stack_max)
+; CHECK-NEXT: ret void
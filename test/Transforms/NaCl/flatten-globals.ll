@@ -135,6 +135,12 @@ target datalayout = "p:32:32:32"
 @ptrs3 = global %ptrs3 { i32* @var1, [3 x i8] c"foo", i8* @var2 }
 ; CHECK: @ptrs3 = global <{ i32, [4 x i8], i32 }> <{ i32 ptrtoint ([4 x i8]* @var1 to i32), [4 x i8] c"foo\00", i32 ptrtoint ([1 x i8]* @var2 to i32) }>
 
+; Byte arrays between relocations are kept whole, or merged with the
+; bytes that follow them.
+%ptrs4 = type { i8*, [4 x i8], i8*, [2 x i8], i16, i32* }
+@ptrs4 = global %ptrs4 { i8* @var2, [4 x i8] c"bar\00", i8* @var2, [2 x i8] c"xy", i16 258, i32* @var1 }
+; CHECK: @ptrs4 = global <{ i32, [4 x i8], i32, [4 x i8], i32 }> <{ i32 ptrtoint ([1 x i8]* @var2 to i32), [4 x i8] c"bar\00", i32 ptrtoint ([1 x i8]* @var2 to i32), [4 x i8] c"xy\02\01", i32 ptrtoint ([4 x i8]* @var1 to i32) }>
+
 @ptr = global i32* @var1
 ; CHECK: @ptr = global i32 ptrtoint ([4 x i8]* @var1 to i32)
 
@@ -0,0 +1,77 @@
+; RUN: opt %s -pnacl-abi-simplify-postopt -S > %t.fused
+; RUN: opt %s -pnacl-abi-simplify-postopt -pnacl-rewrite-threads=2 -S \
+; RUN:     > %t.threads
+; RUN: opt %s -pnacl-abi-simplify-postopt -pnacl-abi-simplify-unfused -S \
+; RUN:     > %t.unfused
+; RUN: diff %t.fused %t.unfused
+; RUN: diff %t.threads %t.unfused
+; RUN: FileCheck %s < %t.fused
+
+; Check that fusing the instruction-local rewrites of the post-opt
+; passes doesn't change their output, including the names of the
+; instructions they create, when several rewrites change a function.
+
+target datalayout = "p:32:32:32"
+
+@global = global i32 0
+
+define void @no_rewrites(i32* %ptr) {
+  %val = load i32* %ptr
+  %sum = add i32 %val, 1
+  store i32 %sum, i32* %ptr
+  ret void
+}
+; CHECK-LABEL: define void @no_rewrites
+; CHECK-NEXT: %val = load i32* %ptr
+
+define i1 @i1_and_constexpr(i1* %ptr, i1 %flag) {
+  %a = load i1* %ptr
+  %b = load i1* %ptr
+  %sum = add i1 %a, %b
+  store i1 %sum, i1* %ptr
+  %x = add i64 ptrtoint (i32* @global to i64), 1
+  %y = add i64 ptrtoint (i32* @global to i64), 2
+  %cmp = icmp ult i64 %x, %y
+  %res = xor i1 %cmp, %flag
+  ret i1 %res
+}
+; CHECK-LABEL: define i1 @i1_and_constexpr
+; CHECK: %ptr.i8ptr = bitcast i1* %ptr to i8*
+; CHECK: %ptr.i8ptr1 = bitcast i1* %ptr to i8*
+; CHECK: %ptr.i8ptr2 = bitcast i1* %ptr to i8*
+; CHECK: %expanded = ptrtoint
+; CHECK: %expanded3 = ptrtoint
+
+define i32 @extract_and_promote(<4 x i32> %vec, i32 %idx, i24* %ptr) {
+  %elt = extractelement <4 x i32> %vec, i32 %idx
+  %narrow = load i24* %ptr
+  %wide = zext i24 %narrow to i32
+  %sum = add i32 %elt, %wide
+  ret i32 %sum
+}
+; CHECK-LABEL: define i32 @extract_and_promote
+; CHECK: alloca i32, i32 4
+; CHECK: %narrow.lo = load i16*
+; CHECK: %wide = and i32 %narrow, 16777215
+
+define i32 @cmpxchg_and_struct(i32* %ptr, { i32, i32 }* %sptr) {
+  %pair = cmpxchg i32* %ptr, i32 0, i32 1 seq_cst seq_cst
+  %old = extractvalue { i32, i1 } %pair, 0
+  %s = load { i32, i32 }* %sptr
+  %field = extractvalue { i32, i32 } %s, 1
+  %sum = add i32 %old, %field
+  ret i32 %sum
+}
+; CHECK-LABEL: define i32 @cmpxchg_and_struct
+; CHECK: call i32 @llvm.nacl.atomic.cmpxchg.i32
+; CHECK-NOT: extractvalue
+
+; Only arithmetic and compares on i1, which change the function too.
+define i1 @i1_arith_only(i1 %a, i1 %b) {
+  %sum = add i1 %a, %b
+  %cmp = icmp slt i1 %sum, %b
+  ret i1 %cmp
+}
+; CHECK-LABEL: define i1 @i1_arith_only
+; CHECK: %sum.pre_trunc = add i8 %a.expand_i1_val, %b.expand_i1_val
+; CHECK: %cmp = icmp slt i8 %sum.expand_i1_val, %b.expand_i1_val1
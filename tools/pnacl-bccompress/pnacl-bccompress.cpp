@@ -40,16 +40,23 @@
 // figures out that leaving the record unabbreviated is best) and
 // writes the record out accordingly.
 //
-// TODO(kschimpf): The current implementation does a trivial solution
-// for the first round.  It just converts all abbreviations (local and
-// global) into global abbreviations.  Future refinements of this file
-// will generate better (and more intelligent) global abbreviations,
-// based on the records found on the first read of the bitcode file.
+// In the first round, all abbreviations (local and global) are converted
+// into global abbreviations, and the distribution of records (per block,
+// abbreviation, code, size and value index) is collected. New candidate
+// abbreviations are then derived from these distributions, and scored by
+// the number of bits they are estimated to save. Candidates are added
+// only if their savings outweigh the cost of defining them, and of the
+// wider abbreviation indices they cause.
+//
+// Since function blocks dominate the size of most files, and only use
+// abbreviations defined in the BlockInfo block, the first round can
+// analyze function blocks on several threads (see -analysis-threads).
 //
 //===----------------------------------------------------------------------===//
 
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/Bitcode/NaCl/AbbrevTrieNode.h"
 #include "llvm/Bitcode/NaCl/NaClBitcodeHeader.h"
@@ -58,6 +65,7 @@
 #include "llvm/Bitcode/NaCl/NaClBitstreamWriter.h"
 #include "llvm/Bitcode/NaCl/NaClCompressBlockDist.h"
 #include "llvm/Bitcode/NaCl/NaClReaderWriter.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Format.h"
@@ -65,12 +73,18 @@
 #include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/PrettyStackTrace.h"
 #include "llvm/Support/Signals.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/raw_ostream.h"
-#include <set>
+#include <algorithm>
 #include <map>
+#include <memory>
 #include <system_error>
 
+#if LLVM_ENABLE_THREADS
+#include <thread>
+#endif
+
 namespace {
 
 using namespace llvm;
@@ -120,6 +134,20 @@ RemoveAbbreviations(
     cl::desc("Remove abbreviations from input bitcode file."),
     cl::init(false));
 
+static cl::opt<unsigned>
+AnalysisThreads(
+    "analysis-threads",
+    cl::desc("Number of threads used to analyze function blocks. "
+             "0 analyzes them while reading the rest of the file."),
+    cl::init(0));
+
+static cl::opt<bool>
+ShowBlockStats(
+    "block-stats",
+    cl::desc("Show the size of each block ID before and after compression, "
+             "and the time spent on each phase and block ID."),
+    cl::init(false));
+
 /// Error - All bitcode analysis errors go through this function,
 /// making this a good place to breakpoint if debugging.
 static bool Error(const std::string &Err) {
@@ -134,6 +162,83 @@ static void PrintAbbrev(raw_ostream &Stream,
   Abbrev->Print(Stream);
 }
 
+// Returns the current wall time, in seconds.
+static double GetWallTime() {
+  return TimeRecord::getCurrentTime(true).getWallTime();
+}
+
+/// Statistics collected for option -block-stats.
+class CompressStats {
+public:
+  /// The statistics of all instances of a block ID.
+  struct BlockStats {
+    BlockStats()
+        : NumBlocks(0), InputBits(0), OutputBits(0), CopySeconds(0.0) {}
+    // The number of instances of the block.
+    unsigned NumBlocks;
+    // The number of bits in the input and output files, excluding
+    // nested blocks.
+    uint64_t InputBits;
+    uint64_t OutputBits;
+    // The time spent copying the blocks, excluding nested blocks.
+    double CopySeconds;
+  };
+
+  typedef std::map<unsigned, BlockStats> BlockStatsMap;
+
+  CompressStats()
+      : NumFunctionBlocks(0), AnalysisSeconds(0.0), SelectionSeconds(0.0),
+        CopySeconds(0.0) {}
+
+  /// Prints the statistics to the given stream.
+  void Print(raw_ostream &Stream) const;
+
+  // The statistics of each block ID.
+  BlockStatsMap Blocks;
+  // The number of function blocks analyzed by worker threads.
+  unsigned NumFunctionBlocks;
+  // The time spent in each phase.
+  double AnalysisSeconds;
+  double SelectionSeconds;
+  double CopySeconds;
+};
+
+void CompressStats::Print(raw_ostream &Stream) const {
+  Stream << "Block ID  # Blocks    Input bits   Output bits  % Change"
+         << "  Copy (s)\n";
+  BlockStats Total;
+  for (BlockStatsMap::const_iterator Iter = Blocks.begin(),
+           IterEnd = Blocks.end(); Iter != IterEnd; ++Iter) {
+    const BlockStats &Stats = Iter->second;
+    Stream << format("%8u  %8u  %12llu  %12llu  %7.2f%%  %8.4f\n",
+                     Iter->first, Stats.NumBlocks,
+                     (unsigned long long) Stats.InputBits,
+                     (unsigned long long) Stats.OutputBits,
+                     Stats.InputBits == 0 ? 0.0 :
+                     ((double) Stats.OutputBits - Stats.InputBits) /
+                     Stats.InputBits * 100.0,
+                     Stats.CopySeconds);
+    Total.NumBlocks += Stats.NumBlocks;
+    Total.InputBits += Stats.InputBits;
+    Total.OutputBits += Stats.OutputBits;
+    Total.CopySeconds += Stats.CopySeconds;
+  }
+  Stream << format("   Total  %8u  %12llu  %12llu  %7.2f%%  %8.4f\n",
+                   Total.NumBlocks,
+                   (unsigned long long) Total.InputBits,
+                   (unsigned long long) Total.OutputBits,
+                   Total.InputBits == 0 ? 0.0 :
+                   ((double) Total.OutputBits - Total.InputBits) /
+                   Total.InputBits * 100.0,
+                   Total.CopySeconds);
+  Stream << format("Analysis: %.4fs", AnalysisSeconds);
+  if (NumFunctionBlocks)
+    Stream << " (" << NumFunctionBlocks << " function blocks on "
+           << AnalysisThreads << " threads)";
+  Stream << format("\nAbbreviation selection: %.4fs\n", SelectionSeconds);
+  Stream << format("Copy: %.4fs\n", CopySeconds);
+}
+
 // Reads the input file into the given buffer.
 static bool ReadAndBuffer(std::unique_ptr<MemoryBuffer> &MemBuf) {
   ErrorOr<std::unique_ptr<MemoryBuffer>> ErrOrFile =
@@ -226,11 +331,7 @@ public:
          Iter != IterEnd; ++Iter) {
       (*Iter)->dropRef();
     }
-    for (AbbrevLookupSizeMap::const_iterator
-             Iter = LookupMap.begin(), IterEnd = LookupMap.end();
-         Iter != IterEnd; ++Iter) {
-      delete Iter->second;
-    }
+    DeleteContainerPointers(LookupTries);
   }
 
   // Constant used to denote that a given abbreviation is not in the
@@ -302,9 +403,19 @@ public:
   // Builds the corresponding fast lookup map for finding abbreviations
   // that applies to abbreviations in the block
   void BuildAbbrevLookupSizeMap() {
-    NaClBuildAbbrevLookupMap(GetLookupMap(),
+    AbbrevLookupSizeMap LookupMap;
+    NaClBuildAbbrevLookupMap(LookupMap,
                              GetAbbrevs(),
                              GetFirstApplicationAbbreviation());
+    // Record sizes are capped at NaClValueIndexCutoff+1, so index the
+    // tries directly by size rather than searching a map per record.
+    LookupTries.assign(NaClValueIndexCutoff + 2, 0);
+    for (AbbrevLookupSizeMap::const_iterator
+             Iter = LookupMap.begin(), IterEnd = LookupMap.end();
+         Iter != IterEnd; ++Iter) {
+      assert(Iter->first < LookupTries.size());
+      LookupTries[Iter->first] = Iter->second;
+    }
     if (ShowAbbrevLookupTries) PrintLookupMap(errs());
   }
 
@@ -312,10 +423,6 @@ public:
     return GlobalAbbrevBitstreamToInternalMap;
   }
 
-  AbbrevLookupSizeMap &GetLookupMap() {
-    return LookupMap;
-  }
-
   // Returns lower level vector of abbreviations.
   const AbbrevVector &GetAbbrevs() const {
     return Abbrevs;
@@ -332,14 +439,13 @@ public:
     size_t Size = Values.size();
 
     if (Size > NaClValueIndexCutoff) Size = NaClValueIndexCutoff+1;
-    AbbrevLookupSizeMap::const_iterator Pos = LookupMap.find(Size);
-    if (Pos != LookupMap.end()) {
-      if (const AbbrevTrieNode *Node = Pos->second) {
+    if (Size < LookupTries.size()) {
+      if (const AbbrevTrieNode *Node = LookupTries[Size]) {
         if (const AbbrevTrieNode *MatchNode =
             Node->MatchRecord(Record)) {
-          const std::set<AbbrevIndexPair> &Abbreviations =
+          const std::vector<AbbrevIndexPair> &Abbreviations =
               MatchNode->GetAbbreviations();
-          for (std::set<AbbrevIndexPair>::const_iterator
+          for (std::vector<AbbrevIndexPair>::const_iterator
                    Iter = Abbreviations.begin(),
                    IterEnd = Abbreviations.end();
                Iter != IterEnd; ++Iter) {
@@ -520,25 +626,22 @@ private:
   // The mapping from global bitstream abbreviations to the corresponding
   // block abbreviation index (in Abbrevs).
   AbbrevBitstreamToInternalMap GlobalAbbrevBitstreamToInternalMap;
-  // A fast lookup map for finding the abbreviation that applies
-  // to a record.
-  AbbrevLookupSizeMap LookupMap;
+  // A fast lookup table for finding the abbreviation that applies
+  // to a record, indexed by the (capped) record size.
+  std::vector<AbbrevTrieNode*> LookupTries;
 
   void PrintLookupMap(raw_ostream &Stream) {
     Stream << "------------------------------\n";
     Stream << "Block " << GetBlockID() << " abbreviation tries:\n";
     bool IsFirstIteration = true;
-    for (AbbrevLookupSizeMap::const_iterator
-           Iter = LookupMap.begin(), IterEnd = LookupMap.end();
-         Iter != IterEnd; ++Iter) {
+    for (size_t Size = 0; Size < LookupTries.size(); ++Size) {
+      if (LookupTries[Size] == 0) continue;
       if (IsFirstIteration)
         IsFirstIteration = false;
       else
         Stream << "-----\n";
-      if (Iter->second) {
-        Stream << "Index " << Iter->first << ":\n";
-        Iter->second->Print(Stream, "  ");
-      }
+      Stream << "Index " << Size << ":\n";
+      LookupTries[Size]->Print(Stream, "  ");
     }
     Stream << "------------------------------\n";
   }
@@ -548,6 +651,38 @@ private:
 /// map to use.
 typedef DenseMap<unsigned, BlockAbbrevs*> BlockAbbrevsMapType;
 
+/// A block of the input bitcode file, as read while analyzing it, so
+/// that the compressed file can be written without parsing the input
+/// again.
+struct ParsedBlock {
+  explicit ParsedBlock(unsigned BlockID) : BlockID(BlockID), NumBits(0) {}
+
+  /// A record of the block, or (if Block is non-null) a block nested
+  /// in it.
+  struct Item {
+    NaClBitcodeRecordData Record;
+    std::unique_ptr<ParsedBlock> Block;
+  };
+
+  unsigned BlockID;
+  // The number of bits in the input, including nested blocks.
+  uint64_t NumBits;
+  // The records and nested blocks, in the order they appear.
+  std::vector<Item> Items;
+};
+
+/// The top-level blocks of the input bitcode file.
+typedef std::vector<std::unique_ptr<ParsedBlock> > ParsedBlockList;
+
+/// A function block that is skipped when first found, and analyzed
+/// afterwards.
+struct DeferredBlock {
+  // The bit just after the block ID.
+  uint64_t StartBit;
+  // The block to read the contents into.
+  ParsedBlock *Parsed;
+};
+
 /// Parses the bitcode file, analyzes it, and generates the
 /// corresponding lists of global abbreviations to use in the
 /// generated (compressed) bitcode file.
@@ -560,13 +695,20 @@ class NaClAnalyzeParser : public NaClBitcodeParser {
 public:
   // Creates the analysis parser, which will fill the given
   // BlockAbbrevsMap with appropriate abbreviations, after
-  // analyzing the bitcode file defined by Cursor.
+  // analyzing the bitcode file defined by Cursor. The blocks read
+  // are added to ParsedBlocks.
   NaClAnalyzeParser(NaClBitstreamCursor &Cursor,
-                    BlockAbbrevsMapType &BlockAbbrevsMap)
+                    BlockAbbrevsMapType &BlockAbbrevsMap,
+                    ParsedBlockList &ParsedBlocks)
       : NaClBitcodeParser(Cursor),
         BlockAbbrevsMap(BlockAbbrevsMap),
         BlockDist(&NaClCompressBlockDistElement::Sentinel),
-        AbbrevListener(this)
+        AbbrevListener(this),
+        ParsedBlocks(ParsedBlocks),
+        FillBlock(0),
+        DeferredFunctionBlocks(0),
+        IsWorker(false),
+        NeedsSerialAnalysis(false)
   {
     SetListener(&AbbrevListener);
   }
@@ -574,12 +716,41 @@ public:
   virtual ~NaClAnalyzeParser() {}
 
   virtual bool Error(const std::string &Message) {
+    // Errors found by workers are reported when the function blocks
+    // are analyzed again, serially.
+    if (IsWorker) {
+      NeedsSerialAnalysis = true;
+      return true;
+    }
     // Use local error routine so that all errors are treated uniformly.
     return ::Error(Message);
   }
 
   virtual bool ParseBlock(unsigned BlockID);
 
+  /// Returns the set of (global) block abbreviations defined for the
+  /// given block ID. Workers must not change BlockAbbrevsMap, which is
+  /// shared. Hence, if a worker finds a block ID without
+  /// abbreviations, it gets a scratch set of abbreviations, and the
+  /// function blocks are analyzed again serially.
+  BlockAbbrevs *GetGlobalAbbrevs(unsigned BlockID) {
+    if (IsWorker) {
+      BlockAbbrevsMapType::const_iterator Pos = BlockAbbrevsMap.find(BlockID);
+      if (Pos != BlockAbbrevsMap.end() && Pos->second)
+        return Pos->second;
+      NeedsSerialAnalysis = true;
+      if (!ScratchAbbrevs)
+        ScratchAbbrevs.reset(new BlockAbbrevs(BlockID));
+      return ScratchAbbrevs.get();
+    }
+    BlockAbbrevs *Abbrevs = BlockAbbrevsMap[BlockID];
+    if (Abbrevs == 0) {
+      Abbrevs = new BlockAbbrevs(BlockID);
+      BlockAbbrevsMap[BlockID] = Abbrevs;
+    }
+    return Abbrevs;
+  }
+
   // Mapping from block ID's to the corresponding list of abbreviations
   // associated with that block.
   BlockAbbrevsMapType &BlockAbbrevsMap;
@@ -589,6 +760,28 @@ public:
 
   // Listener used to get abbreviations as they are read.
   NaClBitcodeParserListener AbbrevListener;
+
+  // The top-level blocks read.
+  ParsedBlockList &ParsedBlocks;
+
+  // If non-null, the (skipped function) block that the next
+  // top-level block is read into, instead of adding it to
+  // ParsedBlocks.
+  ParsedBlock *FillBlock;
+
+  // If non-null, function blocks are skipped, and added to this list,
+  // so that they can be analyzed later by workers.
+  std::vector<DeferredBlock> *DeferredFunctionBlocks;
+
+  // True if the parser analyzes function blocks on a worker thread.
+  bool IsWorker;
+
+  // Set by a worker if it finds something that it can't analyze
+  // without changing BlockAbbrevsMap (such as a local abbreviation).
+  bool NeedsSerialAnalysis;
+
+  // The abbreviations returned to a worker for unknown block IDs.
+  std::unique_ptr<BlockAbbrevs> ScratchAbbrevs;
 };
 
 class NaClBlockAnalyzeParser : public NaClBitcodeParser {
@@ -600,9 +793,12 @@ class NaClBlockAnalyzeParser : public NaClBitcodeParser {
 public:
   /// Top-level constructor to build the top-level block with the
   /// given BlockID, and collect data (for compression) in that block.
+  /// The contents of the block are read into Parsed.
   NaClBlockAnalyzeParser(unsigned BlockID,
-                         NaClAnalyzeParser *Context)
-      : NaClBitcodeParser(BlockID, Context), Context(Context) {
+                         NaClAnalyzeParser *Context,
+                         ParsedBlock *Parsed)
+      : NaClBitcodeParser(BlockID, Context), Context(Context),
+        Parsed(Parsed) {
     Init();
   }
 
@@ -613,26 +809,48 @@ public:
 protected:
   /// Nested constructor to parse a block within a block.  Creates a
   /// block parser to parse a block with the given BlockID, and
-  /// collect data (for compression) in that block.
+  /// collect data (for compression) in that block. The contents of
+  /// the block are read into Parsed.
   NaClBlockAnalyzeParser(unsigned BlockID,
-                         NaClBlockAnalyzeParser *EnclosingParser)
+                         NaClBlockAnalyzeParser *EnclosingParser,
+                         ParsedBlock *Parsed)
       : NaClBitcodeParser(BlockID, EnclosingParser),
-        Context(EnclosingParser->Context) {
+        Context(EnclosingParser->Context),
+        Parsed(Parsed) {
     Init();
   }
 
 public:
   virtual bool Error(const std::string &Message) {
-    // Use local error routine so that all errors are treated uniformly.
-    return ::Error(Message);
+    return Context->Error(Message);
   }
 
   virtual bool ParseBlock(unsigned BlockID) {
-    NaClBlockAnalyzeParser Parser(BlockID, this);
-    return Parser.ParseThisBlock();
+    uint64_t StartBit = Record.GetStartBit();
+    ParsedBlock *Nested = new ParsedBlock(BlockID);
+    Parsed->Items.push_back(ParsedBlock::Item());
+    Parsed->Items.back().Block.reset(Nested);
+    bool Result;
+    if (BlockID == naclbitc::FUNCTION_BLOCK_ID &&
+        Context->DeferredFunctionBlocks) {
+      DeferredBlock Deferred = { Record.GetCursor().GetCurrentBitNo(), Nested };
+      Context->DeferredFunctionBlocks->push_back(Deferred);
+      Result = SkipBlock();
+    } else {
+      NaClBlockAnalyzeParser Parser(BlockID, this, Nested);
+      Result = Parser.ParseThisBlock();
+    }
+    Nested->NumBits = Record.GetCursor().GetCurrentBitNo() - StartBit;
+    return Result;
   }
 
   virtual void ProcessRecord() {
+    // Once a worker gives up, its distributions are thrown away.
+    if (Context->NeedsSerialAnalysis) return;
+
+    Parsed->Items.push_back(ParsedBlock::Item());
+    Parsed->Items.back().Record = Record.GetRecordData();
+
     // Before processing the record, we need to rename the abbreviation
     // index, so that we can look it up in the set of block abbreviations
     // being defined.
@@ -665,6 +883,11 @@ public:
   virtual void ProcessAbbreviation(unsigned BlockID,
                                    NaClBitCodeAbbrev *Abbrev,
                                    bool IsLocal) {
+    if (Context->IsWorker) {
+      // Adding the abbreviation would change BlockAbbrevsMap.
+      Context->NeedsSerialAnalysis = true;
+      return;
+    }
     int Index;
     AddAbbreviation(BlockID, Abbrev->Simplify(), Index);
     if (IsLocal) {
@@ -679,6 +902,9 @@ protected:
   // The context (i.e. top-level) parser.
   NaClAnalyzeParser *Context;
 
+  // The block the records and nested blocks are read into.
+  ParsedBlock *Parsed;
+
   // The global block abbreviations associated with this block.
   BlockAbbrevs *GlobalBlockAbbrevs;
 
@@ -688,12 +914,7 @@ protected:
   /// Returns the set of (global) block abbreviations defined for the
   /// given block ID.
   BlockAbbrevs *GetGlobalAbbrevs(unsigned BlockID) {
-    BlockAbbrevs *Abbrevs = Context->BlockAbbrevsMap[BlockID];
-    if (Abbrevs == 0) {
-      Abbrevs = new BlockAbbrevs(BlockID);
-      Context->BlockAbbrevsMap[BlockID] = Abbrevs;
-    }
-    return Abbrevs;
+    return Context->GetGlobalAbbrevs(BlockID);
   }
 
   void SetGlobalAbbrevs(unsigned BlockID, BlockAbbrevs *Abbrevs) {
@@ -729,8 +950,21 @@ protected:
 };
 
 bool NaClAnalyzeParser::ParseBlock(unsigned BlockID) {
-  NaClBlockAnalyzeParser Parser(BlockID, this);
-  return Parser.ParseThisBlock();
+  if (FillBlock) {
+    NaClBlockAnalyzeParser Parser(BlockID, this, FillBlock);
+    return Parser.ParseThisBlock();
+  }
+  uint64_t StartBit = Record.GetStartBit();
+  ParsedBlocks.push_back(
+      std::unique_ptr<ParsedBlock>(new ParsedBlock(BlockID)));
+  ParsedBlock *Parsed = ParsedBlocks.back().get();
+  bool Result;
+  {
+    NaClBlockAnalyzeParser Parser(BlockID, this, Parsed);
+    Result = Parser.ParseThisBlock();
+  }
+  Parsed->NumBits = Record.GetCursor().GetCurrentBitNo() - StartBit;
+  return Result;
 }
 
 /// Models the unrolling of an abbreviation into its sequence of
@@ -914,17 +1148,94 @@ static inline bool operator<(const CandBlockAbbrev &A1,
   return A1.Compare(A2) < 0;
 }
 
+/// Identifies the group of records (within a block) that a candidate
+/// abbreviation was derived from. That is, the records read using the
+/// abbreviation with index AbbrevIndex, that have the given Code and
+/// (capped) number of values Size.
+struct RecordGroup {
+  RecordGroup(unsigned AbbrevIndex, unsigned Code, unsigned Size)
+      : AbbrevIndex(AbbrevIndex), Code(Code), Size(Size) {}
+
+  unsigned AbbrevIndex;
+  unsigned Code;
+  unsigned Size;
+};
+
+static inline bool operator<(const RecordGroup &G1, const RecordGroup &G2) {
+  if (G1.AbbrevIndex != G2.AbbrevIndex)
+    return G1.AbbrevIndex < G2.AbbrevIndex;
+  if (G1.Code != G2.Code)
+    return G1.Code < G2.Code;
+  return G1.Size < G2.Size;
+}
+
+/// Models the estimated benefit of adding a candidate abbreviation,
+/// broken down by the groups of records the candidate was derived
+/// from. Each record is written using a single abbreviation, so the
+/// bits saved by candidates derived from the same group don't add up.
+class CandAbbrevBenefit {
+public:
+  struct GroupBenefit {
+    GroupBenefit() : NumInstances(0), BitsSaved(0) {}
+    // The number of records in the group that can use the candidate.
+    unsigned NumInstances;
+    // The estimated number of bits saved on those records.
+    uint64_t BitsSaved;
+  };
+
+  typedef std::map<RecordGroup, GroupBenefit> GroupBenefitMap;
+
+  /// Records that NumInstances records of Group can use the
+  /// candidate, saving an estimated BitsSaved bits.
+  void Add(const RecordGroup &Group, unsigned NumInstances,
+           uint64_t BitsSaved) {
+    // A candidate may be derived from the same group more than once
+    // (e.g. as a constant, and as the best fit for the group). Each
+    // derivation applies to the same records.
+    GroupBenefit &Benefit = Groups[Group];
+    Benefit.NumInstances = std::max(Benefit.NumInstances, NumInstances);
+    Benefit.BitsSaved = std::max(Benefit.BitsSaved, BitsSaved);
+  }
+
+  const GroupBenefitMap &GetGroups() const {
+    return Groups;
+  }
+
+  /// Returns the number of records that can use the candidate.
+  unsigned GetNumInstances() const {
+    unsigned NumInstances = 0;
+    for (GroupBenefitMap::const_iterator
+             Iter = Groups.begin(), IterEnd = Groups.end();
+         Iter != IterEnd; ++Iter) {
+      NumInstances += Iter->second.NumInstances;
+    }
+    return NumInstances;
+  }
+
+  /// Returns the estimated number of bits saved by the candidate.
+  uint64_t GetBitsSaved() const {
+    uint64_t BitsSaved = 0;
+    for (GroupBenefitMap::const_iterator
+             Iter = Groups.begin(), IterEnd = Groups.end();
+         Iter != IterEnd; ++Iter) {
+      BitsSaved += Iter->second.BitsSaved;
+    }
+    return BitsSaved;
+  }
+
+private:
+  GroupBenefitMap Groups;
+};
+
 /// Models the set of candidate abbreviations being considered, and
-/// the number of abbreviations associated with each candidate
-/// Abbreviation.
+/// the estimated benefit of each candidate Abbreviation.
 ///
 /// Note: Because we may have abbreviation refinements of A->B->C and
-/// A->D->C, we need to accumulate instance counts in such cases.
+/// A->D->C, we need to accumulate benefits in such cases.
 class CandidateAbbrevs {
 public:
-  // Map from candidate abbreviations to the corresponding number of
-  // instances.
-  typedef std::map<CandBlockAbbrev, unsigned> AbbrevCountMap;
+  // Map from candidate abbreviations to the corresponding benefit.
+  typedef std::map<CandBlockAbbrev, CandAbbrevBenefit> AbbrevCountMap;
   typedef AbbrevCountMap::const_iterator const_iterator;
 
   /// Creates an empty set of candidate abbreviations, to be
@@ -937,12 +1248,15 @@ public:
 
   /// Adds the given (unrolled) abbreviation as a candidate
   /// abbreviation to the given block. NumInstances is the number of
-  /// instances expected to use this candidate abbreviation. Returns
-  /// true if the corresponding candidate abbreviation is added to this
-  /// set of candidate abbreviations.
+  /// records of Group expected to use this candidate abbreviation,
+  /// and BitsSaved the estimated number of bits saved on them.
+  /// Returns true if the corresponding candidate abbreviation is
+  /// added to this set of candidate abbreviations.
   bool Add(unsigned BlockID,
            UnrolledAbbreviation &UnrolledAbbrev,
-           unsigned NumInstances);
+           const RecordGroup &Group,
+           unsigned NumInstances,
+           uint64_t BitsSaved);
 
   /// Returns the list of candidate abbreviations in this set.
   const AbbrevCountMap &GetAbbrevsMap() const {
@@ -954,14 +1268,16 @@ public:
     Stream << "-- " << Title << ": \n";
     for (const_iterator Iter = AbbrevsMap.begin(), IterEnd = AbbrevsMap.end();
          Iter != IterEnd; ++Iter) {
-      Stream << format("%12u", Iter->second) << ": ";
+      Stream << format("%12u %12llu", Iter->second.GetNumInstances(),
+                       (unsigned long long) Iter->second.GetBitsSaved())
+             << ": ";
       Iter->first.Print(Stream);
     }
     Stream << "--\n";
   }
 
 private:
-  // The set of abbreviations and corresponding number instances.
+  // The set of abbreviations and corresponding benefits.
   AbbrevCountMap AbbrevsMap;
 
   // The map of (global) abbreviations already associated with each block.
@@ -970,7 +1286,9 @@ private:
 
 bool CandidateAbbrevs::Add(unsigned BlockID,
                            UnrolledAbbreviation &UnrolledAbbrev,
-                           unsigned NumInstances) {
+                           const RecordGroup &Group,
+                           unsigned NumInstances,
+                           uint64_t BitsSaved) {
   // Drop if it corresponds to an existing global abbreviation.
   NaClBitCodeAbbrev *Abbrev = UnrolledAbbrev.Restore();
   if (BlockAbbrevs* Abbrevs = BlockAbbrevsMap[BlockID]) {
@@ -982,31 +1300,83 @@ bool CandidateAbbrevs::Add(unsigned BlockID,
   }
 
   CandBlockAbbrev CandAbbrev(BlockID, Abbrev);
-  AbbrevCountMap::iterator Pos = AbbrevsMap.find(CandAbbrev);
-  if (Pos == AbbrevsMap.end()) {
-    AbbrevsMap[CandAbbrev] = NumInstances;
-  } else {
-    Pos->second += NumInstances;
+  AbbrevsMap[CandAbbrev].Add(Group, NumInstances, BitsSaved);
+  return true;
+}
+
+// The widest fixed or VBR encoding considered for a value.
+static const unsigned MaxEncodingWidth = 32;
+
+// Returns true if Op is an encoding whose width can be fitted to the
+// values it encodes.
+static bool IsFittableOp(const NaClBitCodeAbbrevOp &Op) {
+  if (Op.isLiteral()) return false;
+  switch (Op.getEncoding()) {
+  case NaClBitCodeAbbrevOp::Fixed:
+  case NaClBitCodeAbbrevOp::VBR:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Computes the number of bits Op needs to encode all values in
+// ValueDist, using the largest value of each range of values in the
+// distribution. Returns false if Op can't encode some value.
+static bool GetEncodedBits(const NaClBitCodeAbbrevOp &Op,
+                           const NaClBitcodeDist &ValueDist,
+                           uint64_t &NumBits) {
+  NumBits = 0;
+  for (NaClBitcodeDist::const_iterator
+           Iter = ValueDist.begin(), IterEnd = ValueDist.end();
+       Iter != IterEnd; ++Iter) {
+    NaClValueRangeType Range = GetNaClValueRange(Iter->first);
+    uint64_t ValueBits = 0;
+    if (!BlockAbbrevs::CanUseSimpleAbbrevOp(Op, Range.second, ValueBits))
+      return false;
+    NumBits += ValueBits * Iter->second->GetNumInstances();
   }
   return true;
 }
 
+// Looks for a fixed or VBR encoding that needs fewer bits than NumBits
+// to encode all values in ValueDist. If found, updates Op and NumBits
+// to the best such encoding.
+static void FitEncoding(const NaClBitcodeDist &ValueDist,
+                        NaClBitCodeAbbrevOp &Op, uint64_t &NumBits) {
+  for (unsigned Width = 1; Width <= MaxEncodingWidth; ++Width) {
+    NaClBitCodeAbbrevOp FixedOp(NaClBitCodeAbbrevOp::Fixed, Width);
+    uint64_t FixedBits;
+    if (GetEncodedBits(FixedOp, ValueDist, FixedBits) && FixedBits < NumBits) {
+      Op = FixedOp;
+      NumBits = FixedBits;
+    }
+    if (Width == 1) continue;
+    NaClBitCodeAbbrevOp VBROp(NaClBitCodeAbbrevOp::VBR, Width);
+    uint64_t VBRBits;
+    if (GetEncodedBits(VBROp, ValueDist, VBRBits) && VBRBits < NumBits) {
+      Op = VBROp;
+      NumBits = VBRBits;
+    }
+  }
+}
+
 // Look for new abbreviations in block BlockID, considering it was
 // read with the given abbreviation Abbrev, and considering changing
 // the abbreviation opererator for value Index. ValueDist is how
-// values at Index are distributed. Any found abbreviations are added
-// to the candidate abbreviations CandAbbrevs. Returns true only if we
-// have added new candidate abbreviations to CandAbbrevs.
+// values at Index are distributed, for the records of Group. Any
+// found abbreviations are added to the candidate abbreviations
+// CandAbbrevs. Returns true only if we have added new candidate
+// abbreviations to CandAbbrevs.
 static bool AddNewAbbreviations(unsigned BlockID,
+                                const RecordGroup &Group,
                                 const UnrolledAbbreviation &Abbrev,
                                 unsigned Index,
                                 NaClBitcodeValueDist &ValueDist,
                                 CandidateAbbrevs &CandAbbrevs) {
-  // TODO(kschimpf): Add code to try and find a better encoding for
-  // the values, based on the distribution.
-
   // If this index is already a literal abbreviation, no improvements can
   // be made.
+  if (Index >= Abbrev.AbbrevOps.size()) return false;
   const NaClBitCodeAbbrevOp Op = Abbrev.AbbrevOps[Index];
   if (Op.isLiteral()) return false;
 
@@ -1022,11 +1392,16 @@ static bool AddNewAbbreviations(unsigned BlockID,
 
     // Defines a constant. Try as new candidate range.  In addition,
     // don't try any more constant values, since this is the one with
-    // the greatest number of instances.
-    NaClBitcodeDistElement *Elmt = ValueDist.at(Range.first);
+    // the greatest number of instances. The constant saves the bits
+    // Op used to encode it.
+    unsigned NumInstances = ValueDist.at(Range.first)->GetNumInstances();
+    uint64_t ValueBits = 0;
+    if (!BlockAbbrevs::CanUseSimpleAbbrevOp(Op, Range.first, ValueBits))
+      return false;
     UnrolledAbbreviation CandAbbrev(Abbrev);
     CandAbbrev.AbbrevOps[Index] = NaClBitCodeAbbrevOp(Range.first);
-    return CandAbbrevs.Add(BlockID, CandAbbrev, Elmt->GetNumInstances());
+    return CandAbbrevs.Add(BlockID, CandAbbrev, Group, NumInstances,
+                           ValueBits * NumInstances);
   }
   return false;
 }
@@ -1034,14 +1409,16 @@ static bool AddNewAbbreviations(unsigned BlockID,
 // Look for new abbreviations in block BlockID, considering it was
 // read with the given abbreviation Abbrev. IndexDist is the
 // corresponding distribution of value indices associated with the
-// abbreviation.  Any found abbreviations are added to the candidate
-// abbreviations CandAbbrevs.
+// abbreviation, for the records of Group.  Any found abbreviations
+// are added to the candidate abbreviations CandAbbrevs.
 static void AddNewAbbreviations(unsigned BlockID,
+                                const RecordGroup &Group,
                                 const UnrolledAbbreviation &Abbrev,
                                 NaClBitcodeDist &IndexDist,
                                 CandidateAbbrevs &CandAbbrevs) {
-  // Search based on sorted distribution, which sorts based on heuristic
-  // of best index to fix first.
+  // Try a constant at each index. Candidates are scored by the bits
+  // they save, so there is no need to stop at the first index that
+  // gives a candidate.
   const NaClBitcodeDist::Distribution *
       IndexDistribution = IndexDist.GetDistribution();
   for (NaClBitcodeDist::Distribution::const_iterator
@@ -1049,22 +1426,70 @@ static void AddNewAbbreviations(unsigned BlockID,
            IndexIterEnd = IndexDistribution->end();
        IndexIter != IndexIterEnd; ++IndexIter) {
     unsigned Index = static_cast<unsigned>(IndexIter->second);
-    if (AddNewAbbreviations(
-            BlockID, Abbrev, Index,
-            cast<NaClBitcodeValueIndexDistElement>(IndexDist.at(Index))
-            ->GetValueDist(),
-            CandAbbrevs)) {
-      return;
+    AddNewAbbreviations(
+        BlockID, Group, Abbrev, Index,
+        cast<NaClBitcodeValueIndexDistElement>(IndexDist.at(Index))
+        ->GetValueDist(),
+        CandAbbrevs);
+  }
+}
+
+// Adds the candidate abbreviation that best fits all NumInstances
+// records of Group in block BlockID, read using abbreviation
+// Abbrev. The record code becomes a literal, and each value index
+// (in IndexDist) is encoded using the literal, or the fixed or VBR
+// width, that needs the fewest bits for the values found at that
+// index.
+static void AddFittedAbbreviation(unsigned BlockID,
+                                  const RecordGroup &Group,
+                                  unsigned NumInstances,
+                                  const UnrolledAbbreviation &Abbrev,
+                                  NaClBitcodeDist &IndexDist,
+                                  CandidateAbbrevs &CandAbbrevs) {
+  UnrolledAbbreviation CandAbbrev(Abbrev);
+  uint64_t BitsSaved = 0;
+  uint64_t CodeBits = 0;
+  if (!CandAbbrev.CodeOp.isLiteral() &&
+      BlockAbbrevs::CanUseSimpleAbbrevOp(CandAbbrev.CodeOp, Group.Code,
+                                         CodeBits)) {
+    CandAbbrev.CodeOp = NaClBitCodeAbbrevOp(Group.Code);
+    BitsSaved += CodeBits * NumInstances;
+  }
+  for (NaClBitcodeDist::const_iterator
+           Iter = IndexDist.begin(), IterEnd = IndexDist.end();
+       Iter != IterEnd; ++Iter) {
+    unsigned Index = static_cast<unsigned>(Iter->first);
+    if (Index >= CandAbbrev.AbbrevOps.size()) continue;
+    NaClBitCodeAbbrevOp &Op = CandAbbrev.AbbrevOps[Index];
+    if (!IsFittableOp(Op)) continue;
+    NaClBitcodeDist &ValueDist =
+        cast<NaClBitcodeValueIndexDistElement>(Iter->second)->GetValueDist();
+    uint64_t OpBits;
+    if (!GetEncodedBits(Op, ValueDist, OpBits)) continue;
+    if (ValueDist.size() == 1) {
+      NaClValueRangeType Range = GetNaClValueRange(ValueDist.begin()->first);
+      if (Range.first == Range.second) {
+        // All records have the same value at this index.
+        Op = NaClBitCodeAbbrevOp(Range.first);
+        BitsSaved += OpBits;
+        continue;
+      }
     }
+    uint64_t FittedBits = OpBits;
+    FitEncoding(ValueDist, Op, FittedBits);
+    BitsSaved += OpBits - FittedBits;
   }
+  if (BitsSaved)
+    CandAbbrevs.Add(BlockID, CandAbbrev, Group, NumInstances, BitsSaved);
 }
 
 // Look for new abbreviations in block BlockID, considering it was
-// read with the given abbreviation Abbrev, and the given record Code.
-// SizeDist is the corresponding distribution of sizes associated with
-// the abbreviation. Any found abbreviations are added to the
-// candidate abbreviations CandAbbrevs.
+// read with the abbreviation Abbrev (with index AbbrevIndex), and the
+// given record Code.  SizeDist is the corresponding distribution of
+// sizes associated with the abbreviation. Any found abbreviations are
+// added to the candidate abbreviations CandAbbrevs.
 static void AddNewAbbreviations(unsigned BlockID,
+                                unsigned AbbrevIndex,
                                 NaClBitCodeAbbrev *Abbrev,
                                 unsigned Code,
                                 NaClBitcodeDist &SizeDist,
@@ -1076,21 +1501,28 @@ static void AddNewAbbreviations(unsigned BlockID,
            SizeIterEnd = SizeDistribution->end();
        SizeIter != SizeIterEnd; ++SizeIter) {
     unsigned Size = static_cast<unsigned>(SizeIter->second);
+    unsigned NumInstances = SizeDist.at(Size)->GetNumInstances();
+    RecordGroup Group(AbbrevIndex, Code, Size);
     UnrolledAbbreviation UnrolledAbbrev(Abbrev, Size+1 /* Add code! */,
                                         Size >= NaClValueIndexCutoff);
-    if (!UnrolledAbbrev.CodeOp.isLiteral()) {
+    uint64_t CodeBits = 0;
+    if (!UnrolledAbbrev.CodeOp.isLiteral() &&
+        BlockAbbrevs::CanUseSimpleAbbrevOp(UnrolledAbbrev.CodeOp, Code,
+                                           CodeBits)) {
       // Try making the code a literal.
       UnrolledAbbreviation CandAbbrev(UnrolledAbbrev);
       CandAbbrev.CodeOp = NaClBitCodeAbbrevOp(Code);
-      CandAbbrevs.Add(BlockID, CandAbbrev,
-                      SizeDist.at(Size)->GetNumInstances());
+      CandAbbrevs.Add(BlockID, CandAbbrev, Group, NumInstances,
+                      CodeBits * NumInstances);
     }
     // Now process value indices to find candidate abbreviations.
-    AddNewAbbreviations(
-        BlockID, UnrolledAbbrev,
+    NaClBitcodeDist &IndexDist =
         cast<NaClBitcodeSizeDistElement>(SizeDist.at(Size))
-        ->GetValueIndexDist(),
-        CandAbbrevs);
+        ->GetValueIndexDist();
+    AddNewAbbreviations(BlockID, Group, UnrolledAbbrev, IndexDist,
+                        CandAbbrevs);
+    AddFittedAbbreviation(BlockID, Group, NumInstances, UnrolledAbbrev,
+                          IndexDist, CandAbbrevs);
   }
 }
 
@@ -1124,6 +1556,7 @@ static void AddNewAbbreviations(unsigned BlockID,
       unsigned Code = static_cast<unsigned>(CodeIter->second);
       AddNewAbbreviations(
           BlockID,
+          static_cast<unsigned>(AbbrevIndex),
           Abbrev,
           Code,
           cast<NaClCompressCodeDistElement>(CodeDist.at(CodeIter->second))
@@ -1133,7 +1566,119 @@ static void AddNewAbbreviations(unsigned BlockID,
   }
 }
 
-typedef std::pair<unsigned, CandBlockAbbrev> CountedAbbrevType;
+// Returns the (approximate) number of bits needed to define the given
+// abbreviation in the bitcode file.
+static uint64_t AbbrevDefinitionBits(const NaClBitCodeAbbrev *Abbrev) {
+  unsigned NumOps = Abbrev->getNumOperandInfos();
+  uint64_t NumBits =
+      NaClBitsNeededForValue(naclbitc::DEFAULT_MAX_ABBREV) +
+      BlockAbbrevs::MatchVBRBits(NumOps, 5);
+  for (unsigned i = 0; i < NumOps; ++i) {
+    const NaClBitCodeAbbrevOp &Op = Abbrev->getOperandInfo(i);
+    ++NumBits;
+    if (Op.isLiteral()) {
+      NumBits += BlockAbbrevs::MatchVBRBits(Op.getLiteralValue(), 8);
+    } else {
+      NumBits += 3;
+      if (Op.hasEncodingData())
+        NumBits += BlockAbbrevs::MatchVBRBits(Op.getEncodingData(), 5);
+    }
+  }
+  return NumBits;
+}
+
+// Adds the candidate abbreviations (Candidates) of the block with
+// abbreviations Abbrevs, that are expected to shrink the block the
+// most. NumRecords is the number of records in all instances of the
+// block.
+//
+// Candidates are picked greedily, based on the bits they save beyond
+// the candidates already picked for the same groups of records, less
+// the bits needed to define them. Every added abbreviation may also
+// widen the abbreviation index of every record in the block. Hence,
+// only the prefix of picked candidates that maximizes the net savings
+// is added.
+//
+// The order that abbreviations are added matters, since method
+// GetRecordAbbrevIndex chooses the first abbreviation that generates
+// the least number of bits. Adding them in the order picked puts the
+// candidates that save the most first.
+//
+// Note: The savings are estimates, since the distribution maps only
+// track ranges of values, and only track each value index
+// separately. The copy phase still chooses the best abbreviation for
+// each record exactly.
+static void AddBestAbbreviations(
+    BlockAbbrevs *Abbrevs, unsigned NumRecords,
+    const std::vector<CandidateAbbrevs::const_iterator> &Candidates) {
+  typedef std::map<RecordGroup, uint64_t> GroupSavingsMap;
+  GroupSavingsMap PickedSavings;
+  std::vector<bool> Picked(Candidates.size(), false);
+  std::vector<size_t> PickOrder;
+  std::vector<int64_t> PickGains;
+  while (true) {
+    size_t Best = Candidates.size();
+    int64_t BestGain = 0;
+    for (size_t i = 0; i < Candidates.size(); ++i) {
+      if (Picked[i]) continue;
+      const CandAbbrevBenefit::GroupBenefitMap &Groups =
+          Candidates[i]->second.GetGroups();
+      uint64_t BitsSaved = 0;
+      for (CandAbbrevBenefit::GroupBenefitMap::const_iterator
+               Iter = Groups.begin(), IterEnd = Groups.end();
+           Iter != IterEnd; ++Iter) {
+        GroupSavingsMap::const_iterator Pos = PickedSavings.find(Iter->first);
+        uint64_t AlreadySaved = Pos == PickedSavings.end() ? 0 : Pos->second;
+        if (Iter->second.BitsSaved > AlreadySaved)
+          BitsSaved += Iter->second.BitsSaved - AlreadySaved;
+      }
+      int64_t Gain = static_cast<int64_t>(BitsSaved) - static_cast<int64_t>(
+          AbbrevDefinitionBits(Candidates[i]->first.GetAbbrev()));
+      if (Gain > BestGain) {
+        Best = i;
+        BestGain = Gain;
+      }
+    }
+    if (Best == Candidates.size()) break;
+    Picked[Best] = true;
+    PickOrder.push_back(Best);
+    PickGains.push_back(BestGain);
+    const CandAbbrevBenefit::GroupBenefitMap &Groups =
+        Candidates[Best]->second.GetGroups();
+    for (CandAbbrevBenefit::GroupBenefitMap::const_iterator
+             Iter = Groups.begin(), IterEnd = Groups.end();
+         Iter != IterEnd; ++Iter) {
+      uint64_t &AlreadySaved = PickedSavings[Iter->first];
+      AlreadySaved = std::max(AlreadySaved, Iter->second.BitsSaved);
+    }
+  }
+
+  unsigned NumAbbrevs = Abbrevs->GetNumberAbbreviations();
+  unsigned IndexBits = NaClBitsNeededForValue(NumAbbrevs - 1);
+  int64_t Gain = 0;
+  int64_t BestNetGain = 0;
+  size_t NumToAdd = 0;
+  for (size_t i = 0; i < PickOrder.size(); ++i) {
+    Gain += PickGains[i];
+    int64_t WiderIndexBits = static_cast<int64_t>(NumRecords) *
+        (NaClBitsNeededForValue(NumAbbrevs + i) - IndexBits);
+    if (Gain - WiderIndexBits > BestNetGain) {
+      BestNetGain = Gain - WiderIndexBits;
+      NumToAdd = i + 1;
+    }
+  }
+
+  for (size_t i = 0; i < NumToAdd; ++i) {
+    CandidateAbbrevs::const_iterator Cand = Candidates[PickOrder[i]];
+    NaClBitCodeAbbrev *Abbrev = Cand->first.GetAbbrev()->Copy();
+    if (TraceGeneratedAbbreviations) {
+      errs() << format("%12u %12llu", Cand->second.GetNumInstances(),
+                       (unsigned long long) PickGains[i]) << ": ";
+      PrintAbbrev(errs(), Cand->first.GetBlockID(), Abbrev);
+    }
+    Abbrevs->AddAbbreviation(Abbrev);
+  }
+}
 
 // Look for new abbreviations in the given block distribution map
 // BlockDist.  BlockAbbrevsMap contains the set of read global
@@ -1156,55 +1701,28 @@ static void AddNewAbbreviations(NaClBitcodeBlockDist &BlockDist,
         ->GetAbbrevDist(),
         CandAbbrevs);
   }
-  // Install candidate abbreviations.
-  //
-  // Sort the candidate abbreviations by number of instances, so that
-  // if multiple abbreviations apply, the one with the largest number
-  // of instances will be chosen when compressing a file.
-  //
-  // For example, we may have just generated two abbreviations. The
-  // first has replaced the 3rd element with the constant 4 while the
-  // second replaced the 4th element with the constant 5. The first
-  // abbreviation can apply to 300 records while the second can apply
-  // to 1000 records.  Assuming that both abbreviations shrink the
-  // record by the same number of bits, we clearly want the tool to
-  // choose the second abbreviation when selecting the abbreviation
-  // index to choose (via method GetRecordAbbrevIndex).
-  //
-  // Selecting the second is important in that abbreviation are
-  // refined by successive calls to this tool. We do not want to
-  // restrict downstream refinements prematurely.  Hence, we want the
-  // tool to choose the abbreviation with the most candidates first.
-  //
-  // Since method GetRecordAbbrevIndex chooses the first abbreviation
-  // that generates the least number of bits, we clearly want to make
-  // sure that the second abbreviation occurs before the first.
-  std::vector<CountedAbbrevType> Candidates;
-  for (CandidateAbbrevs::const_iterator
-           Iter = CandAbbrevs.GetAbbrevsMap().begin(),
-           IterEnd = CandAbbrevs.GetAbbrevsMap().end();
-       Iter != IterEnd; ++Iter) {
-    Candidates.push_back(CountedAbbrevType(Iter->second,Iter->first));
-  }
-  std::sort(Candidates.begin(), Candidates.end());
-  std::vector<CountedAbbrevType>::const_reverse_iterator
-      Iter = Candidates.rbegin(), IterEnd = Candidates.rend();
-  if (Iter == IterEnd) return;
 
+  // Install candidate abbreviations, one block at a time. Candidates
+  // are ordered by block ID.
+  const CandidateAbbrevs::AbbrevCountMap &CandMap =
+      CandAbbrevs.GetAbbrevsMap();
+  if (CandMap.empty()) return;
   if (TraceGeneratedAbbreviations) {
     errs() << "-- New abbrevations:\n";
   }
-  unsigned Min = (Iter->first >> 2);
-  for (; Iter != IterEnd; ++Iter) {
-    if (Iter->first < Min) break;
-    unsigned BlockID = Iter->second.GetBlockID();
-    BlockAbbrevs *Abbrevs = BlockAbbrevsMap[BlockID];
-    NaClBitCodeAbbrev *Abbrev = Iter->second.GetAbbrev()->Copy();
-    if (TraceGeneratedAbbreviations) {
-      errs() <<format("%12u", Iter->first) << ": ";
-      PrintAbbrev(errs(), BlockID, Abbrev);
-    }
-    Abbrevs->AddAbbreviation(Abbrev);
+  std::vector<CandidateAbbrevs::const_iterator> BlockCandidates;
+  for (CandidateAbbrevs::const_iterator
+           Iter = CandMap.begin(), IterEnd = CandMap.end();
+       Iter != IterEnd; ) {
+    unsigned BlockID = Iter->first.GetBlockID();
+    BlockCandidates.clear();
+    for (; Iter != IterEnd && Iter->first.GetBlockID() == BlockID; ++Iter)
+      BlockCandidates.push_back(Iter);
+    unsigned NumRecords =
+        cast<NaClCompressBlockDistElement>(BlockDist.at(BlockID))
+        ->GetAbbrevDist().GetTotal();
+    AddBestAbbreviations(BlockAbbrevsMap[BlockID], NumRecords,
+                         BlockCandidates);
   }
   if (TraceGeneratedAbbreviations) {
     errs() << "--\n";
@@ -1249,20 +1767,92 @@ static void DisplayAbbreviationFrequencies(
   }
 }
 
+// Analyzes the function blocks in FunctionBlocks that are assigned to
+// worker Parser (using Cursor), starting with index First, and taking
+// every Stride-th block.
+static void AnalyzeFunctionBlocks(
+    NaClAnalyzeParser *Parser,
+    NaClBitstreamCursor *Cursor,
+    const std::vector<DeferredBlock> *FunctionBlocks,
+    size_t First, size_t Stride) {
+  for (size_t i = First; i < FunctionBlocks->size(); i += Stride) {
+    const DeferredBlock &Block = (*FunctionBlocks)[i];
+    Cursor->JumpToBit(Block.StartBit);
+    Parser->FillBlock = Block.Parsed;
+    if (Parser->ParseBlock(naclbitc::FUNCTION_BLOCK_ID) ||
+        Parser->NeedsSerialAnalysis) {
+      Parser->NeedsSerialAnalysis = true;
+      return;
+    }
+  }
+}
+
+// Analyzes the function blocks in FunctionBlocks on AnalysisThreads
+// worker threads, and merges the collected distributions into those
+// of Parser. Returns true if the function blocks must instead be
+// analyzed serially.
+static bool AnalyzeFunctionBlocksInParallel(
+    NaClBitstreamReader &StreamFile,
+    const std::vector<DeferredBlock> &FunctionBlocks,
+    NaClAnalyzeParser &Parser) {
+  // Workers can't add block abbreviations, so add those of the blocks
+  // that appear in function blocks now.
+  static const unsigned FunctionBlockIDs[] = {
+    naclbitc::FUNCTION_BLOCK_ID,
+    naclbitc::CONSTANTS_BLOCK_ID,
+    naclbitc::VALUE_SYMTAB_BLOCK_ID
+  };
+  for (size_t i = 0; i < array_lengthof(FunctionBlockIDs); ++i)
+    Parser.GetGlobalAbbrevs(FunctionBlockIDs[i]);
+
+  size_t NumWorkers = std::min<size_t>(AnalysisThreads, FunctionBlocks.size());
+  std::vector<std::unique_ptr<NaClBitstreamCursor> > Cursors;
+  std::vector<std::unique_ptr<NaClAnalyzeParser> > Workers;
+  for (size_t i = 0; i < NumWorkers; ++i) {
+    Cursors.emplace_back(new NaClBitstreamCursor(StreamFile));
+    Workers.emplace_back(
+        new NaClAnalyzeParser(*Cursors[i], Parser.BlockAbbrevsMap,
+                              Parser.ParsedBlocks));
+    Workers[i]->IsWorker = true;
+  }
+#if LLVM_ENABLE_THREADS
+  std::vector<std::thread> Threads;
+  for (size_t i = 0; i < NumWorkers; ++i)
+    Threads.push_back(std::thread(AnalyzeFunctionBlocks, Workers[i].get(),
+                                  Cursors[i].get(), &FunctionBlocks, i,
+                                  NumWorkers));
+  for (size_t i = 0; i < NumWorkers; ++i)
+    Threads[i].join();
+#else
+  for (size_t i = 0; i < NumWorkers; ++i)
+    AnalyzeFunctionBlocks(Workers[i].get(), Cursors[i].get(),
+                          &FunctionBlocks, i, NumWorkers);
+#endif
+
+  for (size_t i = 0; i < NumWorkers; ++i) {
+    if (Workers[i]->NeedsSerialAnalysis)
+      return true;
+  }
+  for (size_t i = 0; i < NumWorkers; ++i)
+    Parser.BlockDist.Merge(Workers[i]->BlockDist);
+  return false;
+}
+
 // Read in bitcode, analyze data, and figure out set of abbreviations
 // to use, from memory buffer MemBuf containing the input bitcode file.
+// The file header is read into Header, and the blocks of the file
+// into ParsedBlocks. If Stats is non-null, the time spent is added to
+// it.
 static bool AnalyzeBitcode(std::unique_ptr<MemoryBuffer> &MemBuf,
-                           BlockAbbrevsMapType &BlockAbbrevsMap) {
-  // TODO(kschimpf): The current code only extracts abbreviations
-  // defined in the bitcode file. This code needs to be updated to
-  // collect data distributions and figure out better (global)
-  // abbreviations to use.
-
+                           NaClBitcodeHeader &Header,
+                           ParsedBlockList &ParsedBlocks,
+                           BlockAbbrevsMapType &BlockAbbrevsMap,
+                           CompressStats *Stats) {
+  double StartSeconds = GetWallTime();
   const unsigned char *BufPtr = (const unsigned char *)MemBuf->getBufferStart();
   const unsigned char *EndBufPtr = BufPtr+MemBuf->getBufferSize();
 
   // First read header and verify it is good.
-  NaClBitcodeHeader Header;
   if (Header.Read(BufPtr, EndBufPtr) || !Header.IsSupported())
     return Error("Invalid PNaCl bitcode header");
 
@@ -1270,11 +1860,34 @@ static bool AnalyzeBitcode(std::unique_ptr<MemoryBuffer> &MemBuf,
   NaClBitstreamReader StreamFile(BufPtr, EndBufPtr);
   NaClBitstreamCursor Stream(StreamFile);
 
-  // Parse the the bitcode file.
-  NaClAnalyzeParser Parser(Stream, BlockAbbrevsMap);
+  // Parse the the bitcode file. Function blocks are skipped, and
+  // analyzed afterwards, if they are analyzed in parallel. Since the
+  // skipped bits would be counted in the enclosing block, the
+  // distributions are only printed if everything is analyzed in order.
+  NaClAnalyzeParser Parser(Stream, BlockAbbrevsMap, ParsedBlocks);
+  std::vector<DeferredBlock> FunctionBlocks;
+  bool InParallel = AnalysisThreads > 0 &&
+      !ShowAbbreviationFrequencies && !ShowValueDistributions;
+  if (InParallel)
+    Parser.DeferredFunctionBlocks = &FunctionBlocks;
   while (!Stream.AtEndOfStream()) {
     if (Parser.Parse()) return true;
   }
+  if (InParallel) {
+    Parser.DeferredFunctionBlocks = 0;
+    if (AnalyzeFunctionBlocksInParallel(StreamFile, FunctionBlocks, Parser)) {
+      for (size_t i = 0; i < FunctionBlocks.size(); ++i) {
+        // Drop whatever a worker read before it gave up.
+        FunctionBlocks[i].Parsed->Items.clear();
+        Stream.JumpToBit(FunctionBlocks[i].StartBit);
+        Parser.FillBlock = FunctionBlocks[i].Parsed;
+        if (Parser.ParseBlock(naclbitc::FUNCTION_BLOCK_ID)) return true;
+      }
+      Parser.FillBlock = 0;
+    } else if (Stats) {
+      Stats->NumFunctionBlocks = FunctionBlocks.size();
+    }
+  }
 
   if (ShowAbbreviationFrequencies || ShowValueDistributions) {
     std::string ErrorInfo;
@@ -1289,36 +1902,38 @@ static bool AnalyzeBitcode(std::unique_ptr<MemoryBuffer> &MemBuf,
       Parser.BlockDist.Print(Output);
   }
 
+  double SelectionSeconds = GetWallTime();
   AddNewAbbreviations(Parser.BlockDist, BlockAbbrevsMap);
+  if (Stats) {
+    double EndSeconds = GetWallTime();
+    Stats->AnalysisSeconds = SelectionSeconds - StartSeconds;
+    Stats->SelectionSeconds = EndSeconds - SelectionSeconds;
+  }
   return false;
 }
 
-/// Parses the input bitcode file and generates the corresponding
-/// compressed bitcode file, by replacing abbreviations in the input
-/// file with the corresponding abbreviations defined in
+/// Writes the blocks read from the input bitcode file into the
+/// corresponding compressed bitcode file, replacing abbreviations in
+/// the input file with the corresponding abbreviations defined in
 /// BlockAbbrevsMap.
-class NaClBitcodeCopyParser : public NaClBitcodeParser {
+class NaClBitcodeCopier {
 public:
-  // Top-level constructor to build the appropriate block parser
-  // using the given BlockAbbrevsMap to define abbreviations.
-  NaClBitcodeCopyParser(NaClBitstreamCursor &Cursor,
-                        BlockAbbrevsMapType &BlockAbbrevsMap,
-                        NaClBitstreamWriter &Writer)
-      : NaClBitcodeParser(Cursor),
-        BlockAbbrevsMap(BlockAbbrevsMap),
+  NaClBitcodeCopier(BlockAbbrevsMapType &BlockAbbrevsMap,
+                    NaClBitstreamWriter &Writer,
+                    CompressStats *Stats)
+      : BlockAbbrevsMap(BlockAbbrevsMap),
         Writer(Writer),
-        FoundFirstBlockInfo(false)
+        FoundFirstBlockInfo(false),
+        Stats(Stats)
   {}
 
-  virtual ~NaClBitcodeCopyParser() {}
-
-  virtual bool Error(const std::string &Message) {
-    // Use local error routine so that all errors are treated uniformly.
-    return ::Error(Message);
-  }
-
-  virtual bool ParseBlock(unsigned BlockID);
+  /// Copies Block, and the blocks nested in it. If collecting
+  /// statistics, adds the bits written and the time taken (including
+  /// nested blocks) to OutputBits and Seconds.
+  void CopyBlock(const ParsedBlock &Block, uint64_t &OutputBits,
+                 double &Seconds);
 
+private:
   // The abbreviations to use for the copied bitcode.
   BlockAbbrevsMapType &BlockAbbrevsMap;
 
@@ -1329,67 +1944,31 @@ public:
   // Used to make sure we don't use abbreviations until we
   // have put them into the bitcode file.
   bool FoundFirstBlockInfo;
-};
-
-class NaClBlockCopyParser : public NaClBitcodeParser {
-public:
-  // Top-level constructor to build the appropriate block parser.
-  NaClBlockCopyParser(unsigned BlockID,
-                      NaClBitcodeCopyParser *Context)
-      : NaClBitcodeParser(BlockID, Context),
-        Context(Context),
-        BlockAbbreviations(0)
-  {}
-
-  virtual ~NaClBlockCopyParser() {}
 
-protected:
-  // The context defining state associated with the block parser.
-  NaClBitcodeCopyParser *Context;
-
-  // The block abbreviations defined for this block (initialized by
-  // EnterBlock).
-  BlockAbbrevs *BlockAbbreviations;
-
-  /// Constructor to parse nested blocks.  Creates a block parser to
-  /// parse in a block with the given BlockID, and write the block
-  /// back out using the abbreviations in BlockAbbrevsMap.
-  NaClBlockCopyParser(unsigned BlockID,
-                      NaClBlockCopyParser *EnclosingParser)
-      : NaClBitcodeParser(BlockID, EnclosingParser),
-        Context(EnclosingParser->Context)
-  {}
-
-  virtual bool Error(const std::string &Message) {
-    // Use local error routine so that all errors are treated uniformly.
-    return ::Error(Message);
-  }
+  // If non-null, the statistics to add the size of each block to.
+  CompressStats *Stats;
 
   /// Returns the set of (global) block abbreviations defined for the
   /// given block ID.
   BlockAbbrevs *GetGlobalAbbrevs(unsigned BlockID) {
-    BlockAbbrevs *Abbrevs = Context->BlockAbbrevsMap[BlockID];
+    BlockAbbrevs *Abbrevs = BlockAbbrevsMap[BlockID];
     if (Abbrevs == 0) {
       Abbrevs = new BlockAbbrevs(BlockID);
-      Context->BlockAbbrevsMap[BlockID] = Abbrevs;
+      BlockAbbrevsMap[BlockID] = Abbrevs;
     }
     return Abbrevs;
   }
 
-  virtual bool ParseBlock(unsigned BlockID) {
-    NaClBlockCopyParser Parser(BlockID, this);
-    return Parser.ParseThisBlock();
-  }
-
-  virtual void EnterBlock(unsigned NumWords) {
-    unsigned BlockID = GetBlockID();
-    BlockAbbreviations = GetGlobalAbbrevs(BlockID);
+  // Enters the block with the given ID in the output, and returns
+  // the abbreviations to use within it.
+  BlockAbbrevs *EnterBlock(unsigned BlockID) {
+    BlockAbbrevs *BlockAbbreviations = GetGlobalAbbrevs(BlockID);
 
     // Enter the subblock.
     NaClBitcodeSelectorAbbrev
         Selector(BlockAbbreviations->GetNumberAbbreviations()-1);
     if (RemoveAbbreviations) Selector = NaClBitcodeSelectorAbbrev();
-    Context->Writer.EnterSubblock(BlockID, Selector);
+    Writer.EnterSubblock(BlockID, Selector);
 
     // Note: We must dump module abbreviations as local
     // abbreviations, because they are in a yet to be
@@ -1397,26 +1976,23 @@ protected:
     if (!RemoveAbbreviations && BlockID == naclbitc::MODULE_BLOCK_ID) {
       BlockAbbrevs* Abbrevs = GetGlobalAbbrevs(naclbitc::MODULE_BLOCK_ID);
       for (unsigned i = 0; i < Abbrevs->GetNumberAbbreviations(); ++i) {
-        Context->Writer.EmitAbbrev(Abbrevs->GetIndexedAbbrev(i)->Copy());
+        Writer.EmitAbbrev(Abbrevs->GetIndexedAbbrev(i)->Copy());
       }
     }
+    return BlockAbbreviations;
   }
 
-  virtual void ExitBlock() {
-    Context->Writer.ExitBlock();
-  }
-
-  virtual void ProcessBlockInfo() {
-    assert(!Context->FoundFirstBlockInfo &&
+  void CopyBlockInfo() {
+    assert(!FoundFirstBlockInfo &&
            "Input bitcode has more that one BlockInfoBlock");
-    Context->FoundFirstBlockInfo = true;
+    FoundFirstBlockInfo = true;
 
     // Generate global abbreviations within a blockinfo block.
-    Context->Writer.EnterBlockInfoBlock();
+    Writer.EnterBlockInfoBlock();
     if (!RemoveAbbreviations) {
       for (BlockAbbrevsMapType::const_iterator
-               Iter = Context->BlockAbbrevsMap.begin(),
-               IterEnd = Context->BlockAbbrevsMap.end();
+               Iter = BlockAbbrevsMap.begin(),
+               IterEnd = BlockAbbrevsMap.end();
            Iter != IterEnd; ++Iter) {
         unsigned BlockID = Iter->first;
         // Don't emit module abbreviations, since they have been
@@ -1428,55 +2004,79 @@ protected:
         for (unsigned i = Abbrevs->GetFirstApplicationAbbreviation();
              i < Abbrevs->GetNumberAbbreviations(); ++i) {
           NaClBitCodeAbbrev *Abbrev = Abbrevs->GetIndexedAbbrev(i);
-          Context->Writer.EmitBlockInfoAbbrev(BlockID, Abbrev);
+          Writer.EmitBlockInfoAbbrev(BlockID, Abbrev);
         }
       }
     }
-    Context->Writer.ExitBlock();
+    Writer.ExitBlock();
   }
 
-  virtual void ProcessRecord() {
-    const NaClBitcodeRecord::RecordVector &Values = Record.GetValues();
+  void CopyRecord(BlockAbbrevs *BlockAbbreviations,
+                  const NaClBitcodeRecordData &Record) {
     if (RemoveAbbreviations) {
-      Context->Writer.EmitRecord(Record.GetCode(), Values, 0);
+      Writer.EmitRecord(Record.Code, Record.Values, 0);
       return;
     }
     // Find best fitting abbreviation to use, and print out the record
     // using that abbreviations.
-    unsigned AbbrevIndex =
-        BlockAbbreviations->GetRecordAbbrevIndex(Record.GetRecordData());
+    unsigned AbbrevIndex = BlockAbbreviations->GetRecordAbbrevIndex(Record);
     if (AbbrevIndex == naclbitc::UNABBREV_RECORD) {
-      Context->Writer.EmitRecord(Record.GetCode(), Values, 0);
+      Writer.EmitRecord(Record.Code, Record.Values, 0);
     } else {
-      Context->Writer.EmitRecord(Record.GetCode(), Values, AbbrevIndex);
+      Writer.EmitRecord(Record.Code, Record.Values, AbbrevIndex);
     }
   }
 };
 
-bool NaClBitcodeCopyParser::ParseBlock(unsigned BlockID) {
-  NaClBlockCopyParser Parser(BlockID, this);
-  return Parser.ParseThisBlock();
+void NaClBitcodeCopier::CopyBlock(const ParsedBlock &Block,
+                                  uint64_t &OutputBits, double &Seconds) {
+  uint64_t OutputStartBit = Stats ? Writer.GetCurrentBitNo() : 0;
+  double StartSeconds = Stats ? GetWallTime() : 0.0;
+  // The bits and time taken by nested blocks. Only used to collect
+  // statistics.
+  uint64_t NestedInputBits = 0;
+  uint64_t NestedOutputBits = 0;
+  double NestedSeconds = 0.0;
+
+  if (Block.BlockID == naclbitc::BLOCKINFO_BLOCK_ID) {
+    CopyBlockInfo();
+  } else {
+    BlockAbbrevs *BlockAbbreviations = EnterBlock(Block.BlockID);
+    for (std::vector<ParsedBlock::Item>::const_iterator
+             Iter = Block.Items.begin(), IterEnd = Block.Items.end();
+         Iter != IterEnd; ++Iter) {
+      if (Iter->Block) {
+        NestedInputBits += Iter->Block->NumBits;
+        CopyBlock(*Iter->Block, NestedOutputBits, NestedSeconds);
+      } else {
+        CopyRecord(BlockAbbreviations, Iter->Record);
+      }
+    }
+    Writer.ExitBlock();
+  }
+
+  // Add the size of the block (excluding nested blocks) in the input
+  // and output, and the time spent copying it, to the statistics.
+  if (Stats == 0) return;
+  uint64_t BlockOutputBits = Writer.GetCurrentBitNo() - OutputStartBit;
+  double BlockSeconds = GetWallTime() - StartSeconds;
+  CompressStats::BlockStats &BlockStats = Stats->Blocks[Block.BlockID];
+  ++BlockStats.NumBlocks;
+  BlockStats.InputBits += Block.NumBits - NestedInputBits;
+  BlockStats.OutputBits += BlockOutputBits - NestedOutputBits;
+  BlockStats.CopySeconds += BlockSeconds - NestedSeconds;
+  OutputBits += BlockOutputBits;
+  Seconds += BlockSeconds;
 }
 
-// Read in bitcode, and write it back out using the abbreviations in
-// BlockAbbrevsMap, from memory buffer MemBuf containing the input
-// bitcode file.
-static bool CopyBitcode(std::unique_ptr<MemoryBuffer> &MemBuf,
-                        BlockAbbrevsMapType &BlockAbbrevsMap) {
-
-  const unsigned char *BufPtr = (const unsigned char *)MemBuf->getBufferStart();
-  const unsigned char *EndBufPtr = BufPtr+MemBuf->getBufferSize();
-
-  // Read header. No verification is needed since AnalyzeBitcode has
-  // already checked it.
-  NaClBitcodeHeader Header;
-  if (Header.Read(BufPtr, EndBufPtr))
-    return Error("Invalid PNaCl bitcode header");
-
-  // Create the bitcode reader.
-  NaClBitstreamReader StreamFile(BufPtr, EndBufPtr);
-  NaClBitstreamCursor Stream(StreamFile);
-
+// Write the blocks in ParsedBlocks, read from the input bitcode file
+// with the given Header, back out using the abbreviations in
+// BlockAbbrevsMap. If Stats is non-null, the size of each block and
+// the time spent copying it are added to it.
+static bool CopyBitcode(const NaClBitcodeHeader &Header,
+                        const ParsedBlockList &ParsedBlocks,
+                        BlockAbbrevsMapType &BlockAbbrevsMap,
+                        CompressStats *Stats) {
   // Create the bitcode writer.
   SmallVector<char, 0> OutputBuffer;
   OutputBuffer.reserve(256*1024);
@@ -1485,12 +2085,14 @@ static bool CopyBitcode(std::unique_ptr<MemoryBuffer> &MemBuf,
   // Emit the file header.
   NaClWriteHeader(Header, StreamWriter);
 
-  // Set up the parser.
-  NaClBitcodeCopyParser Parser(Stream, BlockAbbrevsMap, StreamWriter);
-
-  // Parse the bitcode and copy.
-  while (!Stream.AtEndOfStream()) {
-    if (Parser.Parse()) return true;
+  // Copy the blocks.
+  NaClBitcodeCopier Copier(BlockAbbrevsMap, StreamWriter, Stats);
+  uint64_t OutputBits = 0;
+  double Seconds = 0.0;
+  for (ParsedBlockList::const_iterator
+           Iter = ParsedBlocks.begin(), IterEnd = ParsedBlocks.end();
+       Iter != IterEnd; ++Iter) {
+    Copier.CopyBlock(**Iter, OutputBits, Seconds);
   }
 
   // Write out the copied results.
@@ -1530,12 +2132,24 @@ int main(int argc, char **argv) {
 
   std::unique_ptr<MemoryBuffer> MemBuf;
   if (ReadAndBuffer(MemBuf)) return 1;
+  NaClBitcodeHeader Header;
+  ParsedBlockList ParsedBlocks;
   BlockAbbrevsMapType BlockAbbrevsMap;
-  if (AnalyzeBitcode(MemBuf, BlockAbbrevsMap)) return 1;
+  CompressStats Stats;
+  CompressStats *StatsOrNull = ShowBlockStats ? &Stats : 0;
+  if (AnalyzeBitcode(MemBuf, Header, ParsedBlocks, BlockAbbrevsMap,
+                     StatsOrNull))
+    return 1;
   if (ShowAbbreviationFrequencies || ShowValueDistributions) {
     return 0;
   }
+  double CopyStartSeconds = GetWallTime();
   BuildAbbrevLookupMaps(BlockAbbrevsMap);
-  if (CopyBitcode(MemBuf, BlockAbbrevsMap)) return 1;
+  if (CopyBitcode(Header, ParsedBlocks, BlockAbbrevsMap, StatsOrNull))
+    return 1;
+  if (ShowBlockStats) {
+    Stats.CopySeconds = GetWallTime() - CopyStartSeconds;
+    Stats.Print(errs());
+  }
   return 0;
 }
@@ -11,18 +11,23 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "llvm/ADT/Triple.h"
 #include "llvm/Bitcode/NaCl/NaClBitcodeAnalyzer.h"
 #include "llvm/Bitcode/NaCl/NaClBitcodeHeader.h"
 #include "llvm/Bitcode/NaCl/NaClBitcodeParser.h"
 #include "llvm/Bitcode/NaCl/NaClBitstreamReader.h"
 #include "llvm/Bitcode/NaCl/NaClLLVMBitCodes.h"
 #include "llvm/Bitcode/NaCl/NaClReaderWriter.h"
+#include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IRReader/IRReader.h"
+#include "llvm/PassManager.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DataStream.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Format.h"
 #include "llvm/Support/FormattedStream.h"
 #include "llvm/Support/ManagedStatic.h"
@@ -30,9 +35,20 @@
 #include "llvm/Support/PrettyStackTrace.h"
 #include "llvm/Support/Signals.h"
 #include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/StreamableMemoryObject.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadedStreamingCache.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/Timer.h"
+#include "llvm/Target/TargetLibraryInfo.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/NaCl.h"
+#include <algorithm>
+#include <cstdio>
 #include <memory>
+#include <pthread.h>
+#include <sys/resource.h>
 #include <system_error>
 #include <vector>
 
@@ -45,7 +61,122 @@ InputFilename(cl::Positional, cl::desc("<input bitcode>"), cl::init("-"));
 static cl::opt<unsigned>
 NumRuns("num-runs", cl::desc("Number of runs"), cl::init(1));
 
-/// Used in a lexical block to measure and report the block's execution time.
+static cl::list<unsigned>
+StreamingReaders("streaming-readers", cl::CommaSeparated,
+                 cl::desc("Also time each number of threads in this list "
+                          "reading the input through one streaming cache"));
+
+static cl::list<unsigned>
+ReaderThreads("reader-threads", cl::CommaSeparated,
+              cl::desc("Also time LLVM IR parsing with each number of "
+                       "threads in this list decoding function blocks"));
+
+static cl::opt<std::string>
+JSONOutputFilename("json-output",
+                   cl::desc("Also write the timings of all runs as JSON "
+                            "to <filename>"),
+                   cl::value_desc("filename"), cl::init(""));
+
+static cl::opt<std::string>
+PipelineTriple("pipeline-triple",
+               cl::desc("Target triple of the JS emission stage"),
+               cl::init("asmjs-unknown-emscripten"));
+
+/// Resets the peak resident set size of the process to its current size, if
+/// the kernel allows it, so that the peak of each stage can be measured.
+static void resetPeakRSS() {
+#if defined(__linux__)
+  if (FILE *F = fopen("/proc/self/clear_refs", "w")) {
+    fputs("5", F);
+    fclose(F);
+  }
+#endif
+}
+
+/// Returns the peak resident set size of the process in KB, since the last
+/// resetPeakRSS() if the kernel supports resetting it, and since the process
+/// started otherwise.
+static uint64_t getPeakRSSKB() {
+#if defined(__linux__)
+  if (FILE *F = fopen("/proc/self/status", "r")) {
+    char Line[256];
+    unsigned long long KB = 0;
+    bool Found = false;
+    while (!Found && fgets(Line, sizeof(Line), F))
+      Found = sscanf(Line, "VmHWM: %llu kB", &KB) == 1;
+    fclose(F);
+    if (Found)
+      return KB;
+  }
+#endif
+  struct rusage Usage;
+  if (getrusage(RUSAGE_SELF, &Usage))
+    return 0;
+#if defined(__APPLE__)
+  // Darwin reports bytes rather than KB.
+  return Usage.ru_maxrss / 1024;
+#else
+  return Usage.ru_maxrss;
+#endif
+}
+
+/// The measurements of a stage, over all runs.
+struct StageResults {
+  std::string Name;
+  size_t InputSize;
+  std::vector<double> Seconds;
+  uint64_t PeakRSSKB;
+
+  double getMedian() const {
+    std::vector<double> Sorted(Seconds);
+    std::sort(Sorted.begin(), Sorted.end());
+    size_t Mid = Sorted.size() / 2;
+    if (Sorted.size() % 2)
+      return Sorted[Mid];
+    return (Sorted[Mid - 1] + Sorted[Mid]) / 2;
+  }
+
+  /// The sample variance of the times, or 0 for a single run.
+  double getVariance() const {
+    if (Seconds.size() < 2)
+      return 0;
+    double Mean = 0;
+    for (unsigned i = 0; i < Seconds.size(); ++i)
+      Mean += Seconds[i];
+    Mean /= Seconds.size();
+    double Sum = 0;
+    for (unsigned i = 0; i < Seconds.size(); ++i)
+      Sum += (Seconds[i] - Mean) * (Seconds[i] - Mean);
+    return Sum / (Seconds.size() - 1);
+  }
+
+  /// The throughput at the median time, or 0 if the stage has no input size.
+  double getMBPerSec() const {
+    double Median = getMedian();
+    if (InputSize == 0 || Median == 0)
+      return 0;
+    return (InputSize / Median) / 1000000.0;
+  }
+};
+
+/// The stages timed so far, in the order they were first timed.
+static std::vector<StageResults> AllResults;
+
+static StageResults &getStageResults(StringRef Name, size_t InputSize) {
+  for (unsigned i = 0; i < AllResults.size(); ++i)
+    if (AllResults[i].Name == Name)
+      return AllResults[i];
+  StageResults R;
+  R.Name = Name;
+  R.InputSize = InputSize;
+  R.PeakRSSKB = 0;
+  AllResults.push_back(R);
+  return AllResults.back();
+}
+
+/// Used in a lexical block to measure and report the block's execution time
+/// and the peak RSS while it ran. The measurements are also recorded, to
+/// summarize the runs of the block's stage at the end.
 ///
 /// \param N block name
 /// \param InputSize optional size of input operated upon. If given, the
@@ -53,23 +184,31 @@ NumRuns("num-runs", cl::desc("Number of runs"), cl::init(1));
 class TimingOperationBlock {
 public:
   TimingOperationBlock(StringRef N, size_t InputSize=0)
-    : InputSize(InputSize) {
+    : Name(N), InputSize(InputSize) {
     outs() << "Timing: " << N << "... ";
+    outs().flush();
+    resetPeakRSS();
     TStart = TimeRecord::getCurrentTime(true);
   }
 
   ~TimingOperationBlock() {
     TimeRecord TEnd = TimeRecord::getCurrentTime(false);
     double elapsed = TEnd.getWallTime() - TStart.getWallTime();
+    uint64_t PeakRSSKB = getPeakRSSKB();
     outs() << format("%.3lf", elapsed) << " sec";
 
     if (InputSize != 0) {
       double MBPerSec = (InputSize / elapsed) / 1000000.0;
       outs() << format(" [%.3lf MB/sec]", MBPerSec);
     }
-    outs() << "\n";
+    outs() << " [peak RSS " << PeakRSSKB << " KB]\n";
+
+    StageResults &R = getStageResults(Name, InputSize);
+    R.Seconds.push_back(elapsed);
+    R.PeakRSSKB = std::max(R.PeakRSSKB, PeakRSSKB);
   }
 private:
+  std::string Name;
   TimeRecord TStart;
   size_t InputSize;
 };
@@ -123,6 +262,107 @@ private:
   std::vector<int64_t> RecordValues;
 };
 
+/// Reads the PNaCl bitcode header, advancing BufPtr past it.
+static void readBitcodeHeader(const uint8_t *&BufPtr,
+                              const uint8_t *&EndBufPtr) {
+  NaClBitcodeHeader Header;
+
+  if (Header.Read(BufPtr, EndBufPtr)) {
+    report_fatal_error("Invalid PNaCl bitcode header");
+  }
+
+  if (!Header.IsSupported()) {
+    errs() << "Warning: " << Header.Unsupported() << "\n";
+  }
+
+  if (!Header.IsReadable()) {
+    report_fatal_error("Bitcode file is not readable");
+  }
+}
+
+/// Parses all the blocks in StreamFile with a DummyBitcodeParser.
+static void parseBitcode(NaClBitstreamReader &StreamFile) {
+  NaClBitstreamCursor Stream(StreamFile);
+  DummyBitcodeParser Parser(Stream);
+  while (!Stream.AtEndOfStream()) {
+    if (Parser.Parse()) {
+      report_fatal_error("Parsing failed");
+    }
+  }
+}
+
+/// Times the stages of translation that follow parsing, in order, on the
+/// parsed module M: PNaCl ABI simplification, writing PNaCl bitcode,
+/// ExpandI64 and JS emission. As for the other stages, the throughput is for
+/// the size of the input bitcode.
+void BenchmarkPipeline(Module *M, size_t InputSize) {
+  {
+    TimingOperationBlock T("PNaCl ABI simplification (pre-opt)", InputSize);
+    PassManager PM;
+    PM.add(new DataLayoutPass(M));
+    PNaClABISimplifyAddPreOptPasses(PM);
+    PM.run(*M);
+  }
+
+  {
+    TimingOperationBlock T("PNaCl ABI simplification (post-opt)", InputSize);
+    PassManager PM;
+    PM.add(new DataLayoutPass(M));
+    PNaClABISimplifyAddPostOptPasses(PM);
+    PM.run(*M);
+  }
+
+  {
+    TimingOperationBlock T("PNaCl bitcode writing", InputSize);
+    std::string Bitcode;
+    raw_string_ostream OS(Bitcode);
+    NaClWriteBitcodeToFile(M, OS);
+    OS.flush();
+  }
+
+  Triple TheTriple(Triple::normalize(PipelineTriple));
+  std::string Error;
+  const Target *TheTarget = TargetRegistry::lookupTarget("", TheTriple, Error);
+  if (!TheTarget) {
+    outs() << "Skipping ExpandI64 and JS emission: " << Error << "\n";
+    return;
+  }
+  std::unique_ptr<TargetMachine> Target(
+      TheTarget->createTargetMachine(TheTriple.getTriple(), "", "",
+                                     TargetOptions()));
+  M->setTargetTriple(TheTriple.getTriple());
+  if (const DataLayout *DL = Target->getDataLayout())
+    M->setDataLayout(DL);
+
+  {
+    TimingOperationBlock T("ExpandI64", InputSize);
+    PassManager PM;
+    PM.add(new DataLayoutPass(M));
+    PM.add(createExpandI64Pass());
+    PM.run(*M);
+  }
+
+  // The passes that pnacl-llc runs before the target's own passes, which
+  // include JSWriter.
+  {
+    TimingOperationBlock T("JS emission", InputSize);
+    std::string JS;
+    raw_string_ostream OS(JS);
+    formatted_raw_ostream FOS(OS);
+    PassManager PM;
+    PM.add(new DataLayoutPass(M));
+    PM.add(createAddPNaClExternalDeclsPass());
+    PM.add(createResolvePNaClIntrinsicsPass());
+    PM.add(new TargetLibraryInfo(TheTriple));
+    PM.add(createBackendCanonicalizePass());
+    Target->addAnalysisPasses(PM);
+    if (Target->addPassesToEmitFile(PM, FOS, TargetMachine::CGFT_AssemblyFile,
+                                    /* DisableVerify */ true))
+      report_fatal_error("Target does not support emitting assembly");
+    PM.run(*M);
+  }
+}
+
 void BenchmarkIRParsing() {
   outs() << "Benchmarking IR parsing...\n";
   ErrorOr<std::unique_ptr<MemoryBuffer>> ErrOrFile =
@@ -163,30 +403,22 @@ void BenchmarkIRParsing() {
   }
 
   // Simulate simple bitcode parsing. See DummyBitcodeParser for more details.
+  // The bitcode is all in memory, so the cursor loads it directly.
+  const uint8_t *BitcodePtr = BufPtr;
   {
     TimingOperationBlock T("Bitcode block parsing", BufSize);
-    NaClBitcodeHeader Header;
-
-    if (Header.Read(BufPtr, EndBufPtr)) {
-      report_fatal_error("Invalid PNaCl bitcode header");
-    }
-
-    if (!Header.IsSupported()) {
-      errs() << "Warning: " << Header.Unsupported() << "\n";
-    }
-
-    if (!Header.IsReadable()) {
-      report_fatal_error("Bitcode file is not readable");
-    }
+    readBitcodeHeader(BitcodePtr, EndBufPtr);
+    NaClBitstreamReader StreamFile(BitcodePtr, EndBufPtr);
+    parseBitcode(StreamFile);
+  }
 
-    NaClBitstreamReader StreamFile(BufPtr, EndBufPtr);
-    NaClBitstreamCursor Stream(StreamFile);
-    DummyBitcodeParser Parser(Stream);
-    while (!Stream.AtEndOfStream()) {
-      if (Parser.Parse()) {
-        report_fatal_error("Parsing failed");
-      }
-    }
+  // The same, reading through a StreamableMemoryObject a 32-bit word at a
+  // time, the way streamed bitcode is read.
+  {
+    TimingOperationBlock T("Bitcode block parsing (memory object)", BufSize);
+    NaClBitstreamReader StreamFile(
+        getNonStreamedMemoryObject(BitcodePtr, EndBufPtr));
+    parseBitcode(StreamFile);
   }
 
   // Running bitcode analysis (what bcanalyzer does).
@@ -199,16 +431,130 @@ void BenchmarkIRParsing() {
   }
 
   // Actual LLVM IR parsing and formation from the bitcode
+  std::unique_ptr<Module> M;
   {
     TimingOperationBlock T("LLVM IR parsing", BufSize);
     SMDiagnostic Err;
-    Module *M = NaClParseIRFile(InputFilename, PNaClFormat,
-                                Err, getGlobalContext());
+    M.reset(NaClParseIRFile(InputFilename, PNaClFormat,
+                            Err, getGlobalContext()));
 
     if (!M) {
       report_fatal_error("Unable to NaClParseIRFile");
     }
   }
+
+  // The same, with function blocks decoded on other threads.
+  for (unsigned i = 0; i < ReaderThreads.size(); ++i) {
+    unsigned NumThreads = ReaderThreads[i];
+    PNaClReaderThreads = NumThreads;
+    std::unique_ptr<Module> M;
+    {
+      TimingOperationBlock T("LLVM IR parsing (" + Twine(NumThreads).str() +
+                             " decoding threads)", BufSize);
+      SMDiagnostic Err;
+      M.reset(NaClParseIRFile(InputFilename, PNaClFormat, Err,
+                              getGlobalContext()));
+      if (!M)
+        report_fatal_error("Unable to NaClParseIRFile");
+    }
+  }
+  PNaClReaderThreads = 0;
+
+  BenchmarkPipeline(M.get(), BufSize);
+}
+
+/// Reads the whole object through Cache a word at a time, checking for the
+/// end before each word, as NaClBitstreamCursor does.
+static void *readStreamingCache(void *Arg) {
+  ThreadedStreamingCache *Cache = static_cast<ThreadedStreamingCache *>(Arg);
+  uint32_t Sum = 0;
+  uint8_t Word[4];
+  for (uint64_t Pos = 0; !Cache->isObjectEnd(Pos); Pos += sizeof(Word)) {
+    if (Cache->readBytes(Pos, sizeof(Word), Word))
+      break;
+    Sum ^= Word[0] | (Word[1] << 8) | (Word[2] << 16) | (Word[3] << 24);
+  }
+  return reinterpret_cast<void *>(static_cast<uintptr_t>(Sum));
+}
+
+/// Times how reading through ThreadedStreamingCache scales with the number of
+/// threads that share its streamer, as with pnacl-llc -split-module. The
+/// throughput is for the bytes read by all threads together.
+void BenchmarkStreamingCache() {
+  outs() << "Benchmarking streaming cache...\n";
+  for (unsigned i = 0; i < StreamingReaders.size(); ++i) {
+    unsigned NumReaders = StreamingReaders[i];
+    std::string StrError;
+    DataStreamer *Streamer = getDataFileStreamer(InputFilename, &StrError);
+    if (!Streamer)
+      report_fatal_error("Could not open input file: " + StrError);
+    StreamingMemoryObjectImpl StreamingObject(Streamer);
+    SharedStreamingCache Shared(&StreamingObject);
+    // Find the size up front, so that it is not part of the timing.
+    uint64_t Size = StreamingObject.getExtent();
+
+    std::vector<std::unique_ptr<ThreadedStreamingCache>> Caches;
+    for (unsigned j = 0; j < NumReaders; ++j)
+      Caches.emplace_back(new ThreadedStreamingCache(&Shared));
+    std::vector<pthread_t> Threads(NumReaders);
+    TimingOperationBlock T(Twine(NumReaders).str() + " readers",
+                           NumReaders * Size);
+    for (unsigned j = 0; j < NumReaders; ++j) {
+      if (pthread_create(&Threads[j], nullptr, readStreamingCache,
+                         Caches[j].get()))
+        report_fatal_error("Failed to create thread");
+    }
+    for (unsigned j = 0; j < NumReaders; ++j)
+      pthread_join(Threads[j], nullptr);
+  }
+}
+
+static void printSummary() {
+  outs() << "Summary of " << NumRuns << " runs:\n";
+  for (unsigned i = 0; i < AllResults.size(); ++i) {
+    const StageResults &R = AllResults[i];
+    outs() << "  " << R.Name << ": median "
+           << format("%.3lf", R.getMedian()) << " sec, variance "
+           << format("%.6lf", R.getVariance());
+    if (R.InputSize != 0)
+      outs() << format(" [%.3lf MB/sec]", R.getMBPerSec());
+    outs() << " [peak RSS " << R.PeakRSSKB << " KB]\n";
+  }
+}
+
+static void writeJSONString(raw_ostream &OS, StringRef S) {
+  OS << '"';
+  for (unsigned i = 0; i < S.size(); ++i) {
+    unsigned char C = S[i];
+    if (C == '"' || C == '\\')
+      OS << '\\' << C;
+    else if (C < 0x20)
+      OS << format("\\u%04x", C);
+    else
+      OS << C;
+  }
+  OS << '"';
+}
+
+/// Writes the measurements of all runs, for tracking them over time.
+static void writeJSON(raw_ostream &OS) {
+  OS << "{\n  \"input\": ";
+  writeJSONString(OS, InputFilename);
+  OS << ",\n  \"runs\": " << NumRuns << ",\n  \"stages\": [";
+  for (unsigned i = 0; i < AllResults.size(); ++i) {
+    const StageResults &R = AllResults[i];
+    OS << (i ? "," : "") << "\n    {\n      \"name\": ";
+    writeJSONString(OS, R.Name);
+    OS << ",\n      \"input_size\": " << R.InputSize
+       << ",\n      \"seconds\": [";
+    for (unsigned j = 0; j < R.Seconds.size(); ++j)
+      OS << (j ? ", " : "") << format("%.6lf", R.Seconds[j]);
+    OS << "],\n      \"median_seconds\": " << format("%.6lf", R.getMedian())
+       << ",\n      \"variance\": " << format("%.9lf", R.getVariance())
+       << ",\n      \"mb_per_sec\": " << format("%.3lf", R.getMBPerSec())
+       << ",\n      \"peak_rss_kb\": " << R.PeakRSSKB << "\n    }";
+  }
+  OS << "\n  ]\n}\n";
 }
 
 int main(int argc, char **argv) {
@@ -216,10 +562,29 @@ int main(int argc, char **argv) {
   PrettyStackTraceProgram X(argc, argv);
 
   llvm_shutdown_obj Y;  // Call llvm_shutdown() on exit.
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
   cl::ParseCommandLineOptions(argc, argv, "pnacl-benchmark\n");
 
   for (unsigned i = 0; i < NumRuns; i++) {
     BenchmarkIRParsing();
+    if (!StreamingReaders.empty())
+      BenchmarkStreamingCache();
+  }
+
+  if (NumRuns > 1)
+    printSummary();
+
+  if (!JSONOutputFilename.empty()) {
+    std::string ErrorInfo;
+    tool_output_file Out(JSONOutputFilename.c_str(), ErrorInfo,
+                         sys::fs::F_Text);
+    if (!ErrorInfo.empty()) {
+      errs() << ErrorInfo << "\n";
+      return 1;
+    }
+    writeJSON(Out.os());
+    Out.keep();
   }
 
   return 0;
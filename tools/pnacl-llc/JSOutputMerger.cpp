@@ -0,0 +1,416 @@
+//===- JSOutputMerger.cpp - Merge JS backend output of threads ------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Each thread's output has the module prologue (which every thread computes
+// the same way), the bodies of the functions that thread compiled, each
+// preceded by its position among the module's functions, the epilogue, and
+// line-based metadata. Function pointers to functions that the prologue did
+// not already put in a table are printed as #FI_sig_name#, and are numbered
+// here in the order of the merged output, as a single thread would have.
+// With -emscripten-finalize-function-tables, the #FM_sig# masks of indirect
+// calls are also filled in here, and the tables are printed as JS, since only
+// the merge knows the final tables.
+//
+//===----------------------------------------------------------------------===//
+
+#include "JSOutputMerger.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <set>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+
+const char StartMarker[] = "// EMSCRIPTEN_START_FUNCTIONS\n";
+const char FunctionMarker[] = "// EMSCRIPTEN_FUNCTION ";
+const char PostSetsMarker[] = "function runPostSets() {\n";
+const char MetadataMarker[] = "\n\n// EMSCRIPTEN_METADATA\n";
+const char PointerMarker[] = "#FI_";
+const char MaskMarker[] = "#FM_";
+const char EndFunctionsMarker[] = "// EMSCRIPTEN_END_FUNCTIONS\n\n";
+
+typedef std::vector<std::string> FunctionTable;
+typedef std::map<std::string, FunctionTable> FunctionTableMap;
+
+// The parts of one thread's output.
+struct ThreadOutput {
+  StringRef Prologue; // up to and including the start marker
+  StringRef Epilogue; // runPostSets and the memory initializer
+  std::vector<std::pair<unsigned, StringRef> > Functions; // ordinal, body
+  std::vector<std::pair<StringRef, StringRef> > Metadata; // kind, value
+};
+
+bool parseOutput(StringRef Text, ThreadOutput &Output, std::string &Error) {
+  size_t Start = Text.find(StartMarker);
+  size_t PostSets = Text.find(PostSetsMarker);
+  size_t Metadata = Text.find(MetadataMarker);
+  if (Start == StringRef::npos || PostSets == StringRef::npos ||
+      Metadata == StringRef::npos || Start > PostSets || PostSets > Metadata) {
+    Error = "JS output is not mergeable";
+    return false;
+  }
+  Start += strlen(StartMarker);
+  Output.Prologue = Text.substr(0, Start);
+  Output.Epilogue = Text.slice(PostSets, Metadata);
+
+  StringRef Functions = Text.slice(Start, PostSets);
+  while (!Functions.empty()) {
+    unsigned Ordinal;
+    size_t EndOfLine = Functions.find('\n');
+    if (!Functions.startswith(FunctionMarker) ||
+        EndOfLine == StringRef::npos ||
+        Functions.slice(strlen(FunctionMarker), EndOfLine)
+            .getAsInteger(10, Ordinal)) {
+      Error = "JS output has a function without an ordinal";
+      return false;
+    }
+    Functions = Functions.substr(EndOfLine + 1);
+    size_t Next = Functions.find(FunctionMarker);
+    Output.Functions.push_back(std::make_pair(Ordinal,
+                                              Functions.substr(0, Next)));
+    Functions = Functions.substr(Next);
+  }
+
+  StringRef Lines = Text.substr(Metadata + strlen(MetadataMarker));
+  while (!Lines.empty()) {
+    std::pair<StringRef, StringRef> Line = Lines.split('\n');
+    if (!Line.first.empty())
+      Output.Metadata.push_back(Line.first.split(' '));
+    Lines = Line.second;
+  }
+  return true;
+}
+
+// Numbers function pointers the way the JS backend's getFunctionIndex does.
+class FunctionIndexer {
+  FunctionTableMap &Tables;
+  std::map<std::string, unsigned> Indexes;
+  bool NoAliasing;
+  unsigned NextFunctionIndex;
+
+public:
+  FunctionIndexer(FunctionTableMap &Tables, bool NoAliasing,
+                  unsigned NextFunctionIndex)
+      : Tables(Tables), NoAliasing(NoAliasing),
+        NextFunctionIndex(NextFunctionIndex) {
+    for (FunctionTableMap::const_iterator I = Tables.begin(), E = Tables.end();
+         I != E; ++I) {
+      for (unsigned i = 0; i < I->second.size(); i++) {
+        if (I->second[i] != "0")
+          Indexes[I->second[i]] = i;
+      }
+    }
+  }
+
+  unsigned getIndex(const std::string &Sig, const std::string &Name) {
+    std::map<std::string, unsigned>::const_iterator I = Indexes.find(Name);
+    if (I != Indexes.end())
+      return I->second;
+    FunctionTable &Table = Tables[Sig];
+    if (NoAliasing) {
+      while (Table.size() < NextFunctionIndex) Table.push_back("0");
+    }
+    unsigned Index = Table.size();
+    Table.push_back(Name);
+    Indexes[Name] = Index;
+    if (NoAliasing)
+      NextFunctionIndex = Index + 1;
+    return Index;
+  }
+};
+
+// Pads each table to a power of two, as the JS backend does.
+void padTables(FunctionTableMap &Tables) {
+  for (FunctionTableMap::iterator I = Tables.begin(), E = Tables.end(); I != E;
+       ++I) {
+    FunctionTable &Table = I->second;
+    unsigned Size = 1;
+    while (Size < Table.size()) Size <<= 1;
+    while (Table.size() < Size) Table.push_back("0");
+  }
+}
+
+// Prints Body to OS, if OS is not null, numbering its function pointers with
+// Indexer. If Tables is not null, they are final, and the masks of indirect
+// calls are filled in with their sizes.
+bool printFunctionBody(StringRef Body, FunctionIndexer &Indexer,
+                       const FunctionTableMap *Tables, raw_ostream *OS,
+                       std::string &Error) {
+  while (1) {
+    size_t Pos = std::min(Body.find(PointerMarker),
+                          Tables ? Body.find(MaskMarker) : StringRef::npos);
+    if (Pos == StringRef::npos)
+      break;
+    if (OS)
+      *OS << Body.substr(0, Pos);
+    bool IsMask = Body.substr(Pos).startswith(MaskMarker);
+    Body = Body.substr(Pos + strlen(PointerMarker));
+    size_t End = Body.find('#');
+    if (IsMask) {
+      FunctionTableMap::const_iterator Table;
+      if (End == StringRef::npos ||
+          (Table = Tables->find(Body.substr(0, End))) == Tables->end()) {
+        Error = "JS output has a malformed function table mask";
+        return false;
+      }
+      if (OS)
+        *OS << (Table->second.size() - 1);
+    } else {
+      size_t Separator = Body.find('_');
+      if (End == StringRef::npos || Separator > End) {
+        Error = "JS output has a malformed function pointer";
+        return false;
+      }
+      unsigned Index = Indexer.getIndex(Body.substr(0, Separator).str(),
+                                        Body.slice(Separator + 1, End).str());
+      if (OS)
+        *OS << Index;
+    }
+    Body = Body.substr(End + 1);
+  }
+  if (OS)
+    *OS << Body;
+  return true;
+}
+
+// Prints the strings in Items, quoted and separated by commas.
+template <class T>
+void printQuotedList(raw_ostream &OS, const T &Items) {
+  bool First = true;
+  for (typename T::const_iterator I = Items.begin(), E = Items.end(); I != E;
+       ++I) {
+    if (!First)
+      OS << ", ";
+    First = false;
+    OS << "\"" << *I << "\"";
+  }
+}
+
+} // end anonymous namespace
+
+bool llvm::mergeJSOutputs(ArrayRef<std::string> Outputs, raw_ostream &OS,
+                          std::string &Error) {
+  std::vector<ThreadOutput> Parsed(Outputs.size());
+  for (unsigned i = 0; i < Outputs.size(); i++) {
+    if (!parseOutput(Outputs[i], Parsed[i], Error))
+      return false;
+  }
+  if (Parsed.empty()) {
+    Error = "no JS output to merge";
+    return false;
+  }
+
+  std::map<unsigned, StringRef> Functions;
+  std::map<unsigned, std::string> ModuleDeclares; // by position in the module
+  std::set<std::string> LibraryDeclares;
+  std::map<std::string, std::string> Redirects;
+  std::set<std::string> Externs;
+  FunctionTableMap Tables;
+  bool NoAliasing = false;
+  unsigned NextFunctionIndex = 0;
+  std::string CantValidate;
+  bool UsesSIMD = false;
+  bool UsesTls = false;
+  bool FinalizeTables = false;
+  std::vector<std::string> Implemented, Initializers, Exports;
+  std::vector<std::pair<std::string, std::string> > NamedGlobals;
+
+  for (unsigned i = 0; i < Parsed.size(); i++) {
+    for (unsigned j = 0; j < Parsed[i].Functions.size(); j++)
+      Functions.insert(Parsed[i].Functions[j]);
+
+    for (unsigned j = 0; j < Parsed[i].Metadata.size(); j++) {
+      StringRef Kind = Parsed[i].Metadata[j].first;
+      StringRef Value = Parsed[i].Metadata[j].second;
+      std::pair<StringRef, StringRef> Pair = Value.split(' ');
+      if (Kind == "declare") {
+        unsigned Position;
+        if (Pair.first.getAsInteger(10, Position)) {
+          Error = "JS output has a malformed declare";
+          return false;
+        }
+        ModuleDeclares[Position] = Pair.second.str();
+      } else if (Kind == "libraryDeclare") {
+        LibraryDeclares.insert(Value);
+      } else if (Kind == "redirect") {
+        Redirects[Pair.first] = Pair.second.str();
+      } else if (Kind == "extern") {
+        Externs.insert(Value);
+      } else if (Kind == "table") {
+        // Tables that appear in several outputs were created the same way.
+        if (!Tables.count(Pair.first)) {
+          FunctionTable &Table = Tables[Pair.first];
+          SmallVector<StringRef, 16> Entries;
+          SplitString(Pair.second, Entries, ",");
+          Table.assign(Entries.begin(), Entries.end());
+        }
+      } else if (Kind == "nextFunctionIndex") {
+        NoAliasing = true;
+        Value.getAsInteger(10, NextFunctionIndex);
+      } else if (Kind == "cantValidate") {
+        if (CantValidate.empty())
+          CantValidate = Value.str();
+      } else if (Kind == "simd") {
+        UsesSIMD = true;
+      } else if (Kind == "tls") {
+        UsesTls = true;
+      } else if (Kind == "finalizeTables") {
+        FinalizeTables = true;
+      } else if (i > 0) {
+        // The rest comes from the prologue, the same in every output.
+        continue;
+      } else if (Kind == "implemented") {
+        Implemented.push_back(Value);
+      } else if (Kind == "initializer") {
+        Initializers.push_back(Value);
+      } else if (Kind == "export") {
+        Exports.push_back(Value);
+      } else if (Kind == "namedGlobal") {
+        NamedGlobals.push_back(std::make_pair(Pair.first.str(),
+                                              Pair.second.str()));
+      } else {
+        Error = "JS output has unknown metadata: " + Kind.str();
+        return false;
+      }
+    }
+  }
+
+  OS << Parsed[0].Prologue;
+  FunctionIndexer Indexer(Tables, NoAliasing, NextFunctionIndex);
+  if (FinalizeTables) {
+    // The first function may need the masks, so number all the function
+    // pointers first.
+    for (std::map<unsigned, StringRef>::const_iterator I = Functions.begin(),
+         E = Functions.end(); I != E; ++I) {
+      if (!printFunctionBody(I->second, Indexer, NULL, NULL, Error))
+        return false;
+    }
+    padTables(Tables);
+  }
+  for (std::map<unsigned, StringRef>::const_iterator I = Functions.begin(),
+       E = Functions.end(); I != E; ++I) {
+    if (!printFunctionBody(I->second, Indexer,
+                           FinalizeTables ? &Tables : NULL, &OS, Error))
+      return false;
+  }
+  StringRef Epilogue = Parsed[0].Epilogue;
+  if (FinalizeTables) {
+    // The same JS as JSWriter::printFunctionTables, after the functions.
+    size_t EndFunctions = Epilogue.find(EndFunctionsMarker);
+    if (EndFunctions == StringRef::npos) {
+      Error = "JS output has no end of functions";
+      return false;
+    }
+    EndFunctions += strlen(EndFunctionsMarker);
+    OS << Epilogue.substr(0, EndFunctions);
+    OS << "// EMSCRIPTEN_START_TABLES\n";
+    for (FunctionTableMap::const_iterator I = Tables.begin(), E = Tables.end();
+         I != E; ++I) {
+      OS << "var FUNCTION_TABLE_" << I->first << " = [";
+      const FunctionTable &Table = I->second;
+      for (unsigned i = 0; i < Table.size(); i++) {
+        OS << Table[i];
+        if (i < Table.size() - 1)
+          OS << ",";
+      }
+      OS << "];\n";
+    }
+    OS << "// EMSCRIPTEN_END_TABLES\n\n";
+    Epilogue = Epilogue.substr(EndFunctions);
+  }
+  OS << Epilogue;
+
+  // The same JSON as JSWriter::printModuleEpilogue.
+  OS << MetadataMarker;
+  OS << "{\n";
+
+  OS << "\"declares\": [";
+  std::vector<std::string> Declares;
+  for (std::map<unsigned, std::string>::const_iterator
+       I = ModuleDeclares.begin(), E = ModuleDeclares.end(); I != E; ++I)
+    Declares.push_back(I->second);
+  Declares.insert(Declares.end(), LibraryDeclares.begin(),
+                  LibraryDeclares.end());
+  printQuotedList(OS, Declares);
+  OS << "],";
+
+  OS << "\"redirects\": {";
+  bool First = true;
+  for (std::map<std::string, std::string>::const_iterator
+       I = Redirects.begin(), E = Redirects.end(); I != E; ++I) {
+    if (!First)
+      OS << ", ";
+    First = false;
+    OS << "\"_" << I->first << "\": \"" << I->second << "\"";
+  }
+  OS << "},";
+
+  OS << "\"externs\": [";
+  printQuotedList(OS, Externs);
+  OS << "],";
+
+  OS << "\"implementedFunctions\": [";
+  printQuotedList(OS, Implemented);
+  OS << "],";
+
+  OS << "\"tables\": {";
+  // With finalized tables, the tables were printed as JS instead.
+  unsigned Num = FinalizeTables ? 0 : Tables.size();
+  padTables(Tables);
+  for (FunctionTableMap::iterator I = Tables.begin(), E = Tables.end();
+       Num > 0 && I != E; ++I) {
+    OS << "  \"" << I->first << "\": \"var FUNCTION_TABLE_" << I->first
+       << " = [";
+    FunctionTable &Table = I->second;
+    for (unsigned i = 0; i < Table.size(); i++) {
+      OS << Table[i];
+      if (i < Table.size() - 1)
+        OS << ",";
+    }
+    OS << "];\"";
+    if (--Num > 0)
+      OS << ",";
+    OS << "\n";
+  }
+  OS << "},";
+
+  OS << "\"initializers\": [";
+  printQuotedList(OS, Initializers);
+  OS << "],";
+
+  OS << "\"exports\": [";
+  printQuotedList(OS, Exports);
+  OS << "],";
+
+  OS << "\"cantValidate\": \"" << CantValidate << "\",";
+
+  OS << "\"simd\": " << (UsesSIMD ? "1" : "0") << ",";
+
+  OS << "\"tls\": " << (UsesTls ? "1" : "0") << ",";
+
+  OS << "\"namedGlobals\": {";
+  First = true;
+  for (unsigned i = 0; i < NamedGlobals.size(); i++) {
+    if (!First)
+      OS << ", ";
+    First = false;
+    OS << "\"_" << NamedGlobals[i].first << "\": \"" << NamedGlobals[i].second
+       << "\"";
+  }
+  OS << "}";
+
+  OS << "\n}\n";
+  return true;
+}
@@ -0,0 +1,30 @@
+//===- JSOutputMerger.h - Merge JS backend output of threads ----*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef JSOUTPUTMERGER_H
+#define JSOUTPUTMERGER_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/raw_ostream.h"
+#include <string>
+
+namespace llvm {
+
+// Merges the output of the JS backend's -emscripten-mergeable-output mode,
+// one per thread of -split-module, into what the JS backend prints for the
+// whole module: functions in module order, function pointers numbered in
+// that order, and the metadata of all threads combined. The result does not
+// depend on how the functions were divided between the threads. Returns
+// false and sets Error if the outputs are malformed.
+bool mergeJSOutputs(ArrayRef<std::string> Outputs, raw_ostream &OS,
+                    std::string &Error);
+
+} // end namespace llvm
+
+#endif
@@ -10,10 +10,17 @@
 #ifndef THREADEDFUNCTIONQUEUE_H
 #define THREADEDFUNCTIONQUEUE_H
 
+#include <algorithm>
+#include <deque>
 #include <limits>
+#include <vector>
 
+#include "llvm/ADT/ArrayRef.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Mutex.h"
+#include "llvm/Support/raw_ostream.h"
 
 namespace llvm {
 
@@ -22,12 +29,20 @@ namespace llvm {
 // actually use a queue data structure and instead uses a number which
 // tracks the minimum unassigned function ID, expecting each thread
 // to have the same view of function IDs.
+//
+// Given an estimate of the cost of each function, it can instead hand out
+// functions largest first, from a queue per thread that other threads steal
+// from when theirs runs dry (see GrabFunctionCostAware). It also keeps
+// per-thread statistics of how long threads were busy compiling functions.
 class ThreadedFunctionQueue {
  public:
   ThreadedFunctionQueue(Module *mod, unsigned NumThreads)
       : NumThreads(NumThreads),
         NumFunctions(0),
-        CurrentFunction(0) {
+        CurrentFunction(0),
+        Queues(NumThreads),
+        QueuedCosts(NumThreads),
+        Stats(NumThreads) {
     assert(NumThreads > 0);
     size_t Size = 0;
     for (Module::iterator I = mod->begin(), E = mod->end(); I != E; ++I) {
@@ -97,16 +112,144 @@ class ThreadedFunctionQueue {
     return std::max(1, std::min(8, DynamicChunkSize));
   }
 
+  // Sets the estimated cost of each function with a body, in module order,
+  // and divides the functions between the threads for GrabFunctionCostAware:
+  // largest first, each to the thread with the least cost so far. Returns
+  // false, leaving the queue unchanged, if Costs does not have one cost for
+  // each function.
+  bool SetCosts(ArrayRef<uint64_t> FunctionCosts) {
+    if (FunctionCosts.size() != NumFunctions)
+      return false;
+    Costs.assign(FunctionCosts.begin(), FunctionCosts.end());
+    std::vector<unsigned> BySize(NumFunctions);
+    for (unsigned i = 0; i < NumFunctions; ++i)
+      BySize[i] = i;
+    // Ties go in module order, so that the division is deterministic.
+    std::stable_sort(BySize.begin(), BySize.end(), CostGreater(Costs));
+    for (unsigned i = 0; i < NumFunctions; ++i) {
+      unsigned Thread = std::min_element(QueuedCosts.begin(),
+                                         QueuedCosts.end()) -
+                        QueuedCosts.begin();
+      Queues[Thread].push_back(BySize[i]);
+      QueuedCosts[Thread] += Costs[BySize[i]];
+    }
+    return true;
+  }
+
+  bool HasCosts() const { return !Costs.empty(); }
+
+  // Assign functions between threads by their costs, after SetCosts.
+  // Returns true and sets FuncIndex to the largest function left in the
+  // calling thread's queue. If that queue is empty, steals the smallest
+  // function from the thread with the most cost left, which is the one most
+  // likely to finish last. Returns false when no functions are left.
+  //
+  // Functions are handed out in decreasing order of cost rather than in
+  // module order, so with streaming bitcode a thread may wait for the bytes
+  // of its next function while earlier ones are still arriving. This is
+  // meant for input that is already all there.
+  bool GrabFunctionCostAware(unsigned ThreadIndex, unsigned &FuncIndex) {
+    assert(ThreadIndex < NumThreads && HasCosts());
+    // Each grab compiles a whole function, so one lock is no bottleneck.
+    sys::ScopedLock L(QueueLock);
+    unsigned From = ThreadIndex;
+    if (Queues[From].empty()) {
+      for (unsigned i = 0; i < NumThreads; ++i) {
+        if (!Queues[i].empty() &&
+            (Queues[From].empty() || QueuedCosts[i] > QueuedCosts[From]))
+          From = i;
+      }
+      if (Queues[From].empty())
+        return false;
+      FuncIndex = Queues[From].back();
+      Queues[From].pop_back();
+      ++Stats[ThreadIndex].Stolen;
+    } else {
+      FuncIndex = Queues[From].front();
+      Queues[From].pop_front();
+    }
+    QueuedCosts[From] -= Costs[FuncIndex];
+    return true;
+  }
+
+  // Records that ThreadIndex spent Seconds compiling function FuncIndex.
+  // Each thread only touches its own statistics, so this needs no lock.
+  void RecordFunction(unsigned ThreadIndex, unsigned FuncIndex,
+                      double Seconds) {
+    ThreadStats &S = Stats[ThreadIndex];
+    ++S.Functions;
+    if (HasCosts())
+      S.Cost += Costs[FuncIndex];
+    S.BusySeconds += Seconds;
+  }
+
+  // Records the wall clock times at which ThreadIndex started and finished.
+  void RecordThreadSpan(unsigned ThreadIndex, double Start, double End) {
+    Stats[ThreadIndex].Start = Start;
+    Stats[ThreadIndex].End = End;
+  }
+
+  // Prints how long each thread was busy compiling functions, and how long
+  // it was idle during the time from the first thread starting to the last
+  // thread finishing (including setup and waiting for other threads).
+  void PrintStats(raw_ostream &OS) const {
+    double Start = Stats[0].Start, End = Stats[0].End;
+    for (unsigned i = 1; i < NumThreads; ++i) {
+      Start = std::min(Start, Stats[i].Start);
+      End = std::max(End, Stats[i].End);
+    }
+    double Busy = 0;
+    for (unsigned i = 0; i < NumThreads; ++i) {
+      const ThreadStats &S = Stats[i];
+      OS << "thread " << i << ": " << S.Functions << " functions";
+      if (HasCosts())
+        OS << " (" << S.Stolen << " stolen), cost " << S.Cost;
+      OS << format(", busy %.3lf sec, idle %.3lf sec\n", S.BusySeconds,
+                   (End - Start) - S.BusySeconds);
+      Busy += S.BusySeconds;
+    }
+    OS << format("total: %.3lf sec, %.1lf%% of thread time busy\n",
+                 End - Start,
+                 End > Start ? 100 * Busy / ((End - Start) * NumThreads) : 0);
+  }
+
   // Total number of functions with bodies that should be processed.
   unsigned Size() const {
     return NumFunctions;
   }
 
  private:
+  struct ThreadStats {
+    ThreadStats()
+        : Functions(0), Stolen(0), Cost(0), BusySeconds(0), Start(0),
+          End(0) {}
+    unsigned Functions;
+    unsigned Stolen;
+    uint64_t Cost;
+    double BusySeconds;
+    double Start, End;
+  };
+
+  struct CostGreater {
+    explicit CostGreater(ArrayRef<uint64_t> Costs) : Costs(Costs) {}
+    bool operator()(unsigned A, unsigned B) const {
+      return Costs[A] > Costs[B];
+    }
+    ArrayRef<uint64_t> Costs;
+  };
+
   const unsigned NumThreads;
   unsigned NumFunctions;
   volatile unsigned CurrentFunction;
 
+  // Used by GrabFunctionCostAware.
+  std::vector<uint64_t> Costs;
+  std::vector<std::deque<unsigned> > Queues; // function indices by cost
+  std::vector<uint64_t> QueuedCosts;         // total cost in each queue
+  sys::Mutex QueueLock;
+
+  std::vector<ThreadStats> Stats;
+
   ThreadedFunctionQueue(
       const ThreadedFunctionQueue&) LLVM_DELETED_FUNCTION;
   void operator=(const ThreadedFunctionQueue&) LLVM_DELETED_FUNCTION;
@@ -41,13 +41,15 @@
 #include "llvm/Support/StreamableMemoryObject.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadedStreamingCache.h"
+#include "llvm/Support/Timer.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Target/TargetLibraryInfo.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/NaCl.h"
 
+#include "JSOutputMerger.h"
 #include "ThreadedFunctionQueue.h"
-#include "ThreadedStreamingCache.h"
 
 #include <pthread.h>
 #include <memory>
@@ -141,7 +143,8 @@ SplitModuleCount("split-module",
 
 enum SplitModuleSchedulerKind {
   SplitModuleDynamic,
-  SplitModuleStatic
+  SplitModuleStatic,
+  SplitModuleCostAware
 };
 
 static cl::opt<SplitModuleSchedulerKind>
@@ -153,9 +156,19 @@ SplitModuleSched(
                    "Dynamic thread scheduling (default)"),
         clEnumValN(SplitModuleStatic, "static",
                    "Static thread scheduling"),
+        clEnumValN(SplitModuleCostAware, "cost",
+                   "Largest functions first, by bitcode size, with work "
+                   "stealing (falls back to dynamic if the sizes are not "
+                   "known up front)"),
         clEnumValEnd),
     cl::init(SplitModuleDynamic));
 
+static cl::opt<bool>
+SplitModuleStats("split-module-stats",
+                 cl::desc("Print how long each thread was busy compiling "
+                          "functions and how long it was idle"),
+                 cl::init(false));
+
 /// Compile the module provided to pnacl-llc. The file name for reading the
 /// module and other options are taken from globals populated by command-line
 /// option parsing.
@@ -320,7 +333,7 @@ static void CheckABIVerifyErrors(PNaClABIErrorReporter &Reporter,
 }
 
 static Module* getModule(StringRef ProgramName, LLVMContext &Context,
-                         StreamingMemoryObject *StreamingObject) {
+                         SharedStreamingCache *StreamingCache) {
   Module *M = nullptr;
   SMDiagnostic Err;
   if (LazyBitcode) {
@@ -328,11 +341,11 @@ static Module* getModule(StringRef ProgramName, LLVMContext &Context,
     if (InputFileFormat == PNaClFormat) {
       M = getNaClStreamedBitcodeModule(
           InputFilename,
-          new ThreadedStreamingCache(StreamingObject), Context, &StrError);
+          new ThreadedStreamingCache(StreamingCache), Context, &StrError);
     } else if (InputFileFormat == LLVMFormat) {
       M = getStreamedBitcodeModule(
           InputFilename,
-          new ThreadedStreamingCache(StreamingObject), Context, &StrError);
+          new ThreadedStreamingCache(StreamingCache), Context, &StrError);
     } else {
       llvm_unreachable("Unknown bitcode format");
     }
@@ -364,6 +377,36 @@ ExternalizeAll("externalize",
                cl::desc("Externalize all symbols"),
                cl::init(false));
 
+// Names the unnamed functions and globals the same way in the module of each
+// thread. This relies on LLVM's consistent auto-generation of names, we could
+// maybe do our own in case something changes there.
+static void nameUnnamedGlobalValues(Module *mod) {
+  for (Module::iterator I = mod->begin(), E = mod->end(); I != E; ++I) {
+    if (!I->hasName())
+      I->setName("Function");
+  }
+  for (Module::global_iterator GI = mod->global_begin(),
+       GE = mod->global_end();
+       GI != GE; ++GI) {
+    if (!GI->hasName())
+      GI->setName("Global");
+  }
+}
+
+// Compiles one function with the lazy FunctionPassManager, and drops its
+// body afterwards. FuncIndex counts functions with bodies, as the queue does.
+static void compileFunction(FunctionPassManager &FPM, Function &F,
+                            PNaClABIErrorReporter &ABIErrorReporter,
+                            ThreadedFunctionQueue *FuncQueue,
+                            unsigned ModuleIndex, unsigned FuncIndex) {
+  double Start = TimeRecord::getCurrentTime(true).getWallTime();
+  FPM.run(F);
+  CheckABIVerifyErrors(ABIErrorReporter, "Function " + F.getName());
+  F.Dematerialize();
+  double End = TimeRecord::getCurrentTime(false).getWallTime();
+  FuncQueue->RecordFunction(ModuleIndex, FuncIndex, End - Start);
+}
+
 static int runCompilePasses(Module *mod,
                             unsigned ModuleIndex,
                             ThreadedFunctionQueue *FuncQueue,
@@ -373,21 +416,22 @@ static int runCompilePasses(Module *mod,
                             formatted_raw_ostream &FOS){
   PNaClABIErrorReporter ABIErrorReporter;
 
-  if (SplitModuleCount > 1 || ExternalizeAll) {
+  if (TheTriple.getArch() == Triple::asmjs) {
+    // The JS output of the threads is merged as text, so the functions and
+    // globals only need the same names in every thread. There is no linking
+    // to do, and every thread needs the global initializers to lay out
+    // memory the same way.
+    nameUnnamedGlobalValues(mod);
+  } else if (SplitModuleCount > 1 || ExternalizeAll) {
     // Add function and global names, and give them external linkage.
-    // This relies on LLVM's consistent auto-generation of names, we could
-    // maybe do our own in case something changes there.
+    nameUnnamedGlobalValues(mod);
     for (Module::iterator I = mod->begin(), E = mod->end(); I != E; ++I) {
-      if (!I->hasName())
-        I->setName("Function");
       if (I->hasInternalLinkage())
         I->setLinkage(GlobalValue::ExternalLinkage);
     }
     for (Module::global_iterator GI = mod->global_begin(),
          GE = mod->global_end();
          GI != GE; ++GI) {
-      if (!GI->hasName())
-        GI->setName("Global");
       if (GI->hasInternalLinkage())
         GI->setLinkage(GlobalValue::ExternalLinkage);
     }
@@ -459,17 +503,20 @@ static int runCompilePasses(Module *mod,
     FPM->doInitialization();
     unsigned FuncIndex = 0;
     switch (SplitModuleSched) {
-    case SplitModuleStatic:
+    case SplitModuleStatic: {
+      unsigned BodyIndex = 0;
       for (Module::iterator I = mod->begin(), E = mod->end(); I != E; ++I) {
-        if (FuncQueue->GrabFunctionStatic(FuncIndex, ModuleIndex)) {
-          FPM->run(*I);
-          CheckABIVerifyErrors(ABIErrorReporter, "Function " + I->getName());
-          I->Dematerialize();
-        }
+        bool HasBody = I->isMaterializable() || !I->isDeclaration();
+        if (HasBody && FuncQueue->GrabFunctionStatic(FuncIndex, ModuleIndex))
+          compileFunction(*FPM, *I, ABIErrorReporter, FuncQueue, ModuleIndex,
+                          BodyIndex);
+        if (HasBody)
+          ++BodyIndex;
         ++FuncIndex;
       }
       break;
-    case SplitModuleDynamic:
+    }
+    case SplitModuleDynamic: {
       unsigned ChunkSize = 0;
       unsigned NumFunctions = FuncQueue->Size();
       Module::iterator I = mod->begin();
@@ -484,9 +531,8 @@ static int runCompilePasses(Module *mod,
               ++I;
               continue;
             }
-            FPM->run(*I);
-            CheckABIVerifyErrors(ABIErrorReporter, "Function " + I->getName());
-            I->Dematerialize();
+            compileFunction(*FPM, *I, ABIErrorReporter, FuncQueue,
+                            ModuleIndex, FuncIndex);
             ++FuncIndex;
             ++I;
           }
@@ -503,6 +549,21 @@ static int runCompilePasses(Module *mod,
       }
       break;
     }
+    case SplitModuleCostAware: {
+      // Functions come out of order, so index the ones with bodies.
+      std::vector<Function *> Bodies;
+      for (Module::iterator I = mod->begin(), E = mod->end(); I != E; ++I) {
+        if (I->isMaterializable() || !I->isDeclaration())
+          Bodies.push_back(I);
+      }
+      if (Bodies.size() != FuncQueue->Size())
+        report_fatal_error("Function count mismatch between threads");
+      while (FuncQueue->GrabFunctionCostAware(ModuleIndex, FuncIndex))
+        compileFunction(*FPM, *Bodies[FuncIndex], ABIErrorReporter, FuncQueue,
+                        ModuleIndex, FuncIndex);
+      break;
+    }
+    }
     FPM->doFinalization();
   } else
     static_cast<PassManager *>(PM.get())->run(*mod);
@@ -517,9 +578,10 @@ static int compileSplitModule(const TargetOptions &Options,
                               CodeGenOpt::Level OLvl,
                               const StringRef &ProgramName,
                               Module *GlobalModule,
-                              StreamingMemoryObject *StreamingObject,
+                              SharedStreamingCache *StreamingCache,
                               unsigned ModuleIndex,
-                              ThreadedFunctionQueue *FuncQueue) {
+                              ThreadedFunctionQueue *FuncQueue,
+                              std::string *JSOutput) {
   std::auto_ptr<TargetMachine>
     target(TheTarget->createTargetMachine(TheTriple.getTriple(),
                                           MCPU, FeaturesStr, Options,
@@ -541,7 +603,7 @@ static int compileSplitModule(const TargetOptions &Options,
     mod = GlobalModule;
   } else {
     C.reset(new LLVMContext());
-    mod = getModule(ProgramName, *C, StreamingObject);
+    mod = getModule(ProgramName, *C, StreamingCache);
     if (!mod)
       return 1;
     M.reset(mod);
@@ -557,6 +619,20 @@ static int compileSplitModule(const TargetOptions &Options,
 
   mod->setTargetTriple(Triple::normalize(UserDefinedTriple));
 
+  if (JSOutput) {
+    // Merged with the output of the other threads by compileModule.
+    raw_string_ostream ROS(*JSOutput);
+    formatted_raw_ostream FOS(ROS);
+    int ret = runCompilePasses(mod, ModuleIndex, FuncQueue,
+                               TheTriple, Target, ProgramName,
+                               FOS);
+    if (ret)
+      return ret;
+    FOS.flush();
+    ROS.flush();
+    return 0;
+  }
+
   {
 #if !defined(__native_client__)
       // Figure out where we are going to send the output.
@@ -598,14 +674,16 @@ struct ThreadData {
   CodeGenOpt::Level OLvl;
   std::string ProgramName;
   Module *GlobalModule;
-  StreamingMemoryObject *StreamingObject;
+  SharedStreamingCache *StreamingCache;
   unsigned ModuleIndex;
   ThreadedFunctionQueue *FuncQueue;
+  std::string *JSOutput;
 };
 
 
 static void *runCompileThread(void *arg) {
   struct ThreadData *Data = static_cast<ThreadData *>(arg);
+  double Start = TimeRecord::getCurrentTime(true).getWallTime();
   int ret = compileSplitModule(*Data->Options,
                                *Data->TheTriple,
                                Data->TheTarget,
@@ -613,12 +691,58 @@ static void *runCompileThread(void *arg) {
                                Data->OLvl,
                                Data->ProgramName,
                                Data->GlobalModule,
-                               Data->StreamingObject,
+                               Data->StreamingCache,
                                Data->ModuleIndex,
-                               Data->FuncQueue);
+                               Data->FuncQueue,
+                               Data->JSOutput);
+  Data->FuncQueue->RecordThreadSpan(
+      Data->ModuleIndex, Start, TimeRecord::getCurrentTime(false).getWallTime());
   return reinterpret_cast<void *>(static_cast<intptr_t>(ret));
 }
 
+// Sets Costs to the size in bits of the body of each function with one, in
+// module order, from the function body offsets the reader of the lazily
+// loaded module M keeps. Returns false if the reader cannot find them.
+static bool estimateFunctionCosts(Module *M, std::vector<uint64_t> &Costs) {
+  if (InputFileFormat == PNaClFormat)
+    return !getNaClLazyFunctionBodySizes(M, Costs);
+  return !getLazyFunctionBodySizes(M, Costs);
+}
+
+// Asks the JS backend for output that mergeJSOutputs can merge.
+static void enableMergeableJSOutput() {
+  StringMap<cl::Option *> Options;
+  cl::getRegisteredOptions(Options);
+  cl::Option *Mergeable = Options.lookup("emscripten-mergeable-output");
+  if (!Mergeable)
+    report_fatal_error("JS backend option emscripten-mergeable-output missing");
+  if (Mergeable->getNumOccurrences() == 0)
+    Mergeable->addOccurrence(0, Mergeable->ArgStr, "true");
+}
+
+// Writes the merged output of the JS backend in all threads.
+static int writeMergedJSOutput(const Target *TheTarget,
+                               const Triple &TheTriple,
+                               ArrayRef<std::string> JSOutputs) {
+#if !defined(__native_client__)
+  std::unique_ptr<tool_output_file> Out
+      (GetOutputStream(TheTarget->getName(), TheTriple.getOS(),
+                       OutputFilename));
+  if (!Out) return 1;
+  raw_ostream &OS = Out->os();
+#else
+  raw_fd_ostream OS(getObjectFileFD(0), true, sys::fs::F_None);
+#endif
+  std::string Error;
+  if (!mergeJSOutputs(JSOutputs, OS, Error))
+    report_fatal_error("Failed to merge JS output: " + Error);
+#if !defined(__native_client__)
+  // Declare success.
+  Out->keep();
+#endif
+  return 0;
+}
+
 static int compileModule(StringRef ProgramName) {
   // Use a new context instead of the global context for the main module. It must
   // outlive the module object, declared below. We do this because
@@ -631,6 +755,7 @@ static int compileModule(StringRef ProgramName) {
   Triple TheTriple;
   PNaClABIErrorReporter ABIErrorReporter;
   std::unique_ptr<StreamingMemoryObject> StreamingObject;
+  std::unique_ptr<SharedStreamingCache> StreamingCache;
 
   if (!MainContext) return 1;
 
@@ -650,7 +775,9 @@ static int compileModule(StringRef ProgramName) {
     StreamingObject.reset(new StreamingMemoryObjectImpl(FileStreamer));
   }
 #endif
-  mod.reset(getModule(ProgramName, *MainContext.get(), StreamingObject.get()));
+  if (StreamingObject)
+    StreamingCache.reset(new SharedStreamingCache(StreamingObject.get()));
+  mod.reset(getModule(ProgramName, *MainContext.get(), StreamingCache.get()));
 
   if (!mod) return 1;
 
@@ -718,12 +845,37 @@ static int compileModule(StringRef ProgramName) {
   SmallVector<ThreadData, 4> ThreadDatas(SplitModuleCount);
   ThreadedFunctionQueue FuncQueue(mod.get(), SplitModuleCount);
 
+  // The JS backend emits a whole program rather than an object to link, so
+  // each thread prints its functions to a buffer, and the buffers are merged
+  // into one output. This is also done with one thread, so that the output
+  // is the same however many threads there are.
+  bool MergeJS = TheTriple.getArch() == Triple::asmjs;
+  std::vector<std::string> JSOutputs(MergeJS ? SplitModuleCount : 0);
+  if (MergeJS)
+    enableMergeableJSOutput();
+
   if (SplitModuleCount == 1) {
     // No need for dynamic scheduling with one thread.
     SplitModuleSched = SplitModuleStatic;
-    return compileSplitModule(Options, TheTriple, TheTarget, FeaturesStr,
-                              OLvl, ProgramName, mod.get(), nullptr, 0,
-                              &FuncQueue);
+    double Start = TimeRecord::getCurrentTime(true).getWallTime();
+    int ret = compileSplitModule(Options, TheTriple, TheTarget, FeaturesStr,
+                                 OLvl, ProgramName, mod.get(), nullptr, 0,
+                                 &FuncQueue,
+                                 MergeJS ? &JSOutputs[0] : nullptr);
+    FuncQueue.RecordThreadSpan(0, Start,
+                               TimeRecord::getCurrentTime(false).getWallTime());
+    if (SplitModuleStats)
+      FuncQueue.PrintStats(errs());
+    if (ret || !MergeJS)
+      return ret;
+    return writeMergedJSOutput(TheTarget, TheTriple, JSOutputs);
+  }
+
+  if (SplitModuleSched == SplitModuleCostAware) {
+    std::vector<uint64_t> Costs;
+    if (!LazyBitcode || !estimateFunctionCosts(mod.get(), Costs) ||
+        !FuncQueue.SetCosts(Costs))
+      SplitModuleSched = SplitModuleDynamic;
   }
 
   for(unsigned ModuleIndex = 0; ModuleIndex < SplitModuleCount; ++ModuleIndex) {
@@ -734,9 +886,11 @@ static int compileModule(StringRef ProgramName) {
     ThreadDatas[ModuleIndex].OLvl = OLvl;
     ThreadDatas[ModuleIndex].ProgramName = ProgramName.str();
     ThreadDatas[ModuleIndex].GlobalModule = mod.get();
-    ThreadDatas[ModuleIndex].StreamingObject = StreamingObject.get();
+    ThreadDatas[ModuleIndex].StreamingCache = StreamingCache.get();
     ThreadDatas[ModuleIndex].ModuleIndex = ModuleIndex;
     ThreadDatas[ModuleIndex].FuncQueue = &FuncQueue;
+    ThreadDatas[ModuleIndex].JSOutput =
+        MergeJS ? &JSOutputs[ModuleIndex] : nullptr;
     if (pthread_create(&Pthreads[ModuleIndex], nullptr, runCompileThread,
                         &ThreadDatas[ModuleIndex])) {
       report_fatal_error("Failed to create thread");
@@ -750,6 +904,10 @@ static int compileModule(StringRef ProgramName) {
     if (ret != 0)
       report_fatal_error("Thread returned nonzero");
   }
+  if (SplitModuleStats)
+    FuncQueue.PrintStats(errs());
+  if (MergeJS)
+    return writeMergedJSOutput(TheTarget, TheTriple, JSOutputs);
   return 0;
 }
 
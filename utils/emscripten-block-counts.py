@@ -0,0 +1,93 @@
+#!/usr/bin/env python
+#
+# Makes a profile of the block counts of a program compiled with
+# llc -emscripten-block-counters=MAP. The program counts how often each basic
+# block runs in the 32-bit counters at _emscripten_block_counters; dump them
+# when it exits, e.g. with
+#
+#   Array.prototype.join.call(HEAPU32.subarray(_emscripten_block_counters >> 2,
+#     (_emscripten_block_counters >> 2) + N), '\n')
+#
+# where N is the number of counters in MAP, and pass the dumps of one or more
+# runs to this script, which sums them. The output is the text format of
+# instrumentation profiles in lib/ProfileData, with one record per function:
+# its LLVM name, its number of blocks as the hash, and the count of each block
+# in the order of the function. llvm-profdata merge reads it. With --cold,
+# the output is instead the functions that never ran, one per line, for
+# llc -emscripten-cold-functions.
+#
+# Example:
+#   utils/emscripten-block-counts.py --map=a.map -o a.profdata.txt run1 run2
+#   llvm-profdata merge a.profdata.txt -o a.profdata
+#   utils/emscripten-block-counts.py --map=a.map --cold -o a.cold run1 run2
+
+import optparse
+import sys
+
+
+def read_map(path):
+    # Returns the number of counters, and a list of (name, first, blocks) for
+    # each function.
+    with open(path) as f:
+        lines = f.read().splitlines()
+    if not lines or lines[0] != 'emscripten-block-counters 1':
+        sys.exit('%s: not a block counter map' % path)
+    header = lines[1].split()
+    if header[0] != 'counters':
+        sys.exit('%s: malformed block counter map' % path)
+    num_counters = int(header[2])
+    functions = []
+    for line in lines[2:]:
+        fields = line.split(' ')
+        if fields[0] == 'function':
+            functions.append((fields[1], int(fields[3]), int(fields[4])))
+    return num_counters, functions
+
+
+def read_counts(path, num_counters):
+    with open(path) as f:
+        counts = [int(x) for x in f.read().split()]
+    if len(counts) != num_counters:
+        sys.exit('%s: %d counts, but the map has %d counters' %
+                 (path, len(counts), num_counters))
+    return counts
+
+
+def main():
+    parser = optparse.OptionParser(usage='%prog --map=MAP [options] COUNTS...')
+    parser.add_option('--map', help='the file written by '
+                      'llc -emscripten-block-counters')
+    parser.add_option('--cold', action='store_true', default=False,
+                      help='list the functions that never ran instead')
+    parser.add_option('-o', dest='output', help='write the output here '
+                      'instead of to stdout')
+    options, args = parser.parse_args()
+    if not options.map or not args:
+        parser.error('need a map and at least one file of counts')
+
+    num_counters, functions = read_map(options.map)
+    totals = [0] * num_counters
+    for path in args:
+        counts = read_counts(path, num_counters)
+        for i in range(num_counters):
+            # The counters are 32-bit and wrap around in long runs; keep them
+            # unsigned, as HEAPU32 reads them.
+            totals[i] += counts[i] & 0xffffffff
+
+    out = open(options.output, 'w') if options.output else sys.stdout
+    for name, first, blocks in functions:
+        if options.cold:
+            # the entry block runs on every call
+            if totals[first] == 0:
+                out.write('%s\n' % name)
+            continue
+        out.write('%s\n%d\n%d\n' % (name, blocks, blocks))
+        for i in range(first, first + blocks):
+            out.write('%d\n' % totals[i])
+        out.write('\n')
+    if out is not sys.stdout:
+        out.close()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,115 @@
+#!/usr/bin/env python
+#
+# Checks the sequences of llc -emscripten-div-by-constant against the plain
+# divisions llc emits without it. Generates a module with a function for
+# each of sdiv, udiv, srem and urem, each divisor, and each kind of
+# dividend (any, known to fit in 16 bits, or in 31 bits), compiles it both
+# ways, and runs both in node on the same inputs with
+# test/CodeGen/JS/Inputs/div-check.js, which prints any mismatches.
+#
+# The divisors are 2..1100, 2^k-1, 2^k+1, their negations, and random ones.
+# With --exhaustive, only the given operations and divisors are checked, on
+# every 32-bit input.
+#
+# Examples:
+#   utils/emscripten-div-check.py --bindir=build/bin
+#   utils/emscripten-div-check.py --bindir=build/bin \
+#     --exhaustive=udiv:7,urem:10,sdiv:7,srem:-10
+
+import optparse
+import os
+import random
+import subprocess
+import sys
+import tempfile
+
+OPS = ['sdiv', 'udiv', 'srem', 'urem']
+KINDS = ['', 'h', 'w']
+
+HEADER = '''target datalayout = "e-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-p:32:32:32-v128:32:128-n32-S128"
+target triple = "asmjs-unknown-emscripten"
+
+'''
+
+
+def divisors(count, seed):
+    ds = set(range(2, 1101))
+    for k in range(2, 32):
+        ds.update([(1 << k) - 1, (1 << k) + 1])
+    rand = random.Random(seed)
+    while len(ds) < 1100 + 60 + count:
+        ds.add(rand.randint(2, 0x7fffffff))
+    ds = sorted(d for d in ds if d < 0x80000000)
+    return ds + [-d for d in ds]
+
+
+def function(op, d, kind):
+    # the names end in the divisor, which div-check.js reads back
+    name = '%s_%s%d%s' % (op, 'm' if d < 0 else '', abs(d),
+                          '_' + kind if kind else '')
+    lines = ['define i32 @%s(i32 %%x) {' % name]
+    x = '%x'
+    if kind == 'h':
+        lines.append('  %y = and i32 %x, 65535')
+        x = '%y'
+    elif kind == 'w':
+        lines.append('  %y = lshr i32 %x, 1')
+        x = '%y'
+    # unsigned operations take the divisor as its 32-bit pattern
+    lines += ['  %%r = %s i32 %s, %d' % (op, x, d), '  ret i32 %r', '}', '']
+    return '\n'.join(lines)
+
+
+def check(opts, tmp, funcs, samples):
+    ll = os.path.join(tmp, 'div.ll')
+    plain = os.path.join(tmp, 'plain.js')
+    magic = os.path.join(tmp, 'magic.js')
+    with open(ll, 'w') as f:
+        f.write(HEADER + '\n'.join(funcs))
+    llc = os.path.join(opts.bindir, 'llc')
+    subprocess.check_call([llc, ll, '-o', plain])
+    subprocess.check_call([llc, '-emscripten-div-by-constant', ll, '-o', magic])
+    out = subprocess.check_output([opts.node, opts.checker, plain, magic,
+                                   samples]).decode()
+    sys.stdout.write(out)
+    return ' 0 mismatches' in out.splitlines()[-1]
+
+
+def main():
+    parser = optparse.OptionParser()
+    parser.add_option('--bindir', default='', help='directory with llc')
+    parser.add_option('--node', default='node')
+    parser.add_option('--checker', default=os.path.join(
+        os.path.dirname(os.path.abspath(__file__)), '..', 'test', 'CodeGen',
+        'JS', 'Inputs', 'div-check.js'))
+    parser.add_option('--samples', type='int', default=430,
+                      help='pseudo-random inputs for each function')
+    parser.add_option('--random-divisors', type='int', default=200)
+    parser.add_option('--seed', type='int', default=1)
+    parser.add_option('--batch', type='int', default=2000,
+                      help='functions compiled and run at a time')
+    parser.add_option('--exhaustive', default='',
+                      help='comma-separated op:divisor pairs to check on '
+                           'all inputs')
+    opts, _ = parser.parse_args()
+
+    tmp = tempfile.mkdtemp()
+    if opts.exhaustive:
+        funcs = []
+        for pair in opts.exhaustive.split(','):
+            op, d = pair.split(':')
+            funcs.append(function(op, int(d), ''))
+        ok = check(opts, tmp, funcs, 'all')
+    else:
+        funcs = [function(op, d, kind)
+                 for d in divisors(opts.random_divisors, opts.seed)
+                 for op in OPS for kind in KINDS]
+        ok = True
+        for i in range(0, len(funcs), opts.batch):
+            ok = check(opts, tmp, funcs[i:i + opts.batch],
+                       str(opts.samples)) and ok
+    sys.exit(0 if ok else 1)
+
+
+if __name__ == '__main__':
+    main()
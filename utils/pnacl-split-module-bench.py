@@ -0,0 +1,115 @@
+#!/usr/bin/env python
+#
+# Times pnacl-llc -split-module on a module whose function sizes are skewed:
+# many small functions, and a few large ones near the end of the module,
+# where the dynamic scheduler hands out its last chunks. Prints the wall time
+# of each scheduler for each thread count, and the per-thread busy and idle
+# times that -split-module-stats reports.
+#
+# Example:
+#   utils/pnacl-split-module-bench.py --bindir=build/bin \
+#     --mtriple=asmjs-unknown-emscripten
+
+import optparse
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def small_function(name):
+    return '''define i32 @%s(i32 %%x) {
+entry:
+  %%a = add i32 %%x, 1
+  %%b = mul i32 %%a, 3
+  %%c = xor i32 %%b, %%x
+  ret i32 %%c
+}
+''' % name
+
+
+def large_function(name, blocks):
+    # A chain of blocks that each do some arithmetic and branch on it, so
+    # that the relooper and register allocation have real work to do.
+    lines = ['define i32 @%s(i32 %%x) {' % name, 'entry:',
+             '  br label %b0']
+    for i in range(blocks):
+        prev = '%x' if i == 0 else '%%v%d' % (i - 1)
+        lines += ['b%d:' % i,
+                  '  %%t%d = mul i32 %s, %d' % (i, prev, i + 7),
+                  '  %%u%d = add i32 %%t%d, %d' % (i, i, i),
+                  '  %%v%d = xor i32 %%u%d, %s' % (i, i, prev),
+                  '  %%c%d = icmp slt i32 %%v%d, %d' % (i, i, i * 13),
+                  '  br i1 %%c%d, label %%b%d, label %%exit%d' % (i, i + 1, i),
+                  'exit%d:' % i,
+                  '  ret i32 %%v%d' % i]
+    lines += ['b%d:' % blocks, '  ret i32 %%v%d' % (blocks - 1), '}', '']
+    return '\n'.join(lines)
+
+
+def write_module(path, num_small, num_large, large_blocks):
+    with open(path, 'w') as f:
+        f.write('target datalayout = "e-p:32:32-i64:64-n32-S128"\n\n')
+        for i in range(num_small):
+            f.write(small_function('small%d' % i))
+        for i in range(num_large):
+            f.write(large_function('large%d' % i, large_blocks))
+
+
+def run(args):
+    start = time.time()
+    proc = subprocess.Popen(args, stderr=subprocess.PIPE)
+    _, err = proc.communicate()
+    if proc.returncode != 0:
+        sys.exit('failed: %s\n%s' % (' '.join(args), err.decode()))
+    return time.time() - start, err.decode()
+
+
+def main():
+    parser = optparse.OptionParser()
+    parser.add_option('--bindir', default='',
+                      help='directory with llvm-as and pnacl-llc')
+    parser.add_option('--mtriple', default='asmjs-unknown-emscripten')
+    parser.add_option('--threads', default='1,2,4,8,16,32',
+                      help='comma-separated split-module counts')
+    parser.add_option('--schedulers', default='static,dynamic,cost')
+    parser.add_option('--small', type='int', default=2000,
+                      help='number of small functions')
+    parser.add_option('--large', type='int', default=2,
+                      help='number of large functions')
+    parser.add_option('--large-blocks', type='int', default=3000,
+                      help='basic blocks in each large function')
+    parser.add_option('--runs', type='int', default=3,
+                      help='runs of each configuration; the best is shown')
+    parser.add_option('--stats', action='store_true',
+                      help='also print the per-thread statistics')
+    opts, _ = parser.parse_args()
+
+    tool = lambda name: os.path.join(opts.bindir, name)
+    tmp = tempfile.mkdtemp()
+    ll = os.path.join(tmp, 'skewed.ll')
+    bc = os.path.join(tmp, 'skewed.bc')
+    write_module(ll, opts.small, opts.large, opts.large_blocks)
+    subprocess.check_call([tool('llvm-as'), ll, '-o', bc])
+
+    print('%8s %10s %10s %10s' % ('threads', 'scheduler', 'seconds',
+                                  'speedup'))
+    baseline = None
+    for threads in [int(t) for t in opts.threads.split(',')]:
+        for sched in opts.schedulers.split(','):
+            args = [tool('pnacl-llc'), '-mtriple=' + opts.mtriple,
+                    '-streaming-bitcode', '-split-module=%d' % threads,
+                    '-split-module-sched=' + sched, '-split-module-stats',
+                    bc, '-o', os.path.join(tmp, 'out')]
+            best, stats = min(run(args) for _ in range(opts.runs))
+            if baseline is None:
+                baseline = best
+            print('%8d %10s %10.3f %9.2fx' % (threads, sched, best,
+                                              baseline / best))
+            if opts.stats:
+                sys.stdout.write(stats)
+
+
+if __name__ == '__main__':
+    main()